@@ -0,0 +1,15 @@
+#include <stdio.h>
+#include <zlib.h>
+
+int main(int argc, char *argv[])
+{
+	z_stream strm;
+
+	strm.zalloc = Z_NULL; strm.zfree = Z_NULL; strm.opaque = Z_NULL;
+	if (deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK) return 1;
+	deflateEnd(&strm);
+	printf("%s\n", zlibVersion());
+
+	return 0;
+}
+
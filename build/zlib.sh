@@ -0,0 +1,67 @@
+	echo "Checking for zlib ..."
+
+	ZLIBINC=""
+	ZLIBLIB=""
+	for DIR in /opt/zlib* /usr/local/zlib* /usr/local /usr /usr/pkg /opt/csw /opt/sfw
+	do
+		if test -f $DIR/include/zlib.h
+		then
+			ZLIBINC=$DIR/include
+		fi
+
+		if test -f $DIR/lib/libz.so
+		then
+			ZLIBLIB=$DIR/lib
+		fi
+		if test -f $DIR/lib/libz.a
+		then
+			ZLIBLIB=$DIR/lib
+		fi
+		if test -f $DIR/lib64/libz.so
+		then
+			ZLIBLIB=$DIR/lib64
+		fi
+		if test -f $DIR/lib64/libz.a
+		then
+			ZLIBLIB=$DIR/lib64
+		fi
+	done
+
+	if test "$USERZLIBINC" != ""; then
+		ZLIBINC="$USERZLIBINC"
+	fi
+	if test "$USERZLIBLIB" != ""; then
+		ZLIBLIB="$USERZLIBLIB"
+	fi
+
+	# Multiarch Linux systems keep libz.so somewhere the linker finds it anyway
+	if test -n "$ZLIBINC" -a -z "$ZLIBLIB"; then
+		ZLIBLIB="/usr/lib"
+	fi
+
+	ZLIBDEF=""
+	if test -z "$ZLIBINC"; then
+		echo "zlib include files not found."
+		echo "Xymon works without zlib, but cannot send or receive compressed messages."
+		echo "If you have zlib installed, use the \"--zlibinclude DIR\" and \"--zliblib DIR\""
+		echo "options to configure to specify where they are."
+		echo ""
+	else
+		cd build
+		OS=`uname -s | tr '[/]' '[_]'` $MAKE -f Makefile.test-zlib clean
+		OS=`uname -s | tr '[/]' '[_]'` ZLIBINC="-I$ZLIBINC" $MAKE -f Makefile.test-zlib test-compile
+		if [ $? -eq 0 ]; then
+			OS=`uname -s | tr '[/]' '[_]'` ZLIBLIB="-L$ZLIBLIB" $MAKE -f Makefile.test-zlib test-link
+			if [ $? -eq 0 ]; then
+				echo "Found zlib in $ZLIBINC and $ZLIBLIB"
+				ZLIBDEF="-DHAVE_ZLIB=1"
+			else
+				echo "WARNING: zlib include files found in $ZLIBINC, but link fails."
+			fi
+		else
+			echo "WARNING: zlib include files found in $ZLIBINC, but compile fails."
+		fi
+		OS=`uname -s | tr '[/]' '[_]'` $MAKE -f Makefile.test-zlib clean
+		cd ..
+	fi
+
@@ -0,0 +1,1000 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon client data collector for Linux.                                     */
+/*                                                                            */
+/* This builds the OS-specific part of the Xymon client message by reading   */
+/* /proc and /sys directly, instead of running ps, df, netstat, vmstat,       */
+/* ifconfig etc. The output has the same sections and layout as the          */
+/* xymonclient-linux.sh script, so the server-side handling is unchanged.    */
+/*                                                                            */
+/* Copyright (C) 2005-2011 Henrik Storner <henrik@hswn.dk>                    */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+static char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/utsname.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pwd.h>
+#include <utmpx.h>
+#include <ifaddrs.h>
+#include <limits.h>
+
+#define MAXLINE 4096
+
+static long pagesize_kb = 4;
+static long clockticks = 100;
+static unsigned long memtotal_kb = 0;
+static double uptime_secs = 0.0;
+
+static char *snapshotdir = NULL;	/* Where we keep the counters for the vmstat section */
+static char *hostid = NULL;
+
+static void section(char *name)
+{
+	printf("[%s]\n", name);
+}
+
+static int catfile(char *fn)
+{
+	FILE *fd;
+	char buf[MAXLINE];
+	size_t n;
+
+	fd = fopen(fn, "r");
+	if (!fd) return 0;
+	while ((n = fread(buf, 1, sizeof(buf), fd)) > 0) fwrite(buf, 1, n, stdout);
+	fclose(fd);
+	return 1;
+}
+
+static char *readline1(char *fn, char *buf, int bufsz)
+{
+	/* Return the first line of a (small) file, without the newline */
+	FILE *fd;
+	char *p;
+
+	*buf = '\0';
+	fd = fopen(fn, "r");
+	if (!fd) return NULL;
+	if (!fgets(buf, bufsz, fd)) *buf = '\0';
+	fclose(fd);
+	p = strchr(buf, '\n'); if (p) *p = '\0';
+
+	return buf;
+}
+
+static unsigned long meminfo(char *buf, char *key)
+{
+	/* Pick a value (in kB) out of the /proc/meminfo text */
+	char *p = buf;
+	int keylen = strlen(key);
+
+	while (p) {
+		if ((strncmp(p, key, keylen) == 0) && (*(p+keylen) == ':')) return strtoul(p+keylen+1, NULL, 10);
+		p = strchr(p, '\n'); if (p) p++;
+	}
+
+	return 0;
+}
+
+static char *slurp(char *fn, char *buf, int bufsz)
+{
+	FILE *fd;
+	size_t n;
+
+	*buf = '\0';
+	fd = fopen(fn, "r");
+	if (!fd) return NULL;
+	n = fread(buf, 1, bufsz-1, fd);
+	buf[n] = '\0';
+	fclose(fd);
+
+	return buf;
+}
+
+
+static void do_date(void)
+{
+	time_t now = time(NULL);
+	char tstr[100];
+
+	section("date");
+	strftime(tstr, sizeof(tstr), "%a %b %e %H:%M:%S %Z %Y", localtime(&now));
+	printf("%s\n", tstr);
+}
+
+static void do_uname(void)
+{
+	struct utsname u;
+
+	section("uname");
+	if (uname(&u) == 0) printf("%s %s %s %s\n", u.sysname, u.nodename, u.release, u.machine);
+}
+
+static void do_osversion(void)
+{
+	static char *releasefiles[] = {
+		"/etc/redhat-release", "/etc/gentoo-release", "/etc/SuSE-release", "/etc/SUSE-release",
+		"/etc/slackware-version", "/etc/mandrake-release", "/etc/fedora-release", "/etc/arch-release",
+		NULL
+	};
+	char buf[MAXLINE];
+	int i;
+
+	section("osversion");
+
+	if (slurp("/etc/os-release", buf, sizeof(buf))) {
+		char *name = NULL, *version = NULL, *p;
+
+		/* Same first line as "lsb_release -r -i -s" gives, then the full file */
+		for (p = strtok(buf, "\n"); (p); p = strtok(NULL, "\n")) {
+			if (strncmp(p, "NAME=", 5) == 0) name = p+5;
+			else if (strncmp(p, "VERSION_ID=", 11) == 0) version = p+11;
+		}
+		if (name) { name += strspn(name, "\""); name[strcspn(name, "\"")] = '\0'; }
+		if (version) { version += strspn(version, "\""); version[strcspn(version, "\"")] = '\0'; }
+		printf("%s %s\n", (name ? name : "Linux"), (version ? version : ""));
+		catfile("/etc/os-release");
+		return;
+	}
+
+	if (readline1("/etc/debian_version", buf, sizeof(buf))) {
+		printf("Debian %s\n", buf);
+		return;
+	}
+
+	for (i = 0; (releasefiles[i]); i++) {
+		if (catfile(releasefiles[i])) return;
+	}
+}
+
+static int countusers(void)
+{
+	struct utmpx *u;
+	int count = 0;
+
+	setutxent();
+	while ((u = getutxent()) != NULL) {
+		if (u->ut_type == USER_PROCESS) count++;
+	}
+	endutxent();
+
+	return count;
+}
+
+static void do_uptime(void)
+{
+	char buf[MAXLINE];
+	double load1 = 0, load5 = 0, load15 = 0;
+	long upmins;
+	time_t now = time(NULL);
+	char tstr[20];
+	int users = countusers();
+
+	section("uptime");
+
+	slurp("/proc/loadavg", buf, sizeof(buf));
+	sscanf(buf, "%lf %lf %lf", &load1, &load5, &load15);
+	strftime(tstr, sizeof(tstr), "%H:%M:%S", localtime(&now));
+
+	/* Mimic the "uptime" output, since that is what the server parses */
+	printf(" %s up ", tstr);
+	upmins = (long)(uptime_secs / 60);
+	if (upmins >= 1440) {
+		printf("%ld day%s, ", (upmins / 1440), ((upmins / 1440) == 1) ? "" : "s");
+		upmins %= 1440;
+	}
+	if (upmins >= 60) printf("%2ld:%02ld, ", (upmins / 60), (upmins % 60));
+	else printf("%ld min, ", upmins);
+	printf(" %d user%s,  load average: %.2f, %.2f, %.2f\n", users, ((users == 1) ? "" : "s"), load1, load5, load15);
+}
+
+static void do_who(void)
+{
+	struct utmpx *u;
+
+	section("who");
+
+	setutxent();
+	while ((u = getutxent()) != NULL) {
+		time_t t;
+		char tstr[30];
+
+		if (u->ut_type != USER_PROCESS) continue;
+
+		t = u->ut_tv.tv_sec;
+		strftime(tstr, sizeof(tstr), "%Y-%m-%d %H:%M", localtime(&t));
+		printf("%-8.*s %-12.*s %s", (int)sizeof(u->ut_user), u->ut_user, (int)sizeof(u->ut_line), u->ut_line, tstr);
+		if (*u->ut_host) printf(" (%.*s)", (int)sizeof(u->ut_host), u->ut_host);
+		printf("\n");
+	}
+	endutxent();
+}
+
+
+/* Filesystem types from /proc/filesystems that are not backed by a device (like "df -x") */
+static char *nodevfs = NULL;
+
+static int isnodevfs(char *fstype)
+{
+	char key[128];
+
+	if (strcmp(fstype, "iso9660") == 0) return 1;
+
+	if (!nodevfs) {
+		FILE *fd;
+		char l[MAXLINE];
+		int sz = 2;
+
+		nodevfs = strdup(" ");
+		fd = fopen("/proc/filesystems", "r");
+		if (fd) {
+			while (fgets(l, sizeof(l), fd)) {
+				char *p;
+
+				if (strncmp(l, "nodev", 5) != 0) continue;
+				p = l + 5 + strspn(l+5, " \t");
+				p[strcspn(p, " \t\r\n")] = '\0';
+				sz += strlen(p) + 1;
+				nodevfs = (char *)realloc(nodevfs, sz);
+				strcat(nodevfs, p); strcat(nodevfs, " ");
+			}
+			fclose(fd);
+		}
+	}
+
+	snprintf(key, sizeof(key), " %s ", fstype);
+	return (strstr(nodevfs, key) != NULL);
+}
+
+static void unescape(char *s)
+{
+	/* /proc/mounts encodes blanks etc. as octal "\040" */
+	char *in, *out;
+
+	for (in = out = s; (*in); in++, out++) {
+		if ((*in == '\\') && isdigit((int)*(in+1)) && isdigit((int)*(in+2)) && isdigit((int)*(in+3))) {
+			*out = ((*(in+1) - '0') << 6) | ((*(in+2) - '0') << 3) | (*(in+3) - '0');
+			in += 3;
+		}
+		else *out = *in;
+	}
+	*out = '\0';
+}
+
+static void do_df(void)
+{
+	FILE *fd;
+	char l[MAXLINE];
+
+	section("df");
+	printf("Filesystem         1024-blocks      Used Available Capacity Mounted on\n");
+
+	fd = fopen("/proc/mounts", "r");
+	if (!fd) return;
+
+	while (fgets(l, sizeof(l), fd)) {
+		char dev[MAXLINE], dir[MAXLINE], fstype[100];
+		struct statvfs st;
+		unsigned long long total, avail, used, bfree;
+		int pct;
+
+		if (sscanf(l, "%4095s %4095s %99s", dev, dir, fstype) != 3) continue;
+		if (isnodevfs(fstype)) continue;
+
+		unescape(dev); unescape(dir);
+		if (statvfs(dir, &st) != 0) continue;
+		if (st.f_blocks == 0) continue;
+
+		total = ((unsigned long long)st.f_blocks * st.f_frsize) / 1024;
+		bfree = ((unsigned long long)st.f_bfree * st.f_frsize) / 1024;
+		avail = ((unsigned long long)st.f_bavail * st.f_frsize) / 1024;
+		used = total - bfree;
+
+		/* Same rounding as df: Round up */
+		pct = ((used + avail) > 0) ? (int)(((used * 100) + (used + avail) - 1) / (used + avail)) : 0;
+
+		printf("%-18s %11llu %9llu %9llu %7d%% %s\n", dev, total, used, avail, pct, dir);
+	}
+
+	fclose(fd);
+}
+
+static void do_mount(void)
+{
+	FILE *fd;
+	char l[MAXLINE];
+
+	section("mount");
+
+	fd = fopen("/proc/mounts", "r");
+	if (!fd) return;
+
+	while (fgets(l, sizeof(l), fd)) {
+		char dev[MAXLINE], dir[MAXLINE], fstype[100], opts[MAXLINE];
+
+		if (sscanf(l, "%4095s %4095s %99s %4095s", dev, dir, fstype, opts) != 4) continue;
+		unescape(dev); unescape(dir);
+		printf("%s on %s type %s (%s)\n", dev, dir, fstype, opts);
+	}
+
+	fclose(fd);
+}
+
+static void do_free(char *mi)
+{
+	unsigned long total, mfree, buffers, cached, shared, swaptotal, swapfree, used;
+
+	total = meminfo(mi, "MemTotal");
+	mfree = meminfo(mi, "MemFree");
+	buffers = meminfo(mi, "Buffers");
+	cached = meminfo(mi, "Cached");
+	shared = meminfo(mi, "Shmem");
+	swaptotal = meminfo(mi, "SwapTotal");
+	swapfree = meminfo(mi, "SwapFree");
+	used = total - mfree;
+
+	section("free");
+	printf("             total       used       free     shared    buffers     cached\n");
+	printf("Mem:    %10lu %10lu %10lu %10lu %10lu %10lu\n", total, used, mfree, shared, buffers, cached);
+	printf("-/+ buffers/cache: %10lu %10lu\n", (used - buffers - cached), (mfree + buffers + cached));
+	printf("Swap:   %10lu %10lu %10lu\n", swaptotal, (swaptotal - swapfree), swapfree);
+}
+
+
+static char *sysnetval(char *ifname, char *item, char *buf, int bufsz)
+{
+	char fn[PATH_MAX];
+
+	snprintf(fn, sizeof(fn), "/sys/class/net/%s/%s", ifname, item);
+	if (!readline1(fn, buf, bufsz)) *buf = '\0';
+	return buf;
+}
+
+static char *humanbytes(unsigned long long n, char *buf)
+{
+	if (n >= 1000000000ULL) sprintf(buf, "%.1f GB", n / 1000000000.0);
+	else if (n >= 1000000ULL) sprintf(buf, "%.1f MB", n / 1000000.0);
+	else if (n >= 1000ULL) sprintf(buf, "%.1f KB", n / 1000.0);
+	else sprintf(buf, "%llu.0 B", n);
+	return buf;
+}
+
+static void do_ifconfig(char *sectname)
+{
+	/* Same layout as the classic net-tools "ifconfig", which the ifstat RRD handler parses */
+	FILE *fd;
+	char l[MAXLINE];
+	struct ifaddrs *ifaddrs = NULL, *ifa;
+
+	section(sectname);
+
+	fd = fopen("/proc/net/dev", "r");
+	if (!fd) return;
+	if (getifaddrs(&ifaddrs) != 0) ifaddrs = NULL;
+
+	while (fgets(l, sizeof(l), fd)) {
+		char *ifname, *p;
+		unsigned long long rxbytes, rxpkts, rxerrs, rxdrop, rxfifo, rxframe, rxcomp, rxmcast;
+		unsigned long long txbytes, txpkts, txerrs, txdrop, txfifo, txcolls, txcarrier, txcomp;
+		char val[MAXLINE], encap[40], rxh[40], txh[40];
+		unsigned long flags;
+		int iftype;
+
+		p = strchr(l, ':');
+		if (!p) continue;	/* Header lines */
+		*p = '\0'; p++;
+		ifname = l + strspn(l, " ");
+
+		if (sscanf(p, "%llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+			   &rxbytes, &rxpkts, &rxerrs, &rxdrop, &rxfifo, &rxframe, &rxcomp, &rxmcast,
+			   &txbytes, &txpkts, &txerrs, &txdrop, &txfifo, &txcolls, &txcarrier, &txcomp) < 15) continue;
+
+		flags = strtoul(sysnetval(ifname, "flags", val, sizeof(val)), NULL, 16);
+		if ((flags & 0x1) == 0) continue;	/* Not UP - ifconfig skips these */
+
+		iftype = atoi(sysnetval(ifname, "type", val, sizeof(val)));
+		switch (iftype) {
+		  case 1: strcpy(encap, "Ethernet"); break;
+		  case 772: strcpy(encap, "Local Loopback"); break;
+		  case 512: strcpy(encap, "Point-to-Point Protocol"); break;
+		  default: strcpy(encap, "UNSPEC"); break;
+		}
+
+		printf("%-9s Link encap:%s", ifname, encap);
+		if (iftype == 1) printf("  HWaddr %s", sysnetval(ifname, "address", val, sizeof(val)));
+		printf("  \n");
+
+		for (ifa = ifaddrs; (ifa); ifa = ifa->ifa_next) {
+			char addr[INET6_ADDRSTRLEN], extra[INET6_ADDRSTRLEN];
+
+			if (!ifa->ifa_addr || (strcmp(ifa->ifa_name, ifname) != 0)) continue;
+
+			if (ifa->ifa_addr->sa_family == AF_INET) {
+				inet_ntop(AF_INET, &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr, addr, sizeof(addr));
+				printf("          inet addr:%s", addr);
+				if ((flags & 0x2) && ifa->ifa_broadaddr) {
+					inet_ntop(AF_INET, &((struct sockaddr_in *)ifa->ifa_broadaddr)->sin_addr, extra, sizeof(extra));
+					printf("  Bcast:%s", extra);
+				}
+				if (ifa->ifa_netmask) {
+					inet_ntop(AF_INET, &((struct sockaddr_in *)ifa->ifa_netmask)->sin_addr, extra, sizeof(extra));
+					printf("  Mask:%s", extra);
+				}
+				printf("\n");
+			}
+			else if (ifa->ifa_addr->sa_family == AF_INET6) {
+				struct in6_addr *a6 = &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+				int prefix = 0, i;
+
+				inet_ntop(AF_INET6, a6, addr, sizeof(addr));
+				if (ifa->ifa_netmask) {
+					unsigned char *m = ((struct sockaddr_in6 *)ifa->ifa_netmask)->sin6_addr.s6_addr;
+					for (i = 0; (i < 16); i++) {
+						unsigned char b = m[i];
+						while (b) { prefix += (b & 1); b >>= 1; }
+					}
+				}
+				printf("          inet6 addr: %s/%d Scope:%s\n", addr, prefix,
+					(IN6_IS_ADDR_LOOPBACK(a6) ? "Host" : (IN6_IS_ADDR_LINKLOCAL(a6) ? "Link" : "Global")));
+			}
+		}
+
+		printf("          ");
+		if (flags & 0x1) printf("UP ");
+		if (flags & 0x2) printf("BROADCAST ");
+		if (flags & 0x8) printf("LOOPBACK ");
+		if (flags & 0x10) printf("POINTOPOINT ");
+		/* IFF_RUNNING is not in the sysfs flags, it follows the operational state */
+		sysnetval(ifname, "operstate", val, sizeof(val));
+		if ((strcmp(val, "up") == 0) || (strcmp(val, "unknown") == 0)) printf("RUNNING ");
+		if (flags & 0x100) printf("PROMISC ");
+		if (flags & 0x1000) printf("MULTICAST ");
+		printf(" MTU:%s  Metric:1\n", sysnetval(ifname, "mtu", val, sizeof(val)));
+		printf("          RX packets:%llu errors:%llu dropped:%llu overruns:%llu frame:%llu\n",
+			rxpkts, rxerrs, rxdrop, rxfifo, rxframe);
+		printf("          TX packets:%llu errors:%llu dropped:%llu overruns:%llu carrier:%llu\n",
+			txpkts, txerrs, txdrop, txfifo, txcarrier);
+		printf("          collisions:%llu txqueuelen:%s \n", txcolls, sysnetval(ifname, "tx_queue_len", val, sizeof(val)));
+		printf("          RX bytes:%llu (%s)  TX bytes:%llu (%s)\n\n",
+			rxbytes, humanbytes(rxbytes, rxh), txbytes, humanbytes(txbytes, txh));
+	}
+
+	fclose(fd);
+	if (ifaddrs) freeifaddrs(ifaddrs);
+}
+
+static void do_route(void)
+{
+	FILE *fd;
+	char l[MAXLINE];
+
+	section("route");
+	printf("Kernel IP routing table\n");
+	printf("Destination     Gateway         Genmask         Flags   MSS Window  irtt Iface\n");
+
+	fd = fopen("/proc/net/route", "r");
+	if (!fd) return;
+
+	while (fgets(l, sizeof(l), fd)) {
+		char ifname[64], flagstr[10], *fp;
+		unsigned int dst, gw, mask, flags, mtu, window, irtt;
+		struct in_addr a;
+		char dststr[20], gwstr[20], maskstr[20];
+		int refcnt, use, metric;
+
+		if (sscanf(l, "%63s %x %x %x %d %d %d %x %u %u %u",
+			   ifname, &dst, &gw, &flags, &refcnt, &use, &metric, &mask, &mtu, &window, &irtt) != 11) continue;
+
+		/* The kernel prints the addresses in network byte order as a plain hex number */
+		a.s_addr = dst; strcpy(dststr, inet_ntoa(a));
+		a.s_addr = gw; strcpy(gwstr, inet_ntoa(a));
+		a.s_addr = mask; strcpy(maskstr, inet_ntoa(a));
+
+		fp = flagstr;
+		if (flags & 0x0001) *fp++ = 'U';
+		if (flags & 0x0002) *fp++ = 'G';
+		if (flags & 0x0004) *fp++ = 'H';
+		if (flags & 0x0008) *fp++ = 'R';
+		if (flags & 0x0010) *fp++ = 'D';
+		if (flags & 0x0020) *fp++ = 'M';
+		if (flags & 0x0200) *fp++ = '!';
+		*fp = '\0';
+
+		printf("%-15s %-15s %-15s %-5s %5u %-6u %5u %s\n", dststr, gwstr, maskstr, flagstr, mtu, window, irtt, ifname);
+	}
+
+	fclose(fd);
+}
+
+static unsigned long snmpval(char *snmp, char *proto, char *item)
+{
+	/*
+	 * /proc/net/snmp has pairs of lines per protocol:
+	 *   Tcp: RtoAlgorithm RtoMin ...
+	 *   Tcp: 1 200 ...
+	 */
+	char key[20];
+	char *hdr, *vals, *hp, *vp, *hsave, *vsave;
+	char hline[MAXLINE], vline[MAXLINE];
+	int n;
+
+	sprintf(key, "%s:", proto);
+	hdr = strstr(snmp, key);
+	if (!hdr) return 0;
+	vals = strchr(hdr, '\n');
+	if (!vals || (strncmp(vals+1, key, strlen(key)) != 0)) return 0;
+	vals++;
+
+	n = strcspn(hdr, "\n"); if (n >= sizeof(hline)) n = sizeof(hline)-1;
+	strncpy(hline, hdr, n); hline[n] = '\0';
+	n = strcspn(vals, "\n"); if (n >= sizeof(vline)) n = sizeof(vline)-1;
+	strncpy(vline, vals, n); vline[n] = '\0';
+
+	hp = strtok_r(hline, " ", &hsave);
+	vp = strtok_r(vline, " ", &vsave);
+	while (hp && vp) {
+		if (strcmp(hp, item) == 0) return strtoul(vp, NULL, 10);
+		hp = strtok_r(NULL, " ", &hsave);
+		vp = strtok_r(NULL, " ", &vsave);
+	}
+
+	return 0;
+}
+
+static void do_netstat(void)
+{
+	/* Same wording as "netstat -s", since the netstat RRD handler looks for these texts */
+	char snmp[16384];
+
+	section("netstat");
+	if (!slurp("/proc/net/snmp", snmp, sizeof(snmp))) return;
+
+	printf("Ip:\n");
+	printf("    %lu total packets received\n", snmpval(snmp, "Ip", "InReceives"));
+	printf("    %lu forwarded\n", snmpval(snmp, "Ip", "ForwDatagrams"));
+	printf("    %lu incoming packets discarded\n", snmpval(snmp, "Ip", "InDiscards"));
+	printf("    %lu incoming packets delivered\n", snmpval(snmp, "Ip", "InDelivers"));
+	printf("    %lu requests sent out\n", snmpval(snmp, "Ip", "OutRequests"));
+	printf("Icmp:\n");
+	printf("    %lu ICMP messages received\n", snmpval(snmp, "Icmp", "InMsgs"));
+	printf("    %lu input ICMP message failed.\n", snmpval(snmp, "Icmp", "InErrors"));
+	printf("    %lu ICMP messages sent\n", snmpval(snmp, "Icmp", "OutMsgs"));
+	printf("    %lu ICMP messages failed\n", snmpval(snmp, "Icmp", "OutErrors"));
+	printf("Tcp:\n");
+	printf("    %lu active connections openings\n", snmpval(snmp, "Tcp", "ActiveOpens"));
+	printf("    %lu passive connection openings\n", snmpval(snmp, "Tcp", "PassiveOpens"));
+	printf("    %lu failed connection attempts\n", snmpval(snmp, "Tcp", "AttemptFails"));
+	printf("    %lu connection resets received\n", snmpval(snmp, "Tcp", "EstabResets"));
+	printf("    %lu connections established\n", snmpval(snmp, "Tcp", "CurrEstab"));
+	printf("    %lu segments received\n", snmpval(snmp, "Tcp", "InSegs"));
+	printf("    %lu segments send out\n", snmpval(snmp, "Tcp", "OutSegs"));
+	printf("    %lu segments retransmited\n", snmpval(snmp, "Tcp", "RetransSegs"));
+	printf("    %lu bad segments received.\n", snmpval(snmp, "Tcp", "InErrs"));
+	printf("    %lu resets sent\n", snmpval(snmp, "Tcp", "OutRsts"));
+	printf("Udp:\n");
+	printf("    %lu packets received\n", snmpval(snmp, "Udp", "InDatagrams"));
+	printf("    %lu packets to unknown port received.\n", snmpval(snmp, "Udp", "NoPorts"));
+	printf("    %lu packet receive errors\n", snmpval(snmp, "Udp", "InErrors"));
+	printf("    %lu packets sent\n", snmpval(snmp, "Udp", "OutDatagrams"));
+}
+
+static char *tcpstates[] = {
+	"", "ESTABLISHED", "SYN_SENT", "SYN_RECV", "FIN_WAIT1", "FIN_WAIT2", "TIME_WAIT",
+	"CLOSE", "CLOSE_WAIT", "LAST_ACK", "LISTEN", "CLOSING"
+};
+
+static char *sockaddrstr(char *hexaddr, int ipv6, char *buf)
+{
+	/* "0100007F:0016" -> "127.0.0.1:22" */
+	char addrstr[INET6_ADDRSTRLEN];
+	unsigned int port = 0;
+	char *p;
+
+	p = strchr(hexaddr, ':');
+	if (p) { *p = '\0'; port = strtoul(p+1, NULL, 16); }
+
+	if (ipv6) {
+		struct in6_addr a6;
+		unsigned int w[4];
+		int i;
+
+		if (sscanf(hexaddr, "%8x%8x%8x%8x", &w[0], &w[1], &w[2], &w[3]) != 4) memset(w, 0, sizeof(w));
+		for (i = 0; (i < 4); i++) memcpy(&a6.s6_addr[4*i], &w[i], 4);
+		inet_ntop(AF_INET6, &a6, addrstr, sizeof(addrstr));
+	}
+	else {
+		struct in_addr a;
+
+		a.s_addr = strtoul(hexaddr, NULL, 16);
+		inet_ntop(AF_INET, &a, addrstr, sizeof(addrstr));
+	}
+
+	if (port) sprintf(buf, "%s:%u", addrstr, port);
+	else sprintf(buf, "%s:*", addrstr);
+
+	return buf;
+}
+
+static void do_ports_file(char *fn, char *proto, int ipv6)
+{
+	FILE *fd;
+	char l[MAXLINE];
+
+	fd = fopen(fn, "r");
+	if (!fd) return;
+
+	while (fgets(l, sizeof(l), fd)) {
+		char local[100], remote[100], lstr[INET6_ADDRSTRLEN+10], rstr[INET6_ADDRSTRLEN+10];
+		unsigned int state;
+		unsigned long txq, rxq;
+
+		if (sscanf(l, " %*d: %99s %99s %x %lx:%lx", local, remote, &state, &txq, &rxq) != 5) continue;
+		if (state >= (sizeof(tcpstates) / sizeof(tcpstates[0]))) state = 0;
+
+		printf("%-5s %6lu %6lu %-23s %-23s %s\n", proto, rxq, txq,
+			sockaddrstr(local, ipv6, lstr), sockaddrstr(remote, ipv6, rstr), tcpstates[state]);
+	}
+
+	fclose(fd);
+}
+
+static void do_ports(void)
+{
+	section("ports");
+	printf("Active Internet connections (servers and established)\n");
+	printf("Proto Recv-Q Send-Q Local Address           Foreign Address         State\n");
+	do_ports_file("/proc/net/tcp", "tcp", 0);
+	do_ports_file("/proc/net/tcp6", "tcp6", 1);
+}
+
+static void do_mdstat(void)
+{
+	if (access("/proc/mdstat", R_OK) != 0) return;
+
+	section("mdstat");
+	catfile("/proc/mdstat");
+}
+
+
+typedef struct procinfo_t {
+	int pid, ppid, pri;
+	char state;
+	char user[33];
+	char started[20];
+	char cputime[32];
+	double pcpu, pmem;
+	unsigned long rsz, vsz;
+	char *cmd;
+} procinfo_t;
+
+static char *username(uid_t uid)
+{
+	/* Small cache, since there are usually only a handful of different users */
+	static struct { uid_t uid; char name[33]; } cache[64];
+	static int cachecount = 0;
+	struct passwd *pw;
+	int i;
+
+	for (i = 0; (i < cachecount); i++) if (cache[i].uid == uid) return cache[i].name;
+
+	i = ((cachecount < 64) ? cachecount++ : 63);
+	cache[i].uid = uid;
+	pw = getpwuid(uid);
+	if (pw && (strlen(pw->pw_name) <= 8)) strcpy(cache[i].name, pw->pw_name);
+	else sprintf(cache[i].name, "%u", (unsigned int)uid);
+
+	return cache[i].name;
+}
+
+static int readproc(int pid, time_t boottime, procinfo_t *pi)
+{
+	char fn[PATH_MAX], buf[MAXLINE], comm[256];
+	char *p;
+	struct stat st;
+	unsigned long utime, stime, vsize;
+	unsigned long long starttime;
+	long priority, rss;
+	unsigned long cputicks, cpusecs;
+	double runsecs;
+	time_t tstart;
+	FILE *fd;
+	size_t n;
+	int i;
+
+	snprintf(fn, sizeof(fn), "/proc/%d/stat", pid);
+	if (!slurp(fn, buf, sizeof(buf))) return 0;
+	if (stat(fn, &st) != 0) return 0;
+
+	/* The command name is in parentheses, and may contain blanks and parentheses */
+	p = strrchr(buf, ')');
+	if (!p) return 0;
+	n = p - (strchr(buf, '(') + 1);
+	if (n >= sizeof(comm)) n = sizeof(comm) - 1;
+	strncpy(comm, strchr(buf, '(') + 1, n); comm[n] = '\0';
+
+	if (sscanf(p+2, "%c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %ld %*d %*d %*d %llu %lu %ld",
+		   &pi->state, &pi->ppid, &utime, &stime, &priority, &starttime, &vsize, &rss) != 8) return 0;
+
+	pi->pid = pid;
+	pi->pri = 39 - (int)priority;	/* Same as the procps "pri" column */
+	strcpy(pi->user, username(st.st_uid));
+	pi->rsz = rss * pagesize_kb;
+	pi->vsz = vsize / 1024;
+	pi->pmem = (memtotal_kb ? ((100.0 * pi->rsz) / memtotal_kb) : 0.0);
+
+	cputicks = utime + stime;
+	runsecs = uptime_secs - ((double)starttime / clockticks);
+	pi->pcpu = ((runsecs > 0) ? ((100.0 * cputicks / clockticks) / runsecs) : 0.0);
+
+	cpusecs = cputicks / clockticks;
+	if (cpusecs >= 86400)
+		sprintf(pi->cputime, "%lu-%02lu:%02lu:%02lu", cpusecs / 86400, (cpusecs % 86400) / 3600, (cpusecs % 3600) / 60, cpusecs % 60);
+	else
+		sprintf(pi->cputime, "%02lu:%02lu:%02lu", cpusecs / 3600, (cpusecs % 3600) / 60, cpusecs % 60);
+
+	tstart = boottime + (time_t)(starttime / clockticks);
+	if ((time(NULL) - tstart) < 86400)
+		strftime(pi->started, sizeof(pi->started), "%H:%M:%S", localtime(&tstart));
+	else
+		strftime(pi->started, sizeof(pi->started), "%b %d", localtime(&tstart));
+
+	/* Full commandline, with the NUL separators turned into blanks */
+	snprintf(fn, sizeof(fn), "/proc/%d/cmdline", pid);
+	n = 0;
+	fd = fopen(fn, "r");
+	if (fd) { n = fread(buf, 1, sizeof(buf)-1, fd); fclose(fd); }
+	while ((n > 0) && (buf[n-1] == '\0')) n--;
+	if (n > 0) {
+		buf[n] = '\0';
+		for (i = 0; (i < n); i++) if ((buf[i] == '\0') || (buf[i] == '\n')) buf[i] = ' ';
+		pi->cmd = strdup(buf);
+	}
+	else {
+		pi->cmd = (char *)malloc(strlen(comm) + 3);
+		sprintf(pi->cmd, "[%s]", comm);
+	}
+
+	return 1;
+}
+
+static void do_ps(void)
+{
+	DIR *dir;
+	struct dirent *d;
+	procinfo_t *procs = NULL;
+	int count = 0, alloced = 0, i;
+	int pidw = 5, ppidw = 5, rszw = 5, vszw = 6, timew = 8;
+	time_t boottime = time(NULL) - (time_t)uptime_secs;
+	char w[30];
+
+	dir = opendir("/proc");
+	if (!dir) return;
+
+	while ((d = readdir(dir)) != NULL) {
+		int pid;
+
+		if (!isdigit((int)*d->d_name)) continue;
+		pid = atoi(d->d_name);
+
+		if (count == alloced) {
+			alloced += 256;
+			procs = (procinfo_t *)realloc(procs, alloced * sizeof(procinfo_t));
+		}
+		if (readproc(pid, boottime, &procs[count])) count++;
+	}
+	closedir(dir);
+
+	/*
+	 * The server finds the command by the column offset of the "CMD" header,
+	 * so all of the columns must line up. Make them wide enough for the data.
+	 */
+	for (i = 0; (i < count); i++) {
+		int n;
+
+		n = sprintf(w, "%d", procs[i].pid); if (n > pidw) pidw = n;
+		n = sprintf(w, "%d", procs[i].ppid); if (n > ppidw) ppidw = n;
+		n = sprintf(w, "%lu", procs[i].rsz); if (n > rszw) rszw = n;
+		n = sprintf(w, "%lu", procs[i].vsz); if (n > vszw) vszw = n;
+		n = strlen(procs[i].cputime); if (n > timew) timew = n;
+	}
+
+	section("ps");
+	printf("%*s %*s %-8s  STARTED S PRI %%CPU %*s %%MEM %*s %*s CMD\n",
+		pidw, "PID", ppidw, "PPID", "USER", timew, "TIME", rszw, "RSZ", vszw, "VSZ");
+	for (i = 0; (i < count); i++) {
+		printf("%*d %*d %-8s %8s %c %3d %4.1f %*s %4.1f %*lu %*lu %s\n",
+			pidw, procs[i].pid, ppidw, procs[i].ppid, procs[i].user, procs[i].started,
+			procs[i].state, procs[i].pri, procs[i].pcpu, timew, procs[i].cputime, procs[i].pmem,
+			rszw, procs[i].rsz, vszw, procs[i].vsz, procs[i].cmd);
+		free(procs[i].cmd);
+	}
+
+	if (procs) free(procs);
+}
+
+
+typedef struct vmsnapshot_t {
+	time_t tstamp;
+	unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+	unsigned long long intr, ctxt, pgpgin, pgpgout, pswpin, pswpout;
+} vmsnapshot_t;
+
+static void vmcounters(vmsnapshot_t *v, int *running, int *blocked)
+{
+	char buf[65536];
+	char *p;
+
+	memset(v, 0, sizeof(*v));
+	v->tstamp = time(NULL);
+
+	if (slurp("/proc/stat", buf, sizeof(buf))) {
+		sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+			&v->user, &v->nice, &v->system, &v->idle, &v->iowait, &v->irq, &v->softirq, &v->steal);
+		p = strstr(buf, "\nintr "); if (p) v->intr = strtoull(p+6, NULL, 10);
+		p = strstr(buf, "\nctxt "); if (p) v->ctxt = strtoull(p+6, NULL, 10);
+		p = strstr(buf, "\nprocs_running "); if (p) *running = atoi(p+15);
+		p = strstr(buf, "\nprocs_blocked "); if (p) *blocked = atoi(p+15);
+	}
+
+	if (slurp("/proc/vmstat", buf, sizeof(buf))) {
+		p = strstr(buf, "pgpgin "); if (p) v->pgpgin = strtoull(p+7, NULL, 10);
+		p = strstr(buf, "pgpgout "); if (p) v->pgpgout = strtoull(p+8, NULL, 10);
+		p = strstr(buf, "pswpin "); if (p) v->pswpin = strtoull(p+7, NULL, 10);
+		p = strstr(buf, "pswpout "); if (p) v->pswpout = strtoull(p+8, NULL, 10);
+	}
+}
+
+static void vmstatline(vmsnapshot_t *now, vmsnapshot_t *prev, double secs, int running, int blocked, char *mi)
+{
+	unsigned long long cpuuser, cpusys, cpuidle, cpuwait, cpusteal, cputotal;
+	unsigned long swpd;
+
+	if (secs <= 0) secs = 1;
+
+	cpuuser = (now->user + now->nice) - (prev->user + prev->nice);
+	cpusys = (now->system + now->irq + now->softirq) - (prev->system + prev->irq + prev->softirq);
+	cpuidle = now->idle - prev->idle;
+	cpuwait = now->iowait - prev->iowait;
+	cpusteal = now->steal - prev->steal;
+	cputotal = cpuuser + cpusys + cpuidle + cpuwait + cpusteal;
+	if (cputotal == 0) cputotal = 1;
+
+	swpd = meminfo(mi, "SwapTotal") - meminfo(mi, "SwapFree");
+
+	printf("%2d %2d %6lu %6lu %6lu %6lu %4lu %4lu %5lu %5lu %4lu %4lu %2d %2d %2d %2d %2d\n",
+		running, blocked, swpd, meminfo(mi, "MemFree"), meminfo(mi, "Buffers"), meminfo(mi, "Cached"),
+		(unsigned long)(((now->pswpin - prev->pswpin) * pagesize_kb) / secs),
+		(unsigned long)(((now->pswpout - prev->pswpout) * pagesize_kb) / secs),
+		(unsigned long)((now->pgpgin - prev->pgpgin) / secs),
+		(unsigned long)((now->pgpgout - prev->pgpgout) / secs),
+		(unsigned long)((now->intr - prev->intr) / secs),
+		(unsigned long)((now->ctxt - prev->ctxt) / secs),
+		(int)((100 * cpuuser + cputotal/2) / cputotal), (int)((100 * cpusys + cputotal/2) / cputotal),
+		(int)((100 * cpuidle + cputotal/2) / cputotal), (int)((100 * cpuwait + cputotal/2) / cputotal),
+		(int)((100 * cpusteal + cputotal/2) / cputotal));
+}
+
+static void do_vmstat(char *mi)
+{
+	/*
+	 * The script runs "vmstat 300 2" in the background and reports the result
+	 * on the next run. We do the same by saving the counters between runs, and
+	 * reporting the difference since last time.
+	 */
+	vmsnapshot_t now, prev, zero;
+	int running = 0, blocked = 0, haveprev = 0;
+	char fn[PATH_MAX], tmpfn[PATH_MAX+20];
+	FILE *fd;
+
+	vmcounters(&now, &running, &blocked);
+	if (!snapshotdir) return;
+
+	snprintf(fn, sizeof(fn), "%s/xymon_vmstat.%s.counters", snapshotdir, hostid);
+	fd = fopen(fn, "r");
+	if (fd) {
+		haveprev = (fread(&prev, sizeof(prev), 1, fd) == 1);
+		fclose(fd);
+	}
+
+	snprintf(tmpfn, sizeof(tmpfn), "%s.%d", fn, (int)getpid());
+	fd = fopen(tmpfn, "w");
+	if (fd) {
+		int ok = (fwrite(&now, sizeof(now), 1, fd) == 1);
+		if ((fclose(fd) == 0) && ok) rename(tmpfn, fn); else unlink(tmpfn);
+	}
+
+	/* Only report when the previous sample is from a previous client run */
+	if (!haveprev || ((now.tstamp - prev.tstamp) < 30) || ((now.tstamp - prev.tstamp) > 1800)) return;
+
+	section("vmstat");
+	printf("procs -----------memory---------- ---swap-- -----io---- -system-- ----cpu----\n");
+	printf(" r  b   swpd   free   buff  cache   si   so    bi    bo   in   cs us sy id wa st\n");
+	memset(&zero, 0, sizeof(zero));
+	vmstatline(&now, &zero, uptime_secs, running, blocked, mi);
+	vmstatline(&now, &prev, (double)(now.tstamp - prev.tstamp), running, blocked, mi);
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct timeval tstart, tend;
+	struct rusage ru;
+	char mi[8192];
+	char buf[MAXLINE];
+	int argi;
+
+	gettimeofday(&tstart, NULL);
+
+	snapshotdir = getenv("XYMONTMP");
+	hostid = getenv("MACHINEDOTS");
+	for (argi = 1; (argi < argc); argi++) {
+		if (strncmp(argv[argi], "--tmpdir=", 9) == 0) {
+			snapshotdir = argv[argi]+9;
+		}
+		else if (strncmp(argv[argi], "--hostname=", 11) == 0) {
+			hostid = argv[argi]+11;
+		}
+		else if (strcmp(argv[argi], "--help") == 0) {
+			printf("Usage: %s [--tmpdir=DIR] [--hostname=HOSTNAME]\n", argv[0]);
+			return 0;
+		}
+	}
+	if (!hostid) {
+		struct utsname u;
+
+		hostid = ((uname(&u) == 0) ? strdup(u.nodename) : "localhost");
+	}
+
+	pagesize_kb = sysconf(_SC_PAGESIZE) / 1024;
+	clockticks = sysconf(_SC_CLK_TCK);
+	if (clockticks <= 0) clockticks = 100;
+	if (slurp("/proc/uptime", buf, sizeof(buf))) uptime_secs = atof(buf);
+	slurp("/proc/meminfo", mi, sizeof(mi));
+	memtotal_kb = meminfo(mi, "MemTotal");
+
+	do_date();
+	do_uname();
+	do_osversion();
+	do_uptime();
+	do_who();
+	do_df();
+	do_mount();
+	do_free(mi);
+	do_ifconfig("ifconfig");
+	do_route();
+	do_netstat();
+	do_ports();
+	do_ifconfig("ifstat");
+	do_mdstat();
+	do_ps();
+	do_vmstat(mi);
+
+	/* Report what it cost us to collect all of this */
+	gettimeofday(&tend, NULL);
+	getrusage(RUSAGE_SELF, &ru);
+	section("collector");
+	printf("Collector: linux-collector\n");
+	printf("Wall time: %.3f\n", (tend.tv_sec - tstart.tv_sec) + (tend.tv_usec - tstart.tv_usec) / 1000000.0);
+	printf("User CPU: %.3f\n", ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0);
+	printf("System CPU: %.3f\n", ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0);
+
+	return 0;
+}
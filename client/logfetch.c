@@ -24,6 +24,8 @@ static char rcsid[] = "$Id: logfetch.c 6712 2011-07-31 21:01:52Z storner $";
 #include <time.h>
 #include <limits.h>
 #include <errno.h>
+#include <ctype.h>
+#include <strings.h>
 #include <regex.h>
 #include <pwd.h>
 #include <grp.h>
@@ -37,7 +39,9 @@ static char rcsid[] = "$Id: logfetch.c 6712 2011-07-31 21:01:52Z storner $";
 #include "libxymon.h"
 
 /* Is it ok for these to be hardcoded ? */
-#define MAXCHECK   102400   /* When starting, dont look at more than 100 KB of data */
+#define MAXCHECK   (10*1024*1024)  /* Default for how far back we look when catching up (--catchup) */
+#define LOGBLOCKSZ (256*1024)      /* Read the logfile in blocks of this size */
+#define MAXLOGLINE 8192            /* Lines longer than this are split */
 #define MAXMINUTES 30
 #define POSCOUNT ((MAXMINUTES / 5) + 1)
 #define LINES_AROUND_TRIGGER 5
@@ -52,6 +56,7 @@ typedef struct logdef_t {
 	long lastpos[POSCOUNT];
 	long maxbytes;
 #endif
+	ino_t inode;
 	char **trigger;
 	int triggercount;
 	char **ignore;
@@ -81,6 +86,11 @@ typedef struct checkdef_t {
 } checkdef_t;
 
 checkdef_t *checklist = NULL;
+#ifdef _LARGEFILE_SOURCE
+off_t catchupbytes = MAXCHECK;
+#else
+long catchupbytes = MAXCHECK;
+#endif
 
 
 FILE *fileopen(char *filename, int *err)
@@ -103,237 +113,331 @@ FILE *fileopen(char *filename, int *err)
 }
 
 
+/*
+ * The ignore- and trigger-patterns for a logfile are combined into a
+ * single matcher, so each line is only checked once for each kind.
+ * If all of the patterns are plain strings, we skip the regex engine
+ * and do a simple case-insensitive string search.
+ */
+typedef struct matcher_t {
+	int count;
+	char **literals;	/* Set when all patterns are plain strings */
+	regex_t expr;		/* All patterns combined: (p1)|(p2)|... */
+} matcher_t;
+
+static int isliteral(char *pattern)
+{
+	return (strpbrk(pattern, ".[]()*+?{}|^$\\") == NULL);
+}
+
+static void matcher_init(matcher_t *m, char **patterns, int count)
+{
+	strbuffer_t *combined;
+	int i, literal = 1;
+
+	memset(m, 0, sizeof(*m));
+
+	for (i=0; (i < count); i++) {
+		if (patterns[i] && !isliteral(patterns[i])) literal = 0;
+	}
+
+	if (literal) {
+		m->literals = (char **)calloc(count+1, sizeof(char *));
+		for (i=0; (i < count); i++) {
+			if (patterns[i] && *patterns[i]) m->literals[m->count++] = patterns[i];
+		}
+		return;
+	}
+
+	combined = newstrbuffer(0);
+	for (i=0; (i < count); i++) {
+		regex_t tmpexpr;
+
+		/* Check each pattern by itself, so one bad pattern does not disable all of them */
+		if (!patterns[i]) continue;
+		if (regcomp(&tmpexpr, patterns[i], REG_EXTENDED|REG_ICASE|REG_NOSUB) != 0) {
+			errprintf("Invalid pattern '%s' ignored\n", patterns[i]);
+			continue;
+		}
+		regfree(&tmpexpr);
+
+		if (STRBUFLEN(combined) > 0) addtobuffer(combined, "|");
+		addtobuffer(combined, "(");
+		addtobuffer(combined, patterns[i]);
+		addtobuffer(combined, ")");
+		m->count++;
+	}
+
+	if (m->count && (regcomp(&m->expr, STRBUF(combined), REG_EXTENDED|REG_ICASE|REG_NOSUB) != 0)) m->count = 0;
+	freestrbuffer(combined);
+}
+
+static int matcher_match(matcher_t *m, char *line)
+{
+	int i;
+
+	if (m->count == 0) return 0;
+
+	if (!m->literals) return (regexec(&m->expr, line, 0, NULL, 0) == 0);
+
+	for (i=0; (i < m->count); i++) {
+		char *p, *s = m->literals[i];
+		int slen = strlen(s);
+		int c1 = tolower((int)*s), c2 = toupper((int)*s);
+
+		for (p = line; (*p); p++) {
+			if (((*p == c1) || (*p == c2)) && (strncasecmp(p, s, slen) == 0)) return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void matcher_free(matcher_t *m)
+{
+	if (m->literals) {
+		xfree(m->literals);
+	}
+	else if (m->count) {
+		regfree(&m->expr);
+	}
+	m->count = 0;
+}
+
+static void dropoldest(strbuffer_t *buf, size_t keepbytes)
+{
+	/* Remove data from the start of buf, keeping at least the last keepbytes (complete lines) */
+	char *keep;
+	size_t drop;
+
+	if (STRBUFLEN(buf) <= keepbytes) return;
+	keep = strchr(STRBUF(buf) + STRBUFLEN(buf) - keepbytes, '\n');
+	if (!keep) return;
+
+	keep++;
+	drop = (keep - STRBUF(buf));
+	memmove(STRBUF(buf), keep, STRBUFLEN(buf) - drop + 1);
+	strbufferchop(buf, drop);
+}
+
+static void tailbytes(strbuffer_t *dest, strbuffer_t *src, size_t bytes)
+{
+	/* Add the last "bytes" of src to dest, but only complete lines */
+	char *p;
+
+	if (bytes >= STRBUFLEN(src)) {
+		addtostrbuffer(dest, src);
+		return;
+	}
+
+	p = STRBUF(src) + STRBUFLEN(src) - bytes;
+	if (*(p-1) != '\n') {
+		p = strchr(p, '\n');
+		if (!p) return;
+		p++;
+	}
+	addtobuffer(dest, p);
+}
+
 char *logdata(char *filename, logdef_t *logdef)
 {
-	static char *buf = NULL;
-	char *startpos, *fillpos, *triggerstartpos, *triggerendpos;
+	static strbuffer_t *result = NULL;
+	char *skiptxt = "<...SKIPPED...>\n";
 	FILE *fd;
 	struct stat st;
-	size_t bytesread, bytesleft;
-	int openerr, i, status, triggerlinecount, done;
-	char *linepos[2*LINES_AROUND_TRIGGER+1];
-	int lpidx;
-	regex_t *ignexpr = NULL, *trigexpr = NULL;
+	int openerr, i, n, skipfirst = 0;
+	matcher_t ignores, triggers;
+	char *block = NULL;
+	strbuffer_t *line, *tail, *matches;
+	char *before[LINES_AROUND_TRIGGER];
+	int beforeidx = 0, afterleft = 0;
+	unsigned long lineno = 0, lastmatchline = 0;
+	size_t totalbytes = 0, bytesaftermatch = 0, maxbytes;
 #ifdef _LARGEFILE_SOURCE
-	off_t bufsz;
+	off_t startpos, bytesleft;
 #else
-	long bufsz;
+	long startpos, bytesleft;
 #endif
 
-	if (buf) free(buf);
-	buf = NULL;
+	if (!result) result = newstrbuffer(0); else clearstrbuffer(result);
 
 	fd = fileopen(filename, &openerr);
 	if (fd == NULL) {
-		buf = (char *)malloc(1024 + strlen(filename));
-		sprintf(buf, "Cannot open logfile %s : %s\n", filename, strerror(openerr));
-		return buf;
+		char msg[1024];
+
+		snprintf(msg, sizeof(msg), "Cannot open logfile %s : %s\n", filename, strerror(openerr));
+		addtobuffer(result, msg);
+		return STRBUF(result);
 	}
 
 	/*
 	 * See how large the file is, and decide where to start reading.
 	 * Save the last POSCOUNT positions so we can scrap 5 minutes of data
 	 * from one run to the next.
+	 *
+	 * If the inode changed, or the file shrank, then it has been rotated.
+	 * Start from the beginning of the new file.
 	 */
 	fstat(fileno(fd), &st);
-	if ((st.st_size < logdef->lastpos[0]) || (st.st_size < logdef->lastpos[6])) {
-		/*
-		 * Logfile shrank - probably it was rotated.
-		 * Start from beginning of file.
-		 */
-		for (i=0; (i < 7); i++) logdef->lastpos[i] = 0;
+	if ((logdef->inode && (st.st_ino != logdef->inode)) ||
+	    (st.st_size < logdef->lastpos[0]) || (st.st_size < logdef->lastpos[POSCOUNT-1])) {
+		for (i=0; (i < POSCOUNT); i++) logdef->lastpos[i] = 0;
 	}
+	logdef->inode = st.st_ino;
 
 	/* Go to the position we were at 6 times ago (corresponds to 30 minutes) */
-#ifdef _LARGEFILE_SOURCE
-	fseeko(fd, logdef->lastpos[6], SEEK_SET);
-	bufsz = st.st_size - ftello(fd);
-	if (bufsz > MAXCHECK) {
-		/*
-		 * Too much data for us. We have to skip some of the old data.
-		 */
-		logdef->lastpos[6] = st.st_size - MAXCHECK;
-		fseeko(fd, logdef->lastpos[6], SEEK_SET);
-		bufsz = st.st_size - ftello(fd);
+	startpos = logdef->lastpos[POSCOUNT-1];
+	if ((st.st_size - startpos) > catchupbytes) {
+		/* Too much data for us. We have to skip some of the old data. */
+		startpos = st.st_size - catchupbytes;
+		skipfirst = 1;	/* Probably in the middle of a line */
 	}
+#ifdef _LARGEFILE_SOURCE
+	fseeko(fd, startpos, SEEK_SET);
 #else
-	fseek(fd, logdef->lastpos[6], SEEK_SET);
-	bufsz = st.st_size - ftell(fd);
-	if (bufsz > MAXCHECK) {
-		/*
-		 * Too much data for us. We have to skip some of the old data.
-		 */
-		logdef->lastpos[6] = st.st_size - MAXCHECK;
-		fseek(fd, logdef->lastpos[6], SEEK_SET);
-		bufsz = st.st_size - ftell(fd);
-	}
+	fseek(fd, startpos, SEEK_SET);
 #endif
+	bytesleft = st.st_size - startpos;
 
 	/* Shift position markers one down for the next round */
-	for (i=6; (i > 0); i--) logdef->lastpos[i] = logdef->lastpos[i-1];
+	for (i=(POSCOUNT-1); (i > 0); i--) logdef->lastpos[i] = logdef->lastpos[i-1];
 	logdef->lastpos[0] = st.st_size;
 
+	matcher_init(&ignores, logdef->ignore, logdef->ignorecount);
+	matcher_init(&triggers, logdef->trigger, logdef->triggercount);
+
 	/*
-	 * Get our read buffer.
-	 *
-	 * NB: fgets() need some extra room in the input buffer.
-	 *     If it is missing, we will never detect end-of-file 
-	 *     because fgets() will read 0 bytes, but having read that
-	 *     it still hasnt reached end-of-file status.
-	 *     At least, on some platforms (Solaris, FreeBSD).
+	 * Read the data in large blocks, and pick out the lines. We keep:
+	 * - the most recent data (at least maxbytes of it) in "tail",
+	 * - the lines around each trigger match in "matches",
+	 * so memory use is bounded no matter how much data we scan.
 	 */
-	bufsz += 1023;
-	startpos = buf = (char *)malloc(bufsz + 1);
-	if (buf == NULL) {
-		/* Couldnt allocate the buffer */
-		return "Out of memory";
-	}
+	maxbytes = ((logdef->maxbytes > 0) ? logdef->maxbytes : 0);
+	line = newstrbuffer(0);
+	tail = newstrbuffer(0);
+	matches = newstrbuffer(0);
+	memset(before, 0, sizeof(before));
+	block = (char *)malloc(LOGBLOCKSZ+1);
+
+	while (bytesleft > 0) {
+		char *bol, *eol, *blockend;
+
+		n = fread(block, 1, ((bytesleft < LOGBLOCKSZ) ? bytesleft : LOGBLOCKSZ), fd);
+		if (n <= 0) break;
+		bytesleft -= n;
+		blockend = block + n;
+
+		bol = block;
+		while (bol < blockend) {
+			eol = memchr(bol, '\n', (blockend - bol));
+			if (!eol && (bytesleft > 0) && (STRBUFLEN(line) < MAXLOGLINE)) {
+				/* Partial line - save it, and get the rest with the next block */
+				addtobufferraw(line, bol, (blockend - bol));
+				*(STRBUF(line) + STRBUFLEN(line)) = '\0';
+				break;
+			}
 
-	/* Compile the regex patterns */
-	if (logdef->ignorecount) {
-		int i;
-		ignexpr = (regex_t *) malloc(logdef->ignorecount * sizeof(regex_t));
-		for (i=0; (i < logdef->ignorecount); i++) {
-			status = regcomp(&ignexpr[i], logdef->ignore[i], REG_EXTENDED|REG_ICASE|REG_NOSUB);
-			if (status != 0) logdef->ignore[i] = NULL;
-		}
-	}
-	if (logdef->triggercount) {
-		int i;
-		trigexpr = (regex_t *) malloc(logdef->triggercount * sizeof(regex_t));
-		for (i=0; (i < logdef->triggercount); i++) {
-			status = regcomp(&trigexpr[i], logdef->trigger[i], REG_EXTENDED|REG_ICASE|REG_NOSUB);
-			if (status != 0) logdef->trigger[i] = NULL;
-		}
-	}
-	triggerstartpos = triggerendpos = NULL;
-	triggerlinecount = 0;
-	memset(linepos, 0, sizeof(linepos)); lpidx = 0;
-
-	/* 
-	 * Read data.
-	 * Discard the ignored lines as we go.
-	 * Remember the last trigger line we see.
-	 */
-	fillpos = buf;
-	bytesleft = bufsz;
-	done = 0;
-	while (!ferror(fd) && (bytesleft > 0) && !done && (fgets(fillpos, bytesleft, fd) != NULL)) {
-		if (*fillpos == '\0') {
-			/*
-			 * fgets() can return an empty buffer without flagging
-			 * end-of-file. It should not happen anymore now that
-			 * we have extended the buffer to have room for the
-			 * terminating \0 byte, but if it does then we will
-			 * catch it here.
-			 */
-			done = 1;
-			continue;
-		}
+			eol = (eol ? eol+1 : blockend);
+			addtobufferraw(line, bol, (eol - bol));
+			*(STRBUF(line) + STRBUFLEN(line)) = '\0';
+			bol = eol;
 
-		/* Check ignore pattern */
-		if (logdef->ignorecount) {
-			int i, match = 0;
+			if (skipfirst) {
+				skipfirst = 0;
+				clearstrbuffer(line);
+				continue;
+			}
 
-			for (i=0; ((i < logdef->ignorecount) && !match); i++) {
-				match = (regexec(&ignexpr[i], fillpos, 0, NULL, 0) == 0);
+			/* Have a complete line. NUL bytes in it would cut it short, so zap them */
+			if (strlen(STRBUF(line)) < STRBUFLEN(line)) {
+				for (i=0; (i < STRBUFLEN(line)); i++) if (*(STRBUF(line)+i) == '\0') *(STRBUF(line)+i) = ' ';
 			}
 
-			if (match) continue;
-		}
+			if (matcher_match(&ignores, STRBUF(line))) {
+				clearstrbuffer(line);
+				continue;
+			}
 
-		linepos[lpidx] = fillpos;
+			lineno++;
+			totalbytes += STRBUFLEN(line);
+			addtostrbuffer(tail, line);
+			if (STRBUFLEN(tail) > (2*maxbytes + MAXLOGLINE)) dropoldest(tail, maxbytes + MAXLOGLINE);
 
-		/* See if this is a trigger line */
-		if (logdef->triggercount) {
-			int i, match = 0;
+			if (matcher_match(&triggers, STRBUF(line))) {
+				int j;
 
-			for (i=0; ((i < logdef->ignorecount) && !match); i++) {
-				match = (regexec(&trigexpr[i], fillpos, 0, NULL, 0) == 0);
-			}
+				/* Add the lines before this one that are not already in the matches */
+				if (lastmatchline && ((lastmatchline + LINES_AROUND_TRIGGER + 1) < lineno)) addtobuffer(matches, skiptxt);
+				for (j = 0; (j < LINES_AROUND_TRIGGER); j++) {
+					int idx = (beforeidx + j) % LINES_AROUND_TRIGGER;
+					unsigned long bline = lineno - LINES_AROUND_TRIGGER + j;
 
-			if (match) {
-				int sidx;
-				
-				sidx = lpidx - LINES_AROUND_TRIGGER; 
-				if (sidx < 0) sidx += (2*LINES_AROUND_TRIGGER + 1);
-				triggerstartpos = linepos[sidx]; if (!triggerstartpos) triggerstartpos = buf;
-				triggerlinecount = LINES_AROUND_TRIGGER;
+					if (before[idx] && (bline > lastmatchline)) addtobuffer(matches, before[idx]);
+				}
+				addtostrbuffer(matches, line);
+				lastmatchline = lineno;
+				bytesaftermatch = 0;
+				afterleft = LINES_AROUND_TRIGGER;
+			}
+			else if (afterleft) {
+				addtostrbuffer(matches, line);
+				lastmatchline = lineno;
+				bytesaftermatch = 0;
+				afterleft--;
+			}
+			else {
+				bytesaftermatch += STRBUFLEN(line);
 			}
-		}
-
 
-		/* We want this line */
-		lpidx = ((lpidx + 1) % (2*LINES_AROUND_TRIGGER+1));
-		fillpos += strlen(fillpos);
+			if (STRBUFLEN(matches) > (2*maxbytes + MAXLOGLINE)) dropoldest(matches, maxbytes);
 
-		/* Save the current end-position if we had a trigger within the past LINES_AFTER_TRIGGER lines */
-		if (triggerlinecount) {
-			triggerlinecount--;
-			triggerendpos = fillpos;
+			/* Remember the line for the "before" context of the next trigger */
+			if (before[beforeidx]) xfree(before[beforeidx]);
+			before[beforeidx] = grabstrbuffer(line);
+			line = newstrbuffer(0);
+			beforeidx = (beforeidx + 1) % LINES_AROUND_TRIGGER;
 		}
-
-		bytesleft = (bufsz - (fillpos - buf));
 	}
 
 	/* Was there an error reading the file? */
 	if (ferror(fd)) {
-		buf = (char *)malloc(1024 + strlen(filename));
-		sprintf(buf, "Error while reading logfile %s : %s\n", filename, strerror(errno));
-		startpos = buf;
-		goto cleanup;
-	}
+		char msg[1024];
 
-	bytesread = (fillpos - startpos);
-	*(buf + bytesread) = '\0';
+		snprintf(msg, sizeof(msg), "Error while reading logfile %s : %s\n", filename, strerror(errno));
+		addtobuffer(result, msg);
+	}
+	else if (totalbytes <= maxbytes) {
+		/* It all fits */
+		addtostrbuffer(result, tail);
+	}
+	else if (STRBUFLEN(matches) > 0) {
+		/* Show the trigger lines with context, then as much of the most recent data as will fit */
+		size_t room;
 
-	if (bytesread > logdef->maxbytes) {
-		char *skiptxt = "<...SKIPPED...>\n";
+		addtobuffer(result, skiptxt);
+		if (STRBUFLEN(matches) > maxbytes) tailbytes(result, matches, maxbytes);
+		else addtostrbuffer(result, matches);
 
-		/* FIXME: Must make sure to only pass complete lines back to the server */
-		if (triggerstartpos) {
-			/* Skip the beginning of the data up until the trigger was found */
-			startpos = triggerstartpos;
-			if ((startpos - strlen(skiptxt)) >= buf) {
-				startpos -= strlen(skiptxt);
-				memcpy(startpos, skiptxt, strlen(skiptxt));
-			}
-			bytesread = (fillpos - startpos);
-
-			/*
-			 * If it's still too big, show some lines after the trigger, and
-			 * then skip until it will fit.
-			 */
-			if (bytesread > logdef->maxbytes) {
-				size_t bytesleft;
-
-				bytesleft = logdef->maxbytes - (triggerendpos - startpos);
-				if (bytesleft > 0) {
-					char *skipend;
-
-					skipend = fillpos - bytesleft;
-					memmove(triggerendpos, skipend, bytesleft);
-					*(triggerendpos + bytesleft) = '\0';
-
-					if (bytesleft >= strlen(skiptxt)) 
-						memcpy(triggerendpos, skiptxt, strlen(skiptxt));
-					bytesread = (triggerendpos - startpos) + bytesleft;
-				}
-			}
+		room = ((maxbytes > STRBUFLEN(result)) ? (maxbytes - STRBUFLEN(result)) : 0);
+		if (bytesaftermatch && (bytesaftermatch <= room)) {
+			tailbytes(result, tail, bytesaftermatch);
 		}
-		else {
-			/* Just drop what is too much */
-			startpos += (bytesread - logdef->maxbytes);
-			memcpy(startpos, skiptxt, strlen(skiptxt));
-			bytesread = logdef->maxbytes;
+		else if (bytesaftermatch) {
+			addtobuffer(result, skiptxt);
+			if (room > strlen(skiptxt)) tailbytes(result, tail, room - strlen(skiptxt));
 		}
 	}
+	else {
+		/* Just drop what is too much */
+		addtobuffer(result, skiptxt);
+		if (maxbytes > strlen(skiptxt)) tailbytes(result, tail, maxbytes - strlen(skiptxt));
+	}
 
 	/* Avoid sending a '[' as the first char on a line */
 	{
 		char *p;
 
-		p = startpos;
+		p = STRBUF(result);
 		while (p) {
 			if (*p == '[') *p = '.';
 			p = strstr(p, "\n[");
@@ -341,28 +445,16 @@ char *logdata(char *filename, logdef_t *logdef)
 		}
 	}
 
-cleanup:
-	if (fd) fclose(fd);
-
-	{
-		int i;
-
-		if (logdef->ignorecount) {
-			for (i=0; (i < logdef->ignorecount); i++) {
-				if (logdef->ignore[i]) regfree(&ignexpr[i]);
-			}
-			xfree(ignexpr);
-		}
-
-		if (logdef->triggercount) {
-			for (i=0; (i < logdef->triggercount); i++) {
-				if (logdef->trigger[i]) regfree(&trigexpr[i]);
-			}
-			xfree(trigexpr);
-		}
-	}
-
-	return startpos;
+	fclose(fd);
+	xfree(block);
+	for (i=0; (i < LINES_AROUND_TRIGGER); i++) if (before[i]) xfree(before[i]);
+	freestrbuffer(line);
+	freestrbuffer(tail);
+	freestrbuffer(matches);
+	matcher_free(&ignores);
+	matcher_free(&triggers);
+
+	return STRBUF(result);
 }
 
 char *ftypestr(unsigned int mode, char *symlink)
@@ -884,6 +976,10 @@ void loadlogstatus(char *statfn)
 			/* Sanity check */
 			if (walk->check.logcheck.lastpos[i] < 0) walk->check.logcheck.lastpos[i] = 0;
 		}
+
+		/* Newer versions also save the inode of the file, to detect rotation */
+		tok = strtok(NULL, ":\n");
+		if (tok && (*tok == 'i')) walk->check.logcheck.inode = (ino_t)str2ll(tok+1, NULL);
 	}
 
 	fclose(fd);
@@ -909,6 +1005,7 @@ void savelogstatus(char *statfn)
 
 		fprintf(fd, "%s", walk->filename);
 		for (i = 0; (i < POSCOUNT); i++) fprintf(fd, fmt, walk->check.logcheck.lastpos[i]);
+		if (walk->check.logcheck.inode) fprintf(fd, ":i%llu", (unsigned long long)walk->check.logcheck.inode);
 		fprintf(fd, "\n");
 	}
 	fclose(fd);
@@ -945,8 +1042,16 @@ int main(int argc, char *argv[])
 			printf("%s\n", timestr);
 			return 0;
 		}
-		else if (i == 1) cfgfn = argv[i];
-		else if (i == 2) statfn = argv[i];
+		else if (strncmp(argv[i], "--catchup=", 10) == 0) {
+			char *p;
+
+			catchupbytes = str2ll(strchr(argv[i], '=')+1, &p);
+			if ((*p == 'k') || (*p == 'K')) catchupbytes *= 1024;
+			else if ((*p == 'm') || (*p == 'M')) catchupbytes *= 1024*1024;
+			if (catchupbytes <= 0) catchupbytes = MAXCHECK;
+		}
+		else if (cfgfn == NULL) cfgfn = argv[i];
+		else if (statfn == NULL) statfn = argv[i];
 	}
 
 	if ((cfgfn == NULL) || (statfn == NULL)) return 1;
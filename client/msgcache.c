@@ -7,6 +7,11 @@
 /* A "pullclient" command receives the cache content in response.             */
 /* Any data provided in the "pullclient" request is saved, and passed as      */
 /* response to the first "client" command seen afterwards.                    */
+/* A "pullclient N session" command opens a session, where xymonfetch asks    */
+/* for batches of messages and acknowledges them when they are delivered.     */
+/*                                                                            */
+/* With a spool directory, messages are also written to an append-only spool  */
+/* on disk, so they survive a restart and the memory used is bounded.         */
 /*                                                                            */
 /* Copyright (C) 2006-2011 Henrik Storner <henrik@hswn.dk>                    */
 /*                                                                            */
@@ -39,6 +44,13 @@ static char rcsid[] = "$Id: msgcache.c 6712 2011-07-31 21:01:52Z storner $";
 #include <ctype.h>
 #include <signal.h>
 #include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#ifdef LINUX
+/* sendfile() passes spooled messages from the page cache to the socket without copying them */
+#define USE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 #include "version.h"
 #include "libxymon.h"
@@ -48,6 +60,57 @@ char *client_response = NULL;		/* The latest response to a "client" message */
 char *logfile = NULL;
 int maxage = 600;			/* Maximum time we will cache messages */
 sender_t *serverlist = NULL;		/* Who is allowed to grab our messages */
+unsigned long msgseq = 0;		/* Sequence number of the last message queued */
+
+char *spooldir = NULL;			/* Where we spool messages on disk */
+unsigned long maxmemory = 16*1024*1024;	/* Max. size of messages kept in memory */
+off_t maxspool = 1024*1024*1024;	/* Max. size of the spool */
+off_t segsize = 4*1024*1024;		/* Size of a spool segment before we start a new one */
+int spoolmaxage = 86400;		/* How long we keep spooled messages not delivered to any server */
+unsigned long memused = 0;		/* Size of the messages we have in memory */
+off_t spoolsize = 0;			/* Size of the message data in the spool */
+unsigned long knownids = 0;		/* The server ID bits we have delivered messages to */
+int statedirty = 0;			/* Delivery state must be saved */
+
+#define BATCH_MAXSIZE (4*1024*1024)	/* Max. size of a batch of messages sent in a session */
+#define DELIVERED_NOID 1		/* "sentto" bit for servers without an ID, who get all messages */
+#define SPOOLMAGIC 0x584d5131		/* "XMQ1" */
+
+/*
+ * A spool segment is a pair of files: The ".dat" file holds the messages
+ * back-to-back, and the ".idx" file has one record for each message. Both
+ * are only ever appended to. A message is in the spool when its index
+ * record has been written after the message data, so a partial message
+ * from a crash is discarded when the spool is loaded again.
+ */
+typedef struct spoolrec_t {
+	unsigned int magic;
+	unsigned int len;
+	unsigned long long seq;
+	long long tstamp;
+	unsigned long long offset;
+} spoolrec_t;
+
+typedef struct segment_t {
+	unsigned long firstseq;
+	int datafd, idxfd;
+	off_t size;			/* Bytes of message data in the segment */
+	int reccount;			/* Index records in the segment */
+	int msgcount;			/* Messages on the queue from this segment */
+	int sendcount;			/* Pending sends from this segment */
+	int closed;			/* No more messages go into this segment */
+	struct segment_t *next;
+} segment_t;
+segment_t *seghead = NULL;
+segment_t *segtail = NULL;
+
+typedef struct outchunk_t {
+	strbuffer_t *buf;		/* Data to send from memory ... */
+	segment_t *seg;			/* ... or from a spool segment */
+	off_t offset;
+	size_t len, sent;
+	struct outchunk_t *next;
+} outchunk_t;
 
 typedef struct conn_t {
 	time_t tstamp;
@@ -56,20 +119,29 @@ typedef struct conn_t {
 	enum { C_READING, C_WRITING, C_DONE } action;
 	int sockfd;
 	strbuffer_t *msgbuf;
-	int sentbytes;
+	outchunk_t *outhead, *outtail;	/* Data waiting to be sent */
+	int session;			/* Session with xymonfetch */
+	int pollid;			/* Session: The Xymon server ID bit */
+	unsigned long sentseq;		/* Session: Last message sent */
+	unsigned long ackedseq;		/* Session: Last message acknowledged */
 	struct conn_t *next;
 } conn_t;
 conn_t *chead = NULL;
 conn_t *ctail = NULL;
 
 typedef struct msgqueue_t {
+	unsigned long seq;
 	time_t tstamp;
-	strbuffer_t *msgbuf;
+	strbuffer_t *msgbuf;		/* NULL if the message is only in the spool */
+	int len;
+	segment_t *seg;			/* Spool segment holding the message */
+	off_t offset;
 	unsigned long sentto;
 	struct msgqueue_t *next;
 } msgqueue_t;
 msgqueue_t *qhead = NULL;
 msgqueue_t *qtail = NULL;
+msgqueue_t *spillhint = NULL;		/* No messages before this one have a spooled copy in memory */
 
 
 void sigmisc_handler(int signum)
@@ -90,6 +162,708 @@ void sigmisc_handler(int signum)
 	}
 }
 
+char *spool_filename(unsigned long firstseq, char *suffix)
+{
+	static char fn[PATH_MAX];
+
+	snprintf(fn, sizeof(fn), "%s/%016lu.%s", spooldir, firstseq, suffix);
+	return fn;
+}
+
+int write_all(int fd, void *data, size_t len)
+{
+	char *p = (char *)data;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n <= -1) {
+			if (errno == EINTR) continue;
+			return 0;
+		}
+		p += n; len -= n;
+	}
+
+	return 1;
+}
+
+segment_t *segment_create(unsigned long firstseq)
+{
+	segment_t *seg = (segment_t *)calloc(1, sizeof(segment_t));
+
+	seg->firstseq = firstseq;
+	seg->datafd = open(spool_filename(firstseq, "dat"), O_RDWR|O_CREAT|O_TRUNC|O_APPEND, 0600);
+	seg->idxfd = open(spool_filename(firstseq, "idx"), O_RDWR|O_CREAT|O_TRUNC|O_APPEND, 0600);
+	if ((seg->datafd == -1) || (seg->idxfd == -1)) {
+		errprintf("Cannot create spool segment %s: %s\n", spool_filename(firstseq, "dat"), strerror(errno));
+		if (seg->datafd != -1) { close(seg->datafd); unlink(spool_filename(firstseq, "dat")); }
+		if (seg->idxfd != -1) { close(seg->idxfd); unlink(spool_filename(firstseq, "idx")); }
+		xfree(seg);
+		return NULL;
+	}
+	fcntl(seg->datafd, F_SETFD, FD_CLOEXEC);
+	fcntl(seg->idxfd, F_SETFD, FD_CLOEXEC);
+
+	if (segtail) { segtail->next = seg; segtail = seg; } else seghead = segtail = seg;
+
+	return seg;
+}
+
+void segment_check(segment_t *seg)
+{
+	/* Remove a segment when it is full, and no longer used */
+	segment_t *prev;
+
+	if (!seg->closed || (seg->msgcount > 0) || (seg->sendcount > 0)) return;
+
+	dbgprintf("Removing spool segment %lu\n", seg->firstseq);
+	close(seg->datafd);
+	close(seg->idxfd);
+	unlink(spool_filename(seg->firstseq, "idx"));
+	unlink(spool_filename(seg->firstseq, "dat"));
+	spoolsize -= seg->size;
+
+	if (seg == seghead) {
+		seghead = seg->next;
+		prev = NULL;
+	}
+	else {
+		for (prev = seghead; (prev->next != seg); prev = prev->next) ;
+		prev->next = seg->next;
+	}
+	if (seg == segtail) segtail = prev;
+
+	xfree(seg);
+}
+
+void spool_append(msgqueue_t *msg)
+{
+	/* Write a new message to the current spool segment */
+	static time_t lasterror = 0;
+	segment_t *seg;
+	spoolrec_t rec;
+
+	if (!spooldir) return;
+
+	seg = segtail;
+	if (!seg || seg->closed || (seg->size >= segsize)) {
+		/* Start a new segment */
+		segment_t *oldseg = seg;
+
+		seg = segment_create(msg->seq);
+		if (oldseg) {
+			oldseg->closed = 1;
+			segment_check(oldseg);
+		}
+		if (!seg) return;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = SPOOLMAGIC;
+	rec.len = msg->len;
+	rec.seq = msg->seq;
+	rec.tstamp = msg->tstamp;
+	rec.offset = seg->size;
+
+	if (!write_all(seg->datafd, STRBUF(msg->msgbuf), msg->len) || !write_all(seg->idxfd, &rec, sizeof(rec))) {
+		/* Disk full, probably. The message stays in memory only. */
+		time_t now = getcurrenttime(NULL);
+
+		if (now >= (lasterror + 60)) {
+			errprintf("Cannot write to spool segment %s: %s\n", spool_filename(seg->firstseq, "dat"), strerror(errno));
+			lasterror = now;
+		}
+		ftruncate(seg->datafd, seg->size);
+		ftruncate(seg->idxfd, seg->reccount * sizeof(spoolrec_t));
+		return;
+	}
+
+	msg->seg = seg;
+	msg->offset = seg->size;
+	seg->size += msg->len;
+	seg->reccount++;
+	seg->msgcount++;
+	spoolsize += msg->len;
+}
+
+void queue_append(msgqueue_t *msg)
+{
+	if (qtail) {
+		qtail->next = msg;
+		qtail = msg;
+	}
+	else {
+		qhead = qtail = msg;
+	}
+}
+
+void queue_remove(msgqueue_t *prev, msgqueue_t *msg)
+{
+	if (prev) prev->next = msg->next; else qhead = msg->next;
+	if (qtail == msg) qtail = prev;
+	if (spillhint == msg) spillhint = msg->next;
+
+	if (msg->msgbuf) {
+		memused -= msg->len;
+		freestrbuffer(msg->msgbuf);
+	}
+	if (msg->seg) {
+		msg->seg->msgcount--;
+		segment_check(msg->seg);
+	}
+	xfree(msg);
+}
+
+void enforce_memlimit(void)
+{
+	/* 
+	 * Keep the messages in memory below the limit. Messages which are
+	 * in the spool just have the memory copy dropped, the oldest first.
+	 * If that is not enough - e.g. because we have no spool - then the
+	 * oldest messages are dropped.
+	 */
+	static time_t lastreport = 0;
+	static int dropped = 0;
+	msgqueue_t *mwalk, *mprev, *zombie;
+	time_t now;
+
+	if ((maxmemory == 0) || (memused <= maxmemory)) return;
+
+	for (mwalk = (spillhint ? spillhint : qhead); (spooldir && mwalk && (memused > maxmemory)); mwalk = mwalk->next) {
+		if (mwalk->msgbuf && mwalk->seg) {
+			memused -= mwalk->len;
+			freestrbuffer(mwalk->msgbuf);
+			mwalk->msgbuf = NULL;
+		}
+		spillhint = mwalk->next;
+	}
+
+	mwalk = qhead; mprev = NULL;
+	while (mwalk && (memused > maxmemory)) {
+		if (mwalk->msgbuf) {
+			zombie = mwalk;
+			mwalk = mwalk->next;
+			queue_remove(mprev, zombie);
+			dropped++;
+		}
+		else {
+			mprev = mwalk;
+			mwalk = mwalk->next;
+		}
+	}
+
+	/* Dont flood the log when we are dropping messages all the time */
+	now = getcurrenttime(NULL);
+	if (dropped && (now >= (lastreport + 60))) {
+		errprintf("Memory limit of %lu kB reached, dropped %d messages\n", maxmemory/1024, dropped);
+		dropped = 0;
+		lastreport = now;
+	}
+}
+
+void enforce_spoollimit(void)
+{
+	/* Keep the spool below the limit by dropping the oldest segments */
+	segment_t *seg, *nextseg;
+	msgqueue_t *mwalk, *mprev, *zombie;
+	off_t excess = spoolsize - maxspool;
+	int dropped = 0;
+
+	for (seg = seghead; (seg && (seg != segtail) && (excess > 0)); seg = nextseg) {
+		nextseg = seg->next;
+		excess -= seg->size;
+		if (seg->msgcount == 0) continue;
+
+		mwalk = qhead; mprev = NULL;
+		while (mwalk && (seg->msgcount > 1)) {
+			if (mwalk->seg == seg) {
+				zombie = mwalk;
+				mwalk = mwalk->next;
+				queue_remove(mprev, zombie);
+				dropped++;
+			}
+			else {
+				mprev = mwalk;
+				mwalk = mwalk->next;
+			}
+		}
+
+		/* Removing the last message may also remove the segment */
+		for (; (mwalk && (mwalk->seg != seg)); mprev = mwalk, mwalk = mwalk->next) ;
+		if (mwalk) { queue_remove(mprev, mwalk); dropped++; }
+	}
+
+	if (dropped) errprintf("Spool limit of %lu MB reached, dropped %d messages\n", (unsigned long)(maxspool/(1024*1024)), dropped);
+}
+
+void save_delivered(void)
+{
+	/* 
+	 * Save how far each Xymon server has got through the queue: The
+	 * sequence number before the first message not delivered to it.
+	 * The file is replaced atomically, so after a crash we see either
+	 * the old or the new state. At worst some messages are sent twice.
+	 */
+	char fn[PATH_MAX], tmpfn[PATH_MAX];
+	unsigned long delivered[32];
+	unsigned long found = 0;
+	msgqueue_t *mwalk;
+	FILE *fd;
+	int i;
+
+	statedirty = 0;
+	if (!spooldir) return;
+
+	for (i = 0; (i < 32); i++) delivered[i] = msgseq;
+	for (mwalk = qhead; (mwalk && (found != knownids)); mwalk = mwalk->next) {
+		for (i = 0; (i < 32); i++) {
+			unsigned long bit = (1UL << i);
+
+			if ((knownids & bit) && !(found & bit) && !(mwalk->sentto & bit)) {
+				delivered[i] = mwalk->seq - 1;
+				found |= bit;
+			}
+		}
+	}
+
+	snprintf(fn, sizeof(fn), "%s/delivered", spooldir);
+	snprintf(tmpfn, sizeof(tmpfn), "%s/delivered.tmp", spooldir);
+	fd = fopen(tmpfn, "w");
+	if (!fd) {
+		errprintf("Cannot save delivery state to %s: %s\n", tmpfn, strerror(errno));
+		return;
+	}
+	fprintf(fd, "seq %lu\n", msgseq);
+	for (i = 0; (i < 32); i++) {
+		if (knownids & (1UL << i)) fprintf(fd, "%d %lu\n", i, delivered[i]);
+	}
+	if ((fflush(fd) != 0) || (fsync(fileno(fd)) != 0)) {
+		errprintf("Cannot save delivery state to %s: %s\n", tmpfn, strerror(errno));
+		fclose(fd);
+		unlink(tmpfn);
+		return;
+	}
+	fclose(fd);
+	if (rename(tmpfn, fn) == -1) errprintf("Cannot rename %s: %s\n", tmpfn, strerror(errno));
+}
+
+void load_delivered(void)
+{
+	char fn[PATH_MAX];
+	char l[100];
+	FILE *fd;
+	msgqueue_t *mwalk;
+	unsigned long seq;
+	int id;
+
+	snprintf(fn, sizeof(fn), "%s/delivered", spooldir);
+	fd = fopen(fn, "r");
+	if (!fd) return;
+
+	while (fgets(l, sizeof(l), fd)) {
+		if (sscanf(l, "seq %lu", &seq) == 1) {
+			if (seq > msgseq) msgseq = seq;
+		}
+		else if ((sscanf(l, "%d %lu", &id, &seq) == 2) && (id >= 0) && (id < 32)) {
+			unsigned long bit = (1UL << id);
+
+			knownids |= bit;
+			for (mwalk = qhead; (mwalk && (mwalk->seq <= seq)); mwalk = mwalk->next) mwalk->sentto |= bit;
+		}
+	}
+
+	fclose(fd);
+}
+
+int seq_compare(const void *v1, const void *v2)
+{
+	unsigned long s1 = *(unsigned long *)v1;
+	unsigned long s2 = *(unsigned long *)v2;
+
+	if (s1 < s2) return -1; else if (s1 > s2) return 1; else return 0;
+}
+
+void spool_loadsegment(unsigned long firstseq)
+{
+	segment_t *seg;
+	spoolrec_t recs[1024];
+	struct stat st;
+	int n, i, damaged = 0;
+
+	seg = (segment_t *)calloc(1, sizeof(segment_t));
+	seg->firstseq = firstseq;
+	seg->closed = 1;
+	seg->datafd = open(spool_filename(firstseq, "dat"), O_RDWR|O_APPEND);
+	seg->idxfd = open(spool_filename(firstseq, "idx"), O_RDWR|O_APPEND);
+	if ((seg->datafd == -1) || (seg->idxfd == -1) || (fstat(seg->datafd, &st) == -1)) {
+		errprintf("Cannot load spool segment %s: %s\n", spool_filename(firstseq, "idx"), strerror(errno));
+		if (seg->datafd != -1) close(seg->datafd);
+		if (seg->idxfd != -1) close(seg->idxfd);
+		xfree(seg);
+		return;
+	}
+	fcntl(seg->datafd, F_SETFD, FD_CLOEXEC);
+	fcntl(seg->idxfd, F_SETFD, FD_CLOEXEC);
+
+	while (!damaged && ((n = read(seg->idxfd, recs, sizeof(recs))) > 0)) {
+		for (i = 0; (!damaged && (i < (n / sizeof(spoolrec_t)))); i++) {
+			msgqueue_t *msg;
+
+			if ((recs[i].magic != SPOOLMAGIC) || (recs[i].offset != seg->size) ||
+			    ((seg->size + recs[i].len) > st.st_size) || (recs[i].seq <= msgseq)) {
+				damaged = 1;
+				continue;
+			}
+
+			msg = (msgqueue_t *)calloc(1, sizeof(msgqueue_t));
+			msg->seq = recs[i].seq;
+			msg->tstamp = recs[i].tstamp;
+			msg->len = recs[i].len;
+			msg->seg = seg;
+			msg->offset = seg->size;
+			queue_append(msg);
+
+			msgseq = msg->seq;
+			seg->size += msg->len;
+			seg->reccount++;
+			seg->msgcount++;
+		}
+		/* A partial record at the end is from a crash while it was written */
+		if ((n % sizeof(spoolrec_t)) != 0) damaged = 1;
+	}
+
+	/* Cut off anything after the last good message */
+	if (damaged || (st.st_size != seg->size)) {
+		errprintf("Spool segment %s was not complete, recovered %d messages\n",
+			  spool_filename(firstseq, "dat"), seg->reccount);
+		ftruncate(seg->datafd, seg->size);
+		ftruncate(seg->idxfd, seg->reccount * sizeof(spoolrec_t));
+	}
+
+	spoolsize += seg->size;
+	if (segtail) { segtail->next = seg; segtail = seg; } else seghead = segtail = seg;
+	segment_check(seg);
+}
+
+void spool_load(void)
+{
+	/* Load the messages in the spool left by a previous run */
+	DIR *dirfd;
+	struct dirent *d;
+	unsigned long *segseqs = NULL;
+	int segcount = 0, segalloc = 0, i;
+	msgqueue_t *mwalk;
+	int msgcount = 0;
+
+	if ((mkdir(spooldir, 0700) == -1) && (errno != EEXIST)) {
+		errprintf("Cannot create spool directory %s: %s\n", spooldir, strerror(errno));
+		spooldir = NULL;
+		return;
+	}
+
+	dirfd = opendir(spooldir);
+	if (!dirfd) {
+		errprintf("Cannot read spool directory %s: %s\n", spooldir, strerror(errno));
+		spooldir = NULL;
+		return;
+	}
+
+	while ((d = readdir(dirfd)) != NULL) {
+		if ((strlen(d->d_name) != 20) || (strcmp(d->d_name+16, ".idx") != 0)) continue;
+
+		if (segcount == segalloc) {
+			segalloc += 100;
+			segseqs = (unsigned long *)realloc(segseqs, segalloc * sizeof(unsigned long));
+		}
+		segseqs[segcount++] = strtoul(d->d_name, NULL, 10);
+	}
+	closedir(dirfd);
+
+	qsort(segseqs, segcount, sizeof(unsigned long), seq_compare);
+	for (i = 0; (i < segcount); i++) spool_loadsegment(segseqs[i]);
+	if (segseqs) xfree(segseqs);
+
+	load_delivered();
+
+	for (mwalk = qhead; (mwalk); mwalk = mwalk->next) msgcount++;
+	errprintf("Loaded %d messages (%lu kB) from spool %s\n", msgcount, (unsigned long)(spoolsize/1024), spooldir);
+}
+
+void add_output(conn_t *conn, char *data, int len)
+{
+	/* Queue data to send from memory. It is added to the last chunk, if that is in memory. */
+	outchunk_t *chunk = conn->outtail;
+
+	if (len <= 0) return;
+
+	if (!chunk || !chunk->buf) {
+		chunk = (outchunk_t *)calloc(1, sizeof(outchunk_t));
+		chunk->buf = newstrbuffer(0);
+		if (conn->outtail) { conn->outtail->next = chunk; conn->outtail = chunk; }
+		else conn->outhead = conn->outtail = chunk;
+	}
+
+	addtobufferraw(chunk->buf, data, len);
+	chunk->len += len;
+}
+
+void add_spooloutput(conn_t *conn, segment_t *seg, off_t offset, int len)
+{
+	/* Queue data to send from the spool. Adjacent messages in a segment go in one chunk. */
+	outchunk_t *chunk = conn->outtail;
+
+	if (chunk && (chunk->seg == seg) && ((chunk->offset + chunk->len) == offset)) {
+		chunk->len += len;
+		return;
+	}
+
+	chunk = (outchunk_t *)calloc(1, sizeof(outchunk_t));
+	chunk->seg = seg;
+	chunk->offset = offset;
+	chunk->len = len;
+	seg->sendcount++;
+	if (conn->outtail) { conn->outtail->next = chunk; conn->outtail = chunk; }
+	else conn->outhead = conn->outtail = chunk;
+}
+
+void free_chunk(outchunk_t *chunk)
+{
+	if (chunk->buf) freestrbuffer(chunk->buf);
+	if (chunk->seg) {
+		chunk->seg->sendcount--;
+		segment_check(chunk->seg);
+	}
+	xfree(chunk);
+}
+
+void free_output(conn_t *conn)
+{
+	outchunk_t *zombie;
+
+	while (conn->outhead) {
+		zombie = conn->outhead;
+		conn->outhead = zombie->next;
+		free_chunk(zombie);
+	}
+	conn->outtail = NULL;
+}
+
+int select_messages(int pollid, unsigned long afterseq, int maxsize, strbuffer_t *idxbuf, unsigned long *lastseq, int *backlog)
+{
+	/* 
+	 * Build the index line for the messages after AFTERSEQ not yet
+	 * delivered to POLLID, up to MAXSIZE bytes (0 = no limit). Returns
+	 * the size of the message data.
+	 */
+	time_t now = getcurrenttime(NULL);
+	msgqueue_t *mwalk;
+	int datalen = 0, full = 0;
+	char idx[100];
+
+	*lastseq = afterseq;
+	*backlog = 0;
+
+	for (mwalk = qhead; (mwalk); mwalk = mwalk->next) {
+		if ((mwalk->seq <= afterseq) || (mwalk->sentto & pollid)) continue;
+
+		if (full || ((maxsize > 0) && (datalen > 0) && ((datalen + mwalk->len) > maxsize))) {
+			full = 1;
+			(*backlog)++;
+			continue;
+		}
+
+		sprintf(idx, "%d:%ld ", mwalk->len, (long)(now - mwalk->tstamp));
+		addtobuffer(idxbuf, idx);
+		datalen += mwalk->len;
+		*lastseq = mwalk->seq;
+	}
+	if (STRBUFLEN(idxbuf) > 0) addtobuffer(idxbuf, "\n");
+
+	return datalen;
+}
+
+void queue_messages(conn_t *conn, int pollid, unsigned long afterseq, unsigned long lastseq, int marksent)
+{
+	/* 
+	 * Queue the data of the messages picked by select_messages() for sending.
+	 * Messages we have in memory are copied to the output; the others are
+	 * sent directly from the spool.
+	 */
+	msgqueue_t *mwalk;
+
+	for (mwalk = qhead; (mwalk && (mwalk->seq <= lastseq)); mwalk = mwalk->next) {
+		if ((mwalk->seq <= afterseq) || (mwalk->sentto & pollid)) continue;
+
+		if (mwalk->msgbuf) add_output(conn, STRBUF(mwalk->msgbuf), mwalk->len);
+		else add_spooloutput(conn, mwalk->seg, mwalk->offset, mwalk->len);
+
+		if (marksent) mwalk->sentto |= (pollid ? pollid : DELIVERED_NOID);
+	}
+
+	if (marksent) {
+		knownids |= (pollid ? pollid : DELIVERED_NOID);
+		statedirty = 1;
+	}
+}
+
+int get_pollid(char *idstr)
+{
+	/* 
+	 * The pollid is unique for each Xymon server. It is to allow
+	 * multiple servers to pick up the same message, for resiliance.
+	 */
+	int idnum = atoi(idstr);
+
+	if ((idnum <= 0) || (idnum > 31)) return 0;
+
+	return (1 << idnum);
+}
+
+void consume_input(conn_t *conn, int count)
+{
+	/* Drop COUNT bytes from the start of the input buffer */
+	int len = STRBUFLEN(conn->msgbuf);
+
+	if (count > len) count = len;
+	memmove(STRBUF(conn->msgbuf), STRBUF(conn->msgbuf) + count, len - count);
+	strbufferchop(conn->msgbuf, count);
+}
+
+void session_ack(conn_t *conn, unsigned long seq)
+{
+	/* xymonfetch has delivered the messages up to SEQ to the Xymon server */
+	msgqueue_t *mwalk;
+	int markid = (conn->pollid ? conn->pollid : DELIVERED_NOID);
+
+	if (seq > conn->sentseq) seq = conn->sentseq;
+	if (seq <= conn->ackedseq) return;
+
+	dbgprintf("Session acknowledged messages %lu-%lu\n", conn->ackedseq+1, seq);
+	for (mwalk = qhead; (mwalk && (mwalk->seq <= seq)); mwalk = mwalk->next) {
+		if (mwalk->seq > conn->ackedseq) mwalk->sentto |= markid;
+	}
+	conn->ackedseq = seq;
+	knownids |= markid;
+	statedirty = 1;
+}
+
+void session_batch(conn_t *conn)
+{
+	/* 
+	 * Send the next batch of messages over a session. The batch has a
+	 * header line with the sequence number of the last message in it,
+	 * the number of messages we hold back for the next batch, and the
+	 * size of the data. The data is in the same format as the response
+	 * to a plain "pullclient" request. Messages are not marked as sent
+	 * to this server until they have been acknowledged, so if the session
+	 * is lost they are sent again in the next session.
+	 */
+	strbuffer_t *idxbuf = newstrbuffer(0);
+	unsigned long firstseq = conn->sentseq, lastseq;
+	int datalen, backlog;
+	char line[100];
+
+	datalen = select_messages(conn->pollid, firstseq, BATCH_MAXSIZE, idxbuf, &lastseq, &backlog);
+
+	sprintf(line, "batch %lu %d %d\n", lastseq, backlog, STRBUFLEN(idxbuf) + datalen);
+	add_output(conn, line, strlen(line));
+	add_output(conn, STRBUF(idxbuf), STRBUFLEN(idxbuf));
+	freestrbuffer(idxbuf);
+	queue_messages(conn, conn->pollid, firstseq, lastseq, 0);
+
+	dbgprintf("Session batch: Messages %lu-%lu, %d bytes, %d held back\n", firstseq+1, lastseq, datalen, backlog);
+	conn->sentseq = lastseq;
+	conn->action = C_WRITING;
+}
+
+void session_request(conn_t *conn)
+{
+	/* 
+	 * Handle requests from xymonfetch on a session:
+	 *    fetch ACKSEQ CFGLENGTH\n<client configuration>
+	 *    ack ACKSEQ\n
+	 * A "fetch" gets the next batch of messages in response, "ack" has no response.
+	 */
+	char *eoln;
+	unsigned long seq;
+	int hdrlen, cfglen;
+
+	while (STRBUFLEN(conn->msgbuf) > 0) {
+		eoln = memchr(STRBUF(conn->msgbuf), '\n', STRBUFLEN(conn->msgbuf));
+		if (!eoln) return;	/* Need more data */
+		hdrlen = (eoln - STRBUF(conn->msgbuf)) + 1;
+
+		if (sscanf(STRBUF(conn->msgbuf), "ack %lu", &seq) == 1) {
+			session_ack(conn, seq);
+			consume_input(conn, hdrlen);
+		}
+		else if ((sscanf(STRBUF(conn->msgbuf), "fetch %lu %d", &seq, &cfglen) == 2) &&
+			 (cfglen >= 0) && (cfglen <= MAX_XYMON_INBUFSZ)) {
+			if (cfglen > (STRBUFLEN(conn->msgbuf) - hdrlen)) return;	/* Need more data */
+
+			session_ack(conn, seq);
+			if (cfglen > 0) {
+				/* Save the client config sent to us */
+				if (client_response) xfree(client_response);
+				client_response = (char *)malloc(cfglen + 1);
+				if (!client_response) {
+					errprintf("Out of memory for client configuration from %s\n", inet_ntoa(conn->caddr.sin_addr));
+					conn->action = C_DONE;
+					return;
+				}
+				memcpy(client_response, STRBUF(conn->msgbuf) + hdrlen, cfglen);
+				*(client_response + cfglen) = '\0';
+				dbgprintf("Saved client response: %s\n", client_response);
+			}
+
+			/* xymonfetch waits for our response before it sends anything else */
+			clearstrbuffer(conn->msgbuf);
+			session_batch(conn);
+			return;
+		}
+		else {
+			errprintf("Garbled session request from %s\n", inet_ntoa(conn->caddr.sin_addr));
+			conn->action = C_DONE;
+			return;
+		}
+	}
+}
+
+int session_start(conn_t *conn)
+{
+	/* See if this is a "pullclient N session" request. Returns 1 if a session was started. */
+	char *eoln, *p;
+
+	if ((STRBUFLEN(conn->msgbuf) < 10) || (strncmp(STRBUF(conn->msgbuf), "pullclient", 10) != 0)) return 0;
+
+	eoln = memchr(STRBUF(conn->msgbuf), '\n', STRBUFLEN(conn->msgbuf));
+	if (!eoln) return 0;
+
+	*eoln = '\0';
+	p = strstr(STRBUF(conn->msgbuf), " session");
+	*eoln = '\n';
+	if (!p || (p > eoln)) return 0;
+
+	/* Access check */
+	if (!oksender(serverlist, NULL, conn->caddr.sin_addr, STRBUF(conn->msgbuf))) {
+		errprintf("Rejected pullclient session from %s\n", inet_ntoa(conn->caddr.sin_addr));
+		conn->action = C_DONE;
+		return 1;
+	}
+
+	dbgprintf("Got pullclient session request from %s\n", inet_ntoa(conn->caddr.sin_addr));
+	conn->session = 1;
+	conn->ctype = C_SERVER;
+	conn->pollid = get_pollid(STRBUF(conn->msgbuf) + 10);
+	conn->sentseq = conn->ackedseq = 0;
+
+	clearstrbuffer(conn->msgbuf);
+	add_output(conn, "session ok\n", 11);
+	conn->action = C_WRITING;
+
+	return 1;
+}
+
 void grabdata(conn_t *conn)
 {
 	int n;
@@ -106,9 +880,19 @@ void grabdata(conn_t *conn)
 	}
 
 	if (n > 0) {
-		/* Got some data - store it */
+		/* Got some data - store it. It may be compressed, so dont rely on strlen() */
 		buf[n] = '\0';
-		addtobuffer(conn->msgbuf, buf);
+		addtobufferraw(conn->msgbuf, buf, n);
+
+		/* Sessions do not wait for the end of data */
+		if (conn->session) session_request(conn); else session_start(conn);
+		return;
+	}
+
+	if (conn->session) {
+		/* xymonfetch has closed the session */
+		dbgprintf("Session closed by %s\n", inet_ntoa(conn->caddr.sin_addr));
+		conn->action = C_DONE;
 		return;
 	}
 
@@ -127,7 +911,6 @@ void grabdata(conn_t *conn)
 
 	if (strncmp(STRBUF(conn->msgbuf), "pullclient", 10) == 0) {
 		char *clientcfg;
-		int idnum;
 
 		/* Access check */
 		if (!oksender(serverlist, NULL, conn->caddr.sin_addr, STRBUF(conn->msgbuf))) {
@@ -139,17 +922,7 @@ void grabdata(conn_t *conn)
 
 		dbgprintf("Got pullclient request: %s\n", STRBUF(conn->msgbuf));
 
-		/*
-		 * The pollid is unique for each Xymon server. It is to allow
-		 * multiple servers to pick up the same message, for resiliance.
-		 */
-		idnum = atoi(STRBUF(conn->msgbuf) + 10);
-		if ((idnum <= 0) || (idnum > 31)) {
-			pollid = 0;
-		}
-		else {
-			pollid = (1 << idnum);
-		}
+		pollid = get_pollid(STRBUF(conn->msgbuf) + 10);
 
 		conn->ctype = C_SERVER;
 		conn->action = C_WRITING;
@@ -163,7 +936,8 @@ void grabdata(conn_t *conn)
 			dbgprintf("Saved client response: %s\n", client_response);
 		}
 	}
-	else if (strncmp(STRBUF(conn->msgbuf), "client ", 7) == 0) {
+	else if ((strncmp(STRBUF(conn->msgbuf), "client ", 7) == 0) ||
+		 (strcmp(compressed_type(STRBUF(conn->msgbuf)), "client") == 0)) {
 		/*
 		 * Got a "client" message. Return the client-response saved from
 		 * earlier, if there is any. If not, then we're done.
@@ -177,7 +951,7 @@ void grabdata(conn_t *conn)
 		conn->action = C_DONE;
 	}
 
-	/*
+	/* 
 	 * Messages we receive from clients are stored on our outbound queue.
 	 * If it's a local "client" message, respond with the queued response
 	 * from the Xymon server. Other client messages get no response.
@@ -188,21 +962,21 @@ void grabdata(conn_t *conn)
 		/* Messages from clients go on the outbound queue */
 		msgqueue_t *newq = calloc(1, sizeof(msgqueue_t));
 		dbgprintf("Queuing outbound message\n");
+		newq->seq = ++msgseq;
 		newq->tstamp = conn->tstamp;
 		newq->msgbuf = conn->msgbuf;
+		newq->len = STRBUFLEN(newq->msgbuf);
 		conn->msgbuf = NULL;
-		if (qtail) {
-			qtail->next = newq;
-			qtail = newq;
-		}
-		else {
-			qhead = qtail = newq;
-		}
+		spool_append(newq);
+		memused += newq->len;
+		queue_append(newq);
+
+		enforce_memlimit();
+		if (spooldir && (spoolsize > maxspool)) enforce_spoollimit();
 
 		if ((conn->ctype == C_CLIENT_CLIENT) && (conn->action == C_WRITING)) {
 			/* Send the response back to the client */
-			conn->msgbuf = newstrbuffer(0);
-			addtobuffer(conn->msgbuf, client_response);
+			add_output(conn, client_response, strlen(client_response));
 
 			/* 
 			 * Dont drop the client response data. If for some reason
@@ -213,63 +987,81 @@ void grabdata(conn_t *conn)
 	}
 	else {
 		/* A server has asked us for our list of messages */
-		time_t now = getcurrenttime(NULL);
-		msgqueue_t *mwalk;
+		strbuffer_t *idxbuf = newstrbuffer(0);
+		unsigned long lastseq;
+		int backlog;
 
-		if (!qhead) {
-			/* No queued messages */
+		/*
+		 * Index line first, then the stream of messages. Only as much as
+		 * a session batch, so a large spool is not sent in one go; the
+		 * messages not marked as sent are picked up by the next poll.
+		 */
+		select_messages(pollid, 0, BATCH_MAXSIZE, idxbuf, &lastseq, &backlog);
+		if (STRBUFLEN(idxbuf) == 0) {
+			/* No data for this server */
 			conn->action = C_DONE;
 		}
 		else {
-			/* Build a message of all the queued data */
-			clearstrbuffer(conn->msgbuf);
+			add_output(conn, STRBUF(idxbuf), STRBUFLEN(idxbuf));
+			queue_messages(conn, pollid, 0, lastseq, 1);
+		}
+		freestrbuffer(idxbuf);
+	}
+}
 
-			/* Index line first */
-			for (mwalk = qhead; (mwalk); mwalk = mwalk->next) {
-				if ((mwalk->sentto & pollid) == 0) {
-					char idx[20];
-					sprintf(idx, "%d:%ld ", 
-						STRBUFLEN(mwalk->msgbuf), (long)(now - mwalk->tstamp));
-					addtobuffer(conn->msgbuf, idx);
-				}
-			}
+void senddata(conn_t *conn)
+{
+	outchunk_t *chunk;
+	ssize_t n;
 
-			if (STRBUFLEN(conn->msgbuf) > 0) addtobuffer(conn->msgbuf, "\n");
+	/* Send data on the connection socket, until it is all gone or the socket is full */
+	while ((chunk = conn->outhead) != NULL) {
+		if (chunk->buf) {
+			n = write(conn->sockfd, STRBUF(chunk->buf) + chunk->sent, chunk->len - chunk->sent);
+		}
+		else {
+#ifdef USE_SENDFILE
+			off_t offset = chunk->offset + chunk->sent;
 
-			/* Then the stream of messages */
-			for (mwalk = qhead; (mwalk); mwalk = mwalk->next) {
-				if ((mwalk->sentto & pollid) == 0) {
-					if (pollid) mwalk->sentto |= pollid;
-					addtostrbuffer(conn->msgbuf, mwalk->msgbuf);
-				}
-			}
+			n = sendfile(conn->sockfd, chunk->seg->datafd, &offset, chunk->len - chunk->sent);
+#else
+			char buf[65536];
+			size_t togo = chunk->len - chunk->sent;
 
-			if (STRBUFLEN(conn->msgbuf) == 0) {
-				/* No data for this server */
+			if (togo > sizeof(buf)) togo = sizeof(buf);
+			n = pread(chunk->seg->datafd, buf, togo, chunk->offset + chunk->sent);
+			if (n > 0) n = write(conn->sockfd, buf, n);
+#endif
+			if (n == 0) {
+				errprintf("Spool segment %s is truncated\n", spool_filename(chunk->seg->firstseq, "dat"));
 				conn->action = C_DONE;
+				return;
 			}
 		}
-	}
-}
 
-void senddata(conn_t *conn)
-{
-	int n, togo;
-	char *startp;
+		if (n <= -1) {
+			if ((errno == EAGAIN) || (errno == EINTR)) return;
 
-	/* Send data on the connection socket */
-	togo = STRBUFLEN(conn->msgbuf) - conn->sentbytes;
-	startp = STRBUF(conn->msgbuf) + conn->sentbytes;
-	n = write(conn->sockfd, startp, togo);
+			/* Write failure */
+			errprintf("Connection lost during write to %s\n", inet_ntoa(conn->caddr.sin_addr));
+			conn->action = C_DONE;
+			return;
+		}
 
-	if (n <= -1) {
-		/* Write failure */
-		errprintf("Connection lost during write to %s\n", inet_ntoa(conn->caddr.sin_addr));
-		conn->action = C_DONE;
+		chunk->sent += n;
+		if (chunk->sent < chunk->len) return;
+
+		conn->outhead = chunk->next;
+		if (!conn->outhead) conn->outtail = NULL;
+		free_chunk(chunk);
+	}
+
+	if (conn->session) {
+		/* Wait for the next request on the session */
+		conn->action = C_READING;
 	}
 	else {
-		conn->sentbytes += n;
-		if (conn->sentbytes == STRBUFLEN(conn->msgbuf)) conn->action = C_DONE;
+		conn->action = C_DONE;
 	}
 }
 
@@ -283,6 +1075,7 @@ int main(int argc, char *argv[])
 	struct sockaddr_in laddr;
 	struct sigaction sa;
 	int opt;
+	time_t lastexpire = 0, lastsave = 0;
 
 	/* Dont save the output from errprintf() */
 	save_errbuf = 0;
@@ -318,6 +1111,26 @@ int main(int argc, char *argv[])
 			char *p = strchr(argv[opt], '=');
 			maxage = atoi(p+1);
 		}
+		else if (argnmatch(argv[opt], "--spool=")) {
+			char *p = strchr(argv[opt], '=');
+			spooldir = strdup(p+1);
+		}
+		else if (argnmatch(argv[opt], "--max-memory=")) {
+			char *p = strchr(argv[opt], '=');
+			maxmemory = atol(p+1) * 1024 * 1024;
+		}
+		else if (argnmatch(argv[opt], "--max-spool=")) {
+			char *p = strchr(argv[opt], '=');
+			maxspool = (off_t)atol(p+1) * 1024 * 1024;
+		}
+		else if (argnmatch(argv[opt], "--segment-size=")) {
+			char *p = strchr(argv[opt], '=');
+			segsize = (off_t)atol(p+1) * 1024 * 1024;
+		}
+		else if (argnmatch(argv[opt], "--spool-max-age=")) {
+			char *p = strchr(argv[opt], '=');
+			spoolmaxage = atoi(p+1);
+		}
 		else if (argnmatch(argv[opt], "--lqueue=")) {
 			char *p = strchr(argv[opt], '=');
 			listenq = atoi(p+1);
@@ -345,6 +1158,11 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* The spool must hold a few segments, or we drop messages all the time */
+	if (segsize < 1024*1024) segsize = 1024*1024;
+	if (maxspool < 4*segsize) maxspool = 4*segsize;
+	if (spoolmaxage < maxage) spoolmaxage = maxage;
+
 	/* Set up a socket to listen for new connections */
 	lsocket = socket(AF_INET, SOCK_STREAM, 0);
 	if (lsocket == -1) {
@@ -373,6 +1191,8 @@ int main(int argc, char *argv[])
 	errprintf("Xymon msgcache version %s starting\n", VERSION);
 	errprintf("Listening on %s:%d\n", inet_ntoa(laddr.sin_addr), ntohs(laddr.sin_port));
 
+	if (spooldir) spool_load();
+
 	if (daemonize) {
 		pid_t childpid;
 
@@ -403,6 +1223,7 @@ int main(int argc, char *argv[])
 	sa.sa_handler = sigmisc_handler;
 	sigaction(SIGHUP, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
 
 	do {
 		fd_set fdread, fdwrite;
@@ -410,7 +1231,8 @@ int main(int argc, char *argv[])
 		int n;
 		conn_t *cwalk, *cprev;
 		msgqueue_t *qwalk, *qprev;
-		time_t mintstamp;
+		time_t now;
+		struct timeval tmo;
 
 		/* Remove any finished connections */
 		cwalk = chead; cprev = NULL;
@@ -438,41 +1260,53 @@ int main(int argc, char *argv[])
 			}
 
 			freestrbuffer(zombie->msgbuf);
+			free_output(zombie);
 			xfree(zombie);
 		}
 		ctail = chead;
 		if (ctail) { while (ctail->next) ctail = ctail->next; }
 
 
-		/* Remove expired messages */
-		qwalk = qhead; qprev = NULL;
-		mintstamp = getcurrenttime(NULL) - maxage;
-		while (qwalk) {
-			msgqueue_t *zombie;
+		/*
+		 * Remove expired messages. Without a spool, messages are kept for
+		 * max-age seconds. With a spool, messages which have not been
+		 * delivered to any server are kept for spool-max-age seconds.
+		 */
+		now = getcurrenttime(NULL);
+		if (now != lastexpire) {
+			time_t mintstamp = now - maxage;
+			time_t minspooltstamp = now - spoolmaxage;
+
+			qwalk = qhead; qprev = NULL;
+			while (qwalk) {
+				msgqueue_t *zombie;
+				int expired;
+
+				if (spooldir)
+					expired = (((qwalk->tstamp <= mintstamp) && qwalk->sentto) || (qwalk->tstamp <= minspooltstamp));
+				else
+					expired = (qwalk->tstamp <= mintstamp);
+
+				if (!expired) {
+					/* Hasn't expired yet */
+					qprev = qwalk;
+					qwalk = qwalk->next;
+					continue;
+				}
 
-			if (qwalk->tstamp > mintstamp) {
-				/* Hasn't expired yet */
-				qprev = qwalk;
+				zombie = qwalk;
 				qwalk = qwalk->next;
-				continue;
+				queue_remove(qprev, zombie);
 			}
 
-			zombie = qwalk;
-			if (qprev == NULL) {
-				qhead = zombie->next;
-				qwalk = qhead;
-				qprev = NULL;
-			}
-			else {
-				qprev->next = zombie->next;
-				qwalk = zombie->next;
-			}
+			lastexpire = now;
+		}
 
-			freestrbuffer(zombie->msgbuf);
-			xfree(zombie);
+		/* Save the delivery state, at most once a second */
+		if (statedirty && (now != lastsave)) {
+			save_delivered();
+			lastsave = now;
 		}
-		qtail = qhead;
-		if (qtail) { while (qtail->next) qtail = qtail->next; }
 
 
 		/* Now we're ready to handle some data */
@@ -500,7 +1334,9 @@ int main(int argc, char *argv[])
 			}
 		}
 
-		n = select(maxfd+1, &fdread, &fdwrite, NULL, NULL);
+		/* Wake up in time to save the delivery state, if it has changed */
+		tmo.tv_sec = 1; tmo.tv_usec = 0;
+		n = select(maxfd+1, &fdread, &fdwrite, NULL, (statedirty ? &tmo : NULL));
 
 		if (n < 0) {
 			if (errno == EINTR) continue;
@@ -556,6 +1392,7 @@ int main(int argc, char *argv[])
 
 	} while (keeprunning);
 
+	if (statedirty) save_delivered();
 	if (pidfile) unlink(pidfile);
 	return 0;
 }
@@ -11,6 +11,15 @@
 #
 # $Id: xymonclient-linux.sh 6712 2011-07-31 21:01:52Z storner $
 
+# The native collector reads /proc directly and produces the same
+# output as the commands below, without forking a dozen processes.
+# The [top] section at the end is run for both.
+# Set XYMONNATIVECLIENT="no" in xymonclient.cfg to use the script.
+if test "$XYMONNATIVECLIENT" != "no" -a -x "$XYMONHOME/bin/linux-collector"
+then
+	$XYMONHOME/bin/linux-collector
+else
+
 echo "[date]"
 date
 echo "[uname]"
@@ -70,6 +79,13 @@ if test -r /proc/mdstat; then echo "[mdstat]"; cat /proc/mdstat; fi
 echo "[ps]"
 ps -Aww -o pid,ppid,user,start,state,pri,pcpu,time,pmem,rsz,vsz,cmd
 
+# vmstat
+nohup sh -c "vmstat 300 2 1>$XYMONTMP/xymon_vmstat.$MACHINEDOTS.$$ 2>&1; mv $XYMONTMP/xymon_vmstat.$MACHINEDOTS.$$ $XYMONTMP/xymon_vmstat.$MACHINEDOTS" </dev/null >/dev/null 2>&1 &
+sleep 5
+if test -f $XYMONTMP/xymon_vmstat.$MACHINEDOTS; then echo "[vmstat]"; cat $XYMONTMP/xymon_vmstat.$MACHINEDOTS; rm -f $XYMONTMP/xymon_vmstat.$MACHINEDOTS; fi
+
+fi
+
 # $TOP must be set, the install utility should do that for us if it exists.
 if test "$TOP" != ""
 then
@@ -80,10 +96,5 @@ then
     fi
 fi
 
-# vmstat
-nohup sh -c "vmstat 300 2 1>$XYMONTMP/xymon_vmstat.$MACHINEDOTS.$$ 2>&1; mv $XYMONTMP/xymon_vmstat.$MACHINEDOTS.$$ $XYMONTMP/xymon_vmstat.$MACHINEDOTS" </dev/null >/dev/null 2>&1 &
-sleep 5
-if test -f $XYMONTMP/xymon_vmstat.$MACHINEDOTS; then echo "[vmstat]"; cat $XYMONTMP/xymon_vmstat.$MACHINEDOTS; rm -f $XYMONTMP/xymon_vmstat.$MACHINEDOTS; fi
-
 exit
 
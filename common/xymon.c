@@ -149,6 +149,7 @@ int main(int argc, char *argv[])
 	else if (strncmp(STRBUF(msg), "pullclient", 10) == 0) wantresponse = 1;
 	else if (strncmp(STRBUF(msg), "ghostlist", 9) == 0) wantresponse = 1;
 	else if (strncmp(STRBUF(msg), "multisrclist", 12) == 0) wantresponse = 1;
+	else if (strncmp(STRBUF(msg), "xymondstats", 11) == 0) wantresponse = 1;
 
 	sres = newsendreturnbuf(wantresponse, respfd);
 	result = sendmessage(STRBUF(msg), recipient, timeout, sres);
@@ -0,0 +1,201 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon monitor library.                                                     */
+/*                                                                            */
+/* This is a library module, part of libxymon.                                */
+/* It contains routines for compressing and uncompressing Xymon messages.     */
+/*                                                                            */
+/* A compressed message is sent as a one-line header followed by the          */
+/* compressed data:                                                           */
+/*                                                                            */
+/*    compress ALGORITHM TYPE ORIGINALSIZE COMPRESSEDSIZE\n<data>             */
+/*                                                                            */
+/* TYPE is the first word of the original message ("status", "client" ...),   */
+/* so a proxy can route the message without uncompressing it. Any data        */
+/* following the compressed block is plain text that a proxy has added; it   */
+/* is appended to the message after uncompressing it.                         */
+/*                                                                            */
+/* Copyright (C) 2002-2011 Henrik Storner <henrik@hswn.dk>                    */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+static char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "libxymon.h"
+
+int compression_enabled(void)
+{
+	static int enabled = -1;
+
+	if (enabled == -1) {
+		char *algo = getenv("XYMONCOMPRESS");
+
+		enabled = 0;
+		if (algo && *algo && (strcmp(algo, "none") != 0)) {
+#ifdef HAVE_ZLIB
+			if (strcmp(algo, "zlib") == 0)
+				enabled = 1;
+			else
+				errprintf("Unsupported compression method '%s', sending uncompressed\n", algo);
+#else
+			errprintf("Compression requested, but zlib support is not compiled in\n");
+#endif
+		}
+	}
+
+	return enabled;
+}
+
+char *compress_message(char *msg, size_t msglen, size_t *outlen)
+{
+#ifdef HAVE_ZLIB
+	static size_t minsize = 0;
+	char msgtype[20];
+	int typelen;
+	char *data, *result;
+	uLongf datalen;
+	int hdrlen, n;
+
+	if (!compression_enabled()) return NULL;
+
+	if (minsize == 0) {
+		char *p = getenv("XYMONCOMPRESSMIN");
+
+		minsize = (p ? atol(p) : COMPRESS_MINSIZE);
+		if (minsize <= 0) minsize = 1;
+	}
+	if (msglen < minsize) return NULL;
+
+	/* Never compress twice */
+	if (iscompressed(msg)) return NULL;
+
+	typelen = strspn(msg, "abcdefghijklmnopqrstuvwxyz");
+	if ((typelen == 0) || (typelen >= sizeof(msgtype))) return NULL;
+	strncpy(msgtype, msg, typelen); msgtype[typelen] = '\0';
+
+	datalen = compressBound(msglen);
+	data = (char *)malloc(datalen);
+	n = compress2((Bytef *)data, &datalen, (Bytef *)msg, msglen, Z_DEFAULT_COMPRESSION);
+	if ((n != Z_OK) || (datalen >= msglen)) {
+		/* Failed, or not worth it */
+		xfree(data);
+		return NULL;
+	}
+
+	result = (char *)malloc(datalen + 100);
+	hdrlen = sprintf(result, "%szlib %s %lu %lu\n", 
+			 COMPRESS_MARKER, msgtype, (unsigned long)msglen, (unsigned long)datalen);
+	memcpy(result + hdrlen, data, datalen);
+	xfree(data);
+
+	dbgprintf("Compressed %s message from %lu to %lu bytes\n", 
+		  msgtype, (unsigned long)msglen, (unsigned long)(hdrlen + datalen));
+	*outlen = hdrlen + datalen;
+	return result;
+#else
+	return NULL;
+#endif
+}
+
+char *uncompress_message(char *buf, size_t buflen, size_t maxlen, size_t *outlen)
+{
+	char algo[20], msgtype[20];
+	unsigned long origlen, complen;
+	char *data, *result;
+	size_t hdrlen, traillen;
+
+	*outlen = 0;
+	if (!iscompressed(buf)) return NULL;
+
+	data = memchr(buf, '\n', buflen);
+	if (!data) {
+		errprintf("Compressed message without a header\n");
+		return NULL;
+	}
+	data++;
+	hdrlen = (data - buf);
+
+	if (sscanf(buf + strlen(COMPRESS_MARKER), "%19s %19s %lu %lu", algo, msgtype, &origlen, &complen) != 4) {
+		errprintf("Malformed compressed message header\n");
+		return NULL;
+	}
+
+	/* The sizes come from the network, so check them without overflowing */
+	if (complen > (buflen - hdrlen)) {
+		errprintf("Truncated compressed %s message, expected %lu bytes got %lu\n", 
+			  msgtype, complen, (unsigned long)(buflen - hdrlen));
+		return NULL;
+	}
+	traillen = buflen - hdrlen - complen;
+
+	if ((origlen == 0) || (origlen > MAX_XYMON_INBUFSZ) || (traillen > (MAX_XYMON_INBUFSZ - origlen)) ||
+	    ((maxlen > 0) && ((origlen > maxlen) || (traillen > (maxlen - origlen))))) {
+		errprintf("Compressed %s message has bad size (%lu bytes uncompressed)\n", msgtype, origlen);
+		return NULL;
+	}
+
+#ifdef HAVE_ZLIB
+	if (strcmp(algo, "zlib") == 0) {
+		uLongf datalen = origlen;
+		int n;
+
+		result = (char *)malloc(origlen + traillen + 1);
+		if (!result) {
+			errprintf("Cannot uncompress %s message: Out of memory\n", msgtype);
+			return NULL;
+		}
+		n = uncompress((Bytef *)result, &datalen, (Bytef *)data, complen);
+		if ((n != Z_OK) || (datalen != origlen)) {
+			errprintf("Cannot uncompress %s message: zlib error %d\n", msgtype, n);
+			xfree(result);
+			return NULL;
+		}
+
+		if (traillen) memcpy(result + origlen, data + complen, traillen);
+		*(result + origlen + traillen) = '\0';
+		*outlen = origlen + traillen;
+		return result;
+	}
+#endif
+
+	errprintf("Cannot uncompress %s message: Compression method '%s' not supported\n", msgtype, algo);
+	return NULL;
+}
+
+int iscompressed(char *msg)
+{
+	return (strncmp(msg, COMPRESS_MARKER, strlen(COMPRESS_MARKER)) == 0);
+}
+
+char *compressed_type(char *msg)
+{
+	/* Returns the type of the original message, e.g. "status" */
+	static char msgtype[20];
+	char *p;
+	int n;
+
+	*msgtype = '\0';
+	if (!iscompressed(msg)) return msgtype;
+
+	p = msg + strlen(COMPRESS_MARKER);
+	p += strcspn(p, " \n");		/* Skip the algorithm */
+	if (*p != ' ') return msgtype;
+	p++;
+	n = strspn(p, "abcdefghijklmnopqrstuvwxyz");
+	if (n >= sizeof(msgtype)) n = sizeof(msgtype) - 1;
+	strncpy(msgtype, p, n); msgtype[n] = '\0';
+
+	return msgtype;
+}
+
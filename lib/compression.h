@@ -0,0 +1,31 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon monitor library.                                                     */
+/*                                                                            */
+/* This is used to implement compressed transport of Xymon messages.          */
+/*                                                                            */
+/* Copyright (C) 2002-2011 Henrik Storner <henrik@hswn.dk>                    */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+#ifndef __COMPRESSION_H_
+#define __COMPRESSION_H_
+
+#include <sys/types.h>
+
+#define COMPRESS_MARKER "compress "
+#define COMPRESS_MINSIZE 4096	/* Default: Dont bother compressing messages smaller than this */
+
+/* The largest message we accept, also when uncompressed. Stops the bad guys from data-flooding us. */
+#define MAX_XYMON_INBUFSZ (10*1024*1024)	/* 10 MB */
+
+extern int compression_enabled(void);
+extern char *compress_message(char *msg, size_t msglen, size_t *outlen);
+extern char *uncompress_message(char *buf, size_t buflen, size_t maxlen, size_t *outlen);
+extern int iscompressed(char *msg);
+extern char *compressed_type(char *msg);
+
+#endif
+
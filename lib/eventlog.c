@@ -500,6 +500,440 @@ nextrecord:
 	if (debug) dump_countlists(*hostcounthead, *svccounthead);
 }
 
+/*
+ * The allevents index. xymond_history adds a record for each event it
+ * writes to the allevents file. do_eventlog() uses it to go directly to
+ * the first event in the requested period, and to skip the events for
+ * hosts and tests that are filtered out without reading them.
+ */
+typedef struct eventindex_name_t {
+	char *name;
+	unsigned int id;
+} eventindex_name_t;
+
+static FILE *idxwfd = NULL, *nameswfd = NULL;
+static void *idxhosts = NULL, *idxtests = NULL;
+static unsigned int idxhostcount = 0, idxtestcount = 0;
+static int idxbulk = 0;
+
+static off_t eventindex_ofs(eventindex_rec_t *rec)
+{
+	return (((off_t)rec->ofs_hi) << 32) | (off_t)rec->ofs_lo;
+}
+
+static int eventindex_parse(char *l, char *hostname, char *testname, unsigned int *eventtime)
+{
+	return (sscanf(l, "%s %s %u", hostname, testname, eventtime) == 3);
+}
+
+static unsigned int eventindex_intern(void *tree, unsigned int *count, char nametype, char *name)
+{
+	xtreePos_t handle;
+	eventindex_name_t *rec;
+
+	handle = xtreeFind(tree, name);
+	if (handle != xtreeEnd(tree)) return ((eventindex_name_t *)xtreeData(tree, handle))->id;
+
+	rec = (eventindex_name_t *)malloc(sizeof(eventindex_name_t));
+	rec->name = strdup(name);
+	rec->id = (*count)++;
+	xtreeAdd(tree, rec->name, rec);
+
+	if (nameswfd) {
+		fprintf(nameswfd, "%c %s\n", nametype, name);
+		if (!idxbulk) fflush(nameswfd);
+	}
+
+	return rec->id;
+}
+
+static void eventindex_freetree(void *tree)
+{
+	xtreePos_t handle;
+
+	if (!tree) return;
+
+	for (handle = xtreeFirst(tree); (handle != xtreeEnd(tree)); handle = xtreeNext(tree, handle)) {
+		eventindex_name_t *rec = (eventindex_name_t *)xtreeData(tree, handle);
+		xfree(rec->name);
+		xfree(rec);
+	}
+	xtreeDestroy(tree);
+}
+
+void eventindex_close(void)
+{
+	if (idxwfd) { fclose(idxwfd); idxwfd = NULL; }
+	if (nameswfd) { fclose(nameswfd); nameswfd = NULL; }
+	eventindex_freetree(idxhosts); idxhosts = NULL; idxhostcount = 0;
+	eventindex_freetree(idxtests); idxtests = NULL; idxtestcount = 0;
+}
+
+int eventindex_open(char *histdir)
+{
+	/*
+	 * Setup the index for the allevents file in histdir. If there is an index for
+	 * this allevents file we continue it, otherwise a new index is created. Any
+	 * events not yet in the index are added.
+	 */
+	char alleventsfn[PATH_MAX], idxfn[PATH_MAX], namesfn[PATH_MAX];
+	char l[MAX_LINE_LEN], hostname[MAX_LINE_LEN], testname[MAX_LINE_LEN];
+	struct stat st;
+	eventindex_hdr_t hdr;
+	eventindex_rec_t rec;
+	FILE *fd, *eventfd;
+	unsigned int ino_hi, ino_lo, eventtime;
+	off_t catchup = 0, ofs;
+	int valid = 0;
+
+	eventindex_close();
+
+	sprintf(alleventsfn, "%s/allevents", histdir);
+	sprintf(idxfn, "%s/%s", histdir, EVENTINDEXFN);
+	sprintf(namesfn, "%s/%s", histdir, EVENTNAMESFN);
+	if (stat(alleventsfn, &st) != 0) return -1;
+	ino_hi = (unsigned int)(((unsigned long long)st.st_ino) >> 32);
+	ino_lo = (unsigned int)(((unsigned long long)st.st_ino) & 0xFFFFFFFF);
+
+	idxhosts = xtreeNew(strcmp);
+	idxtests = xtreeNew(strcmp);
+
+	/* Can we continue with the current index ? */
+	fd = fopen(idxfn, "r");
+	if (fd && (fread(&hdr, sizeof(hdr), 1, fd) == 1) && 
+	    (hdr.magic == EVENTINDEXMAGIC) && (hdr.ino_hi == ino_hi) && (hdr.ino_lo == ino_lo)) {
+		FILE *namesfd;
+		struct stat idxst;
+		off_t nrecs;
+
+		fstat(fileno(fd), &idxst);
+		nrecs = (idxst.st_size - sizeof(hdr)) / sizeof(rec);
+
+		namesfd = fopen(namesfn, "r");
+		if (namesfd) {
+			while (fgets(l, sizeof(l), namesfd)) {
+				char *p = strchr(l, '\n');
+
+				if (p) *p = '\0'; else break;
+				if (strncmp(l, "h ", 2) == 0) eventindex_intern(idxhosts, &idxhostcount, 'h', l+2);
+				else if (strncmp(l, "t ", 2) == 0) eventindex_intern(idxtests, &idxtestcount, 't', l+2);
+			}
+			fclose(namesfd);
+			valid = 1;
+		}
+
+		if (valid && (nrecs > 0)) {
+			/* Check that the last record matches the allevents file, and continue after it */
+			valid = 0;
+			eventfd = fopen(alleventsfn, "r");
+			if (eventfd && 
+			    (fseeko(fd, sizeof(hdr) + (nrecs-1)*sizeof(rec), SEEK_SET) == 0) && (fread(&rec, sizeof(rec), 1, fd) == 1) &&
+			    (rec.hostid < idxhostcount) && (rec.testid < idxtestcount) &&
+			    (fseeko(eventfd, eventindex_ofs(&rec), SEEK_SET) == 0) && fgets(l, sizeof(l), eventfd) &&
+			    eventindex_parse(l, hostname, testname, &eventtime) && (eventtime == rec.eventtime)) {
+				valid = 1;
+				catchup = ftello(eventfd);
+			}
+			if (eventfd) fclose(eventfd);
+		}
+
+		/* Drop a partially written record */
+		if (valid && (idxst.st_size != (sizeof(hdr) + nrecs*sizeof(rec)))) truncate(idxfn, sizeof(hdr) + nrecs*sizeof(rec));
+	}
+	if (fd) fclose(fd);
+
+	if (valid) {
+		idxwfd = fopen(idxfn, "a");
+		nameswfd = fopen(namesfn, "a");
+	}
+	else {
+		dbgprintf("Creating new index for %s\n", alleventsfn);
+		eventindex_freetree(idxhosts); idxhosts = xtreeNew(strcmp); idxhostcount = 0;
+		eventindex_freetree(idxtests); idxtests = xtreeNew(strcmp); idxtestcount = 0;
+
+		nameswfd = fopen(namesfn, "w");
+		idxwfd = fopen(idxfn, "w");
+		if (idxwfd) {
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.magic = EVENTINDEXMAGIC;
+			hdr.ino_hi = ino_hi; hdr.ino_lo = ino_lo;
+			fwrite(&hdr, sizeof(hdr), 1, idxwfd);
+		}
+		catchup = 0;
+	}
+
+	if (!idxwfd || !nameswfd) {
+		errprintf("Cannot create allevents index %s: %s\n", idxfn, strerror(errno));
+		eventindex_close();
+		return -1;
+	}
+
+	/* Add the events that are not in the index yet */
+	eventfd = fopen(alleventsfn, "r");
+	if (eventfd && (fseeko(eventfd, catchup, SEEK_SET) == 0)) {
+		idxbulk = 1;
+		ofs = catchup;
+		while (fgets(l, sizeof(l), eventfd) && strchr(l, '\n')) {
+			if (eventindex_parse(l, hostname, testname, &eventtime)) eventindex_add(hostname, testname, eventtime, ofs);
+			ofs = ftello(eventfd);
+		}
+		idxbulk = 0;
+		fflush(nameswfd);
+		fflush(idxwfd);
+	}
+	if (eventfd) fclose(eventfd);
+
+	return 0;
+}
+
+void eventindex_add(char *hostname, char *testname, time_t eventtime, off_t offset)
+{
+	eventindex_rec_t rec;
+
+	if (!idxwfd) return;
+
+	rec.eventtime = (unsigned int)eventtime;
+	rec.hostid = eventindex_intern(idxhosts, &idxhostcount, 'h', hostname);
+	rec.testid = eventindex_intern(idxtests, &idxtestcount, 't', testname);
+	rec.ofs_hi = (unsigned int)(offset >> 32);
+	rec.ofs_lo = (unsigned int)(offset & 0xFFFFFFFF);
+	fwrite(&rec, sizeof(rec), 1, idxwfd);
+	if (!idxbulk) fflush(idxwfd);
+}
+
+
+/* Reading the index in do_eventlog() */
+#define IDXREADCHUNK 1024
+typedef struct eventindex_reader_t {
+	FILE *idxfd;
+	off_t nrecs, nextrec;
+	char **hostnames, **testnames;
+	unsigned int hostcount, testcount;
+	signed char *hostok, *testok;		/* -1: Not checked yet */
+	off_t curofs, tailofs;
+	int filtered, intail;
+	eventindex_rec_t buf[IDXREADCHUNK];
+	int bufcount, bufpos;
+
+	/* The filters */
+	pcre *pageregexp, *expageregexp, *hostregexp, *exhostregexp, *testregexp, *extestregexp;
+	int ignoredialups;
+	f_hostcheck hostcheck;
+} eventindex_reader_t;
+
+static int eventindex_readrec(eventindex_reader_t *r, off_t recno, eventindex_rec_t *rec)
+{
+	if (fseeko(r->idxfd, sizeof(eventindex_hdr_t) + recno*sizeof(eventindex_rec_t), SEEK_SET) != 0) return 0;
+	return (fread(rec, sizeof(eventindex_rec_t), 1, r->idxfd) == 1);
+}
+
+static int eventindex_checkrec(eventindex_reader_t *r, FILE *eventlog, eventindex_rec_t *rec)
+{
+	/* Check that the index record matches the line in allevents. Leaves eventlog positioned after the line */
+	char l[MAX_LINE_LEN], hostname[MAX_LINE_LEN], testname[MAX_LINE_LEN];
+	unsigned int eventtime;
+
+	if (fseeko(eventlog, eventindex_ofs(rec), SEEK_SET) != 0) return 0;
+	if (!fgets(l, sizeof(l), eventlog)) return 0;
+	if (!eventindex_parse(l, hostname, testname, &eventtime)) return 0;
+
+	return ((eventtime == rec->eventtime) && 
+		(rec->hostid < r->hostcount) && (strcmp(hostname, r->hostnames[rec->hostid]) == 0));
+}
+
+static void eventindex_free(eventindex_reader_t *r)
+{
+	unsigned int i;
+
+	if (!r) return;
+
+	if (r->idxfd) fclose(r->idxfd);
+	for (i = 0; (i < r->hostcount); i++) xfree(r->hostnames[i]);
+	for (i = 0; (i < r->testcount); i++) xfree(r->testnames[i]);
+	if (r->hostnames) xfree(r->hostnames);
+	if (r->testnames) xfree(r->testnames);
+	if (r->hostok) xfree(r->hostok);
+	if (r->testok) xfree(r->testok);
+	xfree(r);
+}
+
+static eventindex_reader_t *eventindex_seek(FILE *eventlog, time_t firstevent)
+{
+	/* Position eventlog at the first event at or after firstevent. Returns NULL if the index cannot be used. */
+	char fn[PATH_MAX], l[MAX_LINE_LEN];
+	eventindex_reader_t *r;
+	eventindex_hdr_t hdr;
+	eventindex_rec_t rec;
+	struct stat st, idxst;
+	FILE *namesfd;
+	off_t lo, hi;
+	unsigned int hostsize = 0, testsize = 0;
+
+	if (fstat(fileno(eventlog), &st) != 0) return NULL;
+
+	r = (eventindex_reader_t *)calloc(1, sizeof(eventindex_reader_t));
+	sprintf(fn, "%s/%s", xgetenv("XYMONHISTDIR"), EVENTINDEXFN);
+	r->idxfd = fopen(fn, "r");
+	if (!r->idxfd || (fread(&hdr, sizeof(hdr), 1, r->idxfd) != 1) || (hdr.magic != EVENTINDEXMAGIC) ||
+	    (hdr.ino_hi != (unsigned int)(((unsigned long long)st.st_ino) >> 32)) ||
+	    (hdr.ino_lo != (unsigned int)(((unsigned long long)st.st_ino) & 0xFFFFFFFF)) ||
+	    (fstat(fileno(r->idxfd), &idxst) != 0)) {
+		eventindex_free(r);
+		return NULL;
+	}
+	r->nrecs = (idxst.st_size - sizeof(hdr)) / sizeof(eventindex_rec_t);
+	if (r->nrecs == 0) {
+		eventindex_free(r);
+		return NULL;
+	}
+
+	sprintf(fn, "%s/%s", xgetenv("XYMONHISTDIR"), EVENTNAMESFN);
+	namesfd = fopen(fn, "r");
+	if (!namesfd) {
+		eventindex_free(r);
+		return NULL;
+	}
+	while (fgets(l, sizeof(l), namesfd)) {
+		char *p = strchr(l, '\n');
+
+		if (p) *p = '\0'; else break;
+		if (strncmp(l, "h ", 2) == 0) {
+			if (r->hostcount == hostsize) {
+				hostsize += 1024;
+				r->hostnames = (char **)realloc(r->hostnames, hostsize*sizeof(char *));
+			}
+			r->hostnames[r->hostcount++] = strdup(l+2);
+		}
+		else if (strncmp(l, "t ", 2) == 0) {
+			if (r->testcount == testsize) {
+				testsize += 256;
+				r->testnames = (char **)realloc(r->testnames, testsize*sizeof(char *));
+			}
+			r->testnames[r->testcount++] = strdup(l+2);
+		}
+	}
+	fclose(namesfd);
+	r->hostok = (signed char *)malloc(r->hostcount + 1); memset(r->hostok, -1, r->hostcount + 1);
+	r->testok = (signed char *)malloc(r->testcount + 1); memset(r->testok, -1, r->testcount + 1);
+
+	/* The last record tells us where the events not yet in the index begin */
+	if (!eventindex_readrec(r, r->nrecs-1, &rec) || !eventindex_checkrec(r, eventlog, &rec)) {
+		dbgprintf("allevents index does not match allevents, not using it\n");
+		eventindex_free(r);
+		return NULL;
+	}
+	r->tailofs = ftello(eventlog);
+
+	/* Find the first record at or after firstevent */
+	lo = 0; hi = r->nrecs;
+	while (lo < hi) {
+		off_t mid = lo + (hi - lo) / 2;
+
+		if (!eventindex_readrec(r, mid, &rec)) {
+			eventindex_free(r);
+			return NULL;
+		}
+		if (rec.eventtime < firstevent) lo = mid + 1; else hi = mid;
+	}
+	r->nextrec = lo;
+
+	if (r->nextrec < r->nrecs) {
+		if (!eventindex_readrec(r, r->nextrec, &rec) || !eventindex_checkrec(r, eventlog, &rec)) {
+			eventindex_free(r);
+			return NULL;
+		}
+		fseeko(eventlog, eventindex_ofs(&rec), SEEK_SET);
+		fseeko(r->idxfd, sizeof(hdr) + r->nextrec*sizeof(eventindex_rec_t), SEEK_SET);
+	}
+	else {
+		fseeko(eventlog, r->tailofs, SEEK_SET);
+		r->intail = 1;
+	}
+	r->curofs = ftello(eventlog);
+
+	dbgprintf("allevents index: Starting at record %ld of %ld\n", (long)r->nextrec, (long)r->nrecs);
+
+	return r;
+}
+
+static int eventindex_hostok(eventindex_reader_t *r, unsigned int id)
+{
+	void *hinfo;
+
+	if (id >= r->hostcount) return 1;	/* Not known when we loaded the names, so check the event */
+
+	if (r->hostok[id] == -1) {
+		hinfo = hostinfo(r->hostnames[id]);
+		r->hostok[id] = (hinfo && !xmh_item(hinfo, XMH_FLAG_NONONGREEN) &&
+				 eventfilter(hinfo, "", r->pageregexp, r->expageregexp, 
+					     r->hostregexp, r->exhostregexp, NULL, NULL,
+					     r->ignoredialups, r->hostcheck));
+	}
+
+	return r->hostok[id];
+}
+
+static int eventindex_testok(eventindex_reader_t *r, unsigned int id)
+{
+	char *testname;
+	int ovector[30];
+
+	if (id >= r->testcount) return 1;
+
+	if (r->testok[id] == -1) {
+		testname = r->testnames[id];
+		r->testok[id] = wanted_eventcolumn(testname);
+		if (r->testok[id] && r->testregexp) {
+			r->testok[id] = (pcre_exec(r->testregexp, NULL, testname, strlen(testname), 0, 0,
+						   ovector, (sizeof(ovector)/sizeof(int))) >= 0);
+		}
+		if (r->testok[id] && r->extestregexp) {
+			r->testok[id] = (pcre_exec(r->extestregexp, NULL, testname, strlen(testname), 0, 0,
+						   ovector, (sizeof(ovector)/sizeof(int))) < 0);
+		}
+	}
+
+	return r->testok[id];
+}
+
+static char *eventindex_nextline(eventindex_reader_t *r, FILE *eventlog, char *l, int lsize, time_t lastevent, int stopatlast)
+{
+	/* Without filters, the events are read in sequence */
+	if (!r->filtered || r->intail) return fgets(l, lsize, eventlog);
+
+	while (r->nextrec < r->nrecs) {
+		eventindex_rec_t *rec;
+		off_t ofs;
+
+		if (r->bufpos == r->bufcount) {
+			off_t want = r->nrecs - r->nextrec;
+
+			if (want > IDXREADCHUNK) want = IDXREADCHUNK;
+			r->bufcount = fread(r->buf, sizeof(eventindex_rec_t), want, r->idxfd);
+			r->bufpos = 0;
+			if (r->bufcount <= 0) break;
+		}
+		rec = &r->buf[r->bufpos++];
+		r->nextrec++;
+
+		if (stopatlast && (rec->eventtime > lastevent)) return NULL;
+		if (!eventindex_hostok(r, rec->hostid) || !eventindex_testok(r, rec->testid)) continue;
+
+		ofs = eventindex_ofs(rec);
+		if ((ofs != r->curofs) && (fseeko(eventlog, ofs, SEEK_SET) != 0)) return NULL;
+		if (!fgets(l, lsize, eventlog)) return NULL;
+		r->curofs = ftello(eventlog);
+
+		return l;
+	}
+
+	/* Past the end of the index, read the rest of allevents */
+	r->intail = 1;
+	if (r->curofs != r->tailofs) fseeko(eventlog, r->tailofs, SEEK_SET);
+
+	return fgets(l, lsize, eventlog);
+}
+
 void do_eventlog(FILE *output, int maxcount, int maxminutes, char *fromtime, char *totime, 
 		char *pageregex, char *expageregex,
 		char *hostregex, char *exhostregex,
@@ -529,6 +963,7 @@ void do_eventlog(FILE *output, int maxcount, int maxminutes, char *fromtime, cha
 	pcre *extestregexp = NULL;
 	pcre *colrregexp = NULL;
 	countlist_t *hostcounthead = NULL, *svccounthead = NULL;
+	eventindex_reader_t *eventidx = NULL;
 
 	if (eventlist) *eventlist = NULL;
 	if (hostcounts) *hostcounts = NULL;
@@ -584,7 +1019,21 @@ void do_eventlog(FILE *output, int maxcount, int maxminutes, char *fromtime, cha
 	sprintf(eventlogfilename, "%s/allevents", xgetenv("XYMONHISTDIR"));
 	eventlog = fopen(eventlogfilename, "r");
 
-	if (eventlog && (stat(eventlogfilename, &st) == 0)) {
+	/* Use the index from xymond_history to find where to start, if we can */
+	if (eventlog) eventidx = eventindex_seek(eventlog, firstevent);
+	if (eventidx) {
+		/* The index finds the start directly, so "unlimited" really is */
+		if (maxcount == -1) maxcount = INT_MAX;
+
+		eventidx->filtered = (pageregexp || expageregexp || hostregexp || exhostregexp || 
+				      testregexp || extestregexp || ignoredialups || hostcheck);
+		eventidx->pageregexp = pageregexp; eventidx->expageregexp = expageregexp;
+		eventidx->hostregexp = hostregexp; eventidx->exhostregexp = exhostregexp;
+		eventidx->testregexp = testregexp; eventidx->extestregexp = extestregexp;
+		eventidx->ignoredialups = ignoredialups;
+		eventidx->hostcheck = hostcheck;
+	}
+	else if (eventlog && (stat(eventlogfilename, &st) == 0)) {
 		time_t curtime;
 		int done = 0;
 		int unlimited = (maxcount == -1);
@@ -620,7 +1069,7 @@ void do_eventlog(FILE *output, int maxcount, int maxminutes, char *fromtime, cha
 	
 	eventhead = NULL;
 
-	while (eventlog && (fgets(l, sizeof(l), eventlog))) {
+	while (eventlog && (eventidx ? eventindex_nextline(eventidx, eventlog, l, sizeof(l), lastevent, (counttype != XYMON_COUNT_DURATION)) : fgets(l, sizeof(l), eventlog))) {
 
 		time_t eventtime, changetime, duration;
 		unsigned int uievt, uicht, uidur;
@@ -841,6 +1290,7 @@ void do_eventlog(FILE *output, int maxcount, int maxminutes, char *fromtime, cha
 		fprintf(output, "</CENTER>\n");
 	}
 
+	if (eventidx) eventindex_free(eventidx);
 	if (eventlog) fclose(eventlog);
 
 	if (pageregexp) pcre_free(pageregexp);
@@ -40,6 +40,27 @@ typedef enum { XYMON_COUNT_NONE, XYMON_COUNT_EVENTS, XYMON_COUNT_DURATION } coun
 
 typedef int (*f_hostcheck)(char *hostname);
 
+/*
+ * Index of the allevents file, maintained by xymond_history. The index
+ * file has a header, followed by one record per line in allevents. Host-
+ * and test-names are stored as numbers; the names file lists the names
+ * in the order they were numbered, one per line as "h NAME" or "t NAME".
+ * Records are in host byte order, the index is only used on this server.
+ */
+#define EVENTINDEXFN ".allevents.idx"
+#define EVENTNAMESFN ".allevents.names"
+#define EVENTINDEXMAGIC 0x58454931	/* "XEI1" */
+typedef struct eventindex_hdr_t {
+	unsigned int magic;
+	unsigned int ino_hi, ino_lo;	/* Inode of the allevents file this index belongs to */
+	unsigned int reserved;
+} eventindex_hdr_t;
+typedef struct eventindex_rec_t {
+	unsigned int eventtime;
+	unsigned int hostid, testid;
+	unsigned int ofs_hi, ofs_lo;	/* Offset of the line in the allevents file */
+} eventindex_rec_t;
+
 extern char *eventignorecolumns;
 extern int havedoneeventlog;
 
@@ -52,4 +73,8 @@ extern void do_eventlog(FILE *output, int maxcount, int maxminutes, char *fromti
 			event_t **eventlist, countlist_t **hostcounts, countlist_t **servicecounts,
 			countsummary_t counttype, eventsummary_t sumtype, char *periodstring);
 
+extern int eventindex_open(char *histdir);
+extern void eventindex_add(char *hostname, char *testname, time_t eventtime, off_t offset);
+extern void eventindex_close(void);
+
 #endif
@@ -474,6 +474,7 @@ int load_alertconfig(char *configfn, int defcolors, int defaultinterval)
 				val = strchr(p, '=')+1;
 				crit = setup_criteria(&currule, &currcp);
 				crit->timespec = strdup(val);
+				crit->timewindow = get_timespec(crit->timespec);
 				firsttoken = 0;
 			}
 			else if (strncasecmp(p, "DURATION", 8) == 0) {
@@ -970,7 +971,7 @@ static int criteriamatch(activealerts_t *alert, criteria_t *crit, criteria_t *ru
 	 * some random system recovered ... not good. So apply
 	 * this check to all messages.
 	 */
-	if (crit && crit->timespec && !timematch(xmh_item(hinfo, XMH_HOLIDAYS), crit->timespec)) {
+	if (crit && crit->timewindow && !timespec_covers(crit->timewindow, xmh_item(hinfo, XMH_HOLIDAYS), getcurrenttime(NULL))) {
 		traceprintf("Failed '%s' (time criteria)\n", cfline);
 		if (!printmode) return 0; 
 	}
@@ -46,6 +46,16 @@ static void * locatorcache[ST_MAX];
 static int havecache[ST_MAX] = {0,};
 static int cachetimeout[ST_MAX] = {0,};
 
+/* 
+ * The locator bumps a generation counter whenever a host moves to another
+ * server. We check it now and then, and drop our cached lookups when
+ * it changes.
+ */
+#define GENERATION_CHECKINTERVAL 10
+static unsigned int cachegeneration[ST_MAX] = {0,};
+static time_t nextgenerationcheck[ST_MAX] = {0,};
+static int nogeneration = 0;
+
 typedef struct cacheitm_t {
 	char *key, *resp;
 	time_t tstamp;
@@ -201,6 +211,36 @@ void locator_prepcache(enum locator_servicetype_t svc, int timeout)
 }
 
 
+static void locator_checkgeneration(enum locator_servicetype_t svc)
+{
+	char buf[100];
+	time_t now;
+	unsigned int newgeneration;
+
+	if (nogeneration) return;
+
+	now = gettimer();
+	if (now < nextgenerationcheck[svc]) return;
+	nextgenerationcheck[svc] = now + GENERATION_CHECKINTERVAL;
+
+	sprintf(buf, "G|%s", servicetype_names[svc]);
+	if (call_locator(buf, sizeof(buf)) != 0) return;
+
+	if (strncmp(buf, "G|", 2) != 0) {
+		/* Old locator, cannot move hosts */
+		nogeneration = 1;
+		return;
+	}
+
+	newgeneration = (unsigned int)strtoul(buf+2, NULL, 10);
+	if (newgeneration != cachegeneration[svc]) {
+		dbgprintf("Locator generation for %s changed, flushing cache\n", servicetype_names[svc]);
+		locator_flushcache(svc, NULL);
+		cachegeneration[svc] = newgeneration;
+	}
+}
+
+
 char *locator_cmd(char *cmd)
 {
 	static char pingbuf[512];
@@ -333,7 +373,10 @@ char *locator_query(char *hostname, enum locator_servicetype_t svctype, char **e
 	}
 
 	if (havecache[svctype] && !extras) {
-		char *cachedata = locator_querycache(svctype, hostname);
+		char *cachedata;
+
+		locator_checkgeneration(svctype);
+		cachedata = locator_querycache(svctype, hostname);
 		if (cachedata) return cachedata;
 	}
 
@@ -396,6 +439,74 @@ int locator_serverup(char *servername, enum locator_servicetype_t svctype)
 	return res;
 }
 
+int locator_serverload(char *servername, enum locator_servicetype_t svctype, int msgrate, int lag, int *migrationid, char **handoff)
+{
+	/*
+	 * Report our load to the locator. If the locator wants us to hand off
+	 * some hosts, "handoff" points to a space-separated list of hostnames,
+	 * and "migrationid" must be passed to locator_handoff_done() once
+	 * they have been dealt with.
+	 */
+	static char *buf = NULL;
+	static int bufsz = 32768;
+	int res;
+
+	*handoff = NULL;
+
+	if (!buf) buf = (char *)malloc(bufsz);
+	snprintf(buf, bufsz, "L|%s|%s|%d|%d", servername, servicetype_names[svctype], msgrate, lag);
+
+	res = call_locator(buf, bufsz);
+	if (res == -1) return -1;
+
+	if (strncmp(buf, "MIGRATE|", 8) == 0) {
+		char *p = strchr(buf+8, '|');
+
+		if (p) {
+			*migrationid = atoi(buf+8);
+			*handoff = p+1;
+		}
+	}
+	else if (strcmp(buf, "OK") != 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int locator_handoff_done(char *servername, enum locator_servicetype_t svctype, int migrationid)
+{
+	char *buf;
+	int bufsz;
+	int res;
+
+	bufsz = strlen(servername) + 100;
+	buf = (char *)malloc(bufsz);
+	sprintf(buf, "C|%s|%s|%d", servername, servicetype_names[svctype], migrationid);
+
+	res = call_locator(buf, bufsz);
+
+	xfree(buf);
+	return res;
+}
+
+int locator_relocate_host(char *hostname, enum locator_servicetype_t svctype, char *servername)
+{
+	char *buf;
+	int bufsz;
+	int res;
+
+	bufsz = strlen(servername) + strlen(hostname) + 100;
+	buf = (char *)malloc(bufsz);
+	sprintf(buf, "R|%s|%s|%s", hostname, servicetype_names[svctype], servername);
+
+	res = call_locator(buf, bufsz);
+	if ((res == 0) && (strcmp(buf, "OK") != 0)) res = -1;
+
+	xfree(buf);
+	return res;
+}
+
 int locator_serverforget(char *servername, enum locator_servicetype_t svctype)
 {
 	char *buf;
@@ -446,6 +557,7 @@ int main(int argc, char *argv[])
 		printf("  d(own)       servername type\n");
 		printf("  u(p)         servername type\n");
 		printf("  f(orget)     servername type\n");
+		printf("  m(ove)       hostname type servername\n");
 		printf("  q(uery)      hostname type\n");
 		printf("  x(query)     hostname type\n");
 		printf("  p(ing)\n");
@@ -494,6 +606,10 @@ int main(int argc, char *argv[])
 			printf("%s\n", locator_serverforget(p2, get_servicetype(p3)) ? "Failed" : "OK");
 			break;
 
+		  case 'M': case 'm':
+			printf("%s\n", locator_relocate_host(p2, get_servicetype(p3), p4) ? "Failed" : "OK");
+			break;
+
 		  case 'Q': case 'q':
 		  case 'X': case 'x':
 			extras = NULL;
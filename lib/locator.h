@@ -26,6 +26,9 @@ extern int locator_rename_host(char *oldhostname, char *newhostname, enum locato
 extern char *locator_query(char *hostname, enum locator_servicetype_t svctype, char **extras);
 extern int locator_serverup(char *servername, enum locator_servicetype_t svctype);
 extern int locator_serverdown(char *servername, enum locator_servicetype_t svctype);
+extern int locator_serverload(char *servername, enum locator_servicetype_t svctype, int msgrate, int lag, int *migrationid, char **handoff);
+extern int locator_handoff_done(char *servername, enum locator_servicetype_t svctype, int migrationid);
+extern int locator_relocate_host(char *hostname, enum locator_servicetype_t svctype, char *servername);
 
 #endif
 
@@ -131,7 +131,7 @@ static void setup_transport(char *recipient)
 	dbgprintf("xymonproxyport = %d\n", xymonproxyport);
 }
 
-static int sendtoxymond(char *recipient, char *message, FILE *respfd, char **respstr, int fullresponse, int timeout)
+static int sendtoxymond(char *recipient, char *message, size_t msglen, FILE *respfd, char **respstr, int fullresponse, int timeout)
 {
 	struct in_addr addr;
 	struct sockaddr_in saddr;
@@ -141,6 +141,7 @@ static int sendtoxymond(char *recipient, char *message, FILE *respfd, char **res
 	int	res, isconnected, wdone, rdone;
 	struct timeval tmo;
 	char *msgptr = message;
+	size_t msgleft = msglen;
 	char *p;
 	char *rcptip = NULL;
 	int rcptport = 0;
@@ -236,13 +237,14 @@ static int sendtoxymond(char *recipient, char *message, FILE *respfd, char **res
 			return XYMONSEND_EBADURL;
 		}
 
-		bufp = msgptr = httpmessage = malloc(strlen(message)+1024);
+		bufp = msgptr = httpmessage = malloc(msglen+1024);
 		bufp += sprintf(httpmessage, "POST %s HTTP/1.0\n", posturl);
 		bufp += sprintf(bufp, "MIME-version: 1.0\n");
 		bufp += sprintf(bufp, "Content-Type: application/octet-stream\n");
-		bufp += sprintf(bufp, "Content-Length: %d\n", (int)strlen(message));
+		bufp += sprintf(bufp, "Content-Length: %d\n", (int)msglen);
 		bufp += sprintf(bufp, "Host: %s\n", posthost);
 		bufp += sprintf(bufp, "\n%s", message);
+		msgleft = (bufp - httpmessage);
 
 		if (posturl) xfree(posturl);
 		if (posthost) xfree(posthost);
@@ -399,7 +401,7 @@ retry_connect:
 
 			if (!wdone && FD_ISSET(sockfd, &writefds)) {
 				/* Send some data */
-				res = write(sockfd, msgptr, strlen(msgptr));
+				res = write(sockfd, msgptr, msgleft);
 				if (res == -1) {
 					sprintf(errordetails+strlen(errordetails), "Write error while sending message to Xymon daemon@%s:%d", rcptip, rcptport);
 					result = XYMONSEND_EWRITEERROR;
@@ -408,7 +410,8 @@ retry_connect:
 				else {
 					dbgprintf("Sent %d bytes\n", res);
 					msgptr += res;
-					wdone = (strlen(msgptr) == 0);
+					msgleft -= res;
+					wdone = (msgleft == 0);
 					if (wdone) shutdown(sockfd, SHUT_WR);
 				}
 			}
@@ -428,6 +431,8 @@ static int sendtomany(char *onercpt, char *morercpts, char *msg, int timeout, se
 {
 	int allservers = 1, first = 1, result = XYMONSEND_OK;
 	char *xymondlist, *rcpt;
+	char *zmsg = NULL;
+	size_t msglen, zmsglen = 0;
 
 	/*
 	 * Even though this is the "sendtomany" routine, we need to decide if the
@@ -466,6 +471,14 @@ static int sendtomany(char *onercpt, char *morercpts, char *msg, int timeout, se
 		return XYMONSEND_EBADIP;
 	}
 
+	/*
+	 * Large messages are compressed once and sent compressed to all
+	 * servers we talk to directly. HTTP recipients get the plain message,
+	 * since the CGI relaying it to xymond only handles text.
+	 */
+	msglen = strlen(msg);
+	if (!dontsendmessages) zmsg = compress_message(msg, msglen, &zmsglen);
+
 	if (strcmp(onercpt, "0.0.0.0") != 0) 
 		xymondlist = strdup(onercpt);
 	else
@@ -474,20 +487,27 @@ static int sendtomany(char *onercpt, char *morercpts, char *msg, int timeout, se
 	rcpt = strtok(xymondlist, " \t");
 	while (rcpt) {
 		int oneres;
+		char *txmsg = msg;
+		size_t txlen = msglen;
+
+		if (zmsg && (strncmp(rcpt, "http://", 7) != 0)) {
+			txmsg = zmsg;
+			txlen = zmsglen;
+		}
 
 		if (first) {
 			/* We grab the result from the first server */
 			char *respstr = NULL;
 
 			if (response) {
-				oneres =  sendtoxymond(rcpt, msg,
+				oneres =  sendtoxymond(rcpt, txmsg, txlen,
 						    response->respfd,
 						    (response->respstr ? &respstr : NULL),
 						    (response->respfd || response->respstr),
 						    timeout);
 			}
 			else {
-				oneres =  sendtoxymond(rcpt, msg, NULL, NULL, 0, timeout);
+				oneres =  sendtoxymond(rcpt, txmsg, txlen, NULL, NULL, 0, timeout);
 			}
 
 			if (oneres == XYMONSEND_OK) {
@@ -500,7 +520,7 @@ static int sendtomany(char *onercpt, char *morercpts, char *msg, int timeout, se
 		}
 		else {
 			/* Secondary servers do not yield a response */
-			oneres =  sendtoxymond(rcpt, msg, NULL, NULL, 0, timeout);
+			oneres =  sendtoxymond(rcpt, txmsg, txlen, NULL, NULL, 0, timeout);
 		}
 
 		/* Save any error results */
@@ -518,6 +538,7 @@ static int sendtomany(char *onercpt, char *morercpts, char *msg, int timeout, se
 	}
 
 	xfree(xymondlist);
+	if (zmsg) xfree(zmsg);
 
 	return result;
 }
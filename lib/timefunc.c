@@ -226,50 +226,68 @@ static int minutes(char *p)
 	}
 }
 
-int within_sla(char *holidaykey, char *timespec, int defresult)
+/*
+ * Time specifications are compiled into a weekly bitmap: One bit for
+ * each minute of each weekday. Holidays are mapped onto a weekday by
+ * getweekdayorholiday(), so they need no separate table. Each compiled
+ * spec also caches the current state, and how long it stays valid -
+ * so most lookups are just a timestamp comparison.
+ */
+#define TW_DAYMINUTES 1440
+
+typedef struct timewindow_t {
+	unsigned char map[7][TW_DAYMINUTES/8];
+	char *holidaykey;		/* Holiday set used for the cached state */
+	int state;			/* Cached result ... */
+	time_t validfrom, validuntil;	/* ... and when it is valid */
+} timewindow_t;
+
+static void *timewindows = NULL;	/* Cache of compiled specs, indexed by the spec */
+
+#define TW_ISSET(tw, d, m) (((tw)->map[d][(m) >> 3] & (1 << ((m) & 7))) != 0)
+
+static void tw_setrange(timewindow_t *tw, int day, int first, int last)
+{
+	int m;
+
+	if (last >= TW_DAYMINUTES) last = TW_DAYMINUTES-1;
+	for (m = first; (m <= last); m++) tw->map[day][m >> 3] |= (1 << (m & 7));
+}
+
+void *compile_timespec(char *timespec)
 {
 	/*
 	 *    timespec is of the form W:HHMM:HHMM[,W:HHMM:HHMM]*
 	 *    "W" = weekday : '*' = all, 'W' = Monday-Friday, '0'..'6' = Sunday ..Saturday
 	 */
-
-	int found = 0;
-	time_t tnow;
-	struct tm *now;
-	int curtime;
-	int newwday;
+	timewindow_t *tw;
 	char *onesla;
 
-	if (!timespec) return defresult;
-
-	tnow = getcurrenttime(NULL);
-	now = localtime(&tnow);
-	curtime = now->tm_hour*60+now->tm_min;
-	newwday = getweekdayorholiday(holidaykey, now);
+	tw = (timewindow_t *)calloc(1, sizeof(timewindow_t));
+	tw->validfrom = tw->validuntil = 0;
 
 	onesla = timespec;
-	while (!found && onesla) {
-
-		char *wday;
-		int validday, wdaymatch = 0;
-		char *endsla, *starttimep, *endtimep;
+	while (onesla && *onesla) {
+		int days[7], d, validday;
+		char *wday, *endsla, *starttimep, *endtimep;
 		int starttime, endtime;
 
-		endsla = strchr(onesla, ','); if (endsla) *endsla = '\0';
+		endsla = onesla + strcspn(onesla, ",");
 
-		for (wday = onesla, validday=1; (validday && !wdaymatch); wday++) {
+		memset(days, 0, sizeof(days));
+		for (wday = onesla, validday = 1; (validday); wday++) {
 			switch (*wday) {
 			  case '*':
-				wdaymatch = 1;
+				for (d = 0; (d < 7); d++) days[d] = 1;
 				break;
 
 			  case 'W':
 			  case 'w':
-				if ((newwday >= 1) && (newwday <=5)) wdaymatch = 1;
+				for (d = 1; (d <= 5); d++) days[d] = 1;
 				break;
 
 			  case '0': case '1': case '2': case '3': case '4': case '5': case '6':
-				if (*wday == (newwday+'0')) wdaymatch = 1;
+				days[*wday - '0'] = 1;
 				break;
 
 			  case ':':
@@ -284,98 +302,247 @@ int within_sla(char *holidaykey, char *timespec, int defresult)
 			}
 		}
 
-		if (wdaymatch) {
-			/* Weekday matches */
-			starttimep = strchr(onesla, ':');
-			if (starttimep) {
-				starttime = minutes(starttimep+1);
-				endtimep = strchr(starttimep+1, ':');
-				if (endtimep) {
-					endtime = minutes(endtimep+1);
+		starttimep = strchr(onesla, ':');
+		if (starttimep && (starttimep < endsla)) {
+			starttime = minutes(starttimep+1);
+			endtimep = strchr(starttimep+1, ':');
+			if (endtimep && (endtimep < endsla)) {
+				endtime = minutes(endtimep+1);
+				for (d = 0; (d < 7); d++) {
+					if (!days[d]) continue;
+
 					if (endtime > starttime) {
 						/* *:0200:0400 */
-						found = ((curtime >= starttime) && (curtime <= endtime));
+						tw_setrange(tw, d, starttime, endtime);
 					}
 					else {
 						/* The period crosses over midnight: *:2330:0400 */
-						found = ((curtime >= starttime) || (curtime <= endtime));
+						tw_setrange(tw, d, starttime, TW_DAYMINUTES-1);
+						tw_setrange(tw, d, 0, endtime);
 					}
-					dbgprintf("\tstart,end,current time = %d, %d, %d - found=%d\n", 
-						starttime,endtime,curtime,found);
 				}
-				else errprintf("Bad timespec (missing colon or no endtime): %s\n", onesla);
 			}
-			else errprintf("Bad timespec (missing colon or no starttime): %s\n", onesla);
-		}
-		else {
-			dbgprintf("\tWeekday does not match\n");
+			else errprintf("Bad timespec (missing colon or no endtime): %s\n", onesla);
 		}
+		else errprintf("Bad timespec (missing colon or no starttime): %s\n", onesla);
 
 		/* Go to next SLA spec. */
-		if (endsla) *endsla = ',';
-		onesla = (endsla ? (endsla + 1) : NULL);
+		onesla = ((*endsla == ',') ? (endsla + 1) : NULL);
 	}
 
-	return found;
+	return tw;
+}
+
+void free_timespec(void *twp)
+{
+	timewindow_t *tw = (timewindow_t *)twp;
+
+	if (!tw) return;
+	if (tw->holidaykey) xfree(tw->holidaykey);
+	xfree(tw);
+}
+
+void *get_timespec(char *timespec)
+{
+	/* Returns a compiled timespec, shared by everyone using the same spec */
+	xtreePos_t handle;
+	void *tw;
+
+	if (!timespec) return NULL;
+
+	if (!timewindows) timewindows = xtreeNew(strcmp);
+
+	handle = xtreeFind(timewindows, timespec);
+	if (handle != xtreeEnd(timewindows)) return xtreeData(timewindows, handle);
+
+	tw = compile_timespec(timespec);
+	xtreeAdd(timewindows, strdup(timespec), tw);
+	return tw;
+}
+
+static int sameholidays(char *k1, char *k2)
+{
+	if ((k1 == NULL) || (k2 == NULL)) return (k1 == k2);
+	return (strcmp(k1, k2) == 0);
+}
+
+int timespec_covers(void *twp, char *holidaykey, time_t tnow)
+{
+	timewindow_t *tw = (timewindow_t *)twp;
+	struct tm *now;
+	int wday, curtime, m;
+	time_t nextchange;
+
+	if ((tnow >= tw->validfrom) && (tnow < tw->validuntil) && sameholidays(tw->holidaykey, holidaykey)) 
+		return tw->state;
+
+	now = localtime(&tnow);
+	curtime = now->tm_hour*60+now->tm_min;
+	wday = getweekdayorholiday(holidaykey, now);
+	tw->state = TW_ISSET(tw, wday, curtime);
+
+	/* Find when this changes - at the latest, at midnight when the weekday changes */
+	for (m = curtime+1; ((m < TW_DAYMINUTES) && (TW_ISSET(tw, wday, m) == tw->state)); m++) ;
+	nextchange = tnow - now->tm_sec + (m - curtime)*60;
+
+	/* Re-check every 15 minutes anyway, in case of a DST change */
+	tw->validfrom = tnow;
+	tw->validuntil = tnow - (tnow % 900) + 900;
+	if (nextchange < tw->validuntil) tw->validuntil = nextchange;
+
+	if (!sameholidays(tw->holidaykey, holidaykey)) {
+		if (tw->holidaykey) xfree(tw->holidaykey);
+		tw->holidaykey = (holidaykey ? strdup(holidaykey) : NULL);
+	}
+
+	dbgprintf("\tcurrent time = %d, wday %d - found=%d\n", curtime, wday, tw->state);
+	return tw->state;
+}
+
+time_t timespec_nextchange(void *twp, char *holidaykey)
+{
+	/*
+	 * Returns the time when the timespec result changes next, or 0 if
+	 * it does not change within the next week. DST changes are not
+	 * accounted for, so this may be off by the DST offset.
+	 */
+	timewindow_t *tw = (timewindow_t *)twp;
+	time_t t;
+	struct tm *now;
+	int state, wday, curtime, m, days;
+
+	t = getcurrenttime(NULL);
+	state = timespec_covers(tw, holidaykey, t);
+
+	for (days = 0; (days < 8); days++) {
+		now = localtime(&t);
+		curtime = now->tm_hour*60+now->tm_min;
+		wday = getweekdayorholiday(holidaykey, now);
+
+		for (m = curtime; (m < TW_DAYMINUTES); m++) {
+			if (TW_ISSET(tw, wday, m) != state) return (t - now->tm_sec + (m - curtime)*60);
+		}
+
+		/* Move to midnight */
+		t = t - now->tm_sec + (TW_DAYMINUTES - curtime)*60;
+	}
+
+	return 0;
+}
+
+int within_sla(char *holidaykey, char *timespec, int defresult)
+{
+	if (!timespec) return defresult;
+
+	return timespec_covers(get_timespec(timespec), holidaykey, getcurrenttime(NULL));
 }
 
 #ifndef CLIENTONLY
+typedef struct downtime_t {
+	char **services;		/* NULL means all services */
+	void *window;
+	char *cause;
+	struct downtime_t *next;
+} downtime_t;
+
+static downtime_t *compile_downtime(char *dtag)
+{
+	downtime_t *head = NULL, *tail = NULL;
+	char *downtag, *p;
+	char *s1, *s2, *s3, *s4, *s5;
+	char timetxt[30];
+
+	p = downtag = strdup(dtag);
+	do {
+		downtime_t *newitem;
+		char *cause = NULL;
+		int causelen = 0;
+
+		/* Its either DAYS:START:END or SERVICE:DAYS:START:END:CAUSE */
+
+		s1 = p; p += strcspn(p, ":"); if (*p != '\0') { *p = '\0'; p++; }
+		s2 = p; p += strcspn(p, ":"); if (*p != '\0') { *p = '\0'; p++; }
+		s3 = p; p += strcspn(p, ":;,"); 
+		if ((*p == ',') || (*p == ';') || (*p == '\0')) { 
+			if (*p != '\0') { *p = '\0'; p++; }
+			snprintf(timetxt, sizeof(timetxt), "%s:%s:%s", s1, s2, s3);
+			cause = strdup("Planned downtime");
+			s1 = "*";
+		}
+		else if (*p == ':') {
+			*p = '\0'; p++; 
+			s4 = p; p += strcspn(p, ":"); if (*p != '\0') { *p = '\0'; p++; }
+			s5 = p; p += strcspn(p, ",;"); if (*p != '\0') { *p = '\0'; p++; }
+			snprintf(timetxt, sizeof(timetxt), "%s:%s:%s", s2, s3, s4);
+			getescapestring(s5, (unsigned char **)&cause, &causelen);
+		}
+
+		newitem = (downtime_t *)calloc(1, sizeof(downtime_t));
+		newitem->window = get_timespec(timetxt);
+		newitem->cause = cause;
+		if (strcmp(s1, "*") != 0) {
+			char *onesvc, *buf;
+			int count = 0;
+
+			onesvc = strtok_r(s1, ",", &buf);
+			while (onesvc) {
+				newitem->services = (char **)realloc(newitem->services, (count+2)*sizeof(char *));
+				newitem->services[count++] = strdup(onesvc);
+				newitem->services[count] = NULL;
+				onesvc = strtok_r(NULL, ",", &buf);
+			}
+
+			/* An empty service list matches nothing */
+			if (!newitem->services) newitem->services = (char **)calloc(1, sizeof(char *));
+		}
+
+		if (tail) tail->next = newitem; else head = newitem;
+		tail = newitem;
+	} while (*p);
+
+	xfree(downtag);
+	return head;
+}
+
 char *check_downtime(char *hostname, char *testname)
 {
+	static void *downtimes = NULL;	/* Compiled DOWNTIME tags, indexed by the tag */
 	void *hinfo = hostinfo(hostname);
 	char *dtag;
 	char *holkey;
+	downtime_t *dwalk;
+	xtreePos_t handle;
+	time_t tnow;
 
 	if (hinfo == NULL) return NULL;
 
 	dtag = xmh_item(hinfo, XMH_DOWNTIME);
+	if (!dtag || !*dtag) return NULL;
+
 	holkey = xmh_item(hinfo, XMH_HOLIDAYS);
-	if (dtag && *dtag) {
-		static char *downtag = NULL;
-		static unsigned char *cause = NULL;
-		static int causelen = 0;
-		char *s1, *s2, *s3, *s4, *s5, *p;
-		char timetxt[30];
-
-		if (downtag) xfree(downtag);
-		if (cause) xfree(cause);
-
-		p = downtag = strdup(dtag);
-		do {
-			/* Its either DAYS:START:END or SERVICE:DAYS:START:END:CAUSE */
-
-			s1 = p; p += strcspn(p, ":"); if (*p != '\0') { *p = '\0'; p++; }
-			s2 = p; p += strcspn(p, ":"); if (*p != '\0') { *p = '\0'; p++; }
-			s3 = p; p += strcspn(p, ":;,"); 
-			if ((*p == ',') || (*p == ';') || (*p == '\0')) { 
-				if (*p != '\0') { *p = '\0'; p++; }
-				snprintf(timetxt, sizeof(timetxt), "%s:%s:%s", s1, s2, s3);
-				cause = strdup("Planned downtime");
-				s1 = "*";
-			}
-			else if (*p == ':') {
-				*p = '\0'; p++; 
-				s4 = p; p += strcspn(p, ":"); if (*p != '\0') { *p = '\0'; p++; }
-				s5 = p; p += strcspn(p, ",;"); if (*p != '\0') { *p = '\0'; p++; }
-				snprintf(timetxt, sizeof(timetxt), "%s:%s:%s", s2, s3, s4);
-				getescapestring(s5, &cause, &causelen);
-			}
 
-			if (within_sla(holkey, timetxt, 0)) {
-				char *onesvc, *buf;
+	if (!downtimes) downtimes = xtreeNew(strcmp);
+	handle = xtreeFind(downtimes, dtag);
+	if (handle != xtreeEnd(downtimes)) {
+		dwalk = (downtime_t *)xtreeData(downtimes, handle);
+	}
+	else {
+		dwalk = compile_downtime(dtag);
+		xtreeAdd(downtimes, strdup(dtag), dwalk);
+	}
 
-				if (strcmp(s1, "*") == 0) return cause;
+	tnow = getcurrenttime(NULL);
+	for (; (dwalk); dwalk = dwalk->next) {
+		if (!timespec_covers(dwalk->window, holkey, tnow)) continue;
 
-				onesvc = strtok_r(s1, ",", &buf);
-				while (onesvc) {
-					if (strcmp(onesvc, testname) == 0) return cause;
-					onesvc = strtok_r(NULL, ",", &buf);
-				}
+		if (dwalk->services == NULL) return dwalk->cause;
+		else {
+			char **svc;
 
-				/* If we didn't use the "cause" we just created, it must be freed */
-				if (cause) xfree(cause);
+			for (svc = dwalk->services; (*svc); svc++) {
+				if (strcmp(*svc, testname) == 0) return dwalk->cause;
 			}
-		} while (*p);
+		}
 	}
 
 	return NULL;
@@ -22,6 +22,11 @@ extern void getntimer(struct timespec *tp);
 extern void init_timestamp(void);
 extern char *timespec_text(char *spec);
 extern struct timespec *tvdiff(struct timespec *tstart, struct timespec *tend, struct timespec *result);
+extern void *compile_timespec(char *timespec);
+extern void free_timespec(void *tw);
+extern void *get_timespec(char *timespec);
+extern int timespec_covers(void *tw, char *holidaykey, time_t tnow);
+extern time_t timespec_nextchange(void *tw, char *holidaykey);
 extern int within_sla(char *holidaykey, char *timespec, int defresult);
 extern char *check_downtime(char *hostname, char *testname);
 extern int periodcoversnow(char *tag);
@@ -108,6 +108,9 @@ xtreePos_t xtreeFirst(void *treehandle)
 	/* Does tree exist ? Is it empty? */
 	if ((treehandle == NULL) || (mytree->treesz == 0)) return -1;
 
+	/* Skip records that have been deleted */
+	if (mytree->entries[0].deleted != 0) return xtreeNext(treehandle, 0);
+
 	return 0;
 }
 
@@ -122,7 +125,7 @@ xtreePos_t xtreeNext(void *treehandle, xtreePos_t pos)
 		pos++;
 	} while ((pos < mytree->treesz) && (mytree->entries[pos].deleted != 0));
 
-	return pos;
+	return ((pos < mytree->treesz) ? pos : -1);
 }
 
 char *xtreeKey(void *treehandle, xtreePos_t pos)
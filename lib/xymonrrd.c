@@ -19,6 +19,13 @@ static char rcsid[] = "$Id: xymonrrd.c 6745 2011-09-04 06:01:06Z storner $";
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/file.h>
+#include <fcntl.h>
 
 #include "libxymon.h"
 #include "version.h"
@@ -365,3 +372,172 @@ rrdtpldata_t *setup_template(char *params[])
 }
 
 
+
+
+/*
+ * The RRD index for a host is a text file with one line per RRD file:
+ * The filename, a TAB and the dataset names separated by ':'. xymond_rrd
+ * appends to it when it creates a new RRD file, so the index file is always
+ * modified after the directory. If the directory has been changed after
+ * the index file - e.g. because someone deleted an RRD file - then the
+ * index cannot be trusted, and the caller must scan the directory instead.
+ */
+int rrdindex_valid(char *hostrrddir)
+{
+	char fn[PATH_MAX];
+	struct stat dirst, idxst;
+
+	snprintf(fn, sizeof(fn), "%s/%s", hostrrddir, RRDINDEXFN);
+	if (stat(hostrrddir, &dirst) != 0) return 0;
+	if (stat(fn, &idxst) != 0) return 0;
+
+	return (idxst.st_mtime >= dirst.st_mtime);
+}
+
+static int rrdindex_compare(const void *v1, const void *v2)
+{
+	rrdindex_t *r1 = (rrdindex_t *)v1;
+	rrdindex_t *r2 = (rrdindex_t *)v2;
+
+	return strcmp(r1->rrdfn, r2->rrdfn);
+}
+
+rrdindex_t *rrdindex_load(char *hostrrddir, int *count, int evenifstale)
+{
+	/* Returns the index sorted by filename, terminated by a NULL rrdfn. NULL if there is no valid index */
+	char fn[PATH_MAX];
+	FILE *fd;
+	strbuffer_t *inbuf;
+	rrdindex_t *result = NULL;
+	int rcount = 0, rsize = 0;
+
+	*count = 0;
+	if (!evenifstale && !rrdindex_valid(hostrrddir)) return NULL;
+
+	snprintf(fn, sizeof(fn), "%s/%s", hostrrddir, RRDINDEXFN);
+	fd = stackfopen(fn, "r", NULL);
+	if (fd == NULL) return NULL;
+
+	rsize = 64;
+	result = (rrdindex_t *)malloc(rsize * sizeof(rrdindex_t));
+
+	inbuf = newstrbuffer(0);
+	while (unlimfgets(inbuf, fd)) {
+		char *p;
+
+		sanitize_input(inbuf, 0, 0);
+		if ((STRBUFLEN(inbuf) == 0) || (*STRBUF(inbuf) == '#')) continue;
+
+		p = strchr(STRBUF(inbuf), '\t');
+		if (p) *p = '\0';
+		if (*STRBUF(inbuf) == '\0') continue;
+
+		if ((rcount + 1) >= rsize) {
+			rsize += 256;
+			result = (rrdindex_t *)realloc(result, rsize * sizeof(rrdindex_t));
+		}
+		result[rcount].rrdfn = strdup(STRBUF(inbuf));
+		result[rcount].dsnames = strdup(p ? p+1 : "");
+		rcount++;
+	}
+	stackfclose(fd);
+	freestrbuffer(inbuf);
+
+	qsort(result, rcount, sizeof(rrdindex_t), rrdindex_compare);
+	result[rcount].rrdfn = result[rcount].dsnames = NULL;
+	*count = rcount;
+
+	return result;
+}
+
+void rrdindex_free(rrdindex_t *idx)
+{
+	rrdindex_t *walk;
+
+	if (!idx) return;
+
+	for (walk = idx; (walk->rrdfn); walk++) {
+		xfree(walk->rrdfn);
+		xfree(walk->dsnames);
+	}
+	xfree(idx);
+}
+
+int rrdindex_write(char *hostrrddir, rrdindex_t *idx, int count)
+{
+	/* Write a complete new index */
+	char fn[PATH_MAX], tmpfn[PATH_MAX];
+	FILE *fd;
+	int i;
+
+	snprintf(fn, sizeof(fn), "%s/%s", hostrrddir, RRDINDEXFN);
+	snprintf(tmpfn, sizeof(tmpfn), "%s/%s.%d", hostrrddir, RRDINDEXFN, (int)getpid());
+	fd = fopen(tmpfn, "w");
+	if (fd == NULL) {
+		errprintf("Cannot create RRD index %s: %s\n", tmpfn, strerror(errno));
+		return -1;
+	}
+
+	fprintf(fd, "# Xymon RRD index - maintained by xymond_rrd\n");
+	for (i = 0; (i < count); i++) fprintf(fd, "%s\t%s\n", idx[i].rrdfn, (idx[i].dsnames ? idx[i].dsnames : ""));
+	if (fclose(fd) != 0) {
+		errprintf("Cannot write RRD index %s: %s\n", tmpfn, strerror(errno));
+		unlink(tmpfn);
+		return -1;
+	}
+
+	if (rename(tmpfn, fn) != 0) {
+		errprintf("Cannot rename RRD index %s: %s\n", tmpfn, strerror(errno));
+		unlink(tmpfn);
+		return -1;
+	}
+
+	/* The rename updates the directory timestamp, so bring the index up to the same time */
+	utimes(fn, NULL);
+
+	return 0;
+}
+
+int rrdindex_lock(char *hostrrddir)
+{
+	/*
+	 * Changes to the index must be serialized, since there is a xymond_rrd
+	 * for both the status and the data channel. The lock is on the host
+	 * directory itself, so taking it does not change the directory timestamp.
+	 * Returns a file descriptor to pass to rrdindex_unlock(), or -1.
+	 */
+	int fd;
+
+	fd = open(hostrrddir, O_RDONLY);
+	if (fd == -1) return -1;
+
+	while (flock(fd, LOCK_EX) == -1) {
+		if (errno != EINTR) {
+			errprintf("Cannot lock RRD index in %s: %s\n", hostrrddir, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+void rrdindex_unlock(int lockfd)
+{
+	if (lockfd != -1) close(lockfd);
+}
+
+int rrdindex_append(char *hostrrddir, char *rrdfn, char *dsnames)
+{
+	char fn[PATH_MAX];
+	FILE *fd;
+
+	snprintf(fn, sizeof(fn), "%s/%s", hostrrddir, RRDINDEXFN);
+	fd = fopen(fn, "a");
+	if (fd == NULL) return -1;
+
+	fprintf(fd, "%s\t%s\n", rrdfn, (dsnames ? dsnames : ""));
+	if (fclose(fd) != 0) return -1;
+
+	return 0;
+}
@@ -43,6 +43,16 @@ typedef struct rrdtplnames_t {
 	int idx;
 } rrdtplnames_t;
 
+/*
+ * Index of the RRD files for one host, kept by xymond_rrd in the
+ * host RRD directory so the web tools need not scan the directory.
+ */
+#define RRDINDEXFN ".rrdindex"
+typedef struct rrdindex_t {
+	char *rrdfn;	/* Filename, relative to the host RRD directory */
+	char *dsnames;	/* Dataset names, separated by ':'. Empty if unknown */
+} rrdindex_t;
+
 
 extern xymonrrd_t *xymonrrds;
 extern xymongraph_t *xymongraphs;
@@ -55,5 +65,13 @@ extern char *xymon_graph_data(char *hostname, char *dispname, char *service, int
 		time_t starttime, time_t endtime);
 extern rrdtpldata_t *setup_template(char *params[]);
 
+extern int rrdindex_valid(char *hostrrddir);
+extern rrdindex_t *rrdindex_load(char *hostrrddir, int *count, int evenifstale);
+extern void rrdindex_free(rrdindex_t *idx);
+extern int rrdindex_write(char *hostrrddir, rrdindex_t *idx, int count);
+extern int rrdindex_append(char *hostrrddir, char *rrdfn, char *dsnames);
+extern int rrdindex_lock(char *hostrrddir);
+extern void rrdindex_unlock(int lockfd);
+
 #endif
 
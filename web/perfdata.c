@@ -207,8 +207,11 @@ int oneset(char *hostname, char *rrdname, char *starttime, char *endtime, char *
 int onehost(char *hostname, char *starttime, char *endtime)
 {
 	struct stat st;
-	DIR *d;
+	DIR *d = NULL;
 	struct dirent *de;
+	rrdindex_t *rrdidx;
+	int rrdidxcount, rrdidxpos = 0;
+	char *fn;
 
 	if ((chdir(xgetenv("XYMONRRDS")) == -1) || (chdir(hostname) == -1)) {
 		errprintf("Cannot cd to %s/%s\n", xgetenv("XYMONRRDS"), hostname);
@@ -250,30 +253,34 @@ int onehost(char *hostname, char *starttime, char *endtime)
 	}
 
 	/*
-	 * Report data for all filesystems.
+	 * Report data for all filesystems. Use the RRD index from xymond_rrd
+	 * to find them if we have it, otherwise scan the directory.
 	 */
-	d = opendir(".");
-	while ((de = readdir(d)) != NULL) {
-		if (strncmp(de->d_name, "disk,", 5) != 0) continue;
-
-		stat(de->d_name, &st);
-		if (!S_ISREG(st.st_mode)) continue;
+	rrdidx = rrdindex_load(".", &rrdidxcount, 0);
+	if (!rrdidx) d = opendir(".");
+	while ((fn = (rrdidx ? rrdidx[rrdidxpos++].rrdfn : ((d && (de = readdir(d))) ? de->d_name : NULL))) != NULL) {
+		if (strncmp(fn, "disk,", 5) != 0) continue;
+
+		if (!rrdidx) {
+			stat(fn, &st);
+			if (!S_ISREG(st.st_mode)) continue;
+		}
 
-		if (strcmp(de->d_name, "disk,root.rrd") == 0) {
-			oneset(hostname, de->d_name, starttime, endtime, "pct", 0, "/");
+		if (strcmp(fn, "disk,root.rrd") == 0) {
+			oneset(hostname, fn, starttime, endtime, "pct", 0, "/");
 		}
 		else {
-			char *fsnam = strdup(de->d_name+4);
+			char *fsnam = strdup(fn+4);
 			char *p;
 
 			while ((p = strchr(fsnam, ',')) != NULL) *p = '/';
 			p = fsnam + strlen(fsnam) - 4; *p = '\0';
-			dbgprintf("Processing set %s for host %s from %s\n", de->d_name, hostname, fsnam);
-			oneset(hostname, de->d_name, starttime, endtime, "pct", 0, fsnam);
+			dbgprintf("Processing set %s for host %s from %s\n", fn, hostname, fsnam);
+			oneset(hostname, fn, starttime, endtime, "pct", 0, fsnam);
 			xfree(fsnam);
 		}
 	}
-	closedir(d);
+	if (rrdidx) rrdindex_free(rrdidx); else if (d) closedir(d);
 	return 0;
 }
 
@@ -25,12 +25,15 @@ static char rcsid[] = "$Id: showgraph.c 6712 2011-07-31 21:01:52Z storner $";
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/file.h>
+#include <sys/time.h>
 #include <fcntl.h>
 
 #include <pcre.h>
 #include <rrd.h>
 
 #include "libxymon.h"
+#include "version.h"
 
 #define HOUR_GRAPH  "e-48h"
 #define DAY_GRAPH   "e-12d"
@@ -110,6 +113,12 @@ int firstidx = -1;
 int idxcount = -1;
 int lastidx = 0;
 
+/* The cache of rendered graphs */
+int usecache = 1;
+char *cachedir = NULL;
+off_t cachemaxsize = 50*1024*1024;
+int cachemaxage = 300;
+
 void errormsg(char *msg)
 {
 	printf("Content-type: %s\n\n", xgetenv("HTMLCONTENTTYPE"));
@@ -177,6 +186,212 @@ void request_cacheflush(char *hostname)
 }
 
 
+/*
+ * Rendered graphs are saved in a cache directory, so the same graph
+ * requested again - e.g. by several browsers showing the same page -
+ * is just a file read. The cache key is a hash of everything that goes
+ * into the graph: The graph definition, the request parameters and the
+ * names of the RRD files. A cached graph is only used if it is newer than
+ * all of the RRD files. Graphs ending "now" also expire after cachemaxage
+ * seconds, since the time axis moves and xymond_rrd may hold updates not
+ * yet written to the files.
+ */
+time_t rrdnewest = 0;
+
+char *graphcache_key(gdef_t *gdef)
+{
+	strbuffer_t *keydata = newstrbuffer(0);
+	char numbuf[200];
+	char *key;
+	int i;
+
+	addtobuffer(keydata, VERSION); addtobuffer(keydata, "\n");
+	addtobuffer(keydata, gdef->name); addtobuffer(keydata, "\n");
+	if (gdef->title) addtobuffer(keydata, gdef->title);
+	addtobuffer(keydata, "\n");
+	if (gdef->yaxis) addtobuffer(keydata, gdef->yaxis);
+	addtobuffer(keydata, "\n");
+	for (i=0; (gdef->defs[i]); i++) {
+		addtobuffer(keydata, gdef->defs[i]); addtobuffer(keydata, "\n");
+	}
+
+	if (hostlist) {
+		for (i=0; (i < hostlistsize); i++) { addtobuffer(keydata, hostlist[i]); addtobuffer(keydata, ","); }
+	}
+	else addtobuffer(keydata, hostname);
+	addtobuffer(keydata, "\n");
+	addtobuffer(keydata, displayname); addtobuffer(keydata, "\n");
+	addtobuffer(keydata, service); addtobuffer(keydata, "\n");
+	addtobuffer(keydata, (period ? period : "")); addtobuffer(keydata, "\n");
+	addtobuffer(keydata, (glegend ? glegend : "")); addtobuffer(keydata, "\n");
+	sprintf(numbuf, "%u %u %d %d %d %d %d %d %f %f\n", 
+		(unsigned int)graphstart, (unsigned int)graphend, graphwidth, graphheight, firstidx, lastidx,
+		haveupperlimit, havelowerlimit, upperlimit, lowerlimit);
+	addtobuffer(keydata, numbuf);
+
+	for (i=0; (i < rrddbcount); i++) {
+		struct stat st;
+
+		addtobuffer(keydata, rrddbs[i].rrdfn); addtobuffer(keydata, "\n");
+		if ((stat(rrddbs[i].rrdfn, &st) == 0) && (st.st_mtime > rrdnewest)) rrdnewest = st.st_mtime;
+	}
+
+	key = strdup(md5hash(STRBUF(keydata)));
+	freestrbuffer(keydata);
+
+	return key;
+}
+
+void graph_header(void)
+{
+	time_t expiretime = getcurrenttime(NULL) + 300;
+	char expirehdr[100];
+
+	printf("Content-type: image/png\n");
+	strftime(expirehdr, sizeof(expirehdr), "Expires: %a, %d %b %Y %H:%M:%S GMT", gmtime(&expiretime));
+	printf("%s\n", expirehdr);
+	printf("\n");
+}
+
+int graphcache_sendfile(char *fn)
+{
+	struct stat st;
+	FILE *fd;
+	char *buf;
+	size_t n;
+
+	fd = fopen(fn, "r");
+	if (fd == NULL) return 0;
+	if (fstat(fileno(fd), &st) != 0) {
+		fclose(fd);
+		return 0;
+	}
+	buf = (char *)malloc(st.st_size);
+	n = fread(buf, 1, st.st_size, fd);
+	fclose(fd);
+	if (n != st.st_size) {
+		xfree(buf);
+		return 0;
+	}
+
+	graph_header();
+	fwrite(buf, 1, n, stdout);
+	xfree(buf);
+
+	return 1;
+}
+
+int graphcache_send(char *key)
+{
+	/* Send the cached graph, if we have it and it is still valid */
+	char fn[PATH_MAX];
+	struct stat st;
+	struct timeval tv[2];
+
+	snprintf(fn, sizeof(fn), "%s/%s.png", cachedir, key);
+	if (stat(fn, &st) != 0) return 0;
+	if (st.st_mtime < rrdnewest) return 0;
+	if ((graphend == 0) && ((getcurrenttime(NULL) - st.st_mtime) > cachemaxage)) return 0;
+	if (!graphcache_sendfile(fn)) return 0;
+	dbgprintf("Graph cache hit for %s\n", key);
+
+	/* Record when it was last used, the cache is cleaned by that. Keep the creation time in mtime */
+	tv[0].tv_sec = getcurrenttime(NULL); tv[0].tv_usec = 0;
+	tv[1].tv_sec = st.st_mtime; tv[1].tv_usec = 0;
+	utimes(fn, tv);
+
+	return 1;
+}
+
+int graphcache_lock(char *key)
+{
+	/* 
+	 * Only one process renders a graph; others requesting the same graph 
+	 * wait for it and then pick up the result from the cache. We use 256
+	 * lock files, so the lock files do not pile up.
+	 */
+	char fn[PATH_MAX];
+	int fd;
+
+	snprintf(fn, sizeof(fn), "%s/lock.%.2s", cachedir, key);
+	fd = open(fn, O_RDWR|O_CREAT, 0664);
+	if (fd == -1) return -1;
+
+	while ((flock(fd, LOCK_EX) == -1) && (errno == EINTR)) ;
+	return fd;
+}
+
+typedef struct cachefile_t {
+	char *fn;
+	off_t size;
+	time_t lastused;
+} cachefile_t;
+
+int cachefile_compare(const void *v1, const void *v2)
+{
+	cachefile_t *c1 = (cachefile_t *)v1;
+	cachefile_t *c2 = (cachefile_t *)v2;
+
+	if (c1->lastused < c2->lastused) return -1;
+	else if (c1->lastused > c2->lastused) return 1;
+	else return 0;
+}
+
+void graphcache_prune(void)
+{
+	/* Remove the least recently used graphs when the cache grows too large */
+	DIR *dir;
+	struct dirent *d;
+	cachefile_t *files = NULL;
+	int count = 0, size = 0, i;
+	off_t total = 0;
+	time_t now = getcurrenttime(NULL);
+
+	dir = opendir(cachedir);
+	if (dir == NULL) return;
+
+	while ((d = readdir(dir)) != NULL) {
+		char fn[PATH_MAX];
+		struct stat st;
+		char *ext = d->d_name + strlen(d->d_name) - 4;
+
+		if (*(d->d_name) == '.') continue;
+		snprintf(fn, sizeof(fn), "%s/%s", cachedir, d->d_name);
+
+		if ((ext > d->d_name) && (strcmp(ext, ".tmp") == 0)) {
+			/* Left over from a failed render */
+			if ((stat(fn, &st) == 0) && ((now - st.st_mtime) > 600)) unlink(fn);
+			continue;
+		}
+		if ((ext <= d->d_name) || (strcmp(ext, ".png") != 0)) continue;
+		if (stat(fn, &st) != 0) continue;
+
+		if (count == size) {
+			size += 256;
+			files = (cachefile_t *)realloc(files, size * sizeof(cachefile_t));
+		}
+		files[count].fn = strdup(fn);
+		files[count].size = st.st_size;
+		files[count].lastused = ((st.st_atime > st.st_mtime) ? st.st_atime : st.st_mtime);
+		total += st.st_size;
+		count++;
+	}
+	closedir(dir);
+
+	if (total > cachemaxsize) {
+		/* Clean up to 90% of the max. size, so we dont have to do this on every request */
+		qsort(files, count, sizeof(cachefile_t), cachefile_compare);
+		for (i = 0; ((i < count) && (total > (cachemaxsize / 10) * 9)); i++) {
+			dbgprintf("Removing cached graph %s\n", files[i].fn);
+			if (unlink(files[i].fn) == 0) total -= files[i].size;
+		}
+	}
+
+	for (i = 0; (i < count); i++) xfree(files[i].fn);
+	if (files) xfree(files);
+}
+
+
 void parse_query(void)
 {
 	cgidata_t *cgidata = NULL, *cwalk;
@@ -782,6 +997,12 @@ void generate_graph(char *gdeffn, char *rrddir, char *graphfn)
 	int xsize, ysize;
 	double ymin, ymax;
 
+	/* Graph cache */
+	char *cachekey = NULL;
+	int cachelock = -1;
+	char cachefn[PATH_MAX];
+	char cachetmpfn[PATH_MAX];
+
 	/* Find the graphs.cfg file and load it */
 	if (gdeffn == NULL) {
 		char fnam[PATH_MAX];
@@ -859,13 +1080,6 @@ void generate_graph(char *gdeffn, char *rrddir, char *graphfn)
 	}
 	if (chdir(rrddir)) errormsg("Cannot access RRD directory");
 
-	/* Request an RRD cache flush from the xymond_rrd update daemon */
-	if (hostlist) {
-		int i;
-		for (i=0; (i < hostlistsize); i++) request_cacheflush(hostlist[i]);
-	}
-	else if (hostname) request_cacheflush(hostname);
-
 	/* What RRD files do we have matching this request? */
 	if (hostlist || (gdef->fnpat == NULL)) {
 		/*
@@ -903,6 +1117,9 @@ void generate_graph(char *gdeffn, char *rrddir, char *graphfn)
 	}
 	else {
 		struct dirent *d;
+		rrdindex_t *rrdidx;
+		int rrdidxcount, rrdidxpos = 0;
+		char *fn;
 		pcre *pat, *expat = NULL;
 		const char *errmsg;
 		int errofs, result;
@@ -910,8 +1127,14 @@ void generate_graph(char *gdeffn, char *rrddir, char *graphfn)
 		struct stat st;
 		time_t now = getcurrenttime(NULL);
 
-		/* Scan the directory to see what RRD files are there that match */
-		dir = opendir("."); if (dir == NULL) errormsg("Unexpected error while accessing RRD directory");
+		/* 
+		 * See what RRD files are there that match. Use the RRD index from 
+		 * xymond_rrd if we have one, otherwise scan the directory.
+		 */
+		rrdidx = rrdindex_load(".", &rrdidxcount, 0);
+		if (!rrdidx) {
+			dir = opendir("."); if (dir == NULL) errormsg("Unexpected error while accessing RRD directory");
+		}
 
 		/* Setup the pattern to match filenames against */
 		pat = pcre_compile(gdef->fnpat, PCRE_CASELESS, &errmsg, &errofs, NULL);
@@ -938,43 +1161,43 @@ void generate_graph(char *gdeffn, char *rrddir, char *graphfn)
 		rrddbsize = 5;
 		rrddbs = (rrddb_t *) malloc((rrddbsize+1) * sizeof(rrddb_t));
 
-		while ((d = readdir(dir)) != NULL) {
+		while ((fn = (rrdidx ? rrdidx[rrdidxpos++].rrdfn : ((d = readdir(dir)) ? d->d_name : NULL))) != NULL) {
 			char *ext;
 			char param[PATH_MAX];
 
-			/* Ignore dot-files and files with names shorter than ".rrd" */
-			if (*(d->d_name) == '.') continue;
-			ext = d->d_name + strlen(d->d_name) - strlen(".rrd");
-			if ((ext <= d->d_name) || (strcmp(ext, ".rrd") != 0)) continue;
+			/* Ignore dot-files, files in sub-directories and files with names shorter than ".rrd" */
+			if ((*fn == '.') || strchr(fn, '/')) continue;
+			ext = fn + strlen(fn) - strlen(".rrd");
+			if ((ext <= fn) || (strcmp(ext, ".rrd") != 0)) continue;
 
 			/* First check the exclude pattern. */
 			if (expat) {
-				result = pcre_exec(expat, NULL, d->d_name, strlen(d->d_name), 0, 0, 
+				result = pcre_exec(expat, NULL, fn, strlen(fn), 0, 0, 
 						   ovector, (sizeof(ovector)/sizeof(int)));
 				if (result >= 0) continue;
 			}
 
 			/* Then see if the include pattern matches. */
-			result = pcre_exec(pat, NULL, d->d_name, strlen(d->d_name), 0, 0, 
+			result = pcre_exec(pat, NULL, fn, strlen(fn), 0, 0, 
 					   ovector, (sizeof(ovector)/sizeof(int)));
 			if (result < 0) continue;
 
 			if (wantsingle) {
 				/* "Single" graph, i.e. a graph for a service normally included in a bundle (tcp) */
-				if (strstr(d->d_name, service) == NULL) continue;
+				if (strstr(fn, service) == NULL) continue;
 			}
 
 			/* 
 			 * Has it been updated recently (within the past 24 hours) ? 
 			 * We dont want old graphs to mess up multi-displays.
 			 */
-			if (ignorestalerrds && (stat(d->d_name, &st) == 0) && ((now - st.st_mtime) > 86400)) {
+			if (ignorestalerrds && (stat(fn, &st) == 0) && ((now - st.st_mtime) > 86400)) {
 				continue;
 			}
 
 			/* We have a matching file! */
-			rrddbs[rrddbcount].rrdfn = strdup(d->d_name);
-			if (pcre_copy_substring(d->d_name, ovector, result, 1, param, sizeof(param)) > 0) {
+			rrddbs[rrddbcount].rrdfn = strdup(fn);
+			if (pcre_copy_substring(fn, ovector, result, 1, param, sizeof(param)) > 0) {
 				/*
 				 * This is ugly, but I cannot find a pretty way of un-mangling
 				 * the disk- and http-data that has been molested by the back-end.
@@ -1001,7 +1224,7 @@ void generate_graph(char *gdeffn, char *rrddir, char *graphfn)
 				rrddbs[rrddbcount].key = strdup(rrddbs[rrddbcount].rrdparam);
 			}
 			else {
-				rrddbs[rrddbcount].key = strdup(d->d_name);
+				rrddbs[rrddbcount].key = strdup(fn);
 				rrddbs[rrddbcount].rrdparam = NULL;
 			}
 
@@ -1013,13 +1236,37 @@ void generate_graph(char *gdeffn, char *rrddir, char *graphfn)
 		}
 		pcre_free(pat);
 		if (expat) pcre_free(expat);
-		closedir(dir);
+		if (rrdidx) rrdindex_free(rrdidx); else closedir(dir);
 	}
 	rrddbs[rrddbcount].key = rrddbs[rrddbcount].rrdfn = rrddbs[rrddbcount].rrdparam = NULL;
 
 	/* Sort them so the display looks prettier */
 	qsort(&rrddbs[0], rrddbcount, sizeof(rrddb_t), rrd_name_compare);
 
+	/* If we have this graph in the cache, just send it */
+	if (cachedir && (action == ACT_VIEW) && (strcmp(graphfn, "-") == 0) && (rrddbcount > 0)) {
+		cachekey = graphcache_key(gdef);
+		if (graphcache_send(cachekey)) return;
+
+		/* Someone else may be generating it right now, so wait for them to finish */
+		cachelock = graphcache_lock(cachekey);
+		if (graphcache_send(cachekey)) {
+			if (cachelock != -1) close(cachelock);
+			return;
+		}
+
+		snprintf(cachefn, sizeof(cachefn), "%s/%s.png", cachedir, cachekey);
+		snprintf(cachetmpfn, sizeof(cachetmpfn), "%s/%s.%d.tmp", cachedir, cachekey, (int)getpid());
+		graphfn = cachetmpfn;
+	}
+
+	/* Request an RRD cache flush from the xymond_rrd update daemon */
+	if (hostlist) {
+		int i;
+		for (i=0; (i < hostlistsize); i++) request_cacheflush(hostlist[i]);
+	}
+	else if (hostname) request_cacheflush(hostname);
+
 	/* Setup the title */
 	if (!gdef->title) gdef->title = strdup("");
 	if (strncmp(gdef->title, "exec:", 5) == 0) {
@@ -1119,13 +1366,7 @@ void generate_graph(char *gdeffn, char *rrddir, char *graphfn)
 
 	/* If sending to stdout, print the HTTP header first. */
 	if ((action == ACT_VIEW) && (strcmp(graphfn, "-") == 0)) {
-		time_t expiretime = now + 300;
-		char expirehdr[100];
-
-		printf("Content-type: image/png\n");
-		strftime(expirehdr, sizeof(expirehdr), "Expires: %a, %d %b %Y %H:%M:%S GMT", gmtime(&expiretime));
-		printf("%s\n", expirehdr);
-		printf("\n");
+		graph_header();
 
 #ifdef HIDE_EMPTYGRAPH
 		/* It works, but we still get the "zoom" magnifying glass which looks odd */
@@ -1164,8 +1405,25 @@ void generate_graph(char *gdeffn, char *rrddir, char *graphfn)
 			calcpr = NULL;
 		}
 
+		if (cachekey) unlink(cachetmpfn);
 		errormsg(rrd_get_error());
 	}
+
+	if (cachekey) {
+		/* Put the new graph in the cache, and send it */
+		if (rename(cachetmpfn, cachefn) == 0) {
+			if (!graphcache_sendfile(cachefn)) errormsg("Cannot read generated graph");
+		}
+		else {
+			errprintf("Cannot rename %s to %s: %s\n", cachetmpfn, cachefn, strerror(errno));
+			if (!graphcache_sendfile(cachetmpfn)) errormsg("Cannot read generated graph");
+			unlink(cachetmpfn);
+		}
+		fflush(stdout);
+
+		if (cachelock != -1) close(cachelock);
+		graphcache_prune();
+	}
 }
 
 void generate_zoompage(char *selfURI)
@@ -1261,7 +1519,38 @@ int main(int argc, char *argv[])
 			char *p = strchr(argv[argi], '=');
 			graphfn = strdup(p+1);
 		}
+		else if (argnmatch(argv[argi], "--cache-dir=")) {
+			char *p = strchr(argv[argi], '=');
+			cachedir = strdup(p+1);
+		}
+		else if (argnmatch(argv[argi], "--cache-size=")) {
+			char *p = strchr(argv[argi], '=');
+			cachemaxsize = (off_t)atoi(p+1) * 1024 * 1024;
+		}
+		else if (argnmatch(argv[argi], "--cache-maxage=")) {
+			char *p = strchr(argv[argi], '=');
+			cachemaxage = atoi(p+1);
+		}
+		else if (strcmp(argv[argi], "--no-cache") == 0) {
+			usecache = 0;
+		}
+	}
+
+	if (usecache) {
+		/* Setup the graph cache directory. If we cannot, just run without a cache */
+		struct stat st;
+
+		if (!cachedir) {
+			cachedir = (char *)malloc(strlen(xgetenv("XYMONTMP")) + strlen("/graphcache") + 1);
+			sprintf(cachedir, "%s/graphcache", xgetenv("XYMONTMP"));
+		}
+		if ((stat(cachedir, &st) != 0) && (mkdir(cachedir, 0775) != 0) && (errno != EEXIST)) {
+			dbgprintf("Cannot create graph cache directory %s: %s\n", cachedir, strerror(errno));
+			xfree(cachedir);
+		}
+		if (cachedir && (cachemaxsize <= 0)) xfree(cachedir);
 	}
+	else if (cachedir) xfree(cachedir);
 
 	redirect_cgilog("showgraph");
 
@@ -233,15 +233,20 @@ char *generate_trends(char *hostname, time_t starttime, time_t endtime)
 	graph_t *rwalk;
 	char *allrrdlinks = NULL, *allrrdlinksend;
 	unsigned int allrrdlinksize = 0;
+	rrdindex_t *rrdidx;
+	int rrdidxcount, rrdidxpos = 0;
 
 	myhost = hostinfo(hostname);
 	if (!myhost) return NULL;
 
 	sprintf(hostrrddir, "%s/%s", xgetenv("XYMONRRDS"), hostname);
 	chdir(hostrrddir);
-	stack_opendir(".");
 
-	while ((fn = stack_readdir())) {
+	/* Use the RRD index from xymond_rrd if we have one, otherwise scan the directory */
+	rrdidx = rrdindex_load(hostrrddir, &rrdidxcount, 0);
+	if (!rrdidx) stack_opendir(".");
+
+	while ((fn = (rrdidx ? rrdidx[rrdidxpos++].rrdfn : stack_readdir()))) {
 		/* Check if the filename ends in ".rrd", and we know how to handle this RRD */
 		if ((strlen(fn) <= 4) || (strcmp(fn+strlen(fn)-4, ".rrd") != 0)) continue;
 		graph = find_xymon_graph(fn); if (!graph) continue;
@@ -268,7 +273,7 @@ char *generate_trends(char *hostname, time_t starttime, time_t endtime)
 				rwalk->gdef->xymonrrdname, rwalk->count);
 		}
 	}
-	stack_closedir();
+	if (rrdidx) rrdindex_free(rrdidx); else stack_closedir();
 
 	if (!anyrrds) return NULL;
 
@@ -246,6 +246,7 @@ typedef struct c_rule_t {
 	exprlist_t *classexp;
 	exprlist_t *exclassexp;
 	char *timespec, *statustext, *rrdidstr, *groups;
+	void *timewindow;		/* Compiled timespec */
 	ruletype_t ruletype;
 	int cfid;
 	unsigned int flags;
@@ -437,7 +438,10 @@ static c_rule_t *setup_rule(ruletype_t ruletype,
 	newitem->exdgexp = curexdg;
 	newitem->classexp = curclass;
 	newitem->exclassexp = curexclass;
-	if (curtime) newitem->timespec = strdup(curtime);
+	if (curtime) {
+		newitem->timespec = strdup(curtime);
+		newitem->timewindow = get_timespec(curtime);
+	}
 	if (curtext) newitem->statustext = strdup(curtext);
 	if (curgroup) newitem->groups = strdup(curgroup);
 	newitem->cfid = cfid;
@@ -676,7 +680,10 @@ int load_client_config(char *configfn)
 			}
 			else if (strncasecmp(tok, "TIME=", 5) == 0) {
 				char *p = strchr(tok, '=');
-				if (currule) currule->timespec = strdup(p+1);
+				if (currule) {
+					currule->timespec = strdup(p+1);
+					currule->timewindow = get_timespec(currule->timespec);
+				}
 				else newtime = strdup(p+1);
 				tok = wstok(NULL); continue;
 			}
@@ -1893,6 +1900,7 @@ static c_rule_t *getrule(char *hostname, char *pagename, char *classname, void *
 {
 	static ruleset_t *rwalk = NULL;
 	char *holidayset;
+	time_t tnow = getcurrenttime(NULL);
 
 	if (hostname || pagename) {
 		rwalk = ruleset(hostname, pagename, classname); 
@@ -1905,7 +1913,7 @@ static c_rule_t *getrule(char *hostname, char *pagename, char *classname, void *
 
 	for (; (rwalk); rwalk = rwalk->next) {
 		if (rwalk->rule->ruletype != ruletype) continue;
-		if (rwalk->rule->timespec && !timematch(holidayset, rwalk->rule->timespec)) continue;
+		if (rwalk->rule->timewindow && !timespec_covers(rwalk->rule->timewindow, holidayset, tnow)) continue;
 
 		/* If we get here, then we have something that matches */
 		return rwalk->rule;
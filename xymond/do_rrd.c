@@ -21,6 +21,7 @@ static char rcsid[] = "$Id: do_rrd.c 6779 2011-11-30 10:07:02Z storner $";
 #include <ctype.h>
 #include <errno.h>
 #include <utime.h>
+#include <dirent.h>
 
 #include <rrd.h>
 #include <pcre.h>
@@ -76,6 +77,9 @@ typedef struct flushtree_t {
 	time_t flushtime;
 } flushtree_t;
 
+static void * rrdindextree;	/* Hosts where we have checked the RRD index since startup */
+static int have_rrdindextree = 0;
+
 
 void setup_exthandler(char *handlerpath, char *ids)
 {
@@ -260,6 +264,103 @@ static int flush_cached_updates(updcacheitem_t *cacheitem, char *newdata)
 	return result;
 }
 
+static char *rrdfile_dsnames(char *fn)
+{
+	/* Get the dataset names from an existing RRD file */
+	static strbuffer_t *result = NULL;
+	char *fetch_params[] = { "rrdfetch", fn, "AVERAGE", "-s", "-30m", NULL };
+	time_t starttime, endtime;
+	unsigned long steptime, dscount, i;
+	char **dsnames = NULL;
+	rrd_value_t *rrddata = NULL;
+
+	if (!result) result = newstrbuffer(0); else clearstrbuffer(result);
+
+	optind = opterr = 0; rrd_clear_error();
+	if (rrd_fetch(5, fetch_params, &starttime, &endtime, &steptime, &dscount, &dsnames, &rrddata) == -1) {
+		dbgprintf("Cannot get dataset names from %s: %s\n", fn, rrd_get_error());
+		return "";
+	}
+
+	for (i = 0; (i < dscount); i++) {
+		if (i > 0) addtobuffer(result, ":");
+		addtobuffer(result, dsnames[i]);
+		free(dsnames[i]);
+	}
+	free(dsnames);
+	free(rrddata);
+
+	return STRBUF(result);
+}
+
+static int rrdindex_namecompare(const void *v1, const void *v2)
+{
+	return strcmp(((rrdindex_t *)v1)->rrdfn, ((rrdindex_t *)v2)->rrdfn);
+}
+
+static void rrdindex_scan(char *hostrrddir, char *subdir, rrdindex_t *oldidx, int oldcount, rrdindex_t **idx, int *count, int *size)
+{
+	char dirfn[PATH_MAX];
+	DIR *d;
+	struct dirent *de;
+
+	if (subdir) snprintf(dirfn, sizeof(dirfn), "%s/%s", hostrrddir, subdir); else strcpy(dirfn, hostrrddir);
+	d = opendir(dirfn);
+	if (d == NULL) return;
+
+	while ((de = readdir(d)) != NULL) {
+		char relfn[PATH_MAX], fn[PATH_MAX];
+		struct stat st;
+		int len = strlen(de->d_name);
+		rrdindex_t key, *old;
+
+		if (*(de->d_name) == '.') continue;
+
+		if (subdir) snprintf(relfn, sizeof(relfn), "%s/%s", subdir, de->d_name); else strcpy(relfn, de->d_name);
+		snprintf(fn, sizeof(fn), "%s/%s", hostrrddir, relfn);
+		if (stat(fn, &st) != 0) continue;
+		if (S_ISDIR(st.st_mode)) {
+			rrdindex_scan(hostrrddir, relfn, oldidx, oldcount, idx, count, size);
+			continue;
+		}
+		if ((len <= 4) || (strcmp(de->d_name+len-4, ".rrd") != 0)) continue;
+
+		if (*count == *size) {
+			*size += 256;
+			*idx = (rrdindex_t *)realloc(*idx, (*size) * sizeof(rrdindex_t));
+		}
+
+		/* The dataset names rarely change, so get them from the old index if possible */
+		key.rrdfn = relfn;
+		old = (oldidx ? (rrdindex_t *)bsearch(&key, oldidx, oldcount, sizeof(rrdindex_t), rrdindex_namecompare) : NULL);
+		(*idx)[*count].rrdfn = strdup(relfn);
+		(*idx)[*count].dsnames = strdup((old && *(old->dsnames)) ? old->dsnames : rrdfile_dsnames(fn));
+		(*count)++;
+	}
+
+	closedir(d);
+}
+
+static void rebuild_rrdindex(char *hostrrddir)
+{
+	rrdindex_t *oldidx, *idx = NULL;
+	int oldcount, count = 0, size = 0, i;
+
+	/* The caller holds the index lock */
+	dbgprintf("Rebuilding RRD index for %s\n", hostrrddir);
+
+	oldidx = rrdindex_load(hostrrddir, &oldcount, 1);
+	rrdindex_scan(hostrrddir, NULL, oldidx, oldcount, &idx, &count, &size);
+	rrdindex_write(hostrrddir, idx, count);
+
+	for (i = 0; (i < count); i++) {
+		xfree(idx[i].rrdfn);
+		xfree(idx[i].dsnames);
+	}
+	if (idx) xfree(idx);
+	rrdindex_free(oldidx);
+}
+
 static int create_and_update_rrd(char *hostname, char *testname, char *classname, char *pagepaths, char *creparams[], void *template)
 {
 	static int callcounter = 0;
@@ -293,6 +394,21 @@ static int create_and_update_rrd(char *hostname, char *testname, char *classname
 			return -1;
 		}
 	}
+
+	/* The first time we see a host, make sure the RRD index is up-to-date */
+	if (!have_rrdindextree) {
+		rrdindextree = xtreeNew(strcasecmp);
+		have_rrdindextree = 1;
+	}
+	if (xtreeFind(rrdindextree, hostname) == xtreeEnd(rrdindextree)) {
+		char *key = strdup(hostname);
+		int lockfd = rrdindex_lock(filedir);
+
+		if (!rrdindex_valid(filedir)) rebuild_rrdindex(filedir);
+		rrdindex_unlock(lockfd);
+		xtreeAdd(rrdindextree, key, key);
+	}
+
 	/* Watch out here - "rrdfn" may be very large. */
 	snprintf(filedir, sizeof(filedir)-1, "%s/%s/%s", rrddir, hostname, rrdfn);
 	filedir[sizeof(filedir)-1] = '\0'; /* Make sure it is null terminated */
@@ -334,9 +450,16 @@ static int create_and_update_rrd(char *hostname, char *testname, char *classname
 		char *rrakey = NULL;
 		char stepsetting[10];
 		int havestepsetting = 0, fixcount = 2;
+		char hostrrddir[PATH_MAX];
+		int indexok, lockfd;
 
 		dbgprintf("Creating rrd %s\n", filedir);
 
+		/* Hold the index lock until the new file is in the index */
+		snprintf(hostrrddir, sizeof(hostrrddir), "%s/%s", rrddir, hostname);
+		lockfd = rrdindex_lock(hostrrddir);
+		indexok = rrdindex_valid(hostrrddir);
+
 		/* How many parameters did we get? */
 		for (pcount = 0; (creparams[pcount]); pcount++);
 
@@ -383,10 +506,17 @@ static int create_and_update_rrd(char *hostname, char *testname, char *classname
 
 		if (result != 0) {
 			errprintf("RRD error creating %s: %s\n", filedir, rrd_get_error());
+			rrdindex_unlock(lockfd);
 			MEMUNDEFINE(filedir);
 			MEMUNDEFINE(rrdvalues);
 			return 1;
 		}
+
+		/* Add it to the RRD index. If the index was out of date already, rebuild it */
+		if (!indexok || (rrdindex_append(hostrrddir, rrdfn, ((rrdtpldata_t *)template)->template) != 0)) {
+			rebuild_rrdindex(hostrrddir);
+		}
+		rrdindex_unlock(lockfd);
 	}
 
 	updtime = atoi(rrdvalues);
@@ -523,19 +653,45 @@ void rrdcacheflushall(void)
 	}
 }
 
-void rrdcacheflushhost(char *hostname)
+static void flush_cached_host(char *hostname)
 {
 	xtreePos_t handle;
 	updcacheitem_t *cacheitem;
+	int keylen = strlen(hostname);
+
+	handle = xtreeFirst(updcache); 
+	while (handle != xtreeEnd(updcache)) {
+		cacheitem = (updcacheitem_t *) xtreeData(updcache, handle);
+
+		switch (strncasecmp(cacheitem->key, hostname, keylen)) {
+		  case 1 :
+			handle = xtreeEnd(updcache); break;
+
+		  case 0:
+			if (cacheitem->valcount > 0) {
+				dbgprintf("Flushing cache '%s'\n", cacheitem->key);
+				sprintf(filedir, "%s%s", rrddir, cacheitem->key);
+				flush_cached_updates(cacheitem, NULL);
+			}
+			/* Fall through */
+
+		  default:
+			handle = xtreeNext(updcache, handle);
+			break;
+		}
+	}
+}
+
+void rrdcacheflushhost(char *hostname)
+{
+	xtreePos_t handle;
 	flushtree_t *flushitem;
-	int keylen;
 	time_t now = gettimer();
 
 	if (updcache_keyofs == -1) return;
 
 	/* If we get a full path for the key, skip the leading rrddir */
 	if (strncmp(hostname, rrddir, updcache_keyofs) == 0) hostname += updcache_keyofs;
-	keylen = strlen(hostname);
 
 	if (!have_flushtree) {
 		flushtree = xtreeNew(strcasecmp);
@@ -558,27 +714,20 @@ void rrdcacheflushhost(char *hostname)
 	}
 	flushitem->flushtime = now;
 
-	handle = xtreeFirst(updcache); 
-	while (handle != xtreeEnd(updcache)) {
-		cacheitem = (updcacheitem_t *) xtreeData(updcache, handle);
+	flush_cached_host(hostname);
+}
 
-		switch (strncasecmp(cacheitem->key, hostname, keylen)) {
-		  case 1 :
-			handle = xtreeEnd(updcache); break;
+void rrdcachehandoffhost(char *hostname)
+{
+	/* Host is moving to another RRD server - flush everything we have for it, right now */
+	char *key;
 
-		  case 0:
-			if (cacheitem->valcount > 0) {
-				dbgprintf("Flushing cache '%s'\n", cacheitem->key);
-				sprintf(filedir, "%s%s", rrddir, cacheitem->key);
-				flush_cached_updates(cacheitem, NULL);
-			}
-			/* Fall through */
+	if (updcache_keyofs == -1) return;
 
-		  default:
-			handle = xtreeNext(updcache, handle);
-			break;
-		}
-	}
+	key = (char *)malloc(strlen(hostname) + 3);
+	sprintf(key, "/%s/", hostname);
+	flush_cached_host(key);
+	xfree(key);
 }
 
 static int rrddatasets(char *hostname, char ***dsnames)
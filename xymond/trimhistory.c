@@ -14,12 +14,14 @@ static char rcsid[] = "$Id: trimhistory.c 6712 2011-07-31 21:01:52Z storner $";
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <utime.h>
 #include <limits.h>
 #include <signal.h>
@@ -27,31 +29,27 @@ static char rcsid[] = "$Id: trimhistory.c 6712 2011-07-31 21:01:52Z storner $";
 #include "libxymon.h"
 
 enum ftype_t { F_HOSTHISTORY, F_SERVICEHISTORY, F_ALLEVENTS, F_DROPIT, F_PURGELOGS };
-typedef struct filelist_t {
-	char *fname;
-	enum ftype_t ftype;
-	struct filelist_t *next;
-} filelist_t;
-filelist_t *flhead = NULL;
 
 char *outdir = NULL;
 int progressinfo = 0;
-int totalitems = 0;
+int dropsvcs = 0;
+int dropfiles = 0;
+time_t cutoff = 0;
+static int itemcount = 0;
 
-void showprogress(int itemno)
+void showprogress(int workerno)
 {
-	errprintf("Processing item %d/%d ... \n", itemno, totalitems);
+	itemcount++;
+	if (progressinfo && ((itemcount % progressinfo) == 0)) {
+		errprintf("Worker %d: Processed %d items ... \n", workerno, itemcount);
+	}
 }
 
-int validstatus(char *hname, char *tname)
-{
-	/* Check if a status-file is for a known host+service combination */
-	static char *board = NULL;
-	char buf[1024];
-	char *p;
-	int result = 0;
-
+static char *board = NULL;
 
+void load_board(void)
+{
+	/* Get the list of host+service combinations from xymond */
 	if (!board) {
 		sendreturn_t *sres;
 
@@ -78,163 +76,22 @@ int validstatus(char *hname, char *tname)
 			}
 		}
 	}
-
-	sprintf(buf, "%s|%s\n", hname, tname);
-	p = strstr(board, buf);
-	if (p) result = ( (p == board) || (*(p-1) == '\n'));
-
-	return result;
-}
-
-void add_to_filelist(char *fn, enum ftype_t ftype)
-{
-	/* This keeps track of what files we must process - and how */
-	filelist_t *newitem;
-
-	newitem = (filelist_t *)malloc(sizeof(filelist_t));
-	newitem->fname = strdup(fn);
-	newitem->ftype = ftype;
-	newitem->next = flhead;
-	flhead = newitem;
-
-	totalitems++;
-}
-
-
-void trim_history(FILE *infd, FILE *outfd, enum ftype_t ftype, time_t cutoff)
-{
-	/* Does the grunt work of going through a file and copying the wanted records */
-	char l[4096], prevl[4096], l2[4096];
-	char *cols[10];
-	int i;
-	int copying = 0;
-
-	*prevl = '\0';
-
-	while (fgets(l, sizeof(l), infd)) {
-		if (copying) {
-			fprintf(outfd, "%s", l);
-		}
-		else {
-			/* Split up the input line into columns, and find the timestamp depending on the file type */
-			memset(cols, 0, sizeof(cols));
-			strcpy(l2, l); i = 0; cols[i++] = strtok(l2, " "); 
-			while ((i < 10) && ((cols[i++] = strtok(NULL, " ")) != NULL)) ;
-
-			switch (ftype) {
-			  case F_HOSTHISTORY:
-				copying = (!cols[1] || (atoi(cols[1]) >= cutoff));
-				break;
-
-			  case F_SERVICEHISTORY:
-				copying = (!cols[6] || (atoi(cols[6]) >= cutoff));
-				break;
-
-			  case F_ALLEVENTS:
-				copying = (!cols[3] || (atoi(cols[3]) >= cutoff));
-				break;
-
-			  case F_DROPIT:
-			  case F_PURGELOGS:
-				/* Cannot happen */
-				errprintf("Impossible - F_DROPIT/F_PURGELOGS in trim_history\n");
-				return;
-			}
-
-			/* If we switched to copy-mode, start by outputting the previous and the current lines */
-			if (copying) {
-				if (*prevl) fprintf(outfd, "%s", prevl);
-				fprintf(outfd, "%s", l);
-			}
-			else {
-				strcpy(prevl, l);
-			}
-		}
-	}
-
-	if (!copying) {
-		/* No entries after the cutoff time - keep the last line */
-		if (*prevl) fprintf(outfd, "%s", prevl);
-	}
 }
 
-void trim_files(time_t cutoff)
+int validstatus(char *hname, char *tname)
 {
-	filelist_t *fwalk;
-	FILE *infd, *outfd;
-	char outfn[PATH_MAX];
-	struct stat st;
-	struct utimbuf tstamp;
-	int itemno = 0;
-
-	/* We have a list of files to trim, so process them */
-	for (fwalk = flhead; (fwalk); fwalk = fwalk->next) {
-		dbgprintf("Processing %s\n", fwalk->fname);
-		itemno++; if (progressinfo && ((itemno % progressinfo) == 0)) showprogress(itemno); 
-
-		if (fwalk->ftype == F_DROPIT) {
-			/* It's an orphan, and we want to delete it */
-			unlink(fwalk->fname); 
-			continue;
-		}
-
-		if (stat(fwalk->fname, &st) == -1) {
-			errprintf("Cannot stat input file %s: %s\n", fwalk->fname, strerror(errno));
-			continue;
-		}
-		tstamp.actime = time(NULL);
-		tstamp.modtime = st.st_mtime;
-
-		infd = fopen(fwalk->fname, "r");
-		if (infd == NULL) {
-			errprintf("Cannot open input file %s: %s\n", fwalk->fname, strerror(errno));
-			continue;
-		}
-
-		if (outdir) {
-			sprintf(outfn, "%s/%s", outdir, fwalk->fname);
-		}
-		else {
-			sprintf(outfn, "%s.tmp", fwalk->fname);
-		}
-		outfd = fopen(outfn, "w");
-		if (outfd == NULL) {
-			errprintf("Cannot create output file %s: %s\n", outfn, strerror(errno));
-			fclose(infd);
-			continue;
-		}
-
-		trim_history(infd, outfd, fwalk->ftype, cutoff);
-		if (fwalk->ftype == F_ALLEVENTS) {
-			char pidfn[PATH_MAX];
-			FILE *fd;
-			long pid = -1;
-
-			sprintf(pidfn, "%s/xymond_history.pid", xgetenv("XYMONSERVERLOGS"));
-			fd = fopen(pidfn, "r");
-			if (fd) {
-				char l[100];
-				fgets(l, sizeof(l), fd);
-				fclose(fd);
-				pid = atol(l);
-			}
+	/* Check if a status-file is for a known host+service combination */
+	char buf[1024];
+	char *p;
+	int result = 0;
 
-			if (pid > 0) kill(pid, SIGHUP);
-		}
+	load_board();
 
-		fclose(infd);
-		fclose(outfd);
-		utime(outfn, &tstamp);	/* So the access time is consistent with the last update */
+	sprintf(buf, "%s|%s\n", hname, tname);
+	p = strstr(board, buf);
+	if (p) result = ( (p == board) || (*(p-1) == '\n'));
 
-		/* Final check to make sure the file didn't change while we were processing it */
-		if ((stat(fwalk->fname, &st) == 0) && (st.st_mtime == tstamp.modtime)) {
-			if (!outdir) rename(outfn, fwalk->fname);
-		}
-		else {
-			errprintf("File %s changed while processing it - not trimmed\n", fwalk->fname);
-			unlink(outfn);
-		}
-	}
+	return result;
 }
 
 time_t logtime(char *fn)
@@ -291,82 +148,394 @@ time_t logtime(char *fn)
 	return result;
 }
 
-void trim_logs(time_t cutoff)
+/*
+ * The work is split between a number of worker processes. Each of them
+ * reads the directory, and handles the entries that hash to its number.
+ * So there is no list of all the files, and no communication between
+ * the workers.
+ */
+typedef void (*workerfunc_t)(int workerno, int workercount);
+
+static int myentry(char *name, int workerno, int workercount)
 {
-	filelist_t *fwalk;
-	DIR *ldir = NULL, *sdir = NULL;
-	struct dirent *sent, *lent;
-	time_t ltime;
-	char fn1[PATH_MAX], fn2[PATH_MAX];
-	int itemno = 0;
-
-	/* We have a list of directories to trim, so process them */
-	for (fwalk = flhead; (fwalk); fwalk = fwalk->next) {
-		dbgprintf("Processing %s\n", fwalk->fname);
-		itemno++; if (progressinfo && ((itemno % progressinfo) == 0)) showprogress(itemno); 
-
-		switch (fwalk->ftype) {
-		  case F_DROPIT:
-			/* It's an orphan, and we want to delete it */
-			dropdirectory(fwalk->fname, 0);
-			break;
-
-		  case F_PURGELOGS:
-			sdir = opendir(fwalk->fname);
-			if (sdir == NULL) {
-				errprintf("Cannot process directory %s: %s\n", fwalk->fname, strerror(errno));
-				break;
+	unsigned int h = 5381;
+	unsigned char *p;
+
+	if (workercount <= 1) return 1;
+
+	for (p = (unsigned char *)name; (*p); p++) h = ((h << 5) + h) + *p;
+	return ((h % workercount) == workerno);
+}
+
+static int run_workers(workerfunc_t func, int workercount)
+{
+	int i, status, failed = 0;
+	pid_t pid;
+
+	if (workercount <= 1) {
+		func(0, 1);
+		return 0;
+	}
+
+	fflush(NULL);
+	for (i = 0; (i < workercount); i++) {
+		pid = fork();
+		if (pid == 0) {
+			func(i, workercount);
+			exit(0);
+		}
+		else if (pid == -1) {
+			errprintf("Cannot fork worker %d, doing its work here: %s\n", i, strerror(errno));
+			func(i, workercount);
+		}
+	}
+
+	while (wait(&status) > 0) {
+		if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) failed++;
+	}
+
+	return failed;
+}
+
+
+static int line_is_old(char *l, enum ftype_t ftype)
+{
+	/* Split up the input line into columns, and find the timestamp depending on the file type */
+	char l2[4096];
+	char *cols[10];
+	int i, col;
+
+	switch (ftype) {
+	  case F_HOSTHISTORY: col = 1; break;
+	  case F_SERVICEHISTORY: col = 6; break;
+	  case F_ALLEVENTS: col = 3; break;
+	  default: return 0;
+	}
+
+	memset(cols, 0, sizeof(cols));
+	strcpy(l2, l); i = 0; cols[i++] = strtok(l2, " "); 
+	while ((i < 10) && ((cols[i++] = strtok(NULL, " ")) != NULL)) ;
+
+	return (cols[col] && (atoi(cols[col]) < cutoff));
+}
+
+static off_t keep_offset(int fd, enum ftype_t ftype)
+{
+	/*
+	 * Find where the entries we keep begin. That is the last entry before 
+	 * the cutoff time (it tells the state at the cutoff time), or the 
+	 * first entry if none are before the cutoff time.
+	 */
+	FILE *infd;
+	char l[4096];
+	off_t lineofs = 0, prevofs = -1;
+	int atlinestart = 1;
+
+	infd = fdopen(dup(fd), "r");
+	if (infd == NULL) return -1;
+
+	while (fgets(l, sizeof(l), infd)) {
+		int complete = (strchr(l, '\n') != NULL);
+
+		if (atlinestart) {
+			if (!line_is_old(l, ftype)) break;
+			prevofs = lineofs;
+		}
+
+		atlinestart = complete;
+		if (complete) lineofs = ftello(infd);
+	}
+	fclose(infd);
+
+	/* If all entries are before the cutoff time, prevofs is the last entry */
+	return ((prevofs >= 0) ? prevofs : 0);
+}
+
+static int copy_data(int infd, off_t ofs, int outfd)
+{
+	char buf[65536];
+	ssize_t n;
+
+	while ((n = pread(infd, buf, sizeof(buf), ofs)) > 0) {
+		if (write(outfd, buf, n) != n) return -1;
+		ofs += n;
+	}
+
+	return ((n == 0) ? 0 : -1);
+}
+
+static void trim_file(int dfd, int outdfd, char *fname, enum ftype_t ftype)
+{
+	int fd, outfd;
+	struct stat st, st2;
+	struct timespec tstamp[2];
+	off_t keepofs;
+	char tmpfn[PATH_MAX];
+
+	fd = openat(dfd, fname, O_RDONLY);
+	if (fd == -1) {
+		errprintf("Cannot open input file %s: %s\n", fname, strerror(errno));
+		return;
+	}
+	if (fstat(fd, &st) == -1) {
+		errprintf("Cannot stat input file %s: %s\n", fname, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	/* So the access time is consistent with the last update */
+	tstamp[0].tv_sec = time(NULL); tstamp[0].tv_nsec = 0;
+	tstamp[1].tv_sec = st.st_mtime; tstamp[1].tv_nsec = 0;
+
+	keepofs = keep_offset(fd, ftype);
+	if (keepofs < 0) {
+		errprintf("Cannot read input file %s: %s\n", fname, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	if ((outdfd == -1) && (keepofs == 0)) {
+		/* Nothing to trim */
+		close(fd);
+		return;
+	}
+
+	/* 
+	 * Copy the data we keep to a new file, and replace the original with it.
+	 * xymond_history may rewrite the last entry of a history log, so we
+	 * cannot move the data around inside the file it is using.
+	 */
+	if (outdfd != -1) strcpy(tmpfn, fname); else sprintf(tmpfn, "%s.tmp", fname);
+	outfd = openat((outdfd != -1) ? outdfd : dfd, tmpfn, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (outfd == -1) {
+		errprintf("Cannot create output file %s: %s\n", tmpfn, strerror(errno));
+		close(fd);
+		return;
+	}
+	if (copy_data(fd, keepofs, outfd) != 0) {
+		errprintf("Failed to copy %s: %s\n", fname, strerror(errno));
+		close(outfd);
+		close(fd);
+		if (outdfd == -1) unlinkat(dfd, tmpfn, 0);
+		return;
+	}
+	futimens(outfd, tstamp);
+	close(outfd);
+	close(fd);
+
+	if (outdfd != -1) return;
+
+	/* Final check to make sure the file didn't change while we were processing it */
+	if ((fstatat(dfd, fname, &st2, 0) == 0) && (st2.st_mtime == st.st_mtime) && (st2.st_size == st.st_size)) {
+		renameat(dfd, tmpfn, dfd, fname);
+
+		if (ftype == F_ALLEVENTS) {
+			/* Tell xymond_history to re-open the allevents file */
+			char pidfn[PATH_MAX];
+			FILE *pidfd;
+			long pid = -1;
+
+			sprintf(pidfn, "%s/xymond_history.pid", xgetenv("XYMONSERVERLOGS"));
+			pidfd = fopen(pidfn, "r");
+			if (pidfd) {
+				char l[100];
+				if (fgets(l, sizeof(l), pidfd)) pid = atol(l);
+				fclose(pidfd);
 			}
 
-			while ((sent = readdir(sdir)) != NULL) {
-				int allgone = 1;
-				if (*(sent->d_name) == '.') continue;
+			if (pid > 0) kill(pid, SIGHUP);
+		}
+	}
+	else {
+		errprintf("File %s changed while processing it - not trimmed\n", fname);
+		unlinkat(dfd, tmpfn, 0);
+	}
+}
 
-				sprintf(fn1, "%s/%s", fwalk->fname, sent->d_name);
-				ldir = opendir(fn1);
-				if (ldir == NULL) {
-					errprintf("Cannot process directory %s: %s\n", fn1, strerror(errno));
-					continue;
-				}
+void trim_histdir(int workerno, int workercount)
+{
+	DIR *histdir;
+	int dfd, outdfd = -1;
+	struct dirent *hent;
+	struct stat st;
+
+	histdir = opendir(".");
+	if (!histdir) {
+		errprintf("Cannot read history directory: %s\n", strerror(errno));
+		exit(1);
+	}
+	dfd = dirfd(histdir);
+
+	if (outdir) {
+		outdfd = open(outdir, O_RDONLY);
+		if (outdfd == -1) {
+			errprintf("Cannot access output directory %s: %s\n", outdir, strerror(errno));
+			exit(1);
+		}
+	}
+
+	while ((hent = readdir(histdir)) != NULL) {
+		char *hostname = NULL;
+		char hostip[IP_ADDR_STRLEN];
+		enum ghosthandling_t ghosthandling = GH_IGNORE;
+		enum ftype_t ftype;
+
+		if (*(hent->d_name) == '.') continue;
+		if (!myentry(hent->d_name, workerno, workercount)) continue;
+
+		if (fstatat(dfd, hent->d_name, &st, 0) == -1) {
+			errprintf("Odd entry %s - cannot stat: %s\n", hent->d_name, strerror(errno));
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) continue;
 
-				while ((lent = readdir(ldir)) != NULL) {
-					if (*(lent->d_name) == '.') continue;
-
-					ltime = logtime(lent->d_name);
-					if ((ltime > 0) && (ltime < cutoff)) {
-						sprintf(fn2, "%s/%s", fn1, lent->d_name);
-						if (unlink(fn2) == -1) {
-							errprintf("Failed to unlink %s: %s\n", fn2, strerror(errno));
-						}
-					}
-					else allgone = 0;
+		if (strcmp(hent->d_name, "allevents") == 0) {
+			/* Special all-hosts-services event log */
+			ftype = F_ALLEVENTS;
+		}
+		else if ((hostname = knownhost(hent->d_name, hostip, ghosthandling)) != NULL) {
+			/* Host history file. */
+			ftype = F_HOSTHISTORY;
+		}
+		else {
+			char *delim, *p, *hname, *tname;
+
+			delim = strrchr(hent->d_name, '.');
+			if (!delim) {
+				/* It's a host history file (no dot in filename), but the host does not exist */
+				errprintf("Orphaned host-history file %s - no host\n", hent->d_name);
+				ftype = F_DROPIT;
+			}
+			else {
+				*delim = '\0'; hname = strdup(hent->d_name); tname = delim+1; *delim = '.';
+				p = strchr(hname, ','); while (p) { *p = '.'; p = strchr(p, ','); }
+				hostname = knownhost(hname, hostip, ghosthandling);
+				if (!hostname) {
+					errprintf("Orphaned service-history file %s - no host\n", hent->d_name);
+					ftype = F_DROPIT;
+				}
+				else if (dropsvcs && !validstatus(hostname, tname)) {
+					errprintf("Orphaned service-history file %s - no service\n", hent->d_name);
+					ftype = F_DROPIT;
+				}
+				else {
+					/* Service history file */
+					ftype = F_SERVICEHISTORY;
 				}
+				xfree(hname);
+			}
+		}
+
+		dbgprintf("Processing %s\n", hent->d_name);
+		showprogress(workerno);
+
+		if (ftype == F_DROPIT) {
+			/* It's an orphan. Delete it if we want to */
+			if (dropfiles) unlinkat(dfd, hent->d_name, 0);
+		}
+		else {
+			trim_file(dfd, outdfd, hent->d_name, ftype);
+		}
+	}
+
+	if (outdfd != -1) close(outdfd);
+	closedir(histdir);
+}
+
+static void purge_logdir(int dfd, char *hostdir)
+{
+	int hfd;
+	DIR *sdir;
+	struct dirent *sent;
+
+	hfd = openat(dfd, hostdir, O_RDONLY|O_DIRECTORY);
+	if ((hfd == -1) || ((sdir = fdopendir(hfd)) == NULL)) {
+		errprintf("Cannot process directory %s: %s\n", hostdir, strerror(errno));
+		if (hfd != -1) close(hfd);
+		return;
+	}
+
+	while ((sent = readdir(sdir)) != NULL) {
+		int tfd, allgone = 1;
+		DIR *ldir;
+		struct dirent *lent;
+		time_t ltime;
+
+		if (*(sent->d_name) == '.') continue;
+
+		tfd = openat(hfd, sent->d_name, O_RDONLY|O_DIRECTORY);
+		if ((tfd == -1) || ((ldir = fdopendir(tfd)) == NULL)) {
+			errprintf("Cannot process directory %s/%s: %s\n", hostdir, sent->d_name, strerror(errno));
+			if (tfd != -1) close(tfd);
+			continue;
+		}
 
-				closedir(ldir);
+		while ((lent = readdir(ldir)) != NULL) {
+			if (*(lent->d_name) == '.') continue;
 
-				/* Is it empty ? Then remove it */
-				if (allgone) rmdir(fn1);
+			ltime = logtime(lent->d_name);
+			if ((ltime > 0) && (ltime < cutoff)) {
+				if (unlinkat(tfd, lent->d_name, 0) == -1) {
+					errprintf("Failed to unlink %s/%s/%s: %s\n", 
+						  hostdir, sent->d_name, lent->d_name, strerror(errno));
+				}
 			}
+			else allgone = 0;
+		}
+
+		closedir(ldir);
+
+		/* Is it empty ? Then remove it */
+		if (allgone) unlinkat(hfd, sent->d_name, AT_REMOVEDIR);
+	}
 
-			closedir(sdir);
-			break;
+	closedir(sdir);
+}
+
+void trim_logs(int workerno, int workercount)
+{
+	DIR *histdir;
+	int dfd;
+	struct dirent *hent;
+	struct stat st;
 
-		  default:
-			break;
+	histdir = opendir(".");
+	if (!histdir) {
+		errprintf("Cannot read historical statuslogs directory: %s\n", strerror(errno));
+		exit(1);
+	}
+	dfd = dirfd(histdir);
+
+	while ((hent = readdir(histdir)) != NULL) {
+		if (*(hent->d_name) == '.') continue;
+		if (!myentry(hent->d_name, workerno, workercount)) continue;
+
+		if (fstatat(dfd, hent->d_name, &st, 0) == -1) {
+			errprintf("Odd entry %s - cannot stat: %s\n", hent->d_name, strerror(errno));
+			continue;
+		}
+		if (!S_ISDIR(st.st_mode)) continue;
+
+		dbgprintf("Processing %s\n", hent->d_name);
+		showprogress(workerno);
+
+		if (knownloghost(hent->d_name)) {
+			purge_logdir(dfd, hent->d_name);
+		}
+		else {
+			/* It's an orphan, and we want to delete it */
+			dropdirectory(hent->d_name, 0);
 		}
 	}
+
+	closedir(histdir);
 }
 
 int main(int argc, char *argv[])
 {
 	int argi;
-	DIR *histdir = NULL;
-	struct dirent *hent;
-	struct stat st;
-	time_t cutoff = 0;
-	int dropsvcs = 0;
-	int dropfiles = 0;
 	int droplogs = 0;
+	int workers = 4;
 	char *envarea = NULL;
 
 	for (argi = 1; (argi < argc); argi++) {
@@ -394,6 +563,11 @@ int main(int argc, char *argv[])
 			char *p = strchr(argv[argi], '=');
 			progressinfo = atoi(p+1);
 		}
+		else if (argnmatch(argv[argi], "--workers=")) {
+			char *p = strchr(argv[argi], '=');
+			workers = atoi(p+1);
+			if (workers < 1) workers = 1;
+		}
 		else if (strcmp(argv[argi], "--debug") == 0) {
 			debug = 1;
 		}
@@ -421,112 +595,24 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	histdir = opendir(".");
-	if (!histdir) {
-		errprintf("Cannot read history directory: %s\n", strerror(errno));
-		return 1;
-	}
-
+	/* Load what the workers need before starting them, so it is done only once */
 	load_hostnames(xgetenv("HOSTSCFG"), NULL, get_fqdn());
+	if (dropsvcs) load_board();
 
-	/* First scan the directory for all files, and pick up the ones we want to process */
-	while ((hent = readdir(histdir)) != NULL) {
-		char *hostname = NULL;
-		char hostip[IP_ADDR_STRLEN];
-		enum ghosthandling_t ghosthandling = GH_IGNORE;
-
-		if (stat(hent->d_name, &st) == -1) {
-			errprintf("Odd entry %s - cannot stat: %s\n", hent->d_name, strerror(errno));
-			continue;
-		}
-
-		if ((*(hent->d_name) == '.') || S_ISDIR(st.st_mode)) continue;
-
-		if (strcmp(hent->d_name, "allevents") == 0) {
-			/* Special all-hosts-services event log */
-			add_to_filelist(hent->d_name, F_ALLEVENTS);
-			continue;
-		}
-
-		hostname = knownhost(hent->d_name, hostip, ghosthandling);
-		if (hostname) {
-			/* Host history file. */
-			add_to_filelist(hent->d_name, F_HOSTHISTORY);
-		}
-		else {
-			char *delim, *p, *hname, *tname;
-
-			delim = strrchr(hent->d_name, '.');
-			if (!delim) {
-				/* It's a host history file (no dot in filename), but the host does not exist */
-				errprintf("Orphaned host-history file %s - no host\n", hent->d_name);
-				if (dropfiles) add_to_filelist(hent->d_name, F_DROPIT);
-				continue;
-			}
-
-			*delim = '\0'; hname = strdup(hent->d_name); tname = delim+1; *delim = '.';
-			p = strchr(hname, ','); while (p) { *p = '.'; p = strchr(p, ','); }
-			hostname = knownhost(hname, hostip, ghosthandling);
-			if (!hostname) {
-				errprintf("Orphaned service-history file %s - no host\n", hent->d_name);
-				if (dropfiles) add_to_filelist(hent->d_name, F_DROPIT);
-			}
-			else if (dropsvcs && !validstatus(hostname, tname)) {
-				errprintf("Orphaned service-history file %s - no service\n", hent->d_name);
-				if (dropfiles) add_to_filelist(hent->d_name, F_DROPIT);
-			}
-			else {
-				/* Service history file */
-				add_to_filelist(hent->d_name, F_SERVICEHISTORY);
-			}
-			xfree(hname);
-		}
-	}
-
-	closedir(histdir);
-
-	/* Then process the files */
-	if (progressinfo) errprintf("Starting trim of %d history-logs\n", totalitems);
-	trim_files(cutoff);
+	if (progressinfo) errprintf("Starting trim of history-logs with %d workers\n", workers);
+	if (run_workers(trim_histdir, workers) != 0) return 1;
 
 
 	/* Process statuslogs also ? */
 	if (!droplogs) return 0;
 
-	flhead = NULL;  /* Dirty - we should clean it up properly - but I dont care */
-	totalitems = 0;
 	if (chdir(xgetenv("XYMONHISTLOGS")) == -1) {
 		errprintf("Cannot cd to historical statuslogs directory: %s\n", strerror(errno));
 		return 1;
 	}
 
-	histdir = opendir(".");
-	if (!histdir) {
-		errprintf("Cannot read historical statuslogs directory: %s\n", strerror(errno));
-		return 1;
-	}
-
-	while ((hent = readdir(histdir)) != NULL) {
-		if (stat(hent->d_name, &st) == -1) {
-			errprintf("Odd entry %s - cannot stat: %s\n", hent->d_name, strerror(errno));
-			continue;
-		}
-
-		if ((*(hent->d_name) == '.') || !S_ISDIR(st.st_mode)) continue;
-
-		if (knownloghost(hent->d_name)) {
-			add_to_filelist(hent->d_name, F_PURGELOGS);
-		}
-		else {
-			add_to_filelist(hent->d_name, F_DROPIT);
-		}
-	}
-
-	closedir(histdir);
-
-	if (progressinfo) errprintf("Starting trim of %d status-log collections\n", totalitems);
-	trim_logs(cutoff);
+	if (progressinfo) errprintf("Starting trim of status-log collections with %d workers\n", workers);
+	if (run_workers(trim_logs, workers) != 0) return 1;
 
 	return 0;
 }
-
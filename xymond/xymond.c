@@ -58,14 +58,16 @@ static char rcsid[] = "$Id: xymond.c 6787 2011-12-03 08:10:28Z storner $";
 
 #include "xymond_buffer.h"
 #include "xymond_ipc.h"
+#include "xymond_combo.h"
+#include "xymond_perf.h"
 
 #define DISABLED_UNTIL_OK -1
 
 /*
- * The absolute maximum size we'll grow our buffers to accomodate an incoming message.
- * This is really just an upper bound to squash the bad guys trying to data-flood us. 
+ * The absolute maximum size we'll grow our buffers to accomodate an incoming message
+ * is MAX_XYMON_INBUFSZ, from compression.h. This is really just an upper bound to
+ * squash the bad guys trying to data-flood us.
  */
-#define MAX_XYMON_INBUFSZ (10*1024*1024)	/* 10 MB */
 
 /* The initial size of an input buffer. Make this large enough for most traffic. */
 #define XYMON_INBUF_INITIAL   (128*1024)
@@ -191,6 +193,7 @@ typedef struct conn_t {
 	size_t buflen, bufsz;		/* Active and maximum length of buffer */
 	int doingwhat;			/* Communications state (NOTALK, READING, RESPONDING) */
 	time_t timeout;			/* When the timeout for this connection happens */
+	struct timespec tstart;		/* When we started receiving or responding */
 	struct conn_t *next;
 } conn_t;
 
@@ -271,6 +274,7 @@ xymond_statistics_t xymond_stats[] = {
 	{ "notify", 0 },
 	{ "schedule", 0 },
 	{ "download", 0 },
+	{ "xymondstats", 0 },
 	{ NULL, 0 }
 };
 
@@ -325,6 +329,13 @@ boardfield_t boardfields[BOARDFIELDS_MAX+1];
 unsigned long msgs_total = 0;
 unsigned long msgs_total_last = 0;
 time_t last_stats_time = 0;
+unsigned long msgs_compressed = 0;		/* Compressed messages received */
+unsigned long msgs_compressed_bad = 0;		/* ... that could not be uncompressed */
+unsigned long long bytes_compressed = 0;	/* Bytes received as compressed data */
+unsigned long long bytes_uncompressed = 0;	/* ... and their size after uncompressing */
+double uncompress_msecs = 0.0;			/* Time spent uncompressing */
+
+char *combofn = NULL;				/* combo.cfg, if we do combo tests */
 
 /* List of scheduled (future) tasks */
 typedef struct scheduletask_t {
@@ -337,7 +348,7 @@ typedef struct scheduletask_t {
 scheduletask_t *schedulehead = NULL;
 int nextschedid = 1;
 
-void update_statistics(char *cmd)
+int update_statistics(char *cmd)
 {
 	int i;
 
@@ -345,7 +356,7 @@ void update_statistics(char *cmd)
 
 	if (!cmd) {
 		dbgprintf("No command for update_statistics\n");
-		return;
+		return -1;
 	}
 
 	msgs_total++;
@@ -355,6 +366,8 @@ void update_statistics(char *cmd)
 	xymond_stats[i].count++;
 
 	dbgprintf("<- update_statistics\n");
+
+	return i;
 }
 
 char *generate_stats(void)
@@ -408,6 +421,18 @@ char *generate_stats(void)
 	}
 	msgs_total_last = msgs_total;
 
+	if (msgs_compressed || msgs_compressed_bad) {
+		sprintf(msgline, "\nCompressed messages    : %10lu (%lu failed)\n", msgs_compressed, msgs_compressed_bad);
+		addtobuffer(statsbuf, msgline);
+		sprintf(msgline, "- Bytes received       : %10llu\n", bytes_compressed);
+		addtobuffer(statsbuf, msgline);
+		sprintf(msgline, "- Bytes uncompressed   : %10llu (ratio %.1f)\n", bytes_uncompressed,
+			(bytes_compressed ? ((double)bytes_uncompressed / (double)bytes_compressed) : 0.0));
+		addtobuffer(statsbuf, msgline);
+		sprintf(msgline, "- Uncompress time      : %10.1f ms\n", uncompress_msecs);
+		addtobuffer(statsbuf, msgline);
+	}
+
 	addtobuffer(statsbuf, "\n");
 	clients = semctl(statuschn->semid, CLIENTCOUNT, GETVAL);
 	sprintf(msgline, "status channel messages: %10ld (%d readers)\n", statuschn->msgcount, clients);
@@ -434,6 +459,8 @@ char *generate_stats(void)
 	sprintf(msgline, "clichg channel messages: %10ld (%d readers)\n", clichgchn->msgcount, clients);
 	addtobuffer(statsbuf, msgline);
 
+	perf_report(statsbuf);
+
 	ghandle = xtreeFirst(rbghosts);
 	if (ghandle != xtreeEnd(rbghosts)) addtobuffer(statsbuf, "\n\nGhost reports:\n");
 	for (; (ghandle != xtreeEnd(rbghosts)); ghandle = xtreeNext(rbghosts, ghandle)) {
@@ -538,6 +565,9 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 	void *hi;
 	char *pagepath, *classname, *osname;
 	time_t timeroffset = (getcurrenttime(NULL) - gettimer());
+	struct timespec tstart;
+	unsigned long waitusecs;
+	int backlog;
 
 	dbgprintf("-> posttochannel\n");
 
@@ -548,6 +578,10 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 		return;
 	}
 
+	/* If BOARDBUSY is up, the workers have not picked up the previous message yet */
+	perf_start(&tstart);
+	backlog = semctl(channel->semid, BOARDBUSY, GETVAL);
+
 	/* 
 	 * Wait for BOARDBUSY to go low.
 	 * We need a loop here, because if we catch a signal
@@ -568,9 +602,11 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 	} while ((n == -1) && (semerr == EINTR) && running && !gotalarm);
 	alarm(0);
 	if (!running) return;
+	waitusecs = perf_usecs(&tstart);
 
 	/* Check if the alarm fired */
 	if (gotalarm) {
+		perf_channeldrop(channel->channelid);
 		errprintf("BOARDBUSY locked at %d, GETNCNT is %d, GETPID is %d, %d clients\n",
 			  semctl(channel->semid, BOARDBUSY, GETVAL),
 			  semctl(channel->semid, BOARDBUSY, GETNCNT),
@@ -582,6 +618,7 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 	/* Check if we failed to grab the semaphore */
 	if (n == -1) {
 		errprintf("Dropping message due to semaphore error\n");
+		perf_channeldrop(channel->channelid);
 		return;
 	}
 
@@ -853,6 +890,7 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 	s.sem_num = GOCLIENT; s.sem_op = clients; s.sem_flg = 0; 		/* Up GOCLIENT */
 	n = semop(channel->semid, &s, 1);
 
+	perf_channel(channel->channelid, perf_usecs(&tstart), waitusecs, backlog);
 	dbgprintf("<- posttochannel\n");
 
 	return;
@@ -1232,6 +1270,7 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 	enum alertstate_t oldalertstatus, newalertstatus;
 	int delayval = 0;
 	void *hinfo = hostinfo(hostname);
+	struct timespec tstart;
 
 	dbgprintf("->handle_status\n");
 
@@ -1253,6 +1292,7 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 		return;
 	}
 
+	perf_start(&tstart);
 	issummary = (log->host->hosttype == H_SUMMARY);
 
 	if (strncmp(msg, "status+", 7) == 0) {
@@ -1637,6 +1677,9 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 	dbgprintf("posting to status channel\n");
 	posttochannel(statuschn, channelnames[C_STATUS], msg, sender, hostname, log, NULL);
 
+	if (combofn && (log->oldcolor != newcolor)) combo_statuschange(hostname, testname);
+
+	perf_stage(PERF_STATUS, perf_usecs(&tstart));
 	dbgprintf("<-handle_status\n");
 	return;
 }
@@ -2922,6 +2965,8 @@ void do_message(conn_t *msg, char *origin)
 	char *grouplist;
 	time_t now, timeroffset;
 	char *msgfrom;
+	struct timespec tstart;
+	int cmdidx = -1;
 
 	nesting++;
 	if (debug) {
@@ -2933,12 +2978,43 @@ void do_message(conn_t *msg, char *origin)
 	}
 
 	MEMDEFINE(sender);
+	perf_start(&tstart);
 
 	/* Most likely, we will not send a response */
 	msg->doingwhat = NOTALK;
 	strncpy(sender, inet_ntoa(msg->addr.sin_addr), sizeof(sender));
 	now = getcurrenttime(NULL);
 	timeroffset = (getcurrenttime(NULL) - gettimer());
+	if (nesting == 1) perf_sender(sender, msg->buflen);
+
+	if (iscompressed(msg->buf)) {
+		/* Replace the compressed message with the uncompressed one */
+		struct timespec tstart, tend, tdiff;
+		char *ubuf;
+		size_t ulen;
+
+		getntimer(&tstart);
+		ubuf = uncompress_message(msg->buf, msg->buflen, MAX_XYMON_INBUFSZ, &ulen);
+		getntimer(&tend);
+		tvdiff(&tstart, &tend, &tdiff);
+		uncompress_msecs += (tdiff.tv_sec * 1000.0) + (tdiff.tv_nsec / 1000000.0);
+		perf_stage(PERF_UNCOMPRESS, (tdiff.tv_sec * 1000000) + (tdiff.tv_nsec / 1000));
+
+		if (!ubuf) {
+			errprintf("Dropping bad compressed %s message from %s\n", compressed_type(msg->buf), sender);
+			msgs_compressed_bad++;
+			goto done;
+		}
+
+		msgs_compressed++;
+		bytes_compressed += msg->buflen;
+		bytes_uncompressed += ulen;
+
+		xfree(msg->buf);
+		msg->buf = msg->bufp = ubuf;
+		msg->buflen = ulen;
+		msg->bufsz = ulen+1;
+	}
 
 	if (traceall || tracelist) {
 		int found = 0;
@@ -2977,7 +3053,7 @@ void do_message(conn_t *msg, char *origin)
 	}
 
 	/* Count statistics */
-	update_statistics(msg->buf);
+	cmdidx = update_statistics(msg->buf);
 
 	if (strncmp(msg->buf, "combo\n", 6) == 0) {
 		char *currmsg, *nextmsg;
@@ -3843,6 +3919,39 @@ void do_message(conn_t *msg, char *origin)
 		msg->bufp = msg->buf = strdup(id);
 		msg->buflen = strlen(msg->buf);
 	}
+	else if (strncmp(msg->buf, "xymondstats", 11) == 0) {
+		/* Machine-readable version of the statistics in the xymond status */
+		if (oksender(wwwsenders, NULL, msg->addr.sin_addr, msg->buf)) {
+			strbuffer_t *resp;
+			char msgline[1024];
+			int i;
+
+			resp = newstrbuffer(0);
+			sprintf(msgline, "version %s\nuptime %ld\nmsgs.total %lu\n", 
+				VERSION, (long)(gettimer() - boottimer), msgs_total);
+			addtobuffer(resp, msgline);
+			for (i = 0; (xymond_stats[i].cmd); i++) {
+				sprintf(msgline, "msgs.%s %lu\n", xymond_stats[i].cmd, xymond_stats[i].count);
+				addtobuffer(resp, msgline);
+			}
+			sprintf(msgline, "msgs.bogus %lu\nmsgs.compressed %lu\nmsgs.compressed_bad %lu\n", 
+				xymond_stats[i].count, msgs_compressed, msgs_compressed_bad);
+			addtobuffer(resp, msgline);
+			sprintf(msgline, "channel.status.msgs %lu\nchannel.stachg.msgs %lu\nchannel.page.msgs %lu\nchannel.data.msgs %lu\n",
+				statuschn->msgcount, stachgchn->msgcount, pagechn->msgcount, datachn->msgcount);
+			addtobuffer(resp, msgline);
+			sprintf(msgline, "channel.notes.msgs %lu\nchannel.enadis.msgs %lu\nchannel.client.msgs %lu\nchannel.clichg.msgs %lu\n",
+				noteschn->msgcount, enadischn->msgcount, clientchn->msgcount, clichgchn->msgcount);
+			addtobuffer(resp, msgline);
+			perf_machinereport(resp);
+
+			msg->doingwhat = RESPONDING;
+			xfree(msg->buf);
+			msg->buflen = STRBUFLEN(resp);
+			msg->buf = grabstrbuffer(resp);
+			msg->bufp = msg->buf;
+		}
+	}
 	else if (strncmp(msg->buf, "notify", 6) == 0) {
 		if (!oksender(maintsenders, NULL, msg->addr.sin_addr, msg->buf)) goto done;
 		get_hts(msg->buf, sender, origin, &h, &t, NULL, &log, &color, NULL, NULL, 0, 0);
@@ -4142,6 +4251,13 @@ done:
 		msg->sock = -1;
 	}
 
+	if (nesting == 1) {
+		unsigned long usecs = perf_usecs(&tstart);
+
+		perf_stage(PERF_MESSAGE, usecs);
+		if (cmdidx >= 0) perf_command(cmdidx, xymond_stats[cmdidx].cmd, usecs);
+	}
+
 	MEMUNDEFINE(sender);
 
 	dbgprintf("<- do_message/%d\n", nesting);
@@ -4605,6 +4721,32 @@ void sig_handler(int signum)
 }
 
 
+static int combo_getcolor(char *hostname, char *testname)
+{
+	xymond_hostlist_t *h;
+	xymond_log_t *log;
+
+	log = find_log(hostname, testname, NULL, &h);
+	return (log ? log->color : COL_CLEAR);
+}
+
+static void combo_poststatus(char *msg)
+{
+	xymond_hostlist_t *h;
+	testinfo_t *t;
+	xymond_log_t *log;
+	char *grouplist = NULL;
+	char *downcause = NULL;
+	int color;
+
+	get_hts(msg, "xymond", "", &h, &t, &grouplist, &log, &color, &downcause, NULL, 1, 1);
+	if (h && t && log && (color != -1)) {
+		update_statistics(msg);
+		handle_status(msg, "xymond", h->hostname, t->name, grouplist, log, color, downcause, 0);
+	}
+	if (grouplist) xfree(grouplist);
+}
+
 int main(int argc, char *argv[])
 {
 	conn_t *connhead = NULL, *conntail=NULL;
@@ -4616,6 +4758,8 @@ int main(int argc, char *argv[])
 	int checkpointinterval = 900;
 	int do_purples = 1;
 	time_t nextpurpleupdate;
+	time_t nextcomborefresh = 0;
+	struct timespec tbusy;
 	struct sockaddr_in laddr;
 	int lsocket, opt;
 	int listenq = 512;
@@ -4710,6 +4854,33 @@ int main(int argc, char *argv[])
 		else if (argnmatch(argv[argi], "--no-purple")) {
 			do_purples = 0;
 		}
+		else if (argnmatch(argv[argi], "--combo-error-colors=")) {
+			char *tok;
+			int newerrorcolors = 0;
+
+			tok = strtok(strchr(argv[argi], '=')+1, ",");
+			while (tok) {
+				int col = parse_color(tok);
+
+				if ((col >= 0) && (col <= COL_RED)) newerrorcolors |= (1 << col);
+				tok = strtok(NULL, ",");
+			}
+
+			if (newerrorcolors) comboerrorcolors = newerrorcolors;
+		}
+		else if (argnmatch(argv[argi], "--combo-quiet")) {
+			comboshoweval = 0;
+		}
+		else if (argnmatch(argv[argi], "--combo-clean")) {
+			combocleanexpr = 1;
+		}
+		else if (argnmatch(argv[argi], "--combo=")) {
+			char *p = strchr(argv[argi], '=');
+			combofn = strdup(p+1);
+		}
+		else if (argnmatch(argv[argi], "--combo")) {
+			combofn = "";	/* Default file, setup when the environment is loaded */
+		}
 		else if (argnmatch(argv[argi], "--daemon")) {
 			daemonize = 1;
 		}
@@ -4879,6 +5050,17 @@ int main(int argc, char *argv[])
 		load_checkpoint(restartfn);
 	}
 
+	if (combofn) {
+		if (*combofn == '\0') {
+			combofn = (char *)malloc(strlen(xgetenv("XYMONHOME")) + strlen("/etc/combo.cfg") + 1);
+			sprintf(combofn, "%s/etc/combo.cfg", xgetenv("XYMONHOME"));
+		}
+
+		errprintf("Loading combo tests\n");
+		load_combotests(combofn);
+		nextcomborefresh = getcurrenttime(NULL) + 300;
+	}
+
 	nextcheckpoint = getcurrenttime(NULL) + checkpointinterval;
 	nextpurpleupdate = getcurrenttime(NULL) + 600;	/* Wait 10 minutes the first time */
 	last_stats_time = getcurrenttime(NULL);	/* delay sending of the first status report until we're fully running */
@@ -5005,6 +5187,7 @@ int main(int argc, char *argv[])
 	}
 
 	errprintf("Setup complete\n");
+	perf_start(&tbusy);
 	do {
 		/*
 		 * The endless loop.
@@ -5026,6 +5209,10 @@ int main(int argc, char *argv[])
 		conn_t *cwalk;
 		time_t now = getcurrenttime(NULL);
 		int childstat;
+		int receiving = 0, responding = 0;
+		struct timespec tloop, tidle;
+
+		perf_start(&tloop);
 
 		/* Pickup any finished child processes to avoid zombies */
 		while (wait3(&childstat, WNOHANG, NULL) > 0) ;
@@ -5073,6 +5260,16 @@ int main(int argc, char *argv[])
 			}
 
 			load_clientconfig();
+			if (combofn) load_combotests(combofn);
+		}
+
+		if (combofn) {
+			/* Combo statuses are re-sent regularly so they dont go purple */
+			if (now >= nextcomborefresh) {
+				nextcomborefresh = now + 300;
+				combo_refresh();
+			}
+			combo_run(combo_getcolor, combo_poststatus);
 		}
 
 		if (do_purples && (now > nextpurpleupdate)) {
@@ -5128,13 +5325,17 @@ int main(int argc, char *argv[])
 				case RECEIVING:
 					FD_SET(cwalk->sock, &fdread);
 					if (cwalk->sock > maxfd) maxfd = cwalk->sock;
+					receiving++;
 					break;
 				case RESPONDING:
 					FD_SET(cwalk->sock, &fdwrite);
 					if (cwalk->sock > maxfd) maxfd = cwalk->sock;
+					responding++;
 					break;
 			}
 		}
+		perf_queue(receiving, responding);
+		perf_stage(PERF_HOUSEKEEPING, perf_usecs(&tloop));
 
 		/* 
 		 * Do the select() with a static 2 second timeout. 
@@ -5143,7 +5344,11 @@ int main(int argc, char *argv[])
 		 * us to attend to the housekeeping stuff without undue delay.
 		 */
 		seltmo.tv_sec = 2; seltmo.tv_usec = 0;
+		perf_start(&tidle);
+		perf_loop(perf_usecs(&tbusy), 0);
 		n = select(maxfd+1, &fdread, &fdwrite, NULL, &seltmo);
+		perf_loop(0, perf_usecs(&tidle));
+		perf_start(&tbusy);
 		if (n <= 0) {
 			if ((errno == EINTR) || (n == 0)) {
 				/* Interrupted or a timeout happened */
@@ -5168,9 +5373,11 @@ int main(int argc, char *argv[])
 					if (n <= 0) {
 						/* End of input data on this connection */
 						*(cwalk->bufp) = '\0';
+						perf_stage(PERF_READ, perf_usecs(&cwalk->tstart));
 
 						/* FIXME - need to set origin here */
 						do_message(cwalk, "");
+						if (cwalk->doingwhat == RESPONDING) perf_start(&cwalk->tstart);
 					}
 					else {
 						/* Add data to the input buffer - within reason ... */
@@ -5217,6 +5424,7 @@ int main(int argc, char *argv[])
 					}
 
 					if (cwalk->buflen == 0) {
+						perf_stage(PERF_RESPOND, perf_usecs(&cwalk->tstart));
 						shutdown(cwalk->sock, SHUT_WR);
 						close(cwalk->sock); 
 						cwalk->sock = -1; 
@@ -5358,6 +5566,7 @@ int main(int argc, char *argv[])
 				conntail->bufp = conntail->buf;
 				conntail->buflen = 0;
 				conntail->timeout = now + conn_timeout;
+				perf_start(&conntail->tstart);
 				conntail->next = NULL;
 			}
 		}
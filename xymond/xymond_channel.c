@@ -95,6 +95,12 @@ static int pendingcount = 0;
  */
 static int checksumsize = 0;
 
+/*
+ * framesize is the space left in front of the message for the binary
+ * header used with the "--framed" protocol to local workers.
+ */
+static int framesize = 0;
+
 void addnetpeer(char *peername)
 {
 	xymon_peer_t *newpeer;
@@ -226,6 +232,7 @@ void openconnection(xymon_peer_t *peer)
 				sprintf(logfnenv, "XYMONCHANNEL_LOGFILENAME=%s", logfn);
 				putenv(logfnenv);
 			}
+			if (framesize) putenv("XYMONCHANNEL_FRAMED=1");
 
 			n = dup2(pfd[0], STDIN_FILENO);
 			close(pfd[0]); close(pfd[1]);
@@ -298,12 +305,86 @@ static void addmessage_onepeer(xymon_peer_t *peer, char *inbuf, int inlen)
 	pendingcount++;
 }
 
-int addmessage(char *inbuf)
+static int framemessage(char *inbuf)
+{
+	/*
+	 * Fill in the frame header in front of the message, and return the
+	 * total number of bytes to send. The hostname is the key field after
+	 * the '/'; the testname and color are in different meta-data fields
+	 * depending on the type of message.
+	 */
+	static struct {
+		char *marker;
+		int testfield, colorfield;
+	} framefields[] = {
+		{ "status", 5, 7 },
+		{ "stachg", 5, 7 },
+		{ "page", 4, 7 },
+		{ "ack", 4, -1 },
+		{ "notify", 4, -1 },
+		{ "enadis", 4, -1 },
+		{ "data", 5, -1 },
+		{ NULL, -1, -1 }
+	};
+	xymond_framehdr_t *hdr = (xymond_framehdr_t *)inbuf;
+	char *msg = inbuf + framesize;
+	char *eoln, *p, *fstart;
+	int msglen, markerlen, field, i;
+
+	memset(hdr, 0, sizeof(xymond_framehdr_t));
+	hdr->magic = XYMOND_FRAMEMAGIC;
+
+	/* Strip the end-marker, the frame length tells where the message ends */
+	msglen = strlen(msg);
+	if ((msglen >= 4) && (strcmp(msg+msglen-4, "\n@@\n") == 0)) msglen -= 4;
+	hdr->msglen = msglen;
+
+	eoln = msg + strcspn(msg, "\n");
+	hdr->metalen = (eoln - msg);
+
+	markerlen = strcspn(msg+2, ":#/|\n");
+	p = msg + 2 + strcspn(msg+2, "#|\n");
+	if (*p == '#') {
+		hdr->seq = atoi(p+1);
+		p += strcspn(p, "/|\n");
+		if (*p == '/') {
+			hdr->hostofs = (p + 1 - msg);
+			hdr->hostlen = strcspn(p+1, "|\n");
+		}
+	}
+
+	for (i = 0; (framefields[i].marker && ((strlen(framefields[i].marker) != markerlen) || strncmp(msg+2, framefields[i].marker, markerlen))); i++) ;
+
+	/* Walk the meta-data fields: The timestamp is field 1, the others depend on the message type */
+	for (field = 0, fstart = msg; (fstart < eoln); field++) {
+		int flen = strcspn(fstart, "|\n");
+
+		if (field == 1) {
+			hdr->tstamp_sec = atoi(fstart);
+			p = strchr(fstart, '.');
+			if (p && (p < (fstart + flen))) hdr->tstamp_usec = atoi(p+1);
+		}
+		else if (field == framefields[i].testfield) {
+			hdr->testofs = (fstart - msg);
+			hdr->testlen = flen;
+		}
+		else if (field == framefields[i].colorfield) {
+			hdr->colorofs = (fstart - msg);
+			hdr->colorlen = flen;
+		}
+
+		if (*(fstart + flen) != '|') break;
+		fstart += flen + 1;
+	}
+
+	return framesize + msglen;
+}
+
+int addmessage(char *inbuf, int inlen)
 {
 	xtreePos_t phandle;
 	xymon_peer_t *peer;
 	int bcastmsg = 0;
-	int inlen = strlen(inbuf);
 
 	if (locatorbased) {
 		char *hostname, *hostend, *peerlocation;
@@ -497,6 +578,12 @@ int main(int argc, char *argv[])
 		else if (argnmatch(argv[argi], "--no-md5")) {
 			checksumsize = 0;
 		}
+		else if (argnmatch(argv[argi], "--framed")) {
+			framesize = sizeof(xymond_framehdr_t);
+		}
+		else if (argnmatch(argv[argi], "--no-framed")) {
+			framesize = 0;
+		}
 		else {
 			char *childcmd;
 			char **childargs;
@@ -518,6 +605,10 @@ int main(int argc, char *argv[])
 		errprintf("Must specify --service when using locator\n");
 		return 1;
 	}
+	if (locatorbased && framesize) {
+		errprintf("Framed messages are only used with local workers, ignoring --framed\n");
+		framesize = 0;
+	}
 	if (!locatorbased && (xtreeFirst(peers) == xtreeEnd(peers))) {
 		errprintf("Must specify command for local worker\n");
 		return 1;
@@ -592,13 +683,14 @@ int main(int argc, char *argv[])
 			 * GOCLIENT went high, and so we got alerted about a new
 			 * message arriving. Copy the message to our own buffer queue.
 			 */
-			char *inbuf = NULL;
+			char *inbuf = NULL, *msgp = NULL;
 			int msgsz = 0;
 
 			if (!msgfilter || matchregex(channel->channelbuf, msgfilter) || matchregex(channel->channelbuf, stdfilter)) {
 				msgsz = strlen(channel->channelbuf);
-				inbuf = (char *)malloc(msgsz + checksumsize + 1);
-				memcpy(inbuf+checksumsize, channel->channelbuf, msgsz+1); /* Include \0 */
+				inbuf = (char *)malloc(framesize + msgsz + checksumsize + 1);
+				msgp = inbuf + framesize;
+				memcpy(msgp+checksumsize, channel->channelbuf, msgsz+1); /* Include \0 */
 			}
 
 			/* 
@@ -641,13 +733,13 @@ int main(int argc, char *argv[])
 				 * See if they want us to rotate logs. We pass this on to
 				 * the worker module as well, but must handle our own logfile.
 				 */
-				if (strncmp(inbuf+checksumsize, "@@logrotate", 11) == 0) {
+				if (strncmp(msgp+checksumsize, "@@logrotate", 11) == 0) {
 					freopen(logfn, "a", stdout);
 					freopen(logfn, "a", stderr);
 				}
 
 				if (checksumsize > 0) {
-					char *sep1 = inbuf + checksumsize + strcspn(inbuf+checksumsize, "#|\n");
+					char *sep1 = msgp + checksumsize + strcspn(msgp+checksumsize, "#|\n");
 
 					if (*sep1 == '#') {
 						/* 
@@ -656,16 +748,16 @@ int main(int argc, char *argv[])
 						 * to
 						 *   "@@%s:%s#%u/%s|%d.%06d| channelmarker, hashstr, seq, hostname, tstamp.tv_sec, tstamp.tv_usec
 						 */
-						char *hashstr = md5hash(inbuf+checksumsize);
-						int hlen = sep1 - (inbuf + checksumsize);
+						char *hashstr = md5hash(msgp+checksumsize);
+						int hlen = sep1 - (msgp + checksumsize);
 
-						memmove(inbuf, inbuf+checksumsize, hlen);
-						*(inbuf + hlen) = ':';
-						memcpy(inbuf+hlen+1, hashstr, strlen(hashstr));
+						memmove(msgp, msgp+checksumsize, hlen);
+						*(msgp + hlen) = ':';
+						memcpy(msgp+hlen+1, hashstr, strlen(hashstr));
 					}
 					else {
 						/* No sequence number (control message). Skip checksum for these */
-						memmove(inbuf, inbuf+checksumsize, msgsz+1);
+						memmove(msgp, msgp+checksumsize, msgsz+1);
 					}
 				}
 
@@ -673,7 +765,7 @@ int main(int argc, char *argv[])
 				/*
 				 * Put the new message on our outbound queue.
 				 */
-				if (addmessage(inbuf) != 0) {
+				if (addmessage(inbuf, (framesize ? framemessage(inbuf) : strlen(inbuf))) != 0) {
 					/* Failed to queue message, free the buffer */
 					xfree(inbuf);
 				}
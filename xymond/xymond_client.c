@@ -31,13 +31,31 @@ static char rcsid[] = "$Id: xymond_client.c 6792 2011-12-06 15:25:18Z storner $"
 
 enum msgtype_t { MSG_CPU, MSG_DISK, MSG_INODE, MSG_FILES, MSG_MEMORY, MSG_MSGS, MSG_PORTS, MSG_PROCS, MSG_SVCS, MSG_WHO, MSG_LAST };
 
+#define SECT_HASHSIZE 128	/* Must be a power of 2 */
+
 typedef struct sectlist_t {
 	char *sname;
 	char *sdata;
+	int snamelen;
+	unsigned int shash;
 	char *nextsectionrestoreptr, *sectdatarestoreptr;
 	char nextsectionrestoreval, sectdatarestoreval;
-	struct sectlist_t *next;
+	struct sectlist_t *next;	/* List of sections, last section in the message first */
+	struct sectlist_t *hnext;	/* Next section in the same hash bucket */
 } sectlist_t;
+
+/*
+ * The sections of a client message. The section records are held in
+ * one array (in message order), and indexed by a small hash table on
+ * the section name.
+ */
+typedef struct secttable_t {
+	sectlist_t *sects;
+	int count, size;
+	sectlist_t *head;
+	sectlist_t *buckets[SECT_HASHSIZE];
+} secttable_t;
+static secttable_t *defsects = NULL;
 static sectlist_t *defsecthead = NULL;
 
 int pslistinprocs = 1;
@@ -82,42 +100,54 @@ int add_updateinfo(char *hostname, int seq, time_t tstamp)
 	return 0;
 }
 
-void nextsection_r_done(void *secthead)
+static unsigned int secthash(char *name, int *namelen)
 {
-	/* Free the old list */
-	sectlist_t *swalk, *stmp;
+	/* FNV-1a hash of the section name */
+	unsigned int hash = 2166136261U;
+	char *p;
 
-	swalk = (sectlist_t *)secthead;
-	while (swalk) {
+	for (p = name; (*p); p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 16777619;
+	}
+	*namelen = (p - name);
+
+	return hash;
+}
+
+static void secttable_restore(secttable_t *table)
+{
+	/* Put back the bytes we overwrote in the message */
+	sectlist_t *swalk;
+	int i;
+
+	for (i = 0, swalk = table->sects; (i < table->count); i++, swalk++) {
 		if (swalk->nextsectionrestoreptr) *swalk->nextsectionrestoreptr = swalk->nextsectionrestoreval;
 		if (swalk->sectdatarestoreptr) *swalk->sectdatarestoreptr = swalk->sectdatarestoreval;
-
-		stmp = swalk;
-		swalk = swalk->next;
-		xfree(stmp);
 	}
+
+	table->count = 0;
+	table->head = NULL;
+	memset(table->buckets, 0, sizeof(table->buckets));
 }
 
-void splitmsg_r(char *clientdata, sectlist_t **secthead)
+void nextsection_r_done(void *secthead)
 {
-	char *cursection, *nextsection;
-	char *sectname, *sectdata;
+	secttable_t *table = (secttable_t *)secthead;
 
-	if (clientdata == NULL) {
-		errprintf("Got a NULL client data message\n");
-		return;
-	}
+	if (!table) return;
 
-	if (secthead == NULL) {
-		errprintf("BUG: splitmsg_r called with NULL secthead\n");
-		return;
-	}
+	secttable_restore(table);
+	if (table->sects) xfree(table->sects);
+	xfree(table);
+}
 
-	if (*secthead) {
-		errprintf("BUG: splitmsg_r called with non-empty secthead\n");
-		nextsection_r_done(*secthead);
-		*secthead = NULL;
-	}
+static void splitmsg_table(char *clientdata, secttable_t *table)
+{
+	char *cursection, *nextsection;
+	char *sectname, *sectdata;
+	sectlist_t *newsect;
+	int i;
 
 	/* Find the start of the first section */
 	if (*clientdata == '[') 
@@ -128,7 +158,12 @@ void splitmsg_r(char *clientdata, sectlist_t **secthead)
 	}
 
 	while (cursection) {
-		sectlist_t *newsect = (sectlist_t *)calloc(1, sizeof(sectlist_t));
+		if (table->count == table->size) {
+			table->size = (table->size ? 2*table->size : 64);
+			table->sects = (sectlist_t *)realloc(table->sects, table->size * sizeof(sectlist_t));
+		}
+		newsect = &table->sects[table->count++];
+		memset(newsect, 0, sizeof(sectlist_t));
 
 		/* Find end of this section (i.e. start of the next section, if any) */
 		nextsection = strstr(cursection, "\n[");
@@ -136,26 +171,63 @@ void splitmsg_r(char *clientdata, sectlist_t **secthead)
 			newsect->nextsectionrestoreptr = nextsection;
 			newsect->nextsectionrestoreval = *nextsection;
 			*nextsection = '\0';
-			nextsection++;
 		}
 
 		/* Pick out the section name and data */
 		sectname = cursection+1;
-		sectdata = sectname + strcspn(sectname, "]\n");
-		newsect->sectdatarestoreptr = sectdata;
-		newsect->sectdatarestoreval = *sectdata;
-		*sectdata = '\0'; 
-		sectdata++; if (*sectdata == '\n') sectdata++;
+		newsect->snamelen = strcspn(sectname, "]\n");
+		sectdata = sectname + newsect->snamelen;
+		if (*sectdata) {
+			newsect->sectdatarestoreptr = sectdata;
+			newsect->sectdatarestoreval = *sectdata;
+			*sectdata = '\0';
+			sectdata++; if (*sectdata == '\n') sectdata++;
+		}
 
-		/* Save the pointers in the list */
+		/* Save the pointers in the table */
 		newsect->sname = sectname;
 		newsect->sdata = sectdata;
-		newsect->next = *secthead;
-		*secthead = newsect;
+		newsect->shash = secthash(sectname, &newsect->snamelen);
 
 		/* Next section, please */
-		cursection = nextsection;
+		cursection = (nextsection ? nextsection+1 : NULL);
+	}
+
+	/*
+	 * Link the list and the hash index. Both have the last section of the
+	 * message first, so with duplicate section names the last one is used.
+	 */
+	for (i = 0; (i < table->count); i++) {
+		sectlist_t *sect = &table->sects[i];
+		int bucket = (sect->shash & (SECT_HASHSIZE-1));
+
+		sect->next = table->head;
+		table->head = sect;
+		sect->hnext = table->buckets[bucket];
+		table->buckets[bucket] = sect;
+	}
+}
+
+void splitmsg_r(char *clientdata, void **secthead)
+{
+	if (clientdata == NULL) {
+		errprintf("Got a NULL client data message\n");
+		return;
 	}
+
+	if (secthead == NULL) {
+		errprintf("BUG: splitmsg_r called with NULL secthead\n");
+		return;
+	}
+
+	if (*secthead) {
+		errprintf("BUG: splitmsg_r called with non-empty secthead\n");
+		nextsection_r_done(*secthead);
+		*secthead = NULL;
+	}
+
+	*secthead = calloc(1, sizeof(secttable_t));
+	splitmsg_table(clientdata, (secttable_t *)*secthead);
 }
 
 void splitmsg_done(void)
@@ -163,14 +235,16 @@ void splitmsg_done(void)
 	/*
 	 * NOTE: This MUST be called when we're doing using a message,
 	 * and BEFORE the next message is read. If called after the
-	 * next message is read, the restore-pointers in the "defsecthead"
-	 * list will point to data inside the NEW message, and 
+	 * next message is read, the restore-pointers in the "defsects"
+	 * table will point to data inside the NEW message, and 
 	 * if the buffer-usage happens to be setup correctly, then
 	 * this will write semi-random data over the new message.
+	 *
+	 * The table itself is kept for the next message.
 	 */
 	if (defsecthead) {
 		/* Clean up after the previous message */
-		nextsection_r_done(defsecthead);
+		secttable_restore(defsects);
 		defsecthead = NULL;
 	}
 }
@@ -182,15 +256,22 @@ void splitmsg(char *clientdata)
 		splitmsg_done();
 	}
 
-	splitmsg_r(clientdata, &defsecthead);
+	if (clientdata == NULL) {
+		errprintf("Got a NULL client data message\n");
+		return;
+	}
+
+	if (!defsects) defsects = (secttable_t *)calloc(1, sizeof(secttable_t));
+	splitmsg_table(clientdata, defsects);
+	defsecthead = defsects->head;
 }
 
 char *nextsection_r(char *clientdata, char **name, void **current, void **secthead)
 {
 	if (clientdata) {
 		*secthead = NULL;
-		splitmsg_r(clientdata, (sectlist_t **)secthead);
-		*current = *secthead;
+		splitmsg_r(clientdata, secthead);
+		*current = (*secthead ? ((secttable_t *)*secthead)->head : NULL);
 	}
 	else {
 		*current = (*current ? ((sectlist_t *)*current)->next : NULL);
@@ -208,25 +289,49 @@ char *nextsection(char *clientdata, char **name)
 {
 	static void *current = NULL;
 
-	if (clientdata && defsecthead) {
-		nextsection_r_done(defsecthead);
-		defsecthead = NULL;
+	if (clientdata && defsecthead) splitmsg_done();
+
+	if (clientdata) {
+		splitmsg(clientdata);
+		current = defsecthead;
+	}
+	else {
+		current = (current ? ((sectlist_t *)current)->next : NULL);
+	}
+
+	if (current) {
+		*name = ((sectlist_t *)current)->sname;
+		return ((sectlist_t *)current)->sdata;
 	}
 
-	return nextsection_r(clientdata, name, &current, (void **)&defsecthead);
+	return NULL;
 }
 
 
-char *getdata(char *sectionname)
+static sectlist_t *findsection(char *sectionname)
 {
 	sectlist_t *swalk;
+	unsigned int hash;
+	int namelen;
+
+	if (!defsecthead) return NULL;
 
-	for (swalk = defsecthead; (swalk && strcmp(swalk->sname, sectionname)); swalk = swalk->next) ;
-	if (swalk) return swalk->sdata;
+	hash = secthash(sectionname, &namelen);
+	for (swalk = defsects->buckets[hash & (SECT_HASHSIZE-1)]; (swalk); swalk = swalk->hnext) {
+		if ((swalk->shash == hash) && (swalk->snamelen == namelen) && (memcmp(swalk->sname, sectionname, namelen) == 0)) 
+			return swalk;
+	}
 
 	return NULL;
 }
 
+char *getdata(char *sectionname)
+{
+	sectlist_t *sect = findsection(sectionname);
+
+	return (sect ? sect->sdata : NULL);
+}
+
 int linecount(char *msg)
 {
 	int result = 0;
@@ -1766,6 +1871,8 @@ void unix_ports_report(char *hostname, char *clientclass, enum ostype_t os,
 #include "client/snmpcollect.c"
 
 static volatile int reloadconfig = 0;
+static char *configfn = NULL;
+static char **collectors = NULL;
 
 void sig_handler(int signum)
 {
@@ -2016,94 +2123,12 @@ void testmode(char *configfn)
 	exit(0);
 }
 
-int main(int argc, char *argv[])
+static int client_worker(void)
 {
 	char *msg;
 	int running;
-	int argi, seq;
-	struct sigaction sa;
+	int seq;
 	time_t nextconfigload = 0;
-	char *configfn = NULL;
-	char **collectors = NULL;
-
-	/* Handle program options. */
-	for (argi = 1; (argi < argc); argi++) {
-		if (strcmp(argv[argi], "--debug") == 0) {
-			debug = 1;
-		}
-		else if (strcmp(argv[argi], "--no-update") == 0) {
-			dontsendmessages = 1;
-		}
-		else if (strcmp(argv[argi], "--no-ps-listing") == 0) {
-			pslistinprocs = 0;
-		}
-		else if (strcmp(argv[argi], "--no-port-listing") == 0) {
-			portlistinports = 0;
-		}
-		else if (strcmp(argv[argi], "--no-clear-msgs") == 0) {
-			sendclearmsgs = 0;
-		}
-		else if (strcmp(argv[argi], "--no-clear-files") == 0) {
-			sendclearfiles = 0;
-		}
-		else if (strcmp(argv[argi], "--no-clear-ports") == 0) {
-			sendclearports = 0;
-		}
-		else if (strncmp(argv[argi], "--clear-color=", 14) == 0) {
-			char *p = strchr(argv[argi], '=');
-			noreportcolor = parse_color(p+1);
-		}
-		else if (argnmatch(argv[argi], "--config=")) {
-			char *lp = strchr(argv[argi], '=');
-			configfn = strdup(lp+1);
-		}
-		else if (argnmatch(argv[argi], "--collectors=")) {
-			char *lp = strdup(strchr(argv[argi], '=')+1);
-			char *tok;
-			int i;
-
-			tok = strtok(lp, ","); i = 0; collectors = (char **)calloc(1, sizeof(char *));
-			while (tok) {
-				collectors = (char **)realloc(collectors, (i+2)*sizeof(char *));
-				if (strcasecmp(tok, "default") == 0) tok = "";
-				collectors[i++] = tok; collectors[i] = NULL;
-				tok = strtok(NULL, ",");
-			}
-		}
-		else if (argnmatch(argv[argi], "--dump-config")) {
-			load_client_config(configfn);
-			dump_client_config();
-			return 0;
-		}
-		else if (strcmp(argv[argi], "--local") == 0) {
-			localmode = 1;
-		}
-		else if (strcmp(argv[argi], "--test") == 0) {
-			testmode(configfn);
-		}
-		else if (net_worker_option(argv[argi])) {
-			/* Handled in the subroutine */
-		}
-	}
-
-	save_errbuf = 0;
-
-	if (collectors == NULL) {
-		/* Setup the default collectors */
-		collectors = (char **)calloc(2, sizeof(char *));
-		collectors[0] = "";
-		collectors[1] = NULL;
-	}
-
-	/* Do the network stuff if needed */
-	net_worker_run(ST_CLIENT, LOC_ROAMING, NULL);
-
-	/* Signals */
-	setup_signalhandler("xymond_client");
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = sig_handler;
-	sigaction(SIGHUP, &sa, NULL);
-	signal(SIGCHLD, SIG_IGN);
 
 	updinfotree = xtreeNew(strcasecmp);
 	running = 1;
@@ -2114,7 +2139,7 @@ int main(int argc, char *argv[])
 		int metacount;
 		time_t nowtimer = gettimer();
 
-		msg = get_xymond_message(C_CLIENT, argv[0], &seq, NULL);
+		msg = get_xymond_message(C_CLIENT, "xymond_client", &seq, NULL);
 		if (msg == NULL) {
 			if (!localmode) errprintf("Failed to get a message, terminating\n");
 			running = 0;
@@ -2282,3 +2307,105 @@ int main(int argc, char *argv[])
 	return 0;
 }
 
+int main(int argc, char *argv[])
+{
+	int argi;
+	int workercount = 1;
+	char *reportcolumn = NULL;
+	struct sigaction sa;
+
+	/* Handle program options. */
+	for (argi = 1; (argi < argc); argi++) {
+		if (strcmp(argv[argi], "--debug") == 0) {
+			debug = 1;
+		}
+		else if (strcmp(argv[argi], "--no-update") == 0) {
+			dontsendmessages = 1;
+		}
+		else if (strcmp(argv[argi], "--no-ps-listing") == 0) {
+			pslistinprocs = 0;
+		}
+		else if (strcmp(argv[argi], "--no-port-listing") == 0) {
+			portlistinports = 0;
+		}
+		else if (strcmp(argv[argi], "--no-clear-msgs") == 0) {
+			sendclearmsgs = 0;
+		}
+		else if (strcmp(argv[argi], "--no-clear-files") == 0) {
+			sendclearfiles = 0;
+		}
+		else if (strcmp(argv[argi], "--no-clear-ports") == 0) {
+			sendclearports = 0;
+		}
+		else if (strncmp(argv[argi], "--clear-color=", 14) == 0) {
+			char *p = strchr(argv[argi], '=');
+			noreportcolor = parse_color(p+1);
+		}
+		else if (argnmatch(argv[argi], "--config=")) {
+			char *lp = strchr(argv[argi], '=');
+			configfn = strdup(lp+1);
+		}
+		else if (argnmatch(argv[argi], "--collectors=")) {
+			char *lp = strdup(strchr(argv[argi], '=')+1);
+			char *tok;
+			int i;
+
+			tok = strtok(lp, ","); i = 0; collectors = (char **)calloc(1, sizeof(char *));
+			while (tok) {
+				collectors = (char **)realloc(collectors, (i+2)*sizeof(char *));
+				if (strcasecmp(tok, "default") == 0) tok = "";
+				collectors[i++] = tok; collectors[i] = NULL;
+				tok = strtok(NULL, ",");
+			}
+		}
+		else if (argnmatch(argv[argi], "--dump-config")) {
+			load_client_config(configfn);
+			dump_client_config();
+			return 0;
+		}
+		else if (strcmp(argv[argi], "--local") == 0) {
+			localmode = 1;
+		}
+		else if (strcmp(argv[argi], "--test") == 0) {
+			testmode(configfn);
+		}
+		else if (argnmatch(argv[argi], "--workers=")) {
+			char *p = strchr(argv[argi], '=');
+			workercount = atoi(p+1);
+			if (workercount < 1) workercount = 1;
+		}
+		else if (argnmatch(argv[argi], "--report=") || (strcmp(argv[argi], "--report") == 0)) {
+			char *p = strchr(argv[argi], '=');
+			reportcolumn = (p ? strdup(p+1) : "xymond_client");
+		}
+		else if (net_worker_option(argv[argi])) {
+			/* Handled in the subroutine */
+		}
+	}
+
+	save_errbuf = 0;
+
+	if (collectors == NULL) {
+		/* Setup the default collectors */
+		collectors = (char **)calloc(2, sizeof(char *));
+		collectors[0] = "";
+		collectors[1] = NULL;
+	}
+
+	/* Do the network stuff if needed */
+	net_worker_run(ST_CLIENT, LOC_ROAMING, NULL);
+
+	/* Signals */
+	setup_signalhandler("xymond_client");
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_handler;
+	sigaction(SIGHUP, &sa, NULL);
+	signal(SIGCHLD, SIG_IGN);
+
+	if ((workercount > 1) && !localmode) {
+		/* Spread the client messages over a pool of worker processes, by hostname */
+		return worker_pool_run(C_CLIENT, "xymond_client", workercount, 3, client_worker, reportcolumn);
+	}
+
+	return client_worker();
+}
@@ -0,0 +1,628 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon message daemon.                                                      */
+/*                                                                            */
+/* This module implements the combination tests from combo.cfg inside         */
+/* xymond. The expressions are compiled when the file is loaded, and a        */
+/* combo test is re-evaluated as soon as one of its inputs changes color.     */
+/*                                                                            */
+/* Copyright (C) 2003-2011 Henrik Storner <henrik@hswn.dk>                    */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+static char rcsid[] = "$Id$";
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "libxymon.h"
+
+#include "xymond_combo.h"
+
+typedef struct combo_t combo_t;
+
+typedef struct symbol_t {
+	char *symbol;			/* "host.test" as written in combo.cfg */
+	char *hostname, *testname;
+	combo_t *combo;			/* If the symbol is another combo test */
+	int color;			/* Color used in the last evaluation */
+} symbol_t;
+
+typedef struct exprpart_t {
+	char *text;			/* Literal expression text, or NULL ... */
+	int symidx;			/* ... for a reference to symbols[symidx] */
+} exprpart_t;
+
+struct combo_t {
+	char *reshostname;
+	char *restestname;
+	char *expression;
+	char *comment;
+	symbol_t *symbols;
+	int symcount;
+	exprpart_t *parts;
+	int partcount;
+	char *resultexpr;
+	long result;
+	char *errbuf;
+	int dirty;
+	struct combo_t *nextdirty;
+	struct combo_t *next;
+};
+
+typedef struct combodep_t {
+	combo_t *combo;
+	struct combodep_t *next;
+} combodep_t;
+
+int comboerrorcolors = (1 << COL_RED);
+int comboshoweval = 1;
+int combocleanexpr = 0;
+
+static combo_t *combohead = NULL;
+static int combocount = 0;
+static void *combodeps = NULL;		/* "host|test" -> list of combos using it */
+static void *combonames = NULL;		/* "host|test" -> combo with this result */
+static combo_t *dirtyhead = NULL, *dirtytail = NULL;
+static int loopreported = 0;
+
+
+static char *depkey(char *hostname, char *testname)
+{
+	static char *result = NULL;
+	static int resultsz = 0;
+	int needed = strlen(hostname) + strlen(testname) + 2;
+
+	if (needed > resultsz) {
+		resultsz = needed + 128;
+		result = (char *)realloc(result, resultsz);
+	}
+	sprintf(result, "%s|%s", hostname, testname);
+
+	return result;
+}
+
+static int splitsymbol(char *spec, char **hostname, char **testname)
+{
+	/* Split a "www.xxx.com.testname" string */
+	char *p;
+
+	p = strrchr(spec, '.');
+	if (!p) {
+		errprintf("Item '%s' has no testname part\n", spec);
+		return 0;
+	}
+
+	*p = '\0';
+	*hostname = strdup(spec);
+	*testname = strdup(p+1);
+	*p = '.';
+
+	return 1;
+}
+
+static void flush_combotests(void)
+{
+	combo_t *zombie;
+	xtreePos_t handle;
+	int i;
+
+	while (combohead) {
+		zombie = combohead; combohead = combohead->next;
+
+		xfree(zombie->reshostname);
+		xfree(zombie->restestname);
+		xfree(zombie->expression);
+		if (zombie->comment) xfree(zombie->comment);
+		for (i = 0; (i < zombie->symcount); i++) {
+			xfree(zombie->symbols[i].symbol);
+			if (zombie->symbols[i].hostname) xfree(zombie->symbols[i].hostname);
+			if (zombie->symbols[i].testname) xfree(zombie->symbols[i].testname);
+		}
+		if (zombie->symbols) xfree(zombie->symbols);
+		for (i = 0; (i < zombie->partcount); i++) {
+			if (zombie->parts[i].text) xfree(zombie->parts[i].text);
+		}
+		if (zombie->parts) xfree(zombie->parts);
+		if (zombie->resultexpr) xfree(zombie->resultexpr);
+		if (zombie->errbuf) xfree(zombie->errbuf);
+		xfree(zombie);
+	}
+	combocount = 0;
+	dirtyhead = dirtytail = NULL;
+
+	if (combodeps) {
+		for (handle = xtreeFirst(combodeps); (handle != xtreeEnd(combodeps)); handle = xtreeNext(combodeps, handle)) {
+			combodep_t *dwalk = (combodep_t *)xtreeData(combodeps, handle);
+			char *key = xtreeKey(combodeps, handle);
+
+			while (dwalk) {
+				combodep_t *dzombie = dwalk;
+				dwalk = dwalk->next;
+				xfree(dzombie);
+			}
+			xfree(key);
+		}
+		xtreeDestroy(combodeps);
+	}
+	combodeps = xtreeNew(strcmp);
+
+	if (combonames) {
+		for (handle = xtreeFirst(combonames); (handle != xtreeEnd(combonames)); handle = xtreeNext(combonames, handle)) {
+			char *key = xtreeKey(combonames, handle);
+			xfree(key);
+		}
+		xtreeDestroy(combonames);
+	}
+	combonames = xtreeNew(strcmp);
+}
+
+static void addpart(combo_t *combo, char *text, int symidx)
+{
+	combo->parts = (exprpart_t *)realloc(combo->parts, (combo->partcount+1)*sizeof(exprpart_t));
+	combo->parts[combo->partcount].text = (text ? strdup(text) : NULL);
+	combo->parts[combo->partcount].symidx = symidx;
+	combo->partcount++;
+}
+
+static void compile_expression(combo_t *combo)
+{
+	/*
+	 * Split the expression into literal text and symbols. Symbols
+	 * are parsed the same way as combostatus always did it.
+	 */
+	char *literal, *litp;
+	char *symbol, *symp;
+	char *inp;
+	int insymbol = 0, done = 0;
+
+	literal = (char *)malloc(strlen(combo->expression)+1); litp = literal;
+	symbol = (char *)malloc(strlen(combo->expression)+1); symp = NULL;
+
+	inp = combo->expression;
+	while (!done) {
+		if (isalpha((int)*inp)) {
+			if (!insymbol) { insymbol = 1; symp = symbol; }
+			*symp = *inp; symp++;
+		}
+		else if (insymbol && (isdigit((int) *inp) || (*inp == '.'))) {
+			*symp = *inp; symp++;
+		}
+		else if (insymbol && ((*inp == '\\') && (*(inp+1) > ' '))) {
+			*symp = *(inp+1); symp++; inp++;
+		}
+		else {
+			if (insymbol) {
+				/* Symbol finished - flush the literal text before it, and add the symbol */
+				symbol_t *sym;
+
+				*symp = '\0';
+				insymbol = 0;
+
+				*litp = '\0';
+				if (*literal) addpart(combo, literal, -1);
+				litp = literal;
+
+				combo->symbols = (symbol_t *)realloc(combo->symbols, (combo->symcount+1)*sizeof(symbol_t));
+				sym = &combo->symbols[combo->symcount];
+				sym->symbol = strdup(symbol);
+				sym->hostname = sym->testname = NULL;
+				sym->combo = NULL;
+				sym->color = -1;
+				if (!splitsymbol(symbol, &sym->hostname, &sym->testname)) {
+					errprintf("Invalid data for symbol calculation - missing host/testname: %s\n", symbol);
+				}
+				addpart(combo, NULL, combo->symcount);
+				combo->symcount++;
+			}
+
+			if (*inp) *(litp++) = *inp;
+			symp = NULL;
+		}
+
+		if (*inp == '\0') done = 1; else inp++;
+	}
+
+	*litp = '\0';
+	if (*literal) addpart(combo, literal, -1);
+
+	xfree(symbol);
+	xfree(literal);
+}
+
+static void add_dependency(char *hostname, char *testname, combo_t *combo)
+{
+	xtreePos_t handle;
+	combodep_t *newdep, *dwalk;
+	char *key = depkey(hostname, testname);
+
+	handle = xtreeFind(combodeps, key);
+	dwalk = ((handle != xtreeEnd(combodeps)) ? (combodep_t *)xtreeData(combodeps, handle) : NULL);
+
+	/* The same input may appear several times in one expression */
+	for (newdep = dwalk; (newdep && (newdep->combo != combo)); newdep = newdep->next) ;
+	if (newdep) return;
+
+	newdep = (combodep_t *)calloc(1, sizeof(combodep_t));
+	newdep->combo = combo;
+	if (dwalk) {
+		/* Keep the list head in the tree */
+		newdep->next = dwalk->next;
+		dwalk->next = newdep;
+	}
+	else {
+		xtreeAdd(combodeps, strdup(key), newdep);
+	}
+}
+
+static void markdirty(combo_t *combo)
+{
+	if (combo->dirty) return;
+
+	combo->dirty = 1;
+	combo->nextdirty = NULL;
+	if (dirtytail) dirtytail->nextdirty = combo; else dirtyhead = combo;
+	dirtytail = combo;
+}
+
+int load_combotests(char *fn)
+{
+	/* Returns 1 if the combo tests were (re)loaded */
+	static void *configfiles = NULL;
+	FILE *fd;
+	strbuffer_t *inbuf;
+	combo_t *cwalk;
+	int i;
+
+	if (configfiles && !stackfmodified(configfiles)) return 0;
+
+	fd = stackfopen(fn, "r", &configfiles);
+	if (fd == NULL) {
+		errprintf("Cannot open %s\n", fn);
+		return 0;
+	}
+
+	flush_combotests();
+	loopreported = 0;
+
+	inbuf = newstrbuffer(0);
+	while (stackfgets(inbuf, NULL)) {
+		char *p, *comment;
+		char *inp, *outp;
+		char *hname, *tname;
+		combo_t *newtest;
+
+		p = strchr(STRBUF(inbuf), '\n'); if (p) *p = '\0';
+		/* Strip whitespace */
+		for (inp=outp=STRBUF(inbuf); ((*inp >= ' ') && (*inp != '#')); inp++) {
+			if (!isspace((int)*inp)) {
+				*outp = *inp;
+				outp++;
+			}
+		}
+		*outp = '\0';
+		if (strlen(inp)) memmove(outp, inp, strlen(inp)+1);
+		strbufferrecalc(inbuf);
+
+		if (!STRBUFLEN(inbuf) || (*STRBUF(inbuf) == '#') || ((p = strchr(STRBUF(inbuf), '=')) == NULL)) continue;
+
+		*p = '\0';
+		if (!splitsymbol(STRBUF(inbuf), &hname, &tname)) {
+			errprintf("Invalid combo test %s - missing host/test names. Perhaps you need to escape dashes?\n", STRBUF(inbuf));
+			continue;
+		}
+
+		comment = strchr(p+1, '#');
+		if (comment) *comment = '\0';
+		newtest = (combo_t *) calloc(1, sizeof(combo_t));
+		newtest->reshostname = hname;
+		newtest->restestname = tname;
+		newtest->expression = strdup(p+1);
+		newtest->comment = (comment ? strdup(comment+1) : NULL);
+		newtest->result = -1;
+		compile_expression(newtest);
+		newtest->next = combohead;
+		combohead = newtest;
+		combocount++;
+
+		xtreeAdd(combonames, strdup(depkey(hname, tname)), newtest);
+	}
+
+	stackfclose(fd);
+	freestrbuffer(inbuf);
+
+	/* Now that all combo tests are known, setup the dependencies */
+	for (cwalk = combohead; (cwalk); cwalk = cwalk->next) {
+		for (i = 0; (i < cwalk->symcount); i++) {
+			symbol_t *sym = &cwalk->symbols[i];
+			xtreePos_t handle;
+
+			if (!sym->hostname) continue;
+
+			handle = xtreeFind(combonames, depkey(sym->hostname, sym->testname));
+			if (handle != xtreeEnd(combonames)) sym->combo = (combo_t *)xtreeData(combonames, handle);
+
+			add_dependency(sym->hostname, sym->testname, cwalk);
+		}
+
+		markdirty(cwalk);
+	}
+
+	dbgprintf("Loaded %d combo tests from %s\n", combocount, fn);
+	return 1;
+}
+
+void combo_statuschange(char *hostname, char *testname)
+{
+	/* Called when a status changes color. Flag the combo tests that use it */
+	xtreePos_t handle;
+	combodep_t *dwalk;
+
+	if (!combodeps || !combohead) return;
+
+	handle = xtreeFind(combodeps, depkey(hostname, testname));
+	if (handle == xtreeEnd(combodeps)) return;
+
+	for (dwalk = (combodep_t *)xtreeData(combodeps, handle); (dwalk); dwalk = dwalk->next) markdirty(dwalk->combo);
+}
+
+void combo_refresh(void)
+{
+	/* Re-send all combo statuses, so they dont go purple */
+	combo_t *cwalk;
+
+	for (cwalk = combohead; (cwalk); cwalk = cwalk->next) markdirty(cwalk);
+}
+
+int combo_pending(void)
+{
+	return (dirtyhead != NULL);
+}
+
+static void adderror(combo_t *combo, char *errtext)
+{
+	if (combo->errbuf == NULL) {
+		combo->errbuf = strdup(errtext);
+	}
+	else {
+		combo->errbuf = (char *)realloc(combo->errbuf, strlen(combo->errbuf)+strlen(errtext)+1);
+		strcat(combo->errbuf, errtext);
+	}
+}
+
+static int combo_ready(combo_t *combo)
+{
+	/* A combo test is ready for evaluation when the combo tests it uses have a current result */
+	int i;
+
+	for (i = 0; (i < combo->symcount); i++) {
+		combo_t *input = combo->symbols[i].combo;
+
+		if (input && (input->dirty || (input->result == -1))) return 0;
+	}
+
+	return 1;
+}
+
+static long evaluate(combo_t *combo, combo_getcolor_fn_t *getcolor, int *pending)
+{
+	strbuffer_t *expr;
+	char valstr[30];
+	char errtext[1024];
+	int i, error;
+	long result;
+
+	if (combo->errbuf) { xfree(combo->errbuf); combo->errbuf = NULL; }
+	*pending = 0;
+
+	expr = newstrbuffer(0);
+	for (i = 0; (i < combo->partcount); i++) {
+		symbol_t *sym;
+		long oneval;
+
+		if (combo->parts[i].text) {
+			addtobuffer(expr, combo->parts[i].text);
+			continue;
+		}
+
+		sym = &combo->symbols[combo->parts[i].symidx];
+		if (sym->combo) {
+			/* It is a combo test they want the result of. */
+			oneval = sym->combo->result;
+			sym->color = -1;
+			if (oneval == -1) *pending = 1;	/* Not evaluated yet */
+		}
+		else if (sym->hostname) {
+			sym->color = getcolor(sym->hostname, sym->testname);
+			oneval = (((1 << sym->color) & comboerrorcolors) == 0);
+		}
+		else {
+			oneval = 0;
+			sym->color = COL_CLEAR;
+		}
+
+		sprintf(valstr, "%ld", oneval);
+		addtobuffer(expr, valstr);
+	}
+
+	if (combo->resultexpr) xfree(combo->resultexpr);
+	combo->resultexpr = grabstrbuffer(expr);
+	dbgprintf("Symbolic '%s' converted to '%s'\n", combo->expression, combo->resultexpr);
+
+	error = 0;
+	result = compute(combo->resultexpr, &error);
+
+	if (error) {
+		sprintf(errtext, "compute(%s) returned error %d\n", combo->resultexpr, error);
+		adderror(combo, errtext);
+	}
+
+	return result;
+}
+
+static char *printify(char *exp, int cleanexpr)
+{
+	static char result[MAX_LINE_LEN];
+	char *inp, *outp;
+	size_t n;
+
+	if (!cleanexpr) {
+		return exp;
+	}
+
+	inp = exp;
+	outp = result;
+
+	while (*inp && ((outp - result) < (sizeof(result) - 10))) {
+		n = strcspn(inp, "|&");
+		if (n > (sizeof(result) - 10 - (outp - result))) n = (sizeof(result) - 10 - (outp - result));
+		memcpy(outp, inp, n);
+		inp += n; outp += n;
+
+		if (*inp == '|') {
+			inp++;
+			if (*inp == '|') {
+				inp++;
+				strcpy(outp, " OR "); outp += 4;
+			}
+			else {
+				strcpy(outp, " bOR "); outp += 5;
+			}
+		}
+		else if (*inp == '&') {
+			inp++;
+			if (*inp == '&') {
+				inp++;
+				strcpy(outp, " AND "); outp += 5;
+			}
+			else {
+				strcpy(outp, " bAND "); outp += 6;
+			}
+		}
+	}
+
+	*outp = '\0';
+	return result;
+}
+
+static char *combo_status(combo_t *combo)
+{
+	strbuffer_t *msg;
+	char msgline[MAX_LINE_LEN];
+	int color, i;
+
+	color = (combo->result ? COL_GREEN : COL_RED);
+
+	msg = newstrbuffer(0);
+	addtobuffer(msg, "status ");
+	addtobuffer(msg, commafy(combo->reshostname));
+	addtobuffer(msg, ".");
+	addtobuffer(msg, combo->restestname);
+	addtobuffer(msg, " ");
+	addtobuffer(msg, colorname(color));
+	addtobuffer(msg, " ");
+	addtobuffer(msg, timestamp);
+	addtobuffer(msg, "\n\n");
+	if (combo->comment) { addtobuffer(msg, combo->comment); addtobuffer(msg, "\n\n"); }
+	if (comboshoweval) {
+		addtobuffer(msg, printify(combo->expression, combocleanexpr));
+		addtobuffer(msg, " = ");
+		addtobuffer(msg, printify(combo->resultexpr, combocleanexpr));
+		addtobuffer(msg, " = ");
+		sprintf(msgline, "%ld\n", combo->result);
+		addtobuffer(msg, msgline);
+
+		for (i = 0; (i < combo->symcount); i++) {
+			symbol_t *sym = &combo->symbols[i];
+			int symcolor = sym->color;
+
+			if (!sym->hostname) continue;
+			if (sym->combo) symcolor = (sym->combo->result ? COL_GREEN : COL_RED);
+
+			snprintf(msgline, sizeof(msgline), "&%s <a href=\"%s/svcstatus.sh?HOST=%s&amp;SERVICE=%s\">%s</a>\n",
+				colorname(symcolor), xgetenv("CGIBINURL"), sym->hostname, sym->testname, sym->symbol);
+			addtobuffer(msg, msgline);
+		}
+
+		if (combo->errbuf) {
+			addtobuffer(msg, "\nErrors occurred during evaluation:\n");
+			addtobuffer(msg, combo->errbuf);
+		}
+	}
+
+	return grabstrbuffer(msg);
+}
+
+void combo_run(combo_getcolor_fn_t *getcolor, combo_post_fn_t *poststatus)
+{
+	/*
+	 * Evaluate the combo tests that have changed inputs. Posting a combo
+	 * status may flag other combo tests that depend on it, so these are
+	 * handled in the same run. Combo tests are evaluated after the combo
+	 * tests they use, so they never see an old or missing result.
+	 * A combo test that depends on itself (directly or indirectly) could
+	 * cycle forever, so there is a limit on how many evaluations we will do.
+	 */
+	int evalcount = 0, maxevals = 4*combocount + 10;
+
+	if (!dirtyhead) return;
+
+	init_timestamp();
+
+	while (dirtyhead && (evalcount < maxevals)) {
+		combo_t *combo, *prev = NULL;
+		long oldresult;
+		int pending;
+		char *msg;
+
+		for (combo = dirtyhead; (combo && !combo_ready(combo)); combo = combo->nextdirty) prev = combo;
+		if (!combo) {
+			/* None are ready, so the remaining ones depend on each other in a loop */
+			if (!loopreported) {
+				errprintf("Combo test %s.%s is part of a loop - check combo.cfg\n",
+					  dirtyhead->reshostname, dirtyhead->restestname);
+				loopreported = 1;
+			}
+			combo = dirtyhead; prev = NULL;
+		}
+
+		if (prev) prev->nextdirty = combo->nextdirty; else dirtyhead = combo->nextdirty;
+		if (dirtytail == combo) dirtytail = prev;
+		combo->dirty = 0;
+		combo->nextdirty = NULL;
+
+		oldresult = combo->result;
+		combo->result = evaluate(combo, getcolor, &pending);
+		evalcount++;
+
+		/* Combo tests using this one get the numeric result, not the color */
+		if (combo->result != oldresult) combo_statuschange(combo->reshostname, combo->restestname);
+
+		/* Dont post a result computed from combo tests without a result */
+		if (pending) continue;
+
+		msg = combo_status(combo);
+		poststatus(msg);
+		xfree(msg);
+	}
+
+	if (dirtyhead) {
+		errprintf("Combo test evaluation does not settle - check for loops in combo.cfg\n");
+		while (dirtyhead) {
+			combo_t *combo = dirtyhead;
+
+			dirtyhead = combo->nextdirty;
+			combo->dirty = 0;
+			combo->nextdirty = NULL;
+		}
+		dirtytail = NULL;
+	}
+}
+
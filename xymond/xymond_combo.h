@@ -0,0 +1,27 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon message daemon.                                                      */
+/*                                                                            */
+/* Copyright (C) 2004-2011 Henrik Storner <henrik@hswn.dk>                    */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+#ifndef __XYMOND_COMBO_H__
+#define __XYMOND_COMBO_H__
+
+typedef int (combo_getcolor_fn_t)(char *hostname, char *testname);
+typedef void (combo_post_fn_t)(char *msg);
+
+extern int comboerrorcolors;
+extern int comboshoweval;
+extern int combocleanexpr;
+
+extern int load_combotests(char *fn);
+extern void combo_statuschange(char *hostname, char *testname);
+extern void combo_refresh(void);
+extern int combo_pending(void);
+extern void combo_run(combo_getcolor_fn_t *getcolor, combo_post_fn_t *poststatus);
+#endif
+
@@ -171,7 +171,11 @@ int main(int argc, char *argv[])
 		if (alleventsfd == NULL) {
 			errprintf("Cannot open the all-events file '%s'\n", alleventsfn);
 		}
-		setvbuf(alleventsfd, (char *)NULL, _IOLBF, 0);
+		else {
+			setvbuf(alleventsfd, (char *)NULL, _IOLBF, 0);
+			fseeko(alleventsfd, 0, SEEK_END);
+			eventindex_open(histdir);
+		}
 	}
 
 	/* For picking up lost children */
@@ -204,9 +208,12 @@ int main(int argc, char *argv[])
 			alleventsfd = fopen(alleventsfn, "a");
 			if (alleventsfd == NULL) {
 				errprintf("Cannot re-open the all-events file '%s'\n", alleventsfn);
+				eventindex_close();
 			}
 			else {
 				setvbuf(alleventsfd, (char *)NULL, _IOLBF, 0);
+				fseeko(alleventsfd, 0, SEEK_END);
+				eventindex_open(histdir);
 			}
 		}
 
@@ -535,11 +542,29 @@ int main(int argc, char *argv[])
 				MEMUNDEFINE(hostlogfn);
 			}
 
-			if (save_allevents) {
+			if (save_allevents && alleventsfd) {
+				struct stat fst, st;
+				off_t eventofs;
+
+				/* If trimhistory has replaced the allevents file, switch to the new one */
+				if ((fstat(fileno(alleventsfd), &fst) == 0) && (stat(alleventsfn, &st) == 0) && (fst.st_ino != st.st_ino)) {
+					FILE *newfd = fopen(alleventsfn, "a");
+
+					if (newfd) {
+						fclose(alleventsfd);
+						alleventsfd = newfd;
+						setvbuf(alleventsfd, (char *)NULL, _IOLBF, 0);
+						fseeko(alleventsfd, 0, SEEK_END);
+						eventindex_open(histdir);
+					}
+				}
+
+				eventofs = ftello(alleventsfd);
 				fprintf(alleventsfd, "%s %s %d %d %d %s %s %d\n",
 					hostname, testname, (int)tstamp, (int)lastchg, (int)(tstamp - lastchg),
 					newcol2, oldcol2, trend);
 				fflush(alleventsfd);
+				eventindex_add(hostname, testname, tstamp, eventofs);
 			}
 
 			xfree(hostnamecommas);
@@ -786,7 +811,8 @@ int main(int argc, char *argv[])
 	MEMUNDEFINE(alleventsfn);
 	MEMUNDEFINE(pidfn);
 
-	fclose(alleventsfd);
+	if (alleventsfd) fclose(alleventsfd);
+	eventindex_close();
 	unlink(pidfn);
 
 	return 0;
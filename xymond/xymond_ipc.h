@@ -31,6 +31,25 @@ typedef struct xymond_channel_t {
 	struct xymond_channel_t *next;
 } xymond_channel_t;
 
+/*
+ * Header in front of each message when xymond_channel runs with "--framed".
+ * The message text follows the header, without the "\n@@\n" end-marker.
+ * The offsets of hostname, testname and color are relative to the start of
+ * the message text; a length of 0 means the field is not in this message.
+ * Only used on the local pipe to the worker, so everything is in host byte order.
+ */
+#define XYMOND_FRAMEMAGIC 0x584d4631	/* "XMF1" */
+typedef struct xymond_framehdr_t {
+	unsigned int magic;
+	unsigned int msglen;			/* Bytes of message text following the header */
+	unsigned int seq;			/* Sequence number, 0 for control messages */
+	unsigned int tstamp_sec, tstamp_usec;	/* When xymond posted the message */
+	unsigned int metalen;			/* Length of the meta-data line */
+	unsigned int hostofs, hostlen;
+	unsigned int testofs, testlen;
+	unsigned int colorofs, colorlen;
+} xymond_framehdr_t;
+
 extern char *channelnames[];
 
 extern xymond_channel_t *setup_channel(enum msgchannels_t chnname, int role);
@@ -0,0 +1,1005 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon message daemon.                                                      */
+/*                                                                            */
+/* Load generator for xymond. This sends status-, data- and client-messages  */
+/* to a xymond instance at a configurable rate - either synthesized messages  */
+/* for a number of hosts and tests, or messages replayed from a file saved by */
+/* xymond_capture. When run as a worker module with the "--receive" option,   */
+/* it measures how long it takes for the messages to get through xymond and   */
+/* out to the channel workers.                                                */
+/*                                                                            */
+/* Copyright (C) 2004-2011 Henrik Storner <henrik@hswn.dk>                    */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+static char rcsid[] = "$Id$";
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include "libxymon.h"
+#include "xymond_worker.h"
+
+#define MAX_META 20		/* The maximum number of meta-data items in a message */
+#define MAX_RESULTS 64		/* Max. number of items in a result file */
+#define HISTBUCKETS 1024
+#define MARKER "loadgen-sent: "	/* Line added to each message we send, with runid and timestamp */
+
+/*
+ * Latency histogram. Buckets are log-linear: values below 16 have their own
+ * bucket, above that each power of two is split in 16 buckets. So the
+ * precision is about 6%, with a fixed size regardless of how many samples
+ * we have - which also makes it easy to pass the results from the
+ * generator processes back to the parent.
+ */
+typedef struct loadhist_t {
+	unsigned long count[HISTBUCKETS];
+	unsigned long samples;
+	unsigned long maxval;
+	double sum;
+} loadhist_t;
+
+typedef struct loadresult_t {
+	unsigned long msgs, conns, errors, bytes;
+	unsigned long delivered[3];	/* Messages sent without errors, by kind (status, client, data) */
+	loadhist_t sendlat;
+} loadresult_t;
+
+typedef struct resultset_t {
+	int count;
+	char *key[MAX_RESULTS];
+	double val[MAX_RESULTS];
+} resultset_t;
+
+typedef struct replaymsg_t {
+	char *msg;
+	double tstamp;
+} replaymsg_t;
+
+enum msgkind_t { K_STATUS, K_CLIENT, K_DATA, K_OTHER };
+static char *kindnames[K_OTHER] = { "status", "client", "data" };
+
+/* Generator settings */
+static struct sockaddr_in serveraddr;
+static int hostcount = 100, testcount = 10, withclient = 0, withdata = 0;
+static int concurrency = 1, combosize = 0, msgsize = 0;
+static double msgrate = 0.0, replayspeed = 0.0;
+static int duration = 0, replayloop = 0;
+static unsigned long msglimit = 0;
+static char *hostprefix = "loadgen";
+static char runid[64];
+static replaymsg_t *replaymsgs = NULL;
+static int replaycount = 0;
+static volatile int stopnow = 0;
+
+
+static void sigmisc_handler(int signum)
+{
+	stopnow = 1;
+}
+
+static double timenow(void)
+{
+	struct timeval tv;
+	struct timezone tz;
+
+	gettimeofday(&tv, &tz);
+	return (double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0);
+}
+
+static int histbucket(unsigned long val)
+{
+	int e = 0;
+
+	if (val < 16) return (int)val;
+	while ((val >> e) >= 32) e++;
+	return 16 + e*16 + (int)((val >> e) - 16);
+}
+
+static unsigned long histvalue(int bucket)
+{
+	int e;
+
+	if (bucket < 16) return bucket;
+	e = (bucket - 16) / 16;
+	return ((unsigned long)(((bucket - 16) % 16) + 16 + 1) << e) - 1;
+}
+
+static void histadd(loadhist_t *h, unsigned long val)
+{
+	int b = histbucket(val);
+
+	if (b >= HISTBUCKETS) b = HISTBUCKETS-1;
+	h->count[b]++;
+	h->samples++;
+	h->sum += val;
+	if (val > h->maxval) h->maxval = val;
+}
+
+static void histmerge(loadhist_t *h, loadhist_t *src)
+{
+	int i;
+
+	for (i=0; (i < HISTBUCKETS); i++) h->count[i] += src->count[i];
+	h->samples += src->samples;
+	h->sum += src->sum;
+	if (src->maxval > h->maxval) h->maxval = src->maxval;
+}
+
+static unsigned long histpercentile(loadhist_t *h, double pct)
+{
+	unsigned long want, seen = 0;
+	int i;
+
+	if (h->samples == 0) return 0;
+
+	want = (unsigned long)((pct / 100.0) * h->samples + 0.5);
+	if (want < 1) want = 1;
+	for (i=0; (i < HISTBUCKETS); i++) {
+		seen += h->count[i];
+		if (seen >= want) {
+			unsigned long val = histvalue(i);
+			return ((val < h->maxval) ? val : h->maxval);
+		}
+	}
+
+	return h->maxval;
+}
+
+static void setresult(resultset_t *rs, char *key, double val)
+{
+	int i;
+
+	for (i=0; ((i < rs->count) && strcmp(rs->key[i], key)); i++) ;
+	if (i == rs->count) {
+		if (rs->count == MAX_RESULTS) return;
+		rs->key[rs->count++] = strdup(key);
+	}
+	rs->val[i] = val;
+}
+
+static int getresult(resultset_t *rs, char *key, double *val)
+{
+	int i;
+
+	for (i=0; (i < rs->count); i++) {
+		if (strcmp(rs->key[i], key) == 0) {
+			*val = rs->val[i];
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void sethistresults(resultset_t *rs, char *prefix, loadhist_t *h)
+{
+	char key[100];
+
+	sprintf(key, "%s_p50_us", prefix); setresult(rs, key, histpercentile(h, 50.0));
+	sprintf(key, "%s_p90_us", prefix); setresult(rs, key, histpercentile(h, 90.0));
+	sprintf(key, "%s_p99_us", prefix); setresult(rs, key, histpercentile(h, 99.0));
+	sprintf(key, "%s_max_us", prefix); setresult(rs, key, h->maxval);
+	sprintf(key, "%s_avg_us", prefix); setresult(rs, key, (h->samples ? (h->sum / h->samples) : 0.0));
+}
+
+static int loadresults(char *fn, resultset_t *rs, char **fileid)
+{
+	FILE *fd;
+	char l[1024];
+
+	fd = fopen(fn, "r");
+	if (!fd) return -1;
+
+	while (fgets(l, sizeof(l), fd)) {
+		char *key, *val;
+
+		if ((*l == '#') || (*l == '\n')) continue;
+		key = strtok(l, " \t\r\n");
+		val = (key ? strtok(NULL, " \t\r\n") : NULL);
+		if (!val) continue;
+
+		if (strcmp(key, "runid") == 0) {
+			if (fileid) *fileid = strdup(val);
+		}
+		else setresult(rs, key, atof(val));
+	}
+	fclose(fd);
+
+	return 0;
+}
+
+static int saveresults(char *fn, resultset_t *rs, char *id)
+{
+	FILE *fd;
+	char *tmpfn;
+	int i;
+
+	/* Write to a temp. file and rename, so anyone reading the file sees a complete set of results */
+	tmpfn = (char *)malloc(strlen(fn) + 5);
+	sprintf(tmpfn, "%s.tmp", fn);
+	fd = fopen(tmpfn, "w");
+	if (!fd) {
+		errprintf("Cannot create %s: %s\n", tmpfn, strerror(errno));
+		xfree(tmpfn);
+		return -1;
+	}
+
+	if (id) fprintf(fd, "runid %s\n", id);
+	for (i=0; (i < rs->count); i++) fprintf(fd, "%s %.2f\n", rs->key[i], rs->val[i]);
+	fclose(fd);
+
+	if (rename(tmpfn, fn) != 0) errprintf("Cannot rename %s: %s\n", tmpfn, strerror(errno));
+	xfree(tmpfn);
+
+	return 0;
+}
+
+
+/*
+ * Receiver: Run as a worker module via xymond_channel. Each message we
+ * sent has a marker line with the time it was sent; xymond adds the time
+ * it posted the message to the channel in the meta-data. From these we
+ * get the latency through xymond, and how far behind the worker is.
+ */
+static int receiver(char *reportfn, int reportinterval, char *progname)
+{
+	char *msg;
+	int running = 1, seq, lastseq = 0;
+	struct timespec timeout;
+	loadhist_t *chanlat, *worklag;
+	unsigned long received = 0, marked = 0, seqgaps = 0;
+	unsigned long kindmarked[K_OTHER];
+	double firstrecv = 0.0, lastrecv = 0.0, lastreport = 0.0;
+	char *currentrun = NULL;
+	int dirty = 0, i;
+
+	memset(kindmarked, 0, sizeof(kindmarked));
+	chanlat = (loadhist_t *)calloc(1, sizeof(loadhist_t));
+	worklag = (loadhist_t *)calloc(1, sizeof(loadhist_t));
+	timeout.tv_sec = (reportinterval > 0) ? reportinterval : 5;
+	timeout.tv_nsec = 0;
+
+	while (running) {
+		char *eoln, *restofmsg, *p;
+		char *metadata[MAX_META+1];
+		int metacount;
+		double now;
+
+		msg = get_xymond_message(C_LAST, progname, &seq, &timeout);
+		if (msg == NULL) {
+			running = 0;
+			continue;
+		}
+
+		now = timenow();
+
+		eoln = strchr(msg, '\n');
+		if (eoln) {
+			*eoln = '\0';
+			restofmsg = eoln+1;
+		}
+		else {
+			restofmsg = "";
+		}
+
+		metacount = 0;
+		memset(&metadata, 0, sizeof(metadata));
+		p = gettok(msg, "|");
+		while (p && (metacount < MAX_META)) {
+			metadata[metacount++] = p;
+			p = gettok(NULL, "|");
+		}
+		metadata[metacount] = NULL;
+
+		if (strncmp(metadata[0], "@@shutdown", 10) == 0) {
+			running = 0;
+		}
+		else if (strncmp(metadata[0], "@@logrotate", 11) == 0) {
+			char *fn = xgetenv("XYMONCHANNEL_LOGFILENAME");
+			if (fn && strlen(fn)) {
+				freopen(fn, "a", stdout);
+				freopen(fn, "a", stderr);
+			}
+		}
+		else if (strncmp(metadata[0], "@@idle", 6) == 0) {
+			/* Nothing - we write the report below */
+		}
+		else if (strncmp(metadata[0], "@@", 2) == 0) {
+			char *mrk, *idp, *tsp, *markend;
+			double senttime, posttime;
+
+			/* Only the status/data/client channels have our marker, but count all messages */
+			received++;
+			if (!firstrecv) firstrecv = now;
+			lastrecv = now;
+			if (lastseq && (seq != (lastseq+1)) && (seq != 1)) seqgaps++;
+			lastseq = seq;
+
+			mrk = strstr(restofmsg, "\n" MARKER);
+			if (mrk && (metacount > 1)) {
+				mrk += strlen("\n" MARKER);
+				markend = strchr(mrk, '\n'); if (markend) *markend = '\0';
+				idp = strtok(mrk, " ");
+				tsp = (idp ? strtok(NULL, " ") : NULL);
+
+				if (tsp) {
+					if (!currentrun || (strcmp(currentrun, idp) != 0)) {
+						/* A new load run started - start over with the statistics */
+						if (currentrun) xfree(currentrun);
+						currentrun = strdup(idp);
+						memset(chanlat, 0, sizeof(loadhist_t));
+						memset(worklag, 0, sizeof(loadhist_t));
+						received = 1; marked = 0; seqgaps = 0;
+						memset(kindmarked, 0, sizeof(kindmarked));
+						firstrecv = now;
+					}
+
+					senttime = atof(tsp);
+					posttime = atof(metadata[1]);
+					marked++;
+					for (i=0; (i < K_OTHER); i++) {
+						/* Which channel are we on ? The sender waits only for those messages */
+						if (strncmp(metadata[0]+2, kindnames[i], strlen(kindnames[i])) == 0) kindmarked[i]++;
+					}
+					histadd(chanlat, (posttime > senttime) ? (unsigned long)((posttime - senttime) * 1000000.0) : 0);
+					histadd(worklag, (now > posttime) ? (unsigned long)((now - posttime) * 1000000.0) : 0);
+					dirty = 1;
+				}
+			}
+		}
+
+		if (reportfn && dirty && (!running || ((now - lastreport) >= timeout.tv_sec))) {
+			resultset_t rs;
+
+			memset(&rs, 0, sizeof(rs));
+			setresult(&rs, "recv_msgs", received);
+			setresult(&rs, "recv_marked", marked);
+			for (i=0; (i < K_OTHER); i++) {
+				char key[30];
+
+				if (!kindmarked[i]) continue;
+				sprintf(key, "recv_marked_%s", kindnames[i]);
+				setresult(&rs, key, kindmarked[i]);
+			}
+			setresult(&rs, "recv_seqgaps", seqgaps);
+			setresult(&rs, "recv_per_sec", ((lastrecv > firstrecv) ? (received / (lastrecv - firstrecv)) : 0.0));
+			sethistresults(&rs, "chan", chanlat);
+			sethistresults(&rs, "lag", worklag);
+			saveresults(reportfn, &rs, currentrun);
+
+			lastreport = now;
+			dirty = 0;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Generator.
+ */
+static enum msgkind_t msgkind(char *msg)
+{
+	if (strncmp(msg, "status", 6) == 0) return K_STATUS;
+	if (strncmp(msg, "client", 6) == 0) return K_CLIENT;
+	if (strncmp(msg, "data", 4) == 0) return K_DATA;
+	return K_OTHER;
+}
+
+static enum msgkind_t synthkind(unsigned long msgnum, int *hostnum, int *testnum)
+{
+	int perhost = testcount + withclient + withdata;
+	int idx = (int)(msgnum % perhost);
+
+	*hostnum = (int)((msgnum / perhost) % hostcount);
+	*testnum = idx;
+	if (idx < testcount) return K_STATUS;
+	if (withclient && (idx == testcount)) return K_CLIENT;
+	return K_DATA;
+}
+
+static void addmarker(strbuffer_t *buf, double now)
+{
+	char mrk[100];
+
+	if ((STRBUFLEN(buf) > 0) && (*(STRBUF(buf) + STRBUFLEN(buf) - 1) != '\n')) addtobuffer(buf, "\n");
+	sprintf(mrk, "%s%s %.6f\n", MARKER, runid, now);
+	addtobuffer(buf, mrk);
+}
+
+static void addpadding(strbuffer_t *buf)
+{
+	static char *padline = "Load generator padding text to make the message larger than it otherwise would be\n";
+	int len = STRBUFLEN(buf), plen = strlen(padline);
+
+	while ((len + plen) <= msgsize) {
+		addtobuffer(buf, padline);
+		len += plen;
+	}
+}
+
+static void synthmessage(strbuffer_t *buf, unsigned long msgnum, double now)
+{
+	int hostnum, testnum;
+	char hostname[100], l[1024];
+	time_t tnow = (time_t)now;
+
+	switch (synthkind(msgnum, &hostnum, &testnum)) {
+	  case K_STATUS:
+		snprintf(hostname, sizeof(hostname), "%s-%05d", hostprefix, hostnum);
+		snprintf(l, sizeof(l), "status %s.test%02d %s %s",
+			 hostname, testnum, ((msgnum % 97) == 0) ? "yellow" : "green", ctime(&tnow));
+		addtobuffer(buf, l);
+		addtobuffer(buf, "\nLoad generator status message\n");
+		addmarker(buf, now);
+		addpadding(buf);
+		break;
+
+	  case K_CLIENT:
+		snprintf(hostname, sizeof(hostname), "%s-%05d", hostprefix, hostnum);
+		snprintf(l, sizeof(l), "client %s.linux linux\n[date]\n%s[uname]\nLinux %s 2.6.32 #1 SMP x86_64 GNU/Linux\n",
+			 hostname, ctime(&tnow), hostname);
+		addtobuffer(buf, l);
+		addtobuffer(buf, "[uptime]\n 12:00:00 up 10 days,  1:00,  1 user,  load average: 0.10, 0.20, 0.30\n");
+		addtobuffer(buf, "[free]\n             total       used       free     shared    buffers     cached\n");
+		addtobuffer(buf, "Mem:       4048572    3870200     178372          0     291224    2616564\n");
+		addtobuffer(buf, "Swap:      2096472       1284    2095188\n");
+		addtobuffer(buf, "[df]\nFilesystem     1024-blocks      Used Available Capacity Mounted on\n");
+		addtobuffer(buf, "/dev/sda1         20642428   8429636  11164216      44% /\n");
+		addtobuffer(buf, "[loadgen]\n");
+		addmarker(buf, now);
+		addpadding(buf);
+		break;
+
+	  default:
+		snprintf(hostname, sizeof(hostname), "%s-%05d", hostprefix, hostnum);
+		snprintf(l, sizeof(l), "data %s.loadgen\n", hostname);
+		addtobuffer(buf, l);
+		addmarker(buf, now);
+		addpadding(buf);
+		break;
+	}
+}
+
+static int sendbuffer(strbuffer_t *buf, unsigned long *usecs)
+{
+	int sockfd, n, done;
+	char *outp, rbuf[4096];
+	double tstart = timenow();
+	struct timeval tmo;
+
+	*usecs = 0;
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd == -1) return -1;
+
+	tmo.tv_sec = 30; tmo.tv_usec = 0;
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tmo, sizeof(tmo));
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tmo, sizeof(tmo));
+
+	if (connect(sockfd, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) == -1) {
+		close(sockfd);
+		return -1;
+	}
+
+	outp = STRBUF(buf); done = 0;
+	while (done < STRBUFLEN(buf)) {
+		n = write(sockfd, outp+done, STRBUFLEN(buf)-done);
+		if (n <= 0) {
+			close(sockfd);
+			return -1;
+		}
+		done += n;
+	}
+
+	/* xymond closes the connection when it has the message, so wait for that */
+	shutdown(sockfd, SHUT_WR);
+	do { n = read(sockfd, rbuf, sizeof(rbuf)); } while (n > 0);
+	close(sockfd);
+
+	*usecs = (unsigned long)((timenow() - tstart) * 1000000.0);
+	return 0;
+}
+
+static void generator(int childnum, int resultfd)
+{
+	loadresult_t *res;
+	strbuffer_t *txbuf = newstrbuffer(0);
+	unsigned long msgnum, mymsgs = 0, mylimit = 0;
+	double tstart, tend = 0.0, interval = 0.0;
+	int replayidx = childnum, replaypass = 0;
+
+	res = (loadresult_t *)calloc(1, sizeof(loadresult_t));
+
+	if (msgrate > 0) interval = (double)concurrency / msgrate;
+	if (msglimit) mylimit = (msglimit / concurrency) + ((childnum < (msglimit % concurrency)) ? 1 : 0);
+	tstart = timenow();
+	if (duration) tend = tstart + duration;
+
+	msgnum = childnum;
+	while (!stopnow) {
+		double now, waittime = 0.0;
+		int batchcount = 0;
+		int batchkinds[K_OTHER+1];
+		unsigned long usecs;
+
+		if (mylimit && (mymsgs >= mylimit)) break;
+		if (replaymsgs && (replayidx >= replaycount)) {
+			if (!replayloop) break;
+			replayidx = childnum;
+			replaypass++;
+		}
+
+		/* Wait until it is time to send the next message */
+		now = timenow();
+		if (tend && (now >= tend)) break;
+		if (interval > 0) {
+			waittime = (tstart + mymsgs*interval) - now;
+		}
+		else if (replaymsgs && (replayspeed > 0)) {
+			double span = replaymsgs[replaycount-1].tstamp - replaymsgs[0].tstamp;
+			waittime = tstart + (replaypass*span + replaymsgs[replayidx].tstamp - replaymsgs[0].tstamp) / replayspeed - now;
+		}
+		if (waittime > 0) {
+			struct timespec ts;
+
+			ts.tv_sec = (time_t)waittime;
+			ts.tv_nsec = (long)((waittime - ts.tv_sec) * 1000000000.0);
+			nanosleep(&ts, NULL);
+			now = timenow();
+		}
+
+		/* Build the message - or a combo of several status messages */
+		clearstrbuffer(txbuf);
+		memset(batchkinds, 0, sizeof(batchkinds));
+		do {
+			enum msgkind_t kind;
+			int hostnum, testnum;
+
+			if (replaymsgs) {
+				if (replayidx >= replaycount) break;
+				kind = msgkind(replaymsgs[replayidx].msg);
+			}
+			else {
+				kind = synthkind(msgnum, &hostnum, &testnum);
+			}
+
+			/* Only status messages can go in a combo */
+			if (batchcount && (kind != K_STATUS)) break;
+			if (combosize && (kind == K_STATUS)) {
+				addtobuffer(txbuf, (batchcount ? "\n\n" : "combo\n"));
+			}
+
+			if (replaymsgs) {
+				addtobuffer(txbuf, replaymsgs[replayidx].msg);
+				if (kind != K_OTHER) addmarker(txbuf, now);
+				replayidx += concurrency;
+			}
+			else {
+				synthmessage(txbuf, msgnum, now);
+				msgnum += concurrency;
+			}
+			batchcount++;
+			batchkinds[kind]++;
+			if (kind != K_STATUS) break;	/* A client or data message goes on its own */
+			if (mylimit && ((mymsgs + batchcount) >= mylimit)) break;
+		} while (combosize && (batchcount < combosize));
+
+		if (batchcount == 0) continue;
+
+		mymsgs += batchcount;
+		res->msgs += batchcount;
+		res->conns++;
+		if (sendbuffer(txbuf, &usecs) == 0) {
+			int k;
+
+			res->bytes += STRBUFLEN(txbuf);
+			for (k=0; (k < K_OTHER); k++) res->delivered[k] += batchkinds[k];
+			histadd(&res->sendlat, usecs);
+		}
+		else {
+			res->errors++;
+			dbgprintf("Send failed: %s\n", strerror(errno));
+		}
+	}
+
+	write(resultfd, res, sizeof(loadresult_t));
+	close(resultfd);
+	exit(0);
+}
+
+static int loadreplayfile(char *fn)
+{
+	FILE *fd;
+	struct stat st;
+	char *data, *bol, *nextrec;
+	int allocated = 0;
+
+	fd = fopen(fn, "r");
+	if (!fd || (fstat(fileno(fd), &st) == -1)) {
+		errprintf("Cannot open replay file %s: %s\n", fn, strerror(errno));
+		if (fd) fclose(fd);
+		return -1;
+	}
+
+	data = (char *)malloc(st.st_size + 1);
+	*(data + fread(data, 1, st.st_size, fd)) = '\0';
+	fclose(fd);
+
+	/*
+	 * The file is in the format written by xymond_capture: A line beginning
+	 * with "## " holding the channel meta-data, then the message itself.
+	 * The timestamp when xymond handled the message is the second item.
+	 * The messages are kept in the file buffer, which we never free.
+	 */
+	bol = ((strncmp(data, "## ", 3) == 0) ? data : strstr(data, "\n## "));
+	while (bol) {
+		char *p, *msg;
+		double tstamp = 0.0;
+
+		if (*bol == '\n') bol++;
+		msg = strchr(bol, '\n');
+		if (!msg) break;
+		msg++;
+
+		p = strchr(bol+3, ' ');
+		if (p && (p < msg)) tstamp = atof(p+1);
+
+		/* Find the next record, and drop the newline xymond_capture added after the message */
+		nextrec = strstr(msg-1, "\n## ");
+		if (nextrec == (msg-1)) {
+			/* Empty message */
+			bol = nextrec+1;
+			continue;
+		}
+		if (nextrec) {
+			*nextrec = '\0';
+			if ((nextrec > msg) && (*(nextrec-1) == '\n')) *(nextrec-1) = '\0';
+		}
+		else if (*msg && (*(msg + strlen(msg) - 1) == '\n')) {
+			*(msg + strlen(msg) - 1) = '\0';
+		}
+
+		if (*msg) {
+			if (replaycount == allocated) {
+				allocated += 1000;
+				replaymsgs = (replaymsg_t *)realloc(replaymsgs, allocated*sizeof(replaymsg_t));
+			}
+			replaymsgs[replaycount].tstamp = tstamp;
+			replaymsgs[replaycount].msg = msg;
+			replaycount++;
+		}
+
+		bol = (nextrec ? nextrec+1 : NULL);
+	}
+
+	if (replaycount == 0) {
+		errprintf("No messages found in replay file %s\n", fn);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int comparebaseline(resultset_t *current, resultset_t *baseline, double tolerance)
+{
+	int i, regressions = 0;
+
+	printf("\nComparison with baseline (tolerance %.0f%%):\n", tolerance);
+	for (i=0; (i < baseline->count); i++) {
+		char *key = baseline->key[i];
+		double basev = baseline->val[i], curv, change;
+		int higherisbetter, worse;
+
+		if (strstr(key, "_per_sec")) higherisbetter = 1;
+		else if (strstr(key, "_us")) higherisbetter = 0;
+		else continue;
+
+		if (!getresult(current, key, &curv)) continue;
+		change = ((basev > 0) ? (100.0 * (curv - basev) / basev) : 0.0);
+
+		/*
+		 * Small latencies vary a lot between runs, so a latency must also
+		 * have grown by more than a millisecond before we complain.
+		 */
+		if (higherisbetter) worse = (change < -tolerance);
+		else worse = ((change > tolerance) && ((curv - basev) > 1000.0));
+
+		printf("  %-16s %12.2f %12.2f %+7.1f%%%s\n", key, basev, curv, change, (worse ? "  REGRESSION" : ""));
+		if (worse) regressions++;
+	}
+
+	return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+	int argi, i;
+	int receivemode = 0, reportinterval = 5, waitforreport = 10, listhosts = 0;
+	char *reportfn = NULL, *baselinefn = NULL, *savebaselinefn = NULL, *replayfn = NULL;
+	char *server = "127.0.0.1";
+	int port = 1984;
+	double tolerance = 10.0;
+	int *resultpipes;
+	pid_t *childpids;
+	loadresult_t total;
+	resultset_t rs;
+	double tstart, elapsed;
+	struct sigaction sa;
+
+	for (argi = 1; (argi < argc); argi++) {
+		if (strcmp(argv[argi], "--debug") == 0) {
+			debug = 1;
+		}
+		else if (strcmp(argv[argi], "--receive") == 0) {
+			receivemode = 1;
+		}
+		else if (argnmatch(argv[argi], "--report=")) {
+			char *p = strchr(argv[argi], '=');
+			reportfn = strdup(p+1);
+		}
+		else if (argnmatch(argv[argi], "--report-interval=")) {
+			char *p = strchr(argv[argi], '=');
+			reportinterval = atoi(p+1);
+		}
+		else if (argnmatch(argv[argi], "--wait=")) {
+			char *p = strchr(argv[argi], '=');
+			waitforreport = atoi(p+1);
+		}
+		else if (argnmatch(argv[argi], "--server=")) {
+			char *p = strchr(argv[argi], '=');
+			server = strdup(p+1);
+			p = strchr(server, ':');
+			if (p) { *p = '\0'; port = atoi(p+1); }
+		}
+		else if (argnmatch(argv[argi], "--hosts=")) {
+			char *p = strchr(argv[argi], '=');
+			hostcount = atoi(p+1);
+		}
+		else if (argnmatch(argv[argi], "--tests=")) {
+			char *p = strchr(argv[argi], '=');
+			testcount = atoi(p+1);
+		}
+		else if (argnmatch(argv[argi], "--hostprefix=")) {
+			char *p = strchr(argv[argi], '=');
+			hostprefix = strdup(p+1);
+		}
+		else if (strcmp(argv[argi], "--client") == 0) {
+			withclient = 1;
+		}
+		else if (strcmp(argv[argi], "--data") == 0) {
+			withdata = 1;
+		}
+		else if (argnmatch(argv[argi], "--size=")) {
+			char *p = strchr(argv[argi], '=');
+			msgsize = atoi(p+1);
+		}
+		else if (argnmatch(argv[argi], "--rate=")) {
+			char *p = strchr(argv[argi], '=');
+			msgrate = atof(p+1);
+		}
+		else if (argnmatch(argv[argi], "--duration=")) {
+			char *p = strchr(argv[argi], '=');
+			duration = atoi(p+1);
+		}
+		else if (argnmatch(argv[argi], "--count=")) {
+			char *p = strchr(argv[argi], '=');
+			msglimit = atol(p+1);
+		}
+		else if (argnmatch(argv[argi], "--concurrency=")) {
+			char *p = strchr(argv[argi], '=');
+			concurrency = atoi(p+1);
+		}
+		else if (argnmatch(argv[argi], "--combo=")) {
+			char *p = strchr(argv[argi], '=');
+			combosize = atoi(p+1);
+		}
+		else if (argnmatch(argv[argi], "--replay=")) {
+			char *p = strchr(argv[argi], '=');
+			replayfn = strdup(p+1);
+		}
+		else if (argnmatch(argv[argi], "--speed=")) {
+			char *p = strchr(argv[argi], '=');
+			replayspeed = atof(p+1);
+		}
+		else if (strcmp(argv[argi], "--loop") == 0) {
+			replayloop = 1;
+		}
+		else if (argnmatch(argv[argi], "--baseline=")) {
+			char *p = strchr(argv[argi], '=');
+			baselinefn = strdup(p+1);
+		}
+		else if (argnmatch(argv[argi], "--save-baseline=")) {
+			char *p = strchr(argv[argi], '=');
+			savebaselinefn = strdup(p+1);
+		}
+		else if (argnmatch(argv[argi], "--tolerance=")) {
+			char *p = strchr(argv[argi], '=');
+			tolerance = atof(p+1);
+		}
+		else if (strcmp(argv[argi], "--hosts-cfg") == 0) {
+			listhosts = 1;
+		}
+		else {
+			printf("Unknown option %s\n", argv[argi]);
+			printf("Usage: %s [--hosts=N] [--tests=N] [--client] [--data] [--size=BYTES] [--rate=N] [--duration=SECONDS] [--count=N] [--concurrency=N] [--combo=N] [--replay=FILE [--speed=N] [--loop]] [--server=IP[:PORT]] [--report=FILE] [--baseline=FILE] [--save-baseline=FILE] [--tolerance=PCT]\n", argv[0]);
+			printf("       %s --receive --report=FILE [--report-interval=SECONDS]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (receivemode) return receiver(reportfn, reportinterval, argv[0]);
+
+	if (hostcount < 1) hostcount = 1;
+	if (testcount < 1) testcount = 1;
+	if (concurrency < 1) concurrency = 1;
+	if (combosize == 1) combosize = 0;
+
+	if (listhosts) {
+		/* Print hosts.cfg entries for the synthesized hosts, so xymond will accept the messages */
+		for (i=0; (i < hostcount); i++) printf("127.0.0.1 %s-%05d # noconn\n", hostprefix, i);
+		return 0;
+	}
+
+	if (!duration && !msglimit && !replayfn) duration = 60;
+	if (replayfn && (loadreplayfile(replayfn) != 0)) return 1;
+
+	memset(&serveraddr, 0, sizeof(serveraddr));
+	serveraddr.sin_family = AF_INET;
+	serveraddr.sin_port = htons(port);
+	if (inet_aton(server, &serveraddr.sin_addr) == 0) {
+		errprintf("Invalid server address %s\n", server);
+		return 1;
+	}
+
+	sprintf(runid, "%d-%d", (int)time(NULL), (int)getpid());
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigmisc_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Start the generator processes */
+	resultpipes = (int *)calloc(concurrency, sizeof(int));
+	childpids = (pid_t *)calloc(concurrency, sizeof(pid_t));
+	tstart = timenow();
+	for (i=0; (i < concurrency); i++) {
+		int pfd[2];
+
+		if (pipe(pfd) == -1) {
+			errprintf("Cannot create pipe: %s\n", strerror(errno));
+			return 1;
+		}
+
+		childpids[i] = fork();
+		if (childpids[i] == 0) {
+			close(pfd[0]);
+			generator(i, pfd[1]);
+		}
+		else if (childpids[i] == -1) {
+			errprintf("Fork failed: %s\n", strerror(errno));
+			return 1;
+		}
+
+		close(pfd[1]);
+		resultpipes[i] = pfd[0];
+	}
+
+	/* Collect the results */
+	memset(&total, 0, sizeof(total));
+	for (i=0; (i < concurrency); i++) {
+		loadresult_t res;
+		int n, k, got = 0;
+
+		do {
+			n = read(resultpipes[i], ((char *)&res)+got, sizeof(res)-got);
+			if (n > 0) got += n;
+		} while ((got < sizeof(res)) && ((n > 0) || ((n == -1) && (errno == EINTR))));
+
+		close(resultpipes[i]);
+		if (stopnow) kill(childpids[i], SIGTERM);
+		waitpid(childpids[i], NULL, 0);
+
+		if (got < sizeof(res)) {
+			errprintf("No results from generator %d\n", i);
+			continue;
+		}
+
+		total.msgs += res.msgs;
+		total.conns += res.conns;
+		total.errors += res.errors;
+		total.bytes += res.bytes;
+		for (k=0; (k < K_OTHER); k++) total.delivered[k] += res.delivered[k];
+		histmerge(&total.sendlat, &res.sendlat);
+	}
+	elapsed = timenow() - tstart;
+
+	memset(&rs, 0, sizeof(rs));
+	setresult(&rs, "elapsed", elapsed);
+	setresult(&rs, "msgs", total.msgs);
+	setresult(&rs, "connections", total.conns);
+	setresult(&rs, "errors", total.errors);
+	setresult(&rs, "msgs_per_sec", ((elapsed > 0) ? (total.msgs / elapsed) : 0.0));
+	setresult(&rs, "kbytes_per_sec", ((elapsed > 0) ? (total.bytes / elapsed / 1024.0) : 0.0));
+	sethistresults(&rs, "send", &total.sendlat);
+
+	if (reportfn) {
+		/*
+		 * Pick up the results from the receiver, once it has caught up.
+		 * The receiver only sees the channel it is attached to, so we
+		 * only wait for the kind of messages that it has seen.
+		 */
+		resultset_t rcv;
+		char *rcvid = NULL;
+		int waited = 0, found = 0;
+
+		do {
+			memset(&rcv, 0, sizeof(rcv));
+			if (rcvid) xfree(rcvid);
+			if ((loadresults(reportfn, &rcv, &rcvid) == 0) && rcvid && (strcmp(rcvid, runid) == 0)) {
+				int k, waitkinds = 0, caughtup = 1;
+
+				found = 1;
+				for (k=0; (k < K_OTHER); k++) {
+					char key[30];
+					double marked;
+
+					sprintf(key, "recv_marked_%s", kindnames[k]);
+					if (!getresult(&rcv, key, &marked)) continue;
+
+					waitkinds++;
+					if (marked < total.delivered[k]) caughtup = 0;
+				}
+				if (waitkinds && caughtup) break;
+			}
+
+			sleep(1); waited++;
+		} while (waited <= waitforreport);
+
+		if (found) {
+			for (i=0; (i < rcv.count); i++) setresult(&rs, rcv.key[i], rcv.val[i]);
+		}
+		else {
+			errprintf("No results for this run in receiver report %s\n", reportfn);
+		}
+	}
+
+	printf("Load run %s: %lu messages in %lu connections, %lu errors, %.1f seconds\n",
+		runid, total.msgs, total.conns, total.errors, elapsed);
+	for (i=0; (i < rs.count); i++) printf("  %-16s %12.2f\n", rs.key[i], rs.val[i]);
+
+	if (savebaselinefn) saveresults(savebaselinefn, &rs, runid);
+
+	if (baselinefn) {
+		resultset_t baseline;
+
+		memset(&baseline, 0, sizeof(baseline));
+		if (loadresults(baselinefn, &baseline, NULL) != 0) {
+			errprintf("Cannot load baseline %s: %s\n", baselinefn, strerror(errno));
+			return 1;
+		}
+
+		if (comparebaseline(&rs, &baseline, tolerance) > 0) return 2;
+	}
+
+	return ((total.errors > 0) ? 1 : 0);
+}
+
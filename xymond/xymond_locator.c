@@ -11,6 +11,10 @@
 /* This daemon provides the locator service. Tasks may register ID's and      */
 /* services, allowing others to lookup where they are located.                */
 /*                                                                            */
+/* Servers report their load, and hosts can be moved between servers. A host  */
+/* only moves when the worker processes on the old server have flushed what   */
+/* they hold for the host (e.g. cached RRD updates) and handed it off.        */
+/*                                                                            */
 /* Copyright (C) 2006-2011 Henrik Storner <henrik@hswn.dk>                    */
 /*                                                                            */
 /* This program is released under the GNU General Public License (GPL),       */
@@ -51,6 +55,15 @@ static char rcsid[] = "$Id: xymond_locator.c 6745 2011-09-04 06:01:06Z storner $
 
 volatile int keeprunning = 1;
 char *logfile = NULL;
+int loadaware = 0;		/* Use the load reports when assigning hosts to servers */
+int rebalanceinterval = 0;	/* How often to look for hosts to move. 0 = never */
+int rebalancebatch = 20;	/* Max number of hosts to move from one server in one go */
+double rebalanceratio = 1.5;	/* How much busier than the idlest server a server must be before we move hosts */
+
+#define LOADREPORT_EXPIRE 180	/* Load reports older than this are ignored */
+#define LAGPENALTY 30		/* A server that lags this many seconds behind counts as twice as busy */
+#define MIGRATION_TIMEOUT 600	/* Force a host move if the old server has not handed it off after this long */
+#define MAX_PENDINGBYTES 16000	/* Must fit in the response to a load report */
 
 
 /*
@@ -61,10 +74,28 @@ char *logfile = NULL;
  * Some types of services dont have any host-specific data (e.g. "client"),
  * then the host-specific tree will just be empty.
  */
+/*
+ * Each worker process on a server periodically reports how many messages
+ * it handles (per minute), and how far behind it is. We keep the latest
+ * report from each process - they are identified by the address the
+ * report comes from - and sum them up to get the load of the server.
+ */
+typedef struct loadreport_t {
+	struct sockaddr_in addr;
+	int msgrate, lag;
+	int ackedid;		/* Last host handoff batch this process has completed */
+	time_t tstamp;
+	struct loadreport_t *next;
+} loadreport_t;
+
 typedef struct serverinfo_t {
 	char *servername, *serverextras;
 	int  serverconfweight, serveractualweight, serverweightleft;
 	enum locator_sticky_t sticky;
+	loadreport_t *loadreports;
+	int migrationid;	/* ID of the latest batch of hosts to hand off */
+	int pendingbytes;	/* Size of the list of hosts waiting to be handed off */
+	time_t migrationstart;
 } serverinfo_t;
 void * sitree[ST_MAX];
 xtreePos_t sicurrent[ST_MAX];
@@ -72,9 +103,14 @@ xtreePos_t sicurrent[ST_MAX];
 typedef struct hostinfo_t {
 	char *hostname;
 	serverinfo_t *server; /* Which server handles this host ? */
+	serverinfo_t *newserver; /* Server this host is moving to, while the old server hands it off */
+	int migrationid;
 } hostinfo_t;
 void * hitree[ST_MAX];
 
+/* Bumped whenever a host moves, so clients know when to drop their cached lookups */
+unsigned int generation[ST_MAX];
+
 
 void tree_init(void)
 {
@@ -150,8 +186,15 @@ serverinfo_t *downup_server(char *servername, enum locator_servicetype_t service
 		/* Flag the hosts that point to this server as un-assigned */
 		for (handle = xtreeFirst(hitree[servicetype]); (handle != xtreeEnd(hitree[servicetype])); handle = xtreeNext(hitree[servicetype], handle)) {
 			hostinfo_t *hitm = (hostinfo_t *)xtreeData(hitree[servicetype], handle);
-			if (hitm->server == itm) hitm->server = NULL;
+			if (hitm->server == itm) { hitm->server = NULL; hitm->newserver = NULL; }
+			if (hitm->newserver == itm) {
+				/* Host was moving to this server - it stays where it is */
+				hitm->server->pendingbytes -= (strlen(hitm->hostname) + 1);
+				hitm->newserver = NULL;
+			}
 		}
+		itm->pendingbytes = 0;
+		itm->migrationstart = 0;
 		/* Fall through */
 
 	  case 'D':
@@ -203,6 +246,12 @@ hostinfo_t *register_host(char *hostname, enum locator_servicetype_t servicetype
 				  hostname, servicetype_names[servicetype], itm->server->servername, newserver->servername);
 		}
 
+		if (itm->newserver) {
+			/* An explicit registration overrides a pending move */
+			itm->server->pendingbytes -= (strlen(itm->hostname) + 1);
+			itm->newserver = NULL;
+		}
+
 		itm->server = newserver;
 	}
 
@@ -231,6 +280,274 @@ hostinfo_t *rename_host(char *oldhostname, enum locator_servicetype_t servicetyp
 	return itm;
 }
 
+loadreport_t *get_loadreport(serverinfo_t *srv, struct sockaddr_in *addr)
+{
+	loadreport_t *rwalk, *rprev, *result = NULL;
+	time_t now = gettimer();
+
+	rwalk = srv->loadreports; rprev = NULL;
+	while (rwalk) {
+		if ((rwalk->addr.sin_addr.s_addr == addr->sin_addr.s_addr) && (rwalk->addr.sin_port == addr->sin_port)) {
+			result = rwalk;
+		}
+		else if ((rwalk->tstamp + LOADREPORT_EXPIRE) < now) {
+			/* Stale report - this worker process is gone */
+			loadreport_t *tmp = rwalk;
+
+			if (rprev) rprev->next = rwalk->next; else srv->loadreports = rwalk->next;
+			rwalk = rwalk->next;
+			xfree(tmp);
+			continue;
+		}
+
+		rprev = rwalk;
+		rwalk = rwalk->next;
+	}
+
+	if (!result) {
+		result = (loadreport_t *)calloc(1, sizeof(loadreport_t));
+		memcpy(&result->addr, addr, sizeof(result->addr));
+		result->next = srv->loadreports;
+		srv->loadreports = result;
+	}
+
+	return result;
+}
+
+int server_load(serverinfo_t *srv, double *load)
+{
+	/*
+	 * The load of a server is the number of messages per minute it
+	 * handles, per weight-unit. If it is falling behind, it counts
+	 * as busier than the message rate alone suggests.
+	 * Returns 0 if we have no current load data for the server.
+	 */
+	loadreport_t *rwalk;
+	time_t now = gettimer();
+	int reportcount = 0, msgrate = 0, maxlag = 0;
+
+	for (rwalk = srv->loadreports; (rwalk); rwalk = rwalk->next) {
+		if ((rwalk->tstamp + LOADREPORT_EXPIRE) < now) continue;
+
+		reportcount++;
+		msgrate += rwalk->msgrate;
+		if (rwalk->lag > maxlag) maxlag = rwalk->lag;
+	}
+
+	if (reportcount == 0) return 0;
+
+	*load = (double)msgrate * (1.0 + ((double)maxlag / LAGPENALTY));
+	if (srv->serveractualweight > 1) *load /= srv->serveractualweight;
+
+	return 1;
+}
+
+void move_host(hostinfo_t *hitm, enum locator_servicetype_t servicetype)
+{
+	/* The old server has handed off the host. Point it at the new server */
+	serverinfo_t *oldserver = hitm->server;
+
+	oldserver->pendingbytes -= (strlen(hitm->hostname) + 1);
+	if (oldserver->pendingbytes <= 0) {
+		oldserver->pendingbytes = 0;
+		oldserver->migrationstart = 0;
+	}
+
+	if (hitm->newserver->serveractualweight == 0) {
+		errprintf("Move of host %s:%s to %s cancelled, server is down\n", 
+			  hitm->hostname, servicetype_names[servicetype], hitm->newserver->servername);
+	}
+	else {
+		errprintf("Host %s:%s moved from %s to %s\n",
+			  hitm->hostname, servicetype_names[servicetype], oldserver->servername, hitm->newserver->servername);
+		hitm->server = hitm->newserver;
+		generation[servicetype]++;
+	}
+
+	hitm->newserver = NULL;
+}
+
+void complete_handoffs(serverinfo_t *srv, enum locator_servicetype_t servicetype, int force)
+{
+	/*
+	 * Move the hosts that all of the worker processes on the old server
+	 * have handed off. If there are no worker processes, there is nothing
+	 * to wait for.
+	 */
+	loadreport_t *rwalk;
+	xtreePos_t handle;
+	time_t now = gettimer();
+	int minacked = INT_MAX;
+
+	if (srv->pendingbytes == 0) return;
+
+	if (!force && (srv->serveractualweight != 0)) {
+		for (rwalk = srv->loadreports; (rwalk); rwalk = rwalk->next) {
+			if ((rwalk->tstamp + LOADREPORT_EXPIRE) < now) continue;
+			if (rwalk->ackedid < minacked) minacked = rwalk->ackedid;
+		}
+	}
+
+	for (handle = xtreeFirst(hitree[servicetype]); (handle != xtreeEnd(hitree[servicetype])); handle = xtreeNext(hitree[servicetype], handle)) {
+		hostinfo_t *hitm = (hostinfo_t *)xtreeData(hitree[servicetype], handle);
+
+		if ((hitm->server == srv) && hitm->newserver && (hitm->migrationid <= minacked)) move_host(hitm, servicetype);
+	}
+}
+
+int relocate_host(char *hostname, enum locator_servicetype_t servicetype, char *servername)
+{
+	/*
+	 * Start moving a host to another server. The host stays on the old
+	 * server until its worker processes have flushed whatever they hold
+	 * for the host, and acknowledged the handoff.
+	 * Returns 0 if OK, 1 if there are too many moves pending, -1 on error.
+	 */
+	xtreePos_t handle;
+	hostinfo_t *hitm;
+	serverinfo_t *newserver;
+
+	handle = xtreeFind(hitree[servicetype], hostname);
+	if (handle == xtreeEnd(hitree[servicetype])) return -1;
+	hitm = xtreeData(hitree[servicetype], handle);
+
+	handle = xtreeFind(sitree[servicetype], servername);
+	if (handle == xtreeEnd(sitree[servicetype])) return -1;
+	newserver = xtreeData(sitree[servicetype], handle);
+	if (newserver->serveractualweight == 0) return -1;
+
+	if (hitm->newserver) {
+		/* Already moving - just change the destination */
+		if (newserver == hitm->server) {
+			hitm->server->pendingbytes -= (strlen(hitm->hostname) + 1);
+			hitm->newserver = NULL;
+		}
+		else {
+			hitm->newserver = newserver;
+		}
+		return 0;
+	}
+
+	if (!hitm->server) {
+		/* Not currently assigned anywhere */
+		hitm->server = newserver;
+		generation[servicetype]++;
+		return 0;
+	}
+
+	if (hitm->server == newserver) return 0;
+
+	if ((hitm->server->pendingbytes + strlen(hitm->hostname) + 1) > MAX_PENDINGBYTES) return 1;
+
+	dbgprintf("Host %s:%s moving from %s to %s\n", 
+		  hostname, servicetype_names[servicetype], hitm->server->servername, newserver->servername);
+	hitm->newserver = newserver;
+	hitm->migrationid = ++hitm->server->migrationid;
+	hitm->server->pendingbytes += (strlen(hitm->hostname) + 1);
+	if (hitm->server->migrationstart == 0) hitm->server->migrationstart = gettimer();
+
+	/* If nobody on the old server will hand it off, move it right away */
+	complete_handoffs(hitm->server, servicetype, 0);
+
+	return 0;
+}
+
+void list_handoffs(serverinfo_t *srv, enum locator_servicetype_t servicetype, loadreport_t *rep, char *buf, size_t bufsz)
+{
+	/* Tell a worker process which hosts it must hand off */
+	xtreePos_t handle;
+	char *outp;
+
+	if ((srv->pendingbytes == 0) || (rep->ackedid >= srv->migrationid)) {
+		strcpy(buf, "OK");
+		return;
+	}
+
+	outp = buf + snprintf(buf, bufsz, "MIGRATE|%d|", srv->migrationid);
+	for (handle = xtreeFirst(hitree[servicetype]); (handle != xtreeEnd(hitree[servicetype])); handle = xtreeNext(hitree[servicetype], handle)) {
+		hostinfo_t *hitm = (hostinfo_t *)xtreeData(hitree[servicetype], handle);
+
+		if ((hitm->server != srv) || !hitm->newserver) continue;
+		if ((outp + strlen(hitm->hostname) + 2) >= (buf + bufsz)) break;
+
+		outp += sprintf(outp, "%s ", hitm->hostname);
+	}
+}
+
+void rebalance(enum locator_servicetype_t servicetype)
+{
+	/* Move some hosts from the busiest server to the least busy one */
+	xtreePos_t handle;
+	serverinfo_t *srv, *busiest = NULL, *idlest = NULL;
+	double load, maxload = 0.0, minload = 0.0, loadsum = 0.0;
+	int servercount = 0, hostcount, movecount;
+
+	for (handle = xtreeFirst(sitree[servicetype]); (handle != xtreeEnd(sitree[servicetype])); handle = xtreeNext(sitree[servicetype], handle)) {
+		srv = xtreeData(sitree[servicetype], handle);
+		if (srv->serveractualweight <= 1) continue;
+
+		/* Wait until the previous moves have completed */
+		if (srv->pendingbytes) return;
+
+		if (!server_load(srv, &load)) continue;
+
+		servercount++;
+		loadsum += load;
+		if (!busiest || (load > maxload)) { busiest = srv; maxload = load; }
+		if (!idlest || (load < minload)) { idlest = srv; minload = load; }
+	}
+
+	/* Need at least two servers, and a real difference in load. Below 60 messages/minute we dont bother */
+	if ((servercount < 2) || (maxload < 60.0) || (maxload <= (rebalanceratio * minload))) return;
+
+	hostcount = 0;
+	for (handle = xtreeFirst(hitree[servicetype]); (handle != xtreeEnd(hitree[servicetype])); handle = xtreeNext(hitree[servicetype], handle)) {
+		hostinfo_t *hitm = (hostinfo_t *)xtreeData(hitree[servicetype], handle);
+		if (hitm->server == busiest) hostcount++;
+	}
+
+	/* Move the share of hosts that would bring the busiest server down to the average load */
+	movecount = (int)(hostcount * (maxload - (loadsum / servercount)) / maxload);
+	if (movecount > rebalancebatch) movecount = rebalancebatch;
+	if (movecount < 1) return;
+
+	errprintf("Rebalancing %s: Moving %d of %d hosts from %s (load %.0f) to %s (load %.0f)\n",
+		  servicetype_names[servicetype], movecount, hostcount, 
+		  busiest->servername, maxload, idlest->servername, minload);
+
+	for (handle = xtreeFirst(hitree[servicetype]); ((movecount > 0) && (handle != xtreeEnd(hitree[servicetype]))); handle = xtreeNext(hitree[servicetype], handle)) {
+		hostinfo_t *hitm = (hostinfo_t *)xtreeData(hitree[servicetype], handle);
+
+		if ((hitm->server != busiest) || hitm->newserver) continue;
+		if (relocate_host(hitm->hostname, servicetype, idlest->servername) != 0) break;
+		movecount--;
+	}
+}
+
+void check_migrations(void)
+{
+	enum locator_servicetype_t stype;
+	xtreePos_t handle;
+	time_t now = gettimer();
+
+	for (stype = 0; (stype < ST_MAX); stype++) {
+		for (handle = xtreeFirst(sitree[stype]); (handle != xtreeEnd(sitree[stype])); handle = xtreeNext(sitree[stype], handle)) {
+			serverinfo_t *srv = xtreeData(sitree[stype], handle);
+
+			if (srv->pendingbytes == 0) continue;
+
+			if ((srv->migrationstart + MIGRATION_TIMEOUT) < now) {
+				errprintf("Server %s:%s did not hand off hosts in time, moving them anyway\n",
+					  srv->servername, servicetype_names[stype]);
+				complete_handoffs(srv, stype, 1);
+			}
+			else {
+				complete_handoffs(srv, stype, 0);
+			}
+		}
+	}
+}
+
 serverinfo_t *find_server_by_type(enum locator_servicetype_t servicetype)
 {
 	serverinfo_t *nextserver = NULL;
@@ -298,9 +615,25 @@ serverinfo_t *find_server_by_type(enum locator_servicetype_t servicetype)
 		int totalweight = 0;
 		xtreePos_t handle, firstok;
 		serverinfo_t *srv;
+		double avgload = -1.0;
 
 		firstok = endmarker;
 
+		if (loadaware) {
+			/* Find the average load of the servers that have reported their load */
+			double load, loadsum = 0.0;
+			int loadcount = 0;
+
+			for (handle = xtreeFirst(sitree[servicetype]); (handle != endmarker); handle = xtreeNext(sitree[servicetype], handle)) {
+				srv = xtreeData(sitree[servicetype], handle);
+				if ((srv->serveractualweight > 1) && server_load(srv, &load)) {
+					loadsum += load;
+					loadcount++;
+				}
+			}
+			if (loadcount > 0) avgload = loadsum / loadcount;
+		}
+
 		/* Walk the list of servers, calculate total weight and find the first active server */
 		for (handle = xtreeFirst(sitree[servicetype]); 
 			( (handle != endmarker) && (totalweight >= 0) ); 
@@ -310,6 +643,21 @@ serverinfo_t *find_server_by_type(enum locator_servicetype_t servicetype)
 			if (srv->serveractualweight <= 1) continue;
 
 			srv->serverweightleft = (srv->serveractualweight - 1);
+			if (avgload >= 0.0) {
+				/* 
+				 * Scale the tokens by how busy this server is compared to the
+				 * average, so new hosts go to the servers with spare capacity.
+				 */
+				double load;
+
+				if (server_load(srv, &load)) {
+					if (load <= (avgload / 4)) 
+						srv->serverweightleft *= 4;
+					else
+						srv->serverweightleft = (int)(srv->serverweightleft * avgload / load);
+					if (srv->serverweightleft < 1) srv->serverweightleft = 1;
+				}
+			}
 			totalweight += srv->serverweightleft;
 
 			if (firstok == endmarker) firstok = handle;
@@ -474,7 +822,7 @@ void sigmisc_handler(int signum)
 }
 
 
-void handle_request(char *buf)
+void handle_request(char *buf, size_t bufsz, struct sockaddr_in *remaddr)
 {
 	const char *delims = "|\r\n\t ";
 
@@ -524,6 +872,107 @@ void handle_request(char *buf)
 		}
 		break;
 
+	  case 'L':
+		/* Load report server|type|msgrate|lag - also tells us the server is up */
+		{
+			char *tok, *servername = NULL;
+			enum locator_servicetype_t servicetype = ST_MAX;
+			int msgrate = 0, lag = 0;
+			serverinfo_t *srv;
+
+			tok = strtok(buf, delims); if (tok) { tok = strtok(NULL, delims); }
+			if (tok) { servername = tok; tok = strtok(NULL, delims); }
+			if (tok) { servicetype = get_servicetype(tok); tok = strtok(NULL, delims); }
+			if (tok) { msgrate = atoi(tok); tok = strtok(NULL, delims); }
+			if (tok) { lag = atoi(tok); tok = strtok(NULL, delims); }
+
+			if (servername && (servicetype != ST_MAX)) {
+				srv = downup_server(servername, servicetype, 'U');
+				if (srv) {
+					loadreport_t *rep;
+
+					dbgprintf("Load report from %s:%d for server %s/%s: %d msgs/minute, lag %d\n",
+						  inet_ntoa(remaddr->sin_addr), ntohs(remaddr->sin_port),
+						  servername, servicetype_names[servicetype], msgrate, lag);
+					rep = get_loadreport(srv, remaddr);
+					rep->msgrate = msgrate;
+					rep->lag = lag;
+					rep->tstamp = gettimer();
+					list_handoffs(srv, servicetype, rep, buf, bufsz);
+				}
+				else strcpy(buf, "FAILED");
+			}
+			else strcpy(buf, "BADSYNTAX");
+		}
+		break;
+
+	  case 'C':
+		/* Handoff complete server|type|migrationid */
+		{
+			char *tok, *servername = NULL;
+			enum locator_servicetype_t servicetype = ST_MAX;
+			int migrationid = -1;
+			xtreePos_t handle;
+
+			tok = strtok(buf, delims); if (tok) { tok = strtok(NULL, delims); }
+			if (tok) { servername = tok; tok = strtok(NULL, delims); }
+			if (tok) { servicetype = get_servicetype(tok); tok = strtok(NULL, delims); }
+			if (tok) { migrationid = atoi(tok); tok = strtok(NULL, delims); }
+
+			if (servername && (servicetype != ST_MAX) && (migrationid >= 0)) {
+				handle = xtreeFind(sitree[servicetype], servername);
+				if (handle != xtreeEnd(sitree[servicetype])) {
+					serverinfo_t *srv = xtreeData(sitree[servicetype], handle);
+					loadreport_t *rep = get_loadreport(srv, remaddr);
+
+					if (rep->ackedid < migrationid) rep->ackedid = migrationid;
+					complete_handoffs(srv, servicetype, 0);
+					strcpy(buf, "OK");
+				}
+				else strcpy(buf, "FAILED");
+			}
+			else strcpy(buf, "BADSYNTAX");
+		}
+		break;
+
+	  case 'R':
+		/* Relocate host|type|server */
+		{
+			char *tok, *hostname = NULL, *servername = NULL;
+			enum locator_servicetype_t servicetype = ST_MAX;
+
+			tok = strtok(buf, delims); if (tok) { tok = strtok(NULL, delims); }
+			if (tok) { hostname = tok; tok = strtok(NULL, delims); }
+			if (tok) { servicetype = get_servicetype(tok); tok = strtok(NULL, delims); }
+			if (tok) { servername = tok; tok = strtok(NULL, delims); }
+
+			if (hostname && (servicetype != ST_MAX) && servername) {
+				switch (relocate_host(hostname, servicetype, servername)) {
+				  case 0: strcpy(buf, "OK"); break;
+				  case 1: strcpy(buf, "BUSY"); break;
+				  default: strcpy(buf, "FAILED"); break;
+				}
+			}
+			else strcpy(buf, "BADSYNTAX");
+		}
+		break;
+
+	  case 'G':
+		/* Generation type */
+		{
+			char *tok;
+			enum locator_servicetype_t servicetype = ST_MAX;
+
+			tok = strtok(buf, delims); if (tok) { tok = strtok(NULL, delims); }
+			if (tok) { servicetype = get_servicetype(tok); tok = strtok(NULL, delims); }
+
+			if (servicetype != ST_MAX) {
+				sprintf(buf, "G|%u", generation[servicetype]);
+			}
+			else strcpy(buf, "BADSYNTAX");
+		}
+		break;
+
 	  case 'H':
 		/* Register host|type|server */
 		{
@@ -648,6 +1097,7 @@ int main(int argc, char *argv[])
 	struct sockaddr_in laddr;
 	struct sigaction sa;
 	int argi, opt;
+	time_t nextcheck = 0, nextrebalance = 0;
 
 	/* Dont save the output from errprintf() */
 	save_errbuf = 0;
@@ -687,6 +1137,23 @@ int main(int argc, char *argv[])
 		else if (strcmp(argv[argi], "--debug") == 0) {
 			debug = 1;
 		}
+		else if (strcmp(argv[argi], "--load-aware") == 0) {
+			loadaware = 1;
+		}
+		else if (argnmatch(argv[argi], "--rebalance=")) {
+			char *p = strchr(argv[argi], '=');
+			rebalanceinterval = atoi(p+1);
+		}
+		else if (argnmatch(argv[argi], "--rebalance-batch=")) {
+			char *p = strchr(argv[argi], '=');
+			rebalancebatch = atoi(p+1);
+			if (rebalancebatch < 1) rebalancebatch = 1;
+		}
+		else if (argnmatch(argv[argi], "--rebalance-ratio=")) {
+			char *p = strchr(argv[argi], '=');
+			rebalanceratio = atof(p+1);
+			if (rebalanceratio < 1.1) rebalanceratio = 1.1;
+		}
 	}
 
 	/* Set up a socket to listen for new connections */
@@ -744,6 +1211,7 @@ int main(int argc, char *argv[])
 
 	tree_init();
 	load_state();
+	nextrebalance = gettimer() + rebalanceinterval;
 
 	do {
 		ssize_t n;
@@ -751,19 +1219,40 @@ int main(int argc, char *argv[])
 		socklen_t remaddrsz;
 		char buf[32768];
 		fd_set fdread;
+		struct timeval tmo;
+		time_t now;
 
 		/* Wait for a message */
 		FD_ZERO(&fdread);
 		FD_SET(lsocket, &fdread);
-		n = select(lsocket+1, &fdread, NULL, NULL, NULL);
+		tmo.tv_sec = 10; tmo.tv_usec = 0;
+		n = select(lsocket+1, &fdread, NULL, NULL, &tmo);
 
 		if (n == -1) {
+			if (errno == EINTR) continue;
+
 			/* Select error */
 			errprintf("select error, aborting: %s\n", strerror(errno));
 			keeprunning = 0;
 			continue;
 		}
 
+		now = gettimer();
+		if (now >= nextcheck) {
+			/* Complete host moves, and see if some servers are overloaded */
+			check_migrations();
+			nextcheck = now + 10;
+
+			if (rebalanceinterval && (now >= nextrebalance)) {
+				enum locator_servicetype_t stype;
+
+				for (stype = 0; (stype < ST_MAX); stype++) rebalance(stype);
+				nextrebalance = now + rebalanceinterval;
+			}
+		}
+
+		if (n == 0) continue;
+
 		/* We know there is some data */
 		remaddrsz = sizeof(remaddr);
 		n = recvfrom(lsocket, buf, sizeof(buf), 0, (struct sockaddr *)&remaddr, &remaddrsz);
@@ -782,7 +1271,7 @@ int main(int argc, char *argv[])
 		dbgprintf("Got message from %s:%d : '%s'\n", 
 				inet_ntoa(remaddr.sin_addr), ntohs(remaddr.sin_port), buf);
 
-		handle_request(buf);
+		handle_request(buf, sizeof(buf), &remaddr);
 
 		n = sendto(lsocket, buf, strlen(buf)+1, 0, (struct sockaddr *)&remaddr, remaddrsz);
 		if (n == -1) {
@@ -0,0 +1,472 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon message daemon.                                                      */
+/*                                                                            */
+/* This module keeps track of where xymond spends its time. Each stage of     */
+/* the message handling, each message type and each channel has a latency    */
+/* histogram; we also track the connection queue, how busy the main loop is   */
+/* and which senders send the most messages.                                  */
+/*                                                                            */
+/* The histograms have a fixed size, and updating them is just a few integer */
+/* operations - so this is cheap enough to always have enabled.               */
+/*                                                                            */
+/* Copyright (C) 2004-2011 Henrik Storner <henrik@hswn.dk>                    */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+static char rcsid[] = "$Id$";
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "libxymon.h"
+
+#include "xymond_buffer.h"
+#include "xymond_ipc.h"
+#include "xymond_perf.h"
+
+/*
+ * Log-linear histogram, like the HDR histograms: Values below SUBBUCKETS
+ * have their own bucket, above that each power of two is split into
+ * SUBBUCKETS buckets. With 32 sub-buckets the values are accurate to
+ * about 3%, and the range goes to more than a day (in microseconds).
+ */
+#define SUBBITS 5
+#define SUBBUCKETS (1 << SUBBITS)
+#define HISTBUCKETS (SUBBUCKETS + 32*SUBBUCKETS)
+
+typedef struct perfhist_t {
+	unsigned int count[HISTBUCKETS];
+	unsigned long samples;
+	unsigned long maxval;
+	double sum;
+} perfhist_t;
+
+typedef struct perfitem_t {
+	char *name;
+	perfhist_t cur;		/* Since xymond started */
+	perfhist_t last;	/* Copy of "cur" at the last report, to get the values for the report interval */
+} perfitem_t;
+
+#define PERF_MAXCMDS 32
+#define PERF_MAXSENDERS 5000
+#define PERF_TOPSENDERS 10
+
+static char *stagenames[PERF_LAST] = { "read", "uncompress", "message", "status", "respond", "housekeeping" };
+
+static perfitem_t *stages[PERF_LAST];
+static perfitem_t *commands[PERF_MAXCMDS];
+static perfitem_t *chanpost[C_LAST];
+static perfitem_t *chanwait[C_LAST];
+static unsigned long chanbacklog[C_LAST], chandrops[C_LAST];
+static unsigned long lastbacklog[C_LAST], lastdrops[C_LAST];
+
+typedef struct perfsender_t {
+	char *ip;
+	unsigned long msgs, lastmsgs;		/* Since xymond started, and at the last report */
+	unsigned long long bytes, lastbytes;
+} perfsender_t;
+static void *rbsenders = NULL;
+static int sendercount = 0;
+static unsigned long sendersdropped = 0, lastsendersdropped = 0;
+
+static unsigned long queuesamples = 0, queuereceiving = 0, queueresponding = 0;
+static int queuemaxreceiving = 0, queuemaxresponding = 0;
+static int queuenowreceiving = 0, queuenowresponding = 0;
+static double loopbusy = 0.0, loopidle = 0.0;
+static time_t lastreport = 0;
+
+
+void perf_start(struct timespec *tstart)
+{
+	getntimer(tstart);
+}
+
+unsigned long perf_usecs(struct timespec *tstart)
+{
+	struct timespec tnow;
+	long usecs;
+
+	getntimer(&tnow);
+	usecs = (tnow.tv_sec - tstart->tv_sec)*1000000 + (tnow.tv_nsec - tstart->tv_nsec)/1000;
+
+	return ((usecs > 0) ? usecs : 0);
+}
+
+static int histbucket(unsigned long val)
+{
+	int e = 0;
+
+	if (val < SUBBUCKETS) return (int)val;
+	while ((val >> e) >= 2*SUBBUCKETS) e++;
+	return SUBBUCKETS + e*SUBBUCKETS + (int)((val >> e) - SUBBUCKETS);
+}
+
+static unsigned long histvalue(int bucket)
+{
+	/* The highest value in the bucket */
+	int e;
+
+	if (bucket < SUBBUCKETS) return bucket;
+	e = (bucket - SUBBUCKETS) / SUBBUCKETS;
+	return ((unsigned long)(((bucket - SUBBUCKETS) % SUBBUCKETS) + SUBBUCKETS + 1) << e) - 1;
+}
+
+static perfitem_t *newitem(char *name)
+{
+	perfitem_t *item = (perfitem_t *)calloc(1, sizeof(perfitem_t));
+
+	item->name = name;
+	return item;
+}
+
+static void histadd(perfitem_t *item, unsigned long val)
+{
+	int b = histbucket(val);
+
+	if (b >= HISTBUCKETS) b = HISTBUCKETS-1;
+	item->cur.count[b]++;
+	item->cur.samples++;
+	item->cur.sum += val;
+	if (val > item->cur.maxval) item->cur.maxval = val;
+}
+
+static void histinterval(perfitem_t *item, perfhist_t *result)
+{
+	/* Calculate the histogram for the values added since the last report */
+	int i;
+
+	result->maxval = 0;
+	for (i=0; (i < HISTBUCKETS); i++) {
+		result->count[i] = item->cur.count[i] - item->last.count[i];
+		if (result->count[i]) result->maxval = histvalue(i);
+	}
+	result->samples = item->cur.samples - item->last.samples;
+	result->sum = item->cur.sum - item->last.sum;
+	if (result->maxval > item->cur.maxval) result->maxval = item->cur.maxval;
+}
+
+static unsigned long histpercentile(perfhist_t *h, double pct)
+{
+	unsigned long want, seen = 0;
+	int i;
+
+	if (h->samples == 0) return 0;
+
+	want = (unsigned long)((pct / 100.0) * h->samples + 0.5);
+	if (want < 1) want = 1;
+	for (i=0; (i < HISTBUCKETS); i++) {
+		seen += h->count[i];
+		if (seen >= want) {
+			unsigned long val = histvalue(i);
+			return ((val < h->maxval) ? val : h->maxval);
+		}
+	}
+
+	return h->maxval;
+}
+
+void perf_stage(enum perfstage_t stage, unsigned long usecs)
+{
+	if (!stages[stage]) stages[stage] = newitem(stagenames[stage]);
+	histadd(stages[stage], usecs);
+}
+
+void perf_command(int cmdidx, char *cmdname, unsigned long usecs)
+{
+	if ((cmdidx < 0) || (cmdidx >= PERF_MAXCMDS)) return;
+
+	if (!commands[cmdidx]) commands[cmdidx] = newitem(cmdname ? cmdname : "bogus");
+	histadd(commands[cmdidx], usecs);
+}
+
+void perf_channel(int chnid, unsigned long postusecs, unsigned long waitusecs, int backlog)
+{
+	if ((chnid <= 0) || (chnid >= C_LAST)) return;
+
+	if (!chanpost[chnid]) {
+		chanpost[chnid] = newitem(channelnames[chnid]);
+		chanwait[chnid] = newitem(channelnames[chnid]);
+	}
+	histadd(chanpost[chnid], postusecs);
+	histadd(chanwait[chnid], waitusecs);
+	if (backlog > 0) chanbacklog[chnid]++;
+}
+
+void perf_channeldrop(int chnid)
+{
+	if ((chnid <= 0) || (chnid >= C_LAST)) return;
+	chandrops[chnid]++;
+}
+
+void perf_sender(char *sender, size_t bytes)
+{
+	xtreePos_t handle;
+	perfsender_t *rec;
+
+	if (!rbsenders) rbsenders = xtreeNew(strcmp);
+
+	handle = xtreeFind(rbsenders, sender);
+	if (handle != xtreeEnd(rbsenders)) {
+		rec = (perfsender_t *)xtreeData(rbsenders, handle);
+	}
+	else if (sendercount < PERF_MAXSENDERS) {
+		rec = (perfsender_t *)calloc(1, sizeof(perfsender_t));
+		rec->ip = strdup(sender);
+		xtreeAdd(rbsenders, rec->ip, rec);
+		sendercount++;
+	}
+	else {
+		/* Limit the memory we use for this */
+		sendersdropped++;
+		return;
+	}
+
+	rec->msgs++;
+	rec->bytes += bytes;
+}
+
+void perf_queue(int receiving, int responding)
+{
+	queuesamples++;
+	queuereceiving += receiving;
+	queueresponding += responding;
+	queuenowreceiving = receiving;
+	queuenowresponding = responding;
+	if (receiving > queuemaxreceiving) queuemaxreceiving = receiving;
+	if (responding > queuemaxresponding) queuemaxresponding = responding;
+}
+
+void perf_loop(unsigned long busyusecs, unsigned long idleusecs)
+{
+	loopbusy += busyusecs;
+	loopidle += idleusecs;
+}
+
+static void reportline(strbuffer_t *buf, char *kind, perfitem_t *item)
+{
+	perfhist_t *h;
+	char l[1024];
+
+	if (!item) return;
+
+	h = (perfhist_t *)malloc(sizeof(perfhist_t));
+	histinterval(item, h);
+	if (h->samples) {
+		sprintf(l, "%-8s %-14s %9lu %9lu %9lu %9lu %9lu %9lu\n",
+			kind, item->name, h->samples,
+			histpercentile(h, 50.0), histpercentile(h, 90.0), histpercentile(h, 99.0), histpercentile(h, 99.9),
+			h->maxval);
+		addtobuffer(buf, l);
+	}
+	xfree(h);
+
+	memcpy(&item->last, &item->cur, sizeof(perfhist_t));
+}
+
+static int sendercmp(const void *v1, const void *v2)
+{
+	perfsender_t **s1 = (perfsender_t **)v1;
+	perfsender_t **s2 = (perfsender_t **)v2;
+
+	if ((*s1)->msgs > (*s2)->msgs) return -1;
+	if ((*s1)->msgs < (*s2)->msgs) return 1;
+	return 0;
+}
+
+static int intervalcmp(const void *v1, const void *v2)
+{
+	perfsender_t **s1 = (perfsender_t **)v1;
+	perfsender_t **s2 = (perfsender_t **)v2;
+	unsigned long n1 = (*s1)->msgs - (*s1)->lastmsgs;
+	unsigned long n2 = (*s2)->msgs - (*s2)->lastmsgs;
+
+	if (n1 > n2) return -1;
+	if (n1 < n2) return 1;
+	return 0;
+}
+
+static perfsender_t **topsenders(int *count, int (*cmp)(const void *, const void *))
+{
+	perfsender_t **list;
+	xtreePos_t handle;
+	int n = 0;
+
+	*count = 0;
+	if (!rbsenders || (sendercount == 0)) return NULL;
+
+	list = (perfsender_t **)malloc(sendercount * sizeof(perfsender_t *));
+	for (handle = xtreeFirst(rbsenders); (handle != xtreeEnd(rbsenders)); handle = xtreeNext(rbsenders, handle)) {
+		list[n++] = (perfsender_t *)xtreeData(rbsenders, handle);
+	}
+	qsort(list, n, sizeof(perfsender_t *), cmp);
+
+	*count = ((n < PERF_TOPSENDERS) ? n : PERF_TOPSENDERS);
+	return list;
+}
+
+static void marksenders(void)
+{
+	/*
+	 * Start a new report interval. The totals are kept, but if the
+	 * table is full we make room for new senders by dropping those
+	 * that have been idle during the last interval.
+	 */
+	xtreePos_t handle;
+	perfsender_t **idle = NULL;
+	int idlecount = 0, i;
+
+	lastsendersdropped = sendersdropped;
+	if (!rbsenders) return;
+
+	if (sendercount >= PERF_MAXSENDERS) idle = (perfsender_t **)malloc(sendercount * sizeof(perfsender_t *));
+
+	for (handle = xtreeFirst(rbsenders); (handle != xtreeEnd(rbsenders)); handle = xtreeNext(rbsenders, handle)) {
+		perfsender_t *rec = (perfsender_t *)xtreeData(rbsenders, handle);
+
+		if (idle && (rec->msgs == rec->lastmsgs)) idle[idlecount++] = rec;
+		rec->lastmsgs = rec->msgs;
+		rec->lastbytes = rec->bytes;
+	}
+
+	for (i = 0; (i < idlecount); i++) {
+		xtreeDelete(rbsenders, idle[i]->ip);
+		xfree(idle[i]->ip);
+		xfree(idle[i]);
+		sendercount--;
+	}
+	if (idle) xfree(idle);
+}
+
+void perf_report(strbuffer_t *buf)
+{
+	/* The report for the xymond status column. This shows the values since the last report */
+	time_t now = gettimer();
+	int interval = ((lastreport && (now > lastreport)) ? (now - lastreport) : 0);
+	perfsender_t **senders;
+	int i, count;
+	char l[1024];
+
+	if (lastreport) sprintf(l, "\nProcessing time (microseconds) last %d seconds\n", interval);
+	else strcpy(l, "\nProcessing time (microseconds) since startup\n");
+	addtobuffer(buf, l);
+	sprintf(l, "%-8s %-14s %9s %9s %9s %9s %9s %9s\n", "", "", "count", "p50", "p90", "p99", "p99.9", "max");
+	addtobuffer(buf, l);
+	for (i=0; (i < PERF_LAST); i++) reportline(buf, "stage", stages[i]);
+	for (i=0; (i < PERF_MAXCMDS); i++) reportline(buf, "message", commands[i]);
+	for (i=1; (i < C_LAST); i++) reportline(buf, "post", chanpost[i]);
+	for (i=1; (i < C_LAST); i++) reportline(buf, "semwait", chanwait[i]);
+
+	addtobuffer(buf, "\n");
+	for (i=1; (i < C_LAST); i++) {
+		if ((chanbacklog[i] != lastbacklog[i]) || (chandrops[i] != lastdrops[i])) {
+			sprintf(l, "%-6s channel: %lu posts waited for a worker, %lu dropped\n", channelnames[i], 
+				(chanbacklog[i] - lastbacklog[i]), (chandrops[i] - lastdrops[i]));
+			addtobuffer(buf, l);
+			lastbacklog[i] = chanbacklog[i];
+			lastdrops[i] = chandrops[i];
+		}
+	}
+
+	if (queuesamples) {
+		sprintf(l, "Connections receiving  : %5d now, %7.1f average, %5d max\n",
+			queuenowreceiving, (double)queuereceiving / queuesamples, queuemaxreceiving);
+		addtobuffer(buf, l);
+		sprintf(l, "Connections responding : %5d now, %7.1f average, %5d max\n",
+			queuenowresponding, (double)queueresponding / queuesamples, queuemaxresponding);
+		addtobuffer(buf, l);
+	}
+	if ((loopbusy + loopidle) > 0) {
+		sprintf(l, "Main loop busy         : %7.1f %%\n", 100.0 * loopbusy / (loopbusy + loopidle));
+		addtobuffer(buf, l);
+	}
+	queuesamples = queuereceiving = queueresponding = 0;
+	queuemaxreceiving = queuemaxresponding = 0;
+	loopbusy = loopidle = 0.0;
+
+	senders = topsenders(&count, intervalcmp);
+	if (senders) {
+		if (lastreport) sprintf(l, "\nTop senders last %d seconds\n", interval);
+		else strcpy(l, "\nTop senders since startup\n");
+		addtobuffer(buf, l);
+		for (i=0; ((i < count) && (senders[i]->msgs > senders[i]->lastmsgs)); i++) {
+			unsigned long msgs = senders[i]->msgs - senders[i]->lastmsgs;
+
+			sprintf(l, "  %-16s %9lu msgs %9.1f msgs/sec %12llu bytes\n",
+				senders[i]->ip, msgs,
+				(interval ? ((double)msgs / interval) : 0.0), (senders[i]->bytes - senders[i]->lastbytes));
+			addtobuffer(buf, l);
+		}
+		if (sendersdropped > lastsendersdropped) {
+			sprintf(l, "  (%lu messages from other senders not tracked)\n", (sendersdropped - lastsendersdropped));
+			addtobuffer(buf, l);
+		}
+		xfree(senders);
+	}
+	marksenders();
+
+	lastreport = now;
+}
+
+static void machineitem(strbuffer_t *buf, char *prefix, perfitem_t *item)
+{
+	perfhist_t *h;
+	char l[1024];
+
+	if (!item) return;
+
+	h = &item->cur;
+	sprintf(l, "%s.%s.count %lu\n%s.%s.sum_us %.0f\n%s.%s.p50_us %lu\n%s.%s.p90_us %lu\n%s.%s.p99_us %lu\n%s.%s.p999_us %lu\n%s.%s.max_us %lu\n",
+		prefix, item->name, h->samples,
+		prefix, item->name, h->sum,
+		prefix, item->name, histpercentile(h, 50.0),
+		prefix, item->name, histpercentile(h, 90.0),
+		prefix, item->name, histpercentile(h, 99.0),
+		prefix, item->name, histpercentile(h, 99.9),
+		prefix, item->name, h->maxval);
+	addtobuffer(buf, l);
+}
+
+void perf_machinereport(strbuffer_t *buf)
+{
+	/*
+	 * The report for the "xymondstats" command. One "name value" per line.
+	 * Counters and histograms are since xymond started, so whoever collects
+	 * them can calculate rates from the difference between two samples.
+	 */
+	perfsender_t **senders;
+	int i, count;
+	char l[1024];
+
+	for (i=0; (i < PERF_LAST); i++) machineitem(buf, "stage", stages[i]);
+	for (i=0; (i < PERF_MAXCMDS); i++) machineitem(buf, "message", commands[i]);
+	for (i=1; (i < C_LAST); i++) machineitem(buf, "post", chanpost[i]);
+	for (i=1; (i < C_LAST); i++) machineitem(buf, "semwait", chanwait[i]);
+
+	for (i=1; (i < C_LAST); i++) {
+		if (!chanpost[i] && !chandrops[i]) continue;
+		sprintf(l, "channel.%s.backlog %lu\nchannel.%s.drops %lu\n", 
+			channelnames[i], chanbacklog[i], channelnames[i], chandrops[i]);
+		addtobuffer(buf, l);
+	}
+
+	sprintf(l, "queue.receiving %d\nqueue.responding %d\n", queuenowreceiving, queuenowresponding);
+	addtobuffer(buf, l);
+
+	senders = topsenders(&count, sendercmp);
+	if (senders) {
+		for (i=0; (i < count); i++) {
+			sprintf(l, "sender.%d %s %lu %llu\n", i+1, senders[i]->ip, senders[i]->msgs, senders[i]->bytes);
+			addtobuffer(buf, l);
+		}
+		xfree(senders);
+	}
+	sprintf(l, "senders.untracked %lu\n", sendersdropped);
+	addtobuffer(buf, l);
+}
+
@@ -0,0 +1,33 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon message daemon.                                                      */
+/*                                                                            */
+/* Copyright (C) 2004-2011 Henrik Storner <henrik@hswn.dk>                    */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+#ifndef __XYMOND_PERF_H__
+#define __XYMOND_PERF_H__
+
+#include <time.h>
+
+/* The stages a message goes through in xymond */
+enum perfstage_t { PERF_READ, PERF_UNCOMPRESS, PERF_MESSAGE, PERF_STATUS, PERF_RESPOND, PERF_HOUSEKEEPING, PERF_LAST };
+
+extern void perf_start(struct timespec *tstart);
+extern unsigned long perf_usecs(struct timespec *tstart);
+
+extern void perf_stage(enum perfstage_t stage, unsigned long usecs);
+extern void perf_command(int cmdidx, char *cmdname, unsigned long usecs);
+extern void perf_channel(int chnid, unsigned long postusecs, unsigned long waitusecs, int backlog);
+extern void perf_channeldrop(int chnid);
+extern void perf_sender(char *sender, size_t bytes);
+extern void perf_queue(int receiving, int responding);
+extern void perf_loop(unsigned long busyusecs, unsigned long idleusecs);
+
+extern void perf_report(strbuffer_t *buf);
+extern void perf_machinereport(strbuffer_t *buf);
+#endif
+
@@ -226,6 +226,7 @@ int main(int argc, char *argv[])
 	if (exthandler && extids) setup_exthandler(exthandler, extids);
 
 	/* Do the network stuff if needed */
+	net_worker_handoff(rrdcachehandoffhost);
 	net_worker_run(ST_RRD, LOC_STICKY, update_locator_hostdata);
 
 	setup_signalhandler("xymond_rrd");
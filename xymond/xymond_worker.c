@@ -47,9 +47,20 @@ static char rcsid[] = "$Id: xymond_worker.c 6712 2011-07-31 21:01:52Z storner $"
 
 static int running = 1;
 static int inputfd = STDIN_FILENO;
+static int inputreset = 0;
+static int poolworker = 0;
 
 #define EXTRABUFSPACE 4095
 
+static int framedinput = -1;			/* -1: Not known yet, 0: "@@" delimited messages, 1: framed messages */
+static char *framebuf = NULL;			/* Input buffer for framed messages */
+static size_t framebufsz = 0, framestart = 0, framefill = 0;
+static size_t framesaved = 0;			/* Where we put a \0 over the start of the next frame */
+static char framesavedch = '\0';
+static xymond_framehdr_t framehdr;		/* Header of the last framed message */
+static xymond_msginfo_t msginfo;
+static char infohost[256], infotest[256], infocolor[16];
+
 static char *locatorlocation = NULL;
 static char *locatorid = NULL;
 static enum locator_servicetype_t locatorsvc = ST_MAX;
@@ -57,6 +68,10 @@ static int  locatorweight = 1;
 static char *locatorextra = NULL;
 static char *listenipport = NULL;
 static time_t locatorhb = 0;
+static update_fn_t *handofffunc = NULL;
+static int loadmsgcount = 0;
+static int loadmaxlag = 0;
+static time_t loadstart = 0;
 
 
 static void netinp_sighandler(int signum)
@@ -71,15 +86,57 @@ static void netinp_sighandler(int signum)
 
 static void net_worker_heartbeat(void)
 {
+	/*
+	 * Tell the locator we're alive, and how busy we are. The locator
+	 * may answer with a list of hosts that are moving to another server;
+	 * we must flush whatever we hold for them before it lets them go.
+	 */
 	time_t now;
+	int msgrate, migrationid;
+	char *handoff;
 
 	if (!locatorid || (locatorsvc == ST_MAX)) return;
 
 	now = gettimer();
-	if (now > locatorhb) {
+	if (now <= locatorhb) return;
+
+	msgrate = ((loadstart && (now > loadstart)) ? ((loadmsgcount * 60) / (now - loadstart)) : 0);
+	if (locator_serverload(locatorid, locatorsvc, msgrate, loadmaxlag, &migrationid, &handoff) == 0) {
+		if (handoff) {
+			char *hostname;
+
+			for (hostname = strtok(handoff, " "); (hostname); hostname = strtok(NULL, " ")) {
+				dbgprintf("Handing off host %s\n", hostname);
+				if (handofffunc) handofffunc(hostname);
+			}
+			locator_handoff_done(locatorid, locatorsvc, migrationid);
+		}
+	}
+	else {
+		/* Locator does not know about load reports */
 		locator_serverup(locatorid, locatorsvc);
-		locatorhb = now + 60;
 	}
+
+	loadmsgcount = loadmaxlag = 0;
+	loadstart = now;
+	locatorhb = now + 60;
+}
+
+static void net_worker_countmsg(char *msg)
+{
+	/* Keep track of how many messages we handle, and how old they are when we get them */
+	char *p;
+	int lag;
+
+	loadmsgcount++;
+
+	p = msg + strcspn(msg, "|\n");
+	if (*p == '|') {
+		lag = (int)(getcurrenttime(NULL) - atol(p+1));
+		if (lag > loadmaxlag) loadmaxlag = lag;
+	}
+
+	net_worker_heartbeat();
 }
 
 static int net_worker_listener(char *ipport)
@@ -188,6 +245,7 @@ static int net_worker_listener(char *ipport)
 					/* Child takes input from the new socket, and starts working */
 					close(lsocket);	/* Close the listener socket */
 					inputfd = sock;
+					framedinput = 0;
 					return 0;
 				}
 				else if (childpid > 0) {
@@ -261,6 +319,11 @@ int net_worker_locatorbased(void)
 	return ((locatorsvc != ST_MAX) && listenipport && locatorlocation);
 }
 
+void net_worker_handoff(update_fn_t *func)
+{
+	handofffunc = func;
+}
+
 void net_worker_run(enum locator_servicetype_t svc, enum locator_sticky_t sticky, update_fn_t *updfunc)
 {
 	locatorsvc = svc;
@@ -318,7 +381,16 @@ void net_worker_run(enum locator_servicetype_t svc, enum locator_sticky_t sticky
 			exit(0);
 		}
 		else {
-			/* Worker process started. Return from here causes worker to start. */
+			/* 
+			 * Worker process started. Return from here causes worker to start.
+			 * It needs its own connection to the locator for load reports, so
+			 * it does not pick up the replies meant for the listener.
+			 */
+			if (locator_init(locatorlocation) != 0) {
+				errprintf("Locator unavailable, cannot report load\n");
+			}
+			loadstart = gettimer();
+			locatorhb = loadstart + 60;
 		}
 	}
 	else if (listenipport || locatorlocation || locatorid) {
@@ -328,6 +400,148 @@ void net_worker_run(enum locator_servicetype_t svc, enum locator_sticky_t sticky
 }
 
 
+static char *frame_field(char *msg, unsigned int ofs, unsigned int len, char *dst, size_t dstsz)
+{
+	if ((len == 0) || (len >= dstsz) || ((ofs + len) > framehdr.metalen)) return NULL;
+
+	memcpy(dst, msg+ofs, len);
+	*(dst+len) = '\0';
+	return dst;
+}
+
+static int get_framed_message(size_t initialsz, struct timespec *cutoff, char **result)
+{
+	/*
+	 * Read a message from xymond_channel running with "--framed".
+	 * The message length is in the header, so we know exactly how
+	 * much data to wait for and never search the data for an
+	 * end-of-message marker. The buffer grows if a message does
+	 * not fit, so there is no limit on the message size here.
+	 *
+	 * Returns 1 with a message, 0 on timeout and -1 for I/O errors.
+	 */
+	size_t avail, framelen;
+
+	if (framebuf == NULL) {
+		framebufsz = initialsz + EXTRABUFSPACE + 1;
+		framebuf = (char *)malloc(framebufsz);
+		framestart = framefill = framesaved = 0;
+	}
+
+	/* Restore the byte we overwrote to terminate the previous message */
+	if (framesaved) {
+		*(framebuf + framesaved) = framesavedch;
+		framesaved = 0;
+	}
+
+	while (1) {
+		struct timeval selecttmo;
+		fd_set fdread;
+		int res;
+
+		avail = framefill - framestart;
+		framelen = sizeof(xymond_framehdr_t);
+
+		if (avail >= sizeof(xymond_framehdr_t)) {
+			memcpy(&framehdr, framebuf + framestart, sizeof(xymond_framehdr_t));
+			if (framehdr.magic != XYMOND_FRAMEMAGIC) {
+				errprintf("Bad frame in channel, giving up\n");
+				framestart = framefill = 0;
+				return -1;
+			}
+
+			framelen += framehdr.msglen;
+			if (avail >= framelen) break;
+		}
+
+		/* Need more data. Make sure the buffer can hold the whole frame plus a \0 */
+		if ((framestart + framelen) >= framebufsz) {
+			if (framestart > 0) {
+				memmove(framebuf, framebuf + framestart, avail);
+				framestart = 0;
+				framefill = avail;
+			}
+			if (framelen >= framebufsz) {
+				dbgprintf("Growing frame buffer to %d bytes\n", (int)(framelen + EXTRABUFSPACE + 1));
+				framebufsz = framelen + EXTRABUFSPACE + 1;
+				framebuf = (char *)realloc(framebuf, framebufsz);
+			}
+		}
+
+		if (cutoff) {
+			struct timespec now;
+
+			getntimer(&now);
+			selecttmo.tv_sec = cutoff->tv_sec - now.tv_sec;
+			selecttmo.tv_usec = (cutoff->tv_nsec - now.tv_nsec) / 1000;
+			if (selecttmo.tv_usec < 0) {
+				selecttmo.tv_sec--;
+				selecttmo.tv_usec += 1000000;
+			}
+			if (selecttmo.tv_sec < 0) selecttmo.tv_sec = selecttmo.tv_usec = 0;
+		}
+
+		FD_ZERO(&fdread);
+		FD_SET(inputfd, &fdread);
+		res = select(inputfd+1, &fdread, NULL, NULL, (cutoff ? &selecttmo : NULL));
+		if (res < 0) {
+			if (errno == EAGAIN) continue;
+			if (errno == EINTR) return 0;
+
+			dbgprintf("get_xymond_message: Returning NULL due to select error %s\n", strerror(errno));
+			return -1;
+		}
+		else if (res == 0) {
+			return 0;
+		}
+
+		/* Read as much as we have room for - this often picks up several messages at once */
+		res = read(inputfd, framebuf + framefill, (framebufsz - framefill - 1));
+		if (res < 0) {
+			if ((errno == EAGAIN) || (errno == EINTR)) continue;
+
+			dbgprintf("get_xymond_message: Returning NULL due to read error %s\n", strerror(errno));
+			return -1;
+		}
+		else if (res == 0) {
+			dbgprintf("get_xymond_message: Returning NULL due to EOF\n");
+			return -1;
+		}
+
+		framefill += res;
+	}
+
+	*result = framebuf + framestart + sizeof(xymond_framehdr_t);
+	framestart += framelen;
+	if (framestart == framefill) {
+		framestart = framefill = 0;
+	}
+	else {
+		framesaved = framestart;
+		framesavedch = *(framebuf + framesaved);
+	}
+	*(*result + framehdr.msglen) = '\0';
+
+	msginfo.seq = framehdr.seq;
+	msginfo.tstamp.tv_sec = framehdr.tstamp_sec;
+	msginfo.tstamp.tv_usec = framehdr.tstamp_usec;
+	msginfo.hostname = frame_field(*result, framehdr.hostofs, framehdr.hostlen, infohost, sizeof(infohost));
+	msginfo.testname = frame_field(*result, framehdr.testofs, framehdr.testlen, infotest, sizeof(infotest));
+	msginfo.color = frame_field(*result, framehdr.colorofs, framehdr.colorlen, infocolor, sizeof(infocolor));
+
+	return 1;
+}
+
+xymond_msginfo_t *get_xymond_msginfo(void)
+{
+	/*
+	 * The hostname, testname etc. of the last message returned by
+	 * get_xymond_message(), taken from the frame header. Only
+	 * available when xymond_channel sends us framed messages.
+	 */
+	return ((framedinput == 1) ? &msginfo : NULL);
+}
+
 unsigned char *get_xymond_message(enum msgchannels_t chnid, char *id, int *seq, struct timespec *timeout)
 {
 	static unsigned int seqnum = 0;
@@ -371,6 +585,21 @@ unsigned char *get_xymond_message(enum msgchannels_t chnid, char *id, int *seq,
 	 * does not have room left to hold a complete message.
 	 */
 
+	if (inputreset) {
+		/* Input has been switched to a new file descriptor - drop any old buffered data */
+		if (buf) xfree(buf);
+		if (idlemsg) xfree(idlemsg);
+		seqnum = 0;
+		ioerror = 0;
+		inputreset = 0;
+
+		/* The new input is always a plain message stream */
+		if (framebuf) xfree(framebuf);
+		framedinput = 0;
+	}
+
+	if (framedinput == -1) framedinput = (getenv("XYMONCHANNEL_FRAMED") != NULL);
+
 	if (buf == NULL) {
 		/*
 		 * Initial setup of the buffers.
@@ -380,7 +609,7 @@ unsigned char *get_xymond_message(enum msgchannels_t chnid, char *id, int *seq,
 		 * needed occasionally some room to work optimally.
 		 */
 		maxmsgsize = 1024*shbufsz(chnid);
-		bufsz = maxmsgsize + EXTRABUFSPACE;
+		bufsz = (framedinput ? 0 : maxmsgsize) + EXTRABUFSPACE;	/* Framed input has its own buffer */
 		buf = (char *)malloc(bufsz+1);
 		*buf = '\0';
 		startpos = fillpos = buf;
@@ -434,6 +663,21 @@ startagain:
 		}
 	}
 
+	if (framedinput) {
+		switch (get_framed_message(maxmsgsize, (timeout ? &cutoff : NULL), &result)) {
+		  case 1:
+			goto gotmessage;
+
+		  case 0:
+			*seq = 0;
+			return idlemsg;
+
+		  default:
+			ioerror = 1;
+			return NULL;
+		}
+	}
+
 	/*
 	 * Start looking for the end-of-message marker at the beginning of
 	 * the message. The next scans will only look at the new data we've
@@ -493,6 +737,10 @@ startagain:
 					selecttmo.tv_sec--;
 					selecttmo.tv_usec += 1000000;
 				}
+				if (selecttmo.tv_sec < 0) {
+					/* Already past the cutoff - just poll */
+					selecttmo.tv_sec = selecttmo.tv_usec = 0;
+				}
 			}
 
 			FD_ZERO(&fdread);
@@ -576,20 +824,21 @@ startagain:
 		/* fillpos stays where it is */
 	}
 
+gotmessage:
 	/* Check that it really is a message, and not just some garbled data */
 	if (strncmp(result, "@@", 2) != 0) {
 		errprintf("Dropping (more) garbled data\n");
 		goto startagain;
 	}
 
-	if (!locatorid) {
+	if (!locatorid && !poolworker) {
 		/* 
 		 * Get and check the message sequence number.
 		 * We dont do this for network based workers, since the
 		 * sequence number is globally generated (by xymond)
 		 * but a network-based worker may only see some of the
 		 * messages (those that are not handled by other network-based
-		 * worker modules).
+		 * worker modules). Same for workers in a worker pool.
 		 */
 		char *p = result + strcspn(result, "#/|\n");
 		if (*p == '#') {
@@ -660,6 +909,331 @@ startagain:
 	dbgprintf("startpos %ld, fillpos %ld, endpos %ld\n",
 		  (startpos-buf), (fillpos-buf), (endpos ? (endpos-buf) : -1));
 
+	if (locatorid) net_worker_countmsg(result);
+
 	return result;
 }
 
+
+
+/*
+ * Worker pool.
+ *
+ * Splits the messages arriving on a channel between a number of
+ * worker processes. Each worker is a forked copy of the calling
+ * program, which reads its messages via get_xymond_message() as usual,
+ * but from a pipe fed by the parent instead of from xymond_channel.
+ * Messages are sharded by the hostname found in the meta-data, so all
+ * messages for one host go to the same worker and are handled in the
+ * order they arrived. Control messages (shutdown, reload, logrotate)
+ * go to all of the workers.
+ */
+
+#define POOL_MAXQUEUE (16*1024*1024)	/* Max. bytes queued for one worker before we stop reading input */
+#define POOL_REPORTINTERVAL 300
+
+typedef struct poolworker_t {
+	pid_t pid;
+	int fd;
+	strbuffer_t *queue;		/* Data waiting to be written to the worker */
+	int qoffset;			/* How much of the queue has been written */
+	unsigned long msgcount, bytecount, droppedcount;
+	int maxqueue;			/* Max. bytes queued */
+	int restarts;
+} poolworker_t;
+
+static poolworker_t *pool = NULL;
+static int poolsize = 0;
+static worker_fn_t *poolworkerfunc = NULL;
+static struct sigaction workerhupsa;	/* How the workers handle SIGHUP */
+static volatile int poolreload = 0;
+
+static void pool_sighandler(int signum)
+{
+	/* The workers must reload their configuration */
+	if (signum == SIGHUP) poolreload = 1;
+}
+
+static int pool_spawn(int idx)
+{
+	int pfd[2], i;
+	pid_t childpid;
+
+	if (pipe(pfd) == -1) {
+		errprintf("Cannot create pipe for worker %d: %s\n", idx, strerror(errno));
+		return -1;
+	}
+
+	childpid = fork();
+	if (childpid == 0) {
+		/* Child: Read messages from the pipe, and run the normal worker loop */
+		close(pfd[1]);
+		for (i = 0; (i < poolsize); i++) {
+			if (pool[i].fd >= 0) close(pool[i].fd);
+		}
+		if (inputfd >= 0) close(inputfd);
+
+		inputfd = pfd[0];
+		inputreset = 1;
+		poolworker = 1;
+		signal(SIGPIPE, SIG_DFL);
+		sigaction(SIGHUP, &workerhupsa, NULL);
+		exit(poolworkerfunc());
+	}
+	else if (childpid == -1) {
+		errprintf("Cannot fork worker %d: %s\n", idx, strerror(errno));
+		close(pfd[0]); close(pfd[1]);
+		return -1;
+	}
+
+	close(pfd[0]);
+	fcntl(pfd[1], F_SETFL, O_NONBLOCK);
+	pool[idx].pid = childpid;
+	pool[idx].fd = pfd[1];
+	pool[idx].qoffset = 0;
+	clearstrbuffer(pool[idx].queue);
+	dbgprintf("Started pool worker %d, pid %d\n", idx, (int)childpid);
+
+	return 0;
+}
+
+static void pool_flush(int idx)
+{
+	poolworker_t *w = &pool[idx];
+	int n, pending;
+
+	while ((pending = STRBUFLEN(w->queue) - w->qoffset) > 0) {
+		n = write(w->fd, STRBUF(w->queue) + w->qoffset, pending);
+		if (n > 0) {
+			w->qoffset += n;
+		}
+		else if ((n == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+			break;
+		}
+		else if ((n == -1) && (errno == EINTR)) {
+			continue;
+		}
+		else {
+			/* Worker has died. Restart it - any messages queued for it are lost */
+			char *p;
+			int lost = 0;
+
+			for (p = strstr(STRBUF(w->queue) + w->qoffset, "\n@@\n"); (p); p = strstr(p+4, "\n@@\n")) lost++;
+			errprintf("Pool worker %d (pid %d) failed, restarting it. %d messages dropped\n", idx, (int)w->pid, lost);
+			w->droppedcount += lost;
+			close(w->fd);
+			w->fd = -1;
+			w->restarts++;
+			if (pool_spawn(idx) == -1) running = 0;
+			return;
+		}
+	}
+
+	/* Reclaim the space once everything has been written */
+	if (w->qoffset == STRBUFLEN(w->queue)) {
+		clearstrbuffer(w->queue);
+		w->qoffset = 0;
+	}
+	else if (w->qoffset > (STRBUFLEN(w->queue) / 2)) {
+		int left = STRBUFLEN(w->queue) - w->qoffset;
+
+		memmove(STRBUF(w->queue), STRBUF(w->queue) + w->qoffset, left);
+		strbufferchop(w->queue, w->qoffset);
+		w->qoffset = 0;
+	}
+}
+
+static void pool_queue(int idx, char *msg)
+{
+	poolworker_t *w = &pool[idx];
+	int msglen = strlen(msg);
+	int queued;
+
+	addtobufferraw(w->queue, msg, msglen);
+	addtobufferraw(w->queue, "\n@@\n", 4);
+	w->msgcount++;
+	w->bytecount += msglen + 4;
+
+	queued = STRBUFLEN(w->queue) - w->qoffset;
+	if (queued > w->maxqueue) w->maxqueue = queued;
+
+	pool_flush(idx);
+}
+
+static int pool_shard(char *msg, int hostfield)
+{
+	char *p, *eoln;
+	unsigned int hash = 5381;
+	int field;
+
+	/* With framed input the hostname is ready in the frame header */
+	if (get_xymond_msginfo() && get_xymond_msginfo()->hostname && strcmp(get_xymond_msginfo()->hostname, "*")) {
+		for (p = get_xymond_msginfo()->hostname; (*p); p++) hash = ((hash << 5) + hash) + tolower((int)*p);
+		return (hash % poolsize);
+	}
+
+	/* Find the hostname in the meta-data line, and hash it */
+	eoln = msg + strcspn(msg, "\n");
+	for (field = 0, p = msg; ((field < hostfield) && (p < eoln)); field++) {
+		p = strchr(p, '|');
+		if (!p || (p > eoln)) return 0;
+		p++;
+	}
+
+	while ((p < eoln) && (*p != '|')) {
+		hash = ((hash << 5) + hash) + tolower((int)*p);
+		p++;
+	}
+
+	return (hash % poolsize);
+}
+
+static void pool_report(char *reportcolumn, char *id, time_t starttime)
+{
+	char msgline[1024];
+	int i;
+
+	if (!reportcolumn) return;
+
+	combo_start();
+	init_status(COL_GREEN);
+	sprintf(msgline, "status %s.%s green %s\n\n", xgetenv("MACHINE"), reportcolumn, timestamp);
+	addtostatus(msgline);
+	sprintf(msgline, "%s worker pool: %d workers, up %s\n\n", id, poolsize, durationstring(gettimer() - starttime));
+	addtostatus(msgline);
+	addtostatus("Worker      PID   Messages        Bytes  Queued msgs  Queued bytes  Max queued  Dropped  Restarts\n");
+	for (i = 0; (i < poolsize); i++) {
+		char *p;
+		int queuedmsgs = 0;
+
+		for (p = strstr(STRBUF(pool[i].queue) + pool[i].qoffset, "\n@@\n"); (p); p = strstr(p+4, "\n@@\n")) queuedmsgs++;
+		sprintf(msgline, "%6d %8d %10lu %12lu %12d %13d %11d %8lu %9d\n",
+			i, (int)pool[i].pid, pool[i].msgcount, pool[i].bytecount,
+			queuedmsgs, (STRBUFLEN(pool[i].queue) - pool[i].qoffset), pool[i].maxqueue,
+			pool[i].droppedcount, pool[i].restarts);
+		addtostatus(msgline);
+	}
+	finish_status();
+	combo_end();
+}
+
+int worker_pool_run(enum msgchannels_t chnid, char *id, int count, int hostfield, worker_fn_t *workerfunc, char *reportcolumn)
+{
+	int i, seq, busy;
+	time_t starttime = gettimer(), nextreport = starttime + POOL_REPORTINTERVAL;
+	struct timespec polltmo = { 0, 0 };
+	struct sigaction sa;
+
+	poolsize = count;
+	sigaction(SIGHUP, NULL, &workerhupsa);
+	poolworkerfunc = workerfunc;
+	pool = (poolworker_t *)calloc(poolsize, sizeof(poolworker_t));
+	for (i = 0; (i < poolsize); i++) {
+		pool[i].fd = -1;
+		pool[i].queue = newstrbuffer(0);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; (i < poolsize); i++) {
+		if (pool_spawn(i) == -1) return 1;
+	}
+
+	/* The workers keep the caller's SIGHUP handler; here we pass the signal on to them */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = pool_sighandler;
+	sigaction(SIGHUP, &sa, NULL);
+
+	while (running) {
+		char *msg;
+		int overfull = 0;
+
+		if (poolreload) {
+			poolreload = 0;
+			for (i = 0; (i < poolsize); i++) {
+				if (pool[i].pid > 0) kill(pool[i].pid, SIGHUP);
+			}
+		}
+
+		/* Is any worker lagging so much that we must stop reading input for now ? */
+		for (i = 0, busy = 0; (i < poolsize); i++) {
+			int queued = STRBUFLEN(pool[i].queue) - pool[i].qoffset;
+			if (queued > 0) busy = 1;
+			if (queued > POOL_MAXQUEUE) overfull = 1;
+		}
+
+		if (busy) {
+			/* Wait until we have input, or a worker can take more data */
+			fd_set fdread, fdwrite;
+			struct timeval tmo;
+			int maxfd = (overfull ? -1 : inputfd);
+
+			FD_ZERO(&fdread); FD_ZERO(&fdwrite);
+			if (!overfull) FD_SET(inputfd, &fdread);
+			for (i = 0; (i < poolsize); i++) {
+				if ((STRBUFLEN(pool[i].queue) - pool[i].qoffset) > 0) {
+					FD_SET(pool[i].fd, &fdwrite);
+					if (pool[i].fd > maxfd) maxfd = pool[i].fd;
+				}
+			}
+
+			tmo.tv_sec = 1; tmo.tv_usec = 0;
+			if (select(maxfd+1, &fdread, &fdwrite, NULL, &tmo) > 0) {
+				for (i = 0; (i < poolsize); i++) {
+					if (FD_ISSET(pool[i].fd, &fdwrite)) pool_flush(i);
+				}
+			}
+
+			if (overfull) continue;
+
+			/* There may still be buffered input, so always check */
+			msg = get_xymond_message(chnid, id, &seq, &polltmo);
+		}
+		else {
+			msg = get_xymond_message(chnid, id, &seq, NULL);
+		}
+
+		if (msg == NULL) {
+			running = 0;
+			continue;
+		}
+
+		if (strncmp(msg, "@@idle", 6) == 0) {
+			/* Nothing - just a poll */
+		}
+		else if ((strncmp(msg, "@@shutdown", 10) == 0) || (strncmp(msg, "@@reload", 8) == 0) || (strncmp(msg, "@@logrotate", 11) == 0)) {
+			for (i = 0; (i < poolsize); i++) pool_queue(i, msg);
+
+			if (strncmp(msg, "@@shutdown", 10) == 0) {
+				running = 0;
+			}
+			else if (strncmp(msg, "@@logrotate", 11) == 0) {
+				char *fn = xgetenv("XYMONCHANNEL_LOGFILENAME");
+				if (fn && strlen(fn)) {
+					freopen(fn, "a", stdout);
+					freopen(fn, "a", stderr);
+				}
+			}
+		}
+		else {
+			pool_queue(pool_shard(msg, hostfield), msg);
+		}
+
+		if (reportcolumn && (gettimer() >= nextreport)) {
+			init_timestamp();
+			pool_report(reportcolumn, id, starttime);
+			nextreport = gettimer() + POOL_REPORTINTERVAL;
+		}
+	}
+
+	/* Hand over the remaining data to the workers, then close the pipes so they terminate */
+	for (i = 0; (i < poolsize); i++) {
+		int fl = fcntl(pool[i].fd, F_GETFL);
+
+		fcntl(pool[i].fd, F_SETFL, (fl & ~O_NONBLOCK));
+		pool_flush(i);
+		close(pool[i].fd);
+	}
+
+	return 0;
+}
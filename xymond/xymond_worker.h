@@ -15,11 +15,22 @@
 
 #include "xymond_ipc.h"
 typedef void (update_fn_t)(char *);
+typedef int (worker_fn_t)(void);
+
+/* Message details from the frame header, see get_xymond_msginfo() */
+typedef struct xymond_msginfo_t {
+	unsigned int seq;
+	struct timeval tstamp;
+	char *hostname, *testname, *color;	/* NULL if not in this type of message */
+} xymond_msginfo_t;
 
 extern int net_worker_option(char *arg);
 extern int net_worker_locatorbased(void);
+extern void net_worker_handoff(update_fn_t *func);
 extern void net_worker_run(enum locator_servicetype_t svc, enum locator_sticky_t sticky, update_fn_t *updfunc);
 extern unsigned char *get_xymond_message(enum msgchannels_t chnid, char *id, int *seq, struct timespec *timeout);
+extern xymond_msginfo_t *get_xymond_msginfo(void);
+extern int worker_pool_run(enum msgchannels_t chnid, char *id, int count, int hostfield, worker_fn_t *workerfunc, char *reportcolumn);
 
 #endif
 
@@ -34,9 +34,18 @@ static char rcsid[] = "$Id: xymonfetch.c 6745 2011-09-04 06:01:06Z storner $";
 #include <netdb.h>
 #include <ctype.h>
 #include <signal.h>
+#ifdef LINUX
+/* epoll has no limit on the number of sockets, and does not need the full set passed for each wait */
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include "libxymon.h"
 
+#define SESSION_RETRY 3600	/* How long before we try a session again with a msgcache that does not do them */
+#define COMBO_MAXSIZE 262144	/* Max. size of the combo messages we build from the fetched status messages */
+#define BATCH_MAXSIZE (4*1024*1024 + MAX_XYMON_INBUFSZ)	/* msgcache batches are at most 4 MB, or one large message */
+
 volatile int running = 1;
 volatile time_t reloadtime = 0;
 volatile int dumpsessions = 0;
@@ -45,11 +54,23 @@ int pollinterval = 60; /* Seconds between polls, +/- 15 seconds */
 time_t whentoqueue = 0;
 int serverid = 1;
 int errorloginterval = 900;
+int usesessions = 1;
+int sessiontimeout = 10;	/* How long to wait for msgcache to accept a session */
+int combomaxsize = COMBO_MAXSIZE;
+char *reportcolumn = NULL;
+int reportinterval = 300;
 
 /*
  * When we send in a "client" message to the server, we get the client configuration
  * back. Save this in a tree so the next time we contact the client, we can provide
  * the configuration for it in the "pullclient" data.
+ *
+ * msgcache versions that support it keep a session open with us. We then send
+ * "fetch" requests over the session, and the response is a batch of messages.
+ * Each batch has the sequence number of the last message in it. Once all of the
+ * messages in a batch have been delivered to xymond, we acknowledge the sequence
+ * number to msgcache; messages that are not acknowledged when the session ends
+ * are sent again in the next session.
  */
 typedef struct clients_t {
 	char *hostname;
@@ -58,19 +79,38 @@ typedef struct clients_t {
 	time_t nexterrortxt;	/* When we'll log errors on this client again */
 	char *clientdata;	/* This hosts' client configuration data */
 	int busy;		/* If set, then we are currently processing this host */
+
+	struct conn_t *session;	/* Session with msgcache, if we have one */
+	time_t nextsession;	/* When to try a session with a msgcache that did not accept one */
+	int cfgsent;		/* The clientdata has been passed on in this session */
+	unsigned long fetchedseq; /* Last message sequence number fetched in this session */
+	unsigned long ackedseq;	/* Last sequence number acknowledged to msgcache */
+	int fwdpending;		/* Number of requests to xymond not yet completed */
+	int fwdfailed;		/* Set if a request to xymond failed */
+
+	struct timespec fetchstart;	/* Statistics */
+	unsigned long fetchcount, msgcount, usecstotal, usecsmax, usecslast;
+	int backlog;		/* Messages left in msgcache after the last fetch */
+	time_t lastfetch;
 } clients_t;
 void * clients;
+clients_t selfclient = { "xymonfetch", };	/* Pseudo-client for our own status reports */
 
 typedef enum { C_CLIENT, C_SERVER } conntype_t;
+typedef enum { S_NONE, S_OPENING, S_OPEN } sessionstate_t;
 typedef struct conn_t {
 	unsigned long seq;
 	conntype_t ctype;		/* Talking to a client or a server? */
+	sessionstate_t session;		/* Is this a session with a msgcache? */
 	int savedata;			/* Save the data to the client data buffer */
+	int failed;			/* Set when the request failed */
+	int expectreply;		/* Session: We expect a response to what we sent */
+	int retrynow;			/* msgcache did not accept a session, poll it right away */
 	clients_t *client;		/* Which client this refers to. */
 	time_t tstamp;			/* When did the connection start. */
 	struct sockaddr_in caddr;	/* Destination address */
 	int sockfd;			/* Socket */
-	enum { C_READING, C_WRITING, C_CLEANUP } action;	/* What are we doing? */
+	enum { C_READING, C_WRITING, C_IDLE, C_CLEANUP } action;	/* What are we doing? */
 	strbuffer_t *msgbuf;		/* I/O buffer */
 	int sentbytes;
 	struct conn_t *next;
@@ -80,6 +120,162 @@ conn_t *ctail = NULL;			/* Tail of current connection queue */
 unsigned long connseq = 0;		/* Sequence number, to identify requests in debugging */
 int needcleanup = 0;			/* Do we need to perform a cleanup? */
 
+/* Statistics for the status report */
+unsigned long stat_fetches = 0, stat_msgs = 0, stat_combos = 0, stat_servermsgs = 0, stat_serverfail = 0;
+unsigned long stat_sessions = 0, stat_sessionlost = 0;
+
+#define IO_READ  1
+#define IO_WRITE 2
+
+#ifdef USE_EPOLL
+/*
+ * The sockets stay in the epoll set between calls to io_wait(). Each time
+ * around the main loop we collect which sockets we want to wait for in
+ * fdwant[], and only tell the kernel about those that changed since the
+ * last time (fdwatch[]). fdready[] holds the result of the wait.
+ */
+static int epollfd = -1;
+static unsigned char *fdwant = NULL, *fdwatch = NULL, *fdready = NULL;
+static int fdtabsz = 0;
+#else
+static fd_set fdread, fdwrite;
+#endif
+static int fdmax = -1;
+
+static void io_init(void)
+{
+#ifdef USE_EPOLL
+	struct rlimit lim;
+
+	epollfd = epoll_create(1024);
+	if (epollfd == -1) {
+		errprintf("Cannot create epoll set: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	/* We want as many sockets as we can get */
+	if ((getrlimit(RLIMIT_NOFILE, &lim) == 0) && (lim.rlim_cur < lim.rlim_max)) {
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+#endif
+}
+
+static void io_start(void)
+{
+#ifndef USE_EPOLL
+	FD_ZERO(&fdread);
+	FD_ZERO(&fdwrite);
+	fdmax = -1;
+#endif
+}
+
+static void io_want(int fd, int events)
+{
+	if (fd < 0) return;
+
+#ifdef USE_EPOLL
+	if (fd >= fdtabsz) {
+		int newsz = fd + 1024;
+
+		fdwant = (unsigned char *)realloc(fdwant, newsz);
+		fdwatch = (unsigned char *)realloc(fdwatch, newsz);
+		fdready = (unsigned char *)realloc(fdready, newsz);
+		memset(fdwant+fdtabsz, 0, newsz-fdtabsz);
+		memset(fdwatch+fdtabsz, 0, newsz-fdtabsz);
+		memset(fdready+fdtabsz, 0, newsz-fdtabsz);
+		fdtabsz = newsz;
+	}
+	fdwant[fd] |= events;
+#else
+	/* select() cannot handle file descriptors above FD_SETSIZE */
+	if (fd >= FD_SETSIZE) return;
+	if (events & IO_READ) FD_SET(fd, &fdread);
+	if (events & IO_WRITE) FD_SET(fd, &fdwrite);
+#endif
+
+	if (fd > fdmax) fdmax = fd;
+}
+
+static int io_ready(int fd, int events)
+{
+	if (fd < 0) return 0;
+
+#ifdef USE_EPOLL
+	return ((fd < fdtabsz) && (fdready[fd] & events));
+#else
+	if (fd >= FD_SETSIZE) return 0;
+	return (((events & IO_READ) && FD_ISSET(fd, &fdread)) || ((events & IO_WRITE) && FD_ISSET(fd, &fdwrite)));
+#endif
+}
+
+static int io_wait(int waitms)
+{
+#ifdef USE_EPOLL
+	struct epoll_event events[256];
+	int fd, i, n, newmax = -1;
+
+	for (fd = 0; (fd <= fdmax); fd++) {
+		fdready[fd] = 0;
+
+		if (fdwant[fd] != fdwatch[fd]) {
+			struct epoll_event ev;
+
+			memset(&ev, 0, sizeof(ev));
+			ev.events = ((fdwant[fd] & IO_READ) ? EPOLLIN : 0) | ((fdwant[fd] & IO_WRITE) ? EPOLLOUT : 0);
+			ev.data.fd = fd;
+
+			if (fdwant[fd] == 0) {
+				epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, &ev);
+			}
+			else if (fdwatch[fd] == 0) {
+				if ((epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) &&
+				    ((errno != EEXIST) || (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev) == -1))) {
+					errprintf("Cannot add socket to epoll set: %s\n", strerror(errno));
+				}
+			}
+			else {
+				if ((epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev) == -1) &&
+				    ((errno != ENOENT) || (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1))) {
+					errprintf("Cannot update socket in epoll set: %s\n", strerror(errno));
+				}
+			}
+
+			fdwatch[fd] = fdwant[fd];
+		}
+
+		fdwant[fd] = 0;
+		if (fdwatch[fd]) newmax = fd;
+	}
+	fdmax = newmax;
+
+	n = epoll_wait(epollfd, events, (sizeof(events) / sizeof(events[0])), waitms);
+	for (i = 0; (i < n); i++) {
+		fd = events[i].data.fd;
+		if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) fdready[fd] |= IO_READ;
+		if (events[i].events & (EPOLLOUT|EPOLLHUP|EPOLLERR)) fdready[fd] |= IO_WRITE;
+	}
+
+	return n;
+#else
+	struct timeval selecttmo;
+
+	selecttmo.tv_sec = waitms / 1000;
+	selecttmo.tv_usec = (waitms % 1000) * 1000;
+	return select(fdmax+1, &fdread, &fdwrite, NULL, &selecttmo);
+#endif
+}
+
+static void io_close(int fd)
+{
+	close(fd);
+
+#ifdef USE_EPOLL
+	/* close() removes it from the epoll set */
+	if (fd < fdtabsz) fdwant[fd] = fdwatch[fd] = fdready[fd] = 0;
+#endif
+}
+
 void sigmisc_handler(int signum)
 {
 	switch (signum) {
@@ -115,7 +311,30 @@ void flag_cleanup(conn_t *conn)
 	needcleanup = 1;
 }
 
-void addrequest(conntype_t ctype, char *destip, int portnum, strbuffer_t *req, clients_t *client)
+void flag_failure(conn_t *conn)
+{
+	/* Called when a connection request fails */
+	conn->failed = 1;
+	flag_cleanup(conn);
+}
+
+void abort_conn(conn_t *conn)
+{
+	/*
+	 * Drop a connection with a reset, instead of the normal close. An old
+	 * msgcache that does not do sessions would otherwise take the session
+	 * request as a normal "pullclient" request when it sees the connection
+	 * close, and mark all of its messages as delivered.
+	 */
+	struct linger lng;
+
+	lng.l_onoff = 1;
+	lng.l_linger = 0;
+	if (conn->sockfd >= 0) setsockopt(conn->sockfd, SOL_SOCKET, SO_LINGER, &lng, sizeof(lng));
+	flag_failure(conn);
+}
+
+conn_t *addrequest(conntype_t ctype, char *destip, int portnum, strbuffer_t *req, clients_t *client)
 {
 	/*
 	 * Add a new request to the connection queue.
@@ -134,9 +353,17 @@ void addrequest(conntype_t ctype, char *destip, int portnum, strbuffer_t *req, c
 	newconn->msgbuf = req;
 	newconn->sentbytes = 0;
 	newconn->ctype = ctype;
-	newconn->savedata = ((ctype == C_SERVER) && (strncmp(STRBUF(req), "client ", 7) == 0));
+	newconn->savedata = ((ctype == C_SERVER) &&
+			     ((strncmp(STRBUF(req), "client ", 7) == 0) || (strcmp(compressed_type(STRBUF(req)), "client") == 0)));
 	newconn->action = C_WRITING;
 	newconn->tstamp = gettimer();
+	newconn->sockfd = -1;
+
+	/* Requests to xymond are tracked, so we know when a batch of messages has been delivered */
+	if (ctype == C_SERVER) {
+		client->fwdpending++;
+		stat_servermsgs++;
+	}
 
 	/* Setup the address. */
 	newconn->caddr.sin_port = htons(portnum);
@@ -148,7 +375,7 @@ void addrequest(conntype_t ctype, char *destip, int portnum, strbuffer_t *req, c
 			errprintf("Invalid client IP: %s (req %lu)\n", destip, newconn->seq);
 			newconn->client->nexterrortxt = now + errorloginterval;
 		}
-		flag_cleanup(newconn);
+		flag_failure(newconn);
 		goto done;
 	}
 
@@ -156,7 +383,7 @@ void addrequest(conntype_t ctype, char *destip, int portnum, strbuffer_t *req, c
 	if (newconn->sockfd == -1) {
 		/* No more sockets available. Try again later. */
 		errprintf("Out of sockets (req %lu)\n", newconn->seq);
-		flag_cleanup(newconn);
+		flag_failure(newconn);
 		goto done;
 	}
 	fcntl(newconn->sockfd, F_SETFL, O_NONBLOCK);
@@ -165,22 +392,22 @@ void addrequest(conntype_t ctype, char *destip, int portnum, strbuffer_t *req, c
 		char dbgmsg[100];
 
 		snprintf(dbgmsg, sizeof(dbgmsg), "%s\n", STRBUF(req));
-		dbgprintf("Queuing request %lu to %s for %s: '%s'\n", 
+		dbgprintf("Queuing request %lu to %s for %s: '%s'\n",
 			connseq, addrstring(&newconn->caddr, 1), client->hostname, dbgmsg);
 	}
 
 	/* All set ... start the connection */
-	n = connect(newconn->sockfd, (struct sockaddr *)&newconn->caddr, sizeof(newconn->caddr)); 
+	n = connect(newconn->sockfd, (struct sockaddr *)&newconn->caddr, sizeof(newconn->caddr));
 	if ((n == -1) && (errno != EINPROGRESS)) {
 		/* Immediate connect failure - drop it */
 		time_t now = gettimer();
 		if (debug || (newconn->client->nexterrortxt < now)) {
-			errprintf("Could not connect to %s (req %lu): %s\n", 
+			errprintf("Could not connect to %s (req %lu): %s\n",
 				  addrstring(&newconn->caddr, 1), newconn->seq, strerror(errno));
 			newconn->client->nexterrortxt = now + errorloginterval;
 		}
 
-		flag_cleanup(newconn);
+		flag_failure(newconn);
 		goto done;
 	}
 
@@ -193,8 +420,65 @@ done:
 	else {
 		chead = ctail = newconn;
 	}
+
+	return newconn;
 }
 
+unsigned long deliveredseq(clients_t *client)
+{
+	/* The last message sequence number we know has been delivered to xymond */
+	if ((client->fwdpending == 0) && !client->fwdfailed) return client->fetchedseq;
+
+	return client->ackedseq;
+}
+
+void session_send(conn_t *conn, char *frame, char *data, int expectreply)
+{
+	/* Send a request over an open session to msgcache */
+	clearstrbuffer(conn->msgbuf);
+	addtobuffer(conn->msgbuf, frame);
+	if (data) addtobuffer(conn->msgbuf, data);
+	conn->sentbytes = 0;
+	conn->expectreply = expectreply;
+	conn->action = C_WRITING;
+	conn->tstamp = gettimer();
+}
+
+void start_fetch(clients_t *client)
+{
+	/*
+	 * Ask msgcache for the next batch of messages. The request also
+	 * acknowledges the messages we have delivered so far, and carries the
+	 * client configuration data if it has changed.
+	 */
+	conn_t *conn = client->session;
+	char frame[100];
+	char *cfg = ((client->clientdata && !client->cfgsent) ? client->clientdata : NULL);
+
+	client->ackedseq = deliveredseq(client);
+	sprintf(frame, "fetch %lu %d\n", client->ackedseq, (cfg ? (int)strlen(cfg) : 0));
+	session_send(conn, frame, cfg, 1);
+	if (cfg) client->cfgsent = 1;
+
+	client->busy = 1;
+	getntimer(&client->fetchstart);
+	dbgprintf("Fetching from %s (req %lu), ack %lu\n", client->hostname, conn->seq, client->ackedseq);
+}
+
+void send_ack(clients_t *client)
+{
+	/* All messages fetched have been delivered - let msgcache know, if the session is idle */
+	conn_t *conn = client->session;
+	char frame[100];
+
+	if (!conn || (conn->session != S_OPEN) || (conn->action != C_IDLE)) return;
+	if (deliveredseq(client) <= client->ackedseq) return;
+
+	client->ackedseq = deliveredseq(client);
+	sprintf(frame, "ack %lu\n", client->ackedseq);
+	session_send(conn, frame, NULL, 0);
+	dbgprintf("Acknowledging %lu to %s (req %lu)\n", client->ackedseq, client->hostname, conn->seq);
+}
 
 void senddata(conn_t *conn)
 {
@@ -210,11 +494,11 @@ void senddata(conn_t *conn)
 		/* Write failure. Also happens if connecting to peer fails */
 		time_t now = gettimer();
 		if (debug || (conn->client->nexterrortxt < now)) {
-			errprintf("Connection lost during connect/write to %s (req %lu): %s\n", 
+			errprintf("Connection lost during connect/write to %s (req %lu): %s\n",
 				  addrstring(&conn->caddr, 1), conn->seq, strerror(errno));
 			conn->client->nexterrortxt = now + errorloginterval;
 		}
-		flag_cleanup(conn);
+		flag_failure(conn);
 	}
 	else if (n >= 0) {
 		dbgprintf("Sent %d bytes to %s (req %lu)\n", n, addrstring(&conn->caddr, 1), conn->seq);
@@ -222,61 +506,100 @@ void senddata(conn_t *conn)
 		if (conn->sentbytes == STRBUFLEN(conn->msgbuf)) {
 			/* Everything has been sent, so switch to READ mode */
 			clearstrbuffer(conn->msgbuf);
-			shutdown(conn->sockfd, SHUT_WR);
-			conn->action = C_READING;
+			conn->sentbytes = 0;
+
+			if (conn->session == S_NONE) {
+				shutdown(conn->sockfd, SHUT_WR);
+				conn->action = C_READING;
+			}
+			else {
+				/* Sessions stay open. Keep an eye on an idle session, in case msgcache closes it */
+				conn->action = (conn->expectreply ? C_READING : C_IDLE);
+			}
 		}
 	}
 }
 
 
-void process_clientdata(conn_t *conn)
+void flush_combo(strbuffer_t **combo, int *combocount, clients_t *client)
 {
-	/* 
+	int portnum = atoi(xgetenv("XYMONDPORT"));
+
+	if (*combo == NULL) return;
+
+	if (*combocount == 1) {
+		/* Just one status message, send it as it is */
+		strbuffer_t *cbuf = *combo;
+
+		*combo = newstrbuffer(STRBUFLEN(cbuf));
+		addtobufferraw(*combo, STRBUF(cbuf) + 6, STRBUFLEN(cbuf) - 6);
+		freestrbuffer(cbuf);
+	}
+	else {
+		stat_combos++;
+	}
+
+	addrequest(C_SERVER, serverip, portnum, *combo, client);
+	*combo = NULL;
+	*combocount = 0;
+}
+
+void process_clientdata(conn_t *conn, strbuffer_t *data)
+{
+	/*
 	 * Handle data we received while talking to the Xymon client.
 	 * This will be a list of messages we must send to the server.
 	 * Each of the messages are pushed to the server through
-	 * new C_SERVER requests.
+	 * new C_SERVER requests. Plain status messages are merged into
+	 * "combo" messages, so we need fewer connections to xymond.
 	 */
 
 	char *mptr, *databegin, *msgbegin;
 	int portnum = atoi(xgetenv("XYMONDPORT"));
+	strbuffer_t *combo = NULL;
+	int combocount = 0;
 
-	databegin = strchr(STRBUF(conn->msgbuf), '\n');
-	if (!databegin || (STRBUFLEN(conn->msgbuf) == 0)) {
+	databegin = strchr(STRBUF(data), '\n');
+	if (!databegin || (STRBUFLEN(data) == 0)) {
 		/* No data - we're done */
-		flag_cleanup(conn);
 		return;
 	}
 	*databegin = '\0'; /* End the first line, and point msgbegin at start of data */
 	msgbegin = (databegin+1);
 
 	/*
-	 * First line of the message is a list of numbers, telling 
-	 * us the size of each of the individual messages we got from 
+	 * First line of the message is a list of numbers, telling
+	 * us the size of each of the individual messages we got from
 	 * the client, and how long ago they were received.
 	 */
-	mptr = strtok(STRBUF(conn->msgbuf), " \t");
+	mptr = strtok(STRBUF(data), " \t");
 	while (mptr) {
 		int msgbytes, msgago;
 		char savech;
 		strbuffer_t *req;
+		char *zmsgtype;
 
 		if (sscanf(mptr, "%d:%d", &msgbytes, &msgago) == 2) {
 			msgbytes = atoi(mptr);
-			if ((msgbytes <= 0) || ((msgbegin + msgbytes) - STRBUF(conn->msgbuf)) > STRBUFLEN(conn->msgbuf)) {
+			if ((msgbytes <= 0) || ((msgbegin + msgbytes) - STRBUF(data)) > STRBUFLEN(data)) {
 				/* Someone is playing games with us */
 				errprintf("Invalid message data from %s (req %lu): Current offset %d, msgbytes %d, msglen %d\n",
 					  addrstring(&conn->caddr, 1), conn->seq,
-					  (msgbegin - STRBUF(conn->msgbuf)), msgbytes, STRBUFLEN(conn->msgbuf));
-				return;
+					  (msgbegin - STRBUF(data)), msgbytes, STRBUFLEN(data));
+				break;
 			}
 
 			savech = *(msgbegin + msgbytes);
 			*(msgbegin + msgbytes) = '\0';
 			req = newstrbuffer(msgbytes+100);
-			addtobuffer(req, msgbegin);
+			addtobufferraw(req, msgbegin, msgbytes);
+			stat_msgs++;
+			conn->client->msgcount++;
 
-			if (strncmp(msgbegin, "client ", 7) == 0) {
+			/* Compressed messages are passed on as-is, with our additions after the compressed data */
+			zmsgtype = compressed_type(msgbegin);
+
+			if ((strncmp(msgbegin, "client ", 7) == 0) || (strcmp(zmsgtype, "client") == 0)) {
 				/*
 				 * It's a client message. See when it was received in
 				 * msgcache, and adjust our next poll time accordingly.
@@ -290,21 +613,42 @@ void process_clientdata(conn_t *conn)
 
 				/* Add a section to the client message with cache delay info */
 				snprintf(msgcachesection, sizeof(msgcachesection),
-					 "[msgcache]\nCachedelay: %d\n[proxy]\nClientIP:%s", 
+					 "%s[msgcache]\nCachedelay: %d\n[proxy]\nClientIP:%s",
+					 (*zmsgtype ? "\n" : ""),
 					 msgago, addrstring(&conn->caddr, 0));
 				addtobuffer(req, msgcachesection);
 			}
 			else if ( (strncmp(msgbegin, "status", 6) == 0) ||
-				  (strncmp(msgbegin, "data", 4) == 0) ) {
+				  (strncmp(msgbegin, "data", 4) == 0) ||
+				  (strcmp(zmsgtype, "status") == 0) || (strcmp(zmsgtype, "data") == 0) ) {
 				char sourcemsg[100];
 
 				/* Add a line to the message showing where it came from */
-				sprintf(sourcemsg, "\nStatus message received from %s\n", 
+				sprintf(sourcemsg, "\nStatus message received from %s\n",
 					addrstring(&conn->caddr, 0));
 				addtobuffer(req, sourcemsg);
+
+				if ((*zmsgtype == '\0') && (strncmp(msgbegin, "status", 6) == 0)) {
+					/* Plain status messages go into a combo message */
+					if (combo && ((STRBUFLEN(combo) + STRBUFLEN(req) + 2) > combomaxsize)) {
+						flush_combo(&combo, &combocount, conn->client);
+					}
+
+					if (!combo) {
+						combo = newstrbuffer(STRBUFLEN(req) + 1024);
+						addtobuffer(combo, "combo\n");
+					}
+					else {
+						addtobuffer(combo, "\n\n");
+					}
+					addtostrbuffer(combo, req);
+					combocount++;
+					freestrbuffer(req);
+					req = NULL;
+				}
 			}
 
-			addrequest(C_SERVER, serverip, portnum, req, conn->client);
+			if (req) addrequest(C_SERVER, serverip, portnum, req, conn->client);
 
 			*(msgbegin + msgbytes) = savech;
 
@@ -317,6 +661,8 @@ void process_clientdata(conn_t *conn)
 			mptr = NULL;
 		}
 	}
+
+	flush_combo(&combo, &combocount, conn->client);
 }
 
 void process_serverdata(conn_t *conn)
@@ -336,46 +682,193 @@ void process_serverdata(conn_t *conn)
 
 		if (conn->client->clientdata) xfree(conn->client->clientdata);
 		conn->client->clientdata = grabstrbuffer(conn->msgbuf);
+		conn->client->cfgsent = 0;
 		conn->msgbuf = NULL;
-		dbgprintf("Client data for %s (req %lu): %s\n", conn->client->hostname, conn->seq, 
+		dbgprintf("Client data for %s (req %lu): %s\n", conn->client->hostname, conn->seq,
 			(conn->client->clientdata ? conn->client->clientdata : "<Null>"));
 	}
 }
 
+void set_polltime(clients_t *client)
+{
+	time_t now = gettimer();
+
+	if ((client->suggestpoll > now) && (client->suggestpoll < (now + pollinterval))) {
+		/*
+		 * We have a suggested poll time tuned to the next "client" message,
+		 * and it happens within a reasonable time. So use that.
+		 */
+		client->nextpoll = client->suggestpoll;
+		client->suggestpoll = 0;
+		dbgprintf("Next poll of %s in %d seconds (for client msg)\n",
+			client->hostname, (client->nextpoll - now));
+	}
+	else {
+		/*
+		 * Pick a reasonable next polltime.
+		 * We try to avoid doing all polls in one go, by setting
+		 * the next poll to "pollinterval" seconds from now,
+		 * +/- 15 seconds.
+		 */
+		int delay;
+
+		delay = pollinterval + ((random() % 31) - 16);
+		client->nextpoll = now + delay;
+		dbgprintf("Next poll of %s in %d seconds\n", client->hostname, delay);
+	}
+
+	if (whentoqueue > client->nextpoll) {
+		whentoqueue = client->nextpoll;
+	}
+}
+
+unsigned long fetch_done(clients_t *client, int backlog)
+{
+	/* Update the fetch statistics for a client */
+	struct timespec tnow;
+	unsigned long usecs;
+
+	getntimer(&tnow);
+	usecs = (tnow.tv_sec - client->fetchstart.tv_sec)*1000000 + (tnow.tv_nsec - client->fetchstart.tv_nsec)/1000;
+	client->fetchcount++;
+	client->usecstotal += usecs;
+	client->usecslast = usecs;
+	if (usecs > client->usecsmax) client->usecsmax = usecs;
+	client->backlog = backlog;
+	client->lastfetch = tnow.tv_sec;
+	stat_fetches++;
+
+	return usecs;
+}
+
+void process_sessiondata(conn_t *conn)
+{
+	/*
+	 * Handle data from a msgcache session. First msgcache tells us it
+	 * accepts the session; after that each "fetch" gets a response with
+	 * a header line, followed by the messages in the same format as the
+	 * response to a plain "pullclient" request:
+	 *    batch LASTSEQ BACKLOG LENGTH
+	 */
+	clients_t *client = conn->client;
+	char *eoln;
+	unsigned long lastseq;
+	int backlog, datalen, hdrlen;
+	strbuffer_t *data;
+	unsigned long usecs;
+
+	eoln = memchr(STRBUF(conn->msgbuf), '\n', STRBUFLEN(conn->msgbuf));
+	if (!eoln) return;	/* Need more data */
+
+	if (conn->session == S_OPENING) {
+		if (strncmp(STRBUF(conn->msgbuf), "session ok\n", 11) != 0) {
+			errprintf("Unexpected session response from %s (req %lu)\n", addrstring(&conn->caddr, 1), conn->seq);
+			abort_conn(conn);
+			return;
+		}
+
+		dbgprintf("Session with %s opened (req %lu)\n", client->hostname, conn->seq);
+		conn->session = S_OPEN;
+		stat_sessions++;
+		client->cfgsent = 0;
+		client->fetchedseq = client->ackedseq = 0;
+		start_fetch(client);
+		return;
+	}
+
+	if ((sscanf(STRBUF(conn->msgbuf), "batch %lu %d %d", &lastseq, &backlog, &datalen) != 3) ||
+	    (datalen < 0) || (datalen > BATCH_MAXSIZE)) {
+		errprintf("Garbled session response from %s (req %lu)\n", addrstring(&conn->caddr, 1), conn->seq);
+		abort_conn(conn);
+		return;
+	}
+
+	hdrlen = (eoln - STRBUF(conn->msgbuf)) + 1;
+	if (datalen > (STRBUFLEN(conn->msgbuf) - hdrlen)) return;	/* Need more data */
+
+	/* Got the full batch */
+	usecs = fetch_done(client, backlog);
+	dbgprintf("Got batch from %s (req %lu): Last seq %lu, %d bytes, %d messages left, %lu usecs\n",
+		  client->hostname, conn->seq, lastseq, datalen, backlog, usecs);
+
+	data = newstrbuffer(datalen+1);
+	addtobufferraw(data, STRBUF(conn->msgbuf) + hdrlen, datalen);
+	clearstrbuffer(conn->msgbuf);
+	conn->action = C_IDLE;
+
+	if (lastseq > client->fetchedseq) {
+		client->fetchedseq = lastseq;
+		process_clientdata(conn, data);
+	}
+	freestrbuffer(data);
+
+	if (backlog > 0) {
+		/* msgcache has more for us, so get it right away while these messages go to xymond */
+		start_fetch(client);
+	}
+	else {
+		client->busy = 0;
+		set_polltime(client);
+		send_ack(client);
+	}
+}
+
 void grabdata(conn_t *conn)
 {
 	int n;
-	char buf[8192];
+	char buf[16384];
 
 	/* Read data from a peer connection (client or server) */
         n = read(conn->sockfd, buf, sizeof(buf)-1);
 	if (n == -1) {
 		/* Read failure */
-		time_t now = gettimer();
+		time_t now;
+
+		if ((errno == EAGAIN) || (errno == EINTR)) return;
+
+		now = gettimer();
 		if (debug || (conn->client->nexterrortxt < now)) {
-			errprintf("Connection lost during read from %s (req %lu): %s\n", 
+			errprintf("Connection lost during read from %s (req %lu): %s\n",
 				  addrstring(&conn->caddr, 1), conn->seq, strerror(errno));
 			conn->client->nexterrortxt = now + errorloginterval;
 		}
-		flag_cleanup(conn);
+		flag_failure(conn);
 	}
 	else if (n > 0) {
 		/* Save the data */
-		dbgprintf("Got %d bytes of data from %s (req %lu)\n", 
+		dbgprintf("Got %d bytes of data from %s (req %lu)\n",
 			n, addrstring(&conn->caddr, 1), conn->seq);
 		buf[n] = '\0';
-		addtobuffer(conn->msgbuf, buf);
+		addtobufferraw(conn->msgbuf, buf, n);
+
+		if (conn->session != S_NONE) {
+			if (conn->action == C_IDLE) {
+				errprintf("Unexpected data on idle session from %s (req %lu)\n", addrstring(&conn->caddr, 1), conn->seq);
+				abort_conn(conn);
+			}
+			else {
+				process_sessiondata(conn);
+			}
+		}
 	}
 	else if (n == 0) {
+		if (conn->session != S_NONE) {
+			/* msgcache closed the session */
+			dbgprintf("Session closed by %s (req %lu)\n", addrstring(&conn->caddr, 1), conn->seq);
+			flag_failure(conn);
+			return;
+		}
+
 		/* Done reading. Process the data. */
-		dbgprintf("Done reading data from %s (req %lu)\n", 
+		dbgprintf("Done reading data from %s (req %lu)\n",
 			addrstring(&conn->caddr, 1), conn->seq);
 		shutdown(conn->sockfd, SHUT_RDWR);
 		flag_cleanup(conn);
 
 		switch (conn->ctype) {
 		  case C_CLIENT:
-			process_clientdata(conn);
+			fetch_done(conn->client, 0);
+			process_clientdata(conn, conn->msgbuf);
 			break;
 
 		  case C_SERVER:
@@ -385,37 +878,171 @@ void grabdata(conn_t *conn)
 	}
 }
 
-void set_polltime(clients_t *client)
+void poll_client(clients_t *client, time_t now)
 {
-	time_t now = gettimer();
+	void *hostwalk;
+	char msgline[100];
+	strbuffer_t *request;
+	char *pullstr, *ip;
+	int port;
 
-	if ((client->suggestpoll > now) && (client->suggestpoll < (now + pollinterval))) {
-		/*
-		 * We have a suggested poll time tuned to the next "client" message,
-		 * and it happens within a reasonable time. So use that.
-		 */
-		client->nextpoll = client->suggestpoll;
-		client->suggestpoll = 0;
-		dbgprintf("Next poll of %s in %d seconds (for client msg)\n", 
-			client->hostname, (client->nextpoll - now));
+	if (client->session && (client->session->session == S_OPEN)) {
+		if (client->session->action == C_IDLE) start_fetch(client);
+		return;
+	}
+
+	/* Deleted hosts stay in our tree - but should disappear from the known hosts */
+	hostwalk = hostinfo(client->hostname); if (!hostwalk) return;
+	pullstr = xmh_item(hostwalk, XMH_FLAG_PULLDATA); if (!pullstr) return;
+
+	ip = strchr(pullstr, '=');
+	port = atoi(xgetenv("XYMONDPORT"));
+
+	if (!ip) {
+		ip = strdup(xmh_item(hostwalk, XMH_IP));
+	}
+	else {
+		/* There is an explicit IP setting in the pulldata tag */
+		char *p;
+
+		ip++; /* Skip the '=' */
+		ip = strdup(ip);
+		p = strchr(ip, ':');
+		if (p) { *p = '\0'; port = atoi(p+1); }
+
+		if (*ip == '\0') {
+			/* No IP given, just a port number */
+			xfree(ip);
+			ip = strdup(xmh_item(hostwalk, XMH_IP));
+		}
+	}
+
+	if (strcmp(ip, "0.0.0.0") == 0) {
+		struct hostent *hent;
+
+		xfree(ip); ip = NULL;
+		hent = gethostbyname(client->hostname);
+		if (hent) {
+			struct in_addr addr;
+
+			memcpy(&addr, *(hent->h_addr_list), sizeof(addr));
+			ip = strdup(inet_ntoa(addr));
+		}
+	}
+
+	if (!ip) return;
+
+	request = newstrbuffer(0);
+	if (usesessions && (client->nextsession <= now)) {
+		/* Try to open a session with msgcache. We get our data once it has accepted. */
+		conn_t *conn;
+
+		sprintf(msgline, "pullclient %d session\n", serverid);
+		addtobuffer(request, msgline);
+		conn = addrequest(C_CLIENT, ip, port, request, client);
+		conn->session = S_OPENING;
+		conn->expectreply = 1;
+		if (conn->action != C_CLEANUP) client->session = conn;
+		getntimer(&client->fetchstart);
 	}
 	else {
 		/*
-		 * Pick a reasonable next polltime.
-		 * We try to avoid doing all polls in one go, by setting
-		 * the next poll to "pollinterval" seconds from now, 
-		 * +/- 15 seconds.
+		 * Build the "pullclient" request, which includes the latest
+		 * clientdata config we got from the server. Keep the clientdata
+		 * here - we send "pullclient" requests more often that we actually
+		 * contact the server, but we should provide the config data always.
 		 */
-		int delay;
+		sprintf(msgline, "pullclient %d\n", serverid);
+		addtobuffer(request, msgline);
+		if (client->clientdata) addtobuffer(request, client->clientdata);
 
-		delay = pollinterval + ((random() % 31) - 16);
-		client->nextpoll = now + delay;
-		dbgprintf("Next poll of %s in %d seconds\n", client->hostname, delay);
+		/* Put the request on the connection queue */
+		addrequest(C_CLIENT, ip, port, request, client);
+		getntimer(&client->fetchstart);
 	}
+	client->busy = 1;
 
-	if (whentoqueue > client->nextpoll) {
-		whentoqueue = client->nextpoll;
+	xfree(ip);
+}
+
+int client_compare(const void *v1, const void *v2)
+{
+	clients_t **c1 = (clients_t **)v1;
+	clients_t **c2 = (clients_t **)v2;
+	unsigned long avg1 = ((*c1)->fetchcount ? ((*c1)->usecstotal / (*c1)->fetchcount) : 0);
+	unsigned long avg2 = ((*c2)->fetchcount ? ((*c2)->usecstotal / (*c2)->fetchcount) : 0);
+
+	if ((*c1)->backlog != (*c2)->backlog) return ((*c1)->backlog > (*c2)->backlog) ? -1 : 1;
+	if (avg1 != avg2) return (avg1 > avg2) ? -1 : 1;
+	return strcmp((*c1)->hostname, (*c2)->hostname);
+}
+
+void client_report(strbuffer_t *buf, int maxclients)
+{
+	/* Per-client fetch latency and backlog, the clients with the largest backlog and slowest fetches first */
+	xtreePos_t handle;
+	clients_t **ctab;
+	int ccount = 0, i;
+	char line[1024];
+	time_t now = gettimer();
+
+	for (handle = xtreeFirst(clients); (handle != xtreeEnd(clients)); handle = xtreeNext(clients, handle)) ccount++;
+	if (ccount == 0) return;
+
+	ctab = (clients_t **)malloc(ccount * sizeof(clients_t *));
+	for (handle = xtreeFirst(clients), i = 0; (handle != xtreeEnd(clients)); handle = xtreeNext(clients, handle)) {
+		ctab[i++] = (clients_t *)xtreeData(clients, handle);
 	}
+	qsort(ctab, ccount, sizeof(clients_t *), client_compare);
+
+	addtobuffer(buf, "\nHost                              Mode     Fetches   Messages  Backlog  Last(ms)   Avg(ms)   Max(ms)  Last fetch\n");
+	for (i = 0; ((i < ccount) && ((maxclients == 0) || (i < maxclients))); i++) {
+		clients_t *c = ctab[i];
+
+		snprintf(line, sizeof(line), "%-32s  %-7s  %7lu  %9lu  %7d  %8lu  %8lu  %8lu  %ld secs ago\n",
+			 c->hostname,
+			 ((c->session && (c->session->session == S_OPEN)) ? "session" : "poll"),
+			 c->fetchcount, c->msgcount, c->backlog,
+			 c->usecslast / 1000, (c->fetchcount ? (c->usecstotal / c->fetchcount / 1000) : 0), c->usecsmax / 1000,
+			 (c->lastfetch ? (long)(now - c->lastfetch) : -1L));
+		addtobuffer(buf, line);
+	}
+	if (i < ccount) {
+		snprintf(line, sizeof(line), "... and %d more\n", ccount - i);
+		addtobuffer(buf, line);
+	}
+
+	xfree(ctab);
+}
+
+void send_report(time_t elapsed)
+{
+	strbuffer_t *msg;
+	char line[4096];
+	int sessioncount = 0, clientcount = 0;
+	xtreePos_t handle;
+
+	for (handle = xtreeFirst(clients); (handle != xtreeEnd(clients)); handle = xtreeNext(clients, handle)) {
+		clients_t *c = (clients_t *)xtreeData(clients, handle);
+
+		clientcount++;
+		if (c->session && (c->session->session == S_OPEN)) sessioncount++;
+	}
+
+	init_timestamp();
+	msg = newstrbuffer(0);
+	snprintf(line, sizeof(line),
+		 "status %s.%s %s %s\n\nxymonfetch statistics for the last %ld seconds\n\nClients                  : %8d\nOpen sessions            : %8d\nSessions opened          : %8lu\nSessions lost            : %8lu\nFetches                  : %8lu\nMessages fetched         : %8lu\nRequests to xymond       : %8lu\n  Failed                 : %8lu\n  Combo messages         : %8lu\n",
+		 xgetenv("MACHINE"), reportcolumn, colorname(stat_serverfail ? COL_YELLOW : COL_GREEN), timestamp,
+		 (long)elapsed, clientcount, sessioncount, stat_sessions, stat_sessionlost,
+		 stat_fetches, stat_msgs, stat_servermsgs, stat_serverfail, stat_combos);
+	addtobuffer(msg, line);
+	client_report(msg, 200);
+
+	addrequest(C_SERVER, serverip, atoi(xgetenv("XYMONDPORT")), msg, &selfclient);
+
+	stat_fetches = stat_msgs = stat_combos = stat_servermsgs = stat_serverfail = 0;
+	stat_sessions = stat_sessionlost = 0;
 }
 
 int main(int argc, char *argv[])
@@ -423,7 +1050,7 @@ int main(int argc, char *argv[])
 	int argi;
 	struct sigaction sa;
 	void *hostwalk;
-	time_t nexttimeout;
+	time_t nexttimeout, nextreport;
 
 	for (argi=1; (argi < argc); argi++) {
 		if (argnmatch(argv[argi], "--server=")) {
@@ -442,6 +1069,21 @@ int main(int argc, char *argv[])
 			char *p = strchr(argv[argi], '=');
 			serverid = atoi(p+1);
 		}
+		else if (strcmp(argv[argi], "--no-sessions") == 0) {
+			usesessions = 0;
+		}
+		else if (argnmatch(argv[argi], "--session-timeout=")) {
+			char *p = strchr(argv[argi], '=');
+			sessiontimeout = atoi(p+1);
+		}
+		else if (argnmatch(argv[argi], "--combo-size=")) {
+			char *p = strchr(argv[argi], '=');
+			combomaxsize = 1024*atoi(p+1);
+		}
+		else if (argnmatch(argv[argi], "--report=") || (strcmp(argv[argi], "--report") == 0)) {
+			char *p = strchr(argv[argi], '=');
+			reportcolumn = (p ? strdup(p+1) : "xymonfetch");
+		}
 		else if (strcmp(argv[argi], "--debug") == 0) {
 			debug = 1;
 		}
@@ -453,9 +1095,12 @@ int main(int argc, char *argv[])
 	sigaction(SIGHUP, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SIGUSR1, &sa, NULL);	/* SIGUSR1 triggers logging of active requests */
+	signal(SIGPIPE, SIG_IGN);	/* A msgcache session can be closed while we write to it */
 
+	io_init();
 	clients = xtreeNew(strcasecmp);
-	nexttimeout = gettimer() + 60;
+	nexttimeout = gettimer() + 1;
+	nextreport = gettimer() + reportinterval;
 
 	{
 		/* Seed the random number generator */
@@ -469,11 +1114,9 @@ int main(int argc, char *argv[])
 	do {
 		xtreePos_t handle;
 		conn_t *connwalk, *cprev;
-		fd_set fdread, fdwrite;
-		int n, maxfd;
-		struct timeval tmo;
+		int n;
 		time_t now;
-		
+
 		now = gettimer();
 		if (now > reloadtime) {
 			/* Time to reload the hosts.cfg file */
@@ -495,21 +1138,44 @@ int main(int argc, char *argv[])
 					whentoqueue = now;
 				}
 			}
+
+			/* Close idle sessions with hosts that are no longer pulled from */
+			for (handle = xtreeFirst(clients); (handle != xtreeEnd(clients)); handle = xtreeNext(clients, handle)) {
+				clients_t *c = (clients_t *)xtreeData(clients, handle);
+
+				if (!c->session || (c->session->action != C_IDLE)) continue;
+
+				hostwalk = hostinfo(c->hostname);
+				if (!hostwalk || !xmh_item(hostwalk, XMH_FLAG_PULLDATA)) {
+					dbgprintf("Closing session with %s, no longer in hosts.cfg\n", c->hostname);
+					flag_cleanup(c->session);
+				}
+			}
 		}
 
 		now = gettimer();
-		if (now > nexttimeout) {
-			/* Check for connections that have timed out */
-			nexttimeout = now + 60;
+		if (now >= nexttimeout) {
+			/* Check for connections that have timed out. Idle sessions do not time out. */
+			nexttimeout = now + 1;
 
 			for (connwalk = chead; (connwalk); connwalk = connwalk->next) {
-				if ((connwalk->tstamp + 60) < now) {
+				if ((connwalk->action == C_IDLE) || (connwalk->action == C_CLEANUP)) continue;
+
+				if ((connwalk->session == S_OPENING) && ((connwalk->tstamp + sessiontimeout) < now)) {
+					/* An older msgcache that does not do sessions. Poll it the old way. */
+					dbgprintf("msgcache on %s does not accept sessions (req %lu)\n",
+						  connwalk->client->hostname, connwalk->seq);
+					connwalk->client->nextsession = now + SESSION_RETRY;
+					connwalk->retrynow = 1;
+					abort_conn(connwalk);
+				}
+				else if ((connwalk->tstamp + 60) < now) {
 					if (debug || (connwalk->client->nexterrortxt < now)) {
 						errprintf("Timeout while talking to %s (req %lu): Aborting session\n",
 							  addrstring(&connwalk->caddr, 1), connwalk->seq);
 						connwalk->client->nexterrortxt = now + errorloginterval;
 					}
-					flag_cleanup(connwalk);
+					abort_conn(connwalk);
 				}
 			}
 		}
@@ -523,24 +1189,61 @@ int main(int argc, char *argv[])
 			while (connwalk) {
 				conn_t *zombie;
 
-				if ((connwalk->action == C_READING) || (connwalk->action == C_WRITING)) {
+				if (connwalk->action != C_CLEANUP) {
 					/* Active connection - skip to the next conn_t record */
 					cprev = connwalk;
 					connwalk = connwalk->next;
 					continue;
 				}
 
-				if (connwalk->action == C_CLEANUP) {
-					if (connwalk->ctype == C_CLIENT) {
-						/* 
-						 * Finished getting data from a client, 
-						 * flag idle and set next poll time.
-						 */
-						connwalk->client->busy = 0;
-						set_polltime(connwalk->client);
+				if (connwalk->ctype == C_CLIENT) {
+					clients_t *client = connwalk->client;
+
+					if (client->session == connwalk) {
+						/* The session has ended. Unacknowledged messages will be sent again in the next session */
+						client->session = NULL;
+						if (connwalk->session == S_OPEN) stat_sessionlost++;
+					}
+
+					/*
+					 * Finished getting data from a client,
+					 * flag idle and set next poll time.
+					 */
+					client->busy = 0;
+					if (connwalk->retrynow) {
+						client->nextpoll = gettimer();
+						whentoqueue = client->nextpoll;
+					}
+					else if ((connwalk->session == S_NONE) || connwalk->failed || (client->nextpoll <= gettimer())) {
+						set_polltime(client);
+					}
+				}
+				else if (connwalk->ctype == C_SERVER) {
+					clients_t *client = connwalk->client;
+
+					client->fwdpending--;
+					if (connwalk->failed) {
+						client->fwdfailed = 1;
+						stat_serverfail++;
 					}
-					else if (connwalk->ctype == C_SERVER) {
-						/* Nothing needed for server cleanups */
+
+					if (client->fwdpending == 0) {
+						if (client->fwdfailed) {
+							/*
+							 * Some messages could not be delivered. Drop the session,
+							 * so msgcache will send them again the next time.
+							 */
+							client->fwdfailed = 0;
+							if (client->session && (client->session->session == S_OPEN)) {
+								errprintf("Could not deliver all messages from %s to xymond, will fetch them again\n",
+									  client->hostname);
+								abort_conn(client->session);
+								needcleanup = 1;
+							}
+						}
+						else {
+							send_ack(client);
+						}
 					}
 				}
 
@@ -557,11 +1260,11 @@ int main(int argc, char *argv[])
 				}
 
 				/* Purge the zombie */
-				dbgprintf("Request completed: req %lu, peer %s, action was %d, type was %d\n", 
-					zombie->seq, addrstring(&zombie->caddr, 1), 
+				dbgprintf("Request completed: req %lu, peer %s, action was %d, type was %d\n",
+					zombie->seq, addrstring(&zombie->caddr, 1),
 					zombie->action, zombie->ctype);
-				close(zombie->sockfd);
-				freestrbuffer(zombie->msgbuf);
+				if (zombie->sockfd >= 0) io_close(zombie->sockfd);
+				if (zombie->msgbuf) freestrbuffer(zombie->msgbuf);
 				xfree(zombie);
 			}
 
@@ -571,20 +1274,23 @@ int main(int argc, char *argv[])
 		}
 
 		if (dumpsessions) {
-			/* Set by SIGUSR1 - dump the list of active requests */
+			/* Set by SIGUSR1 - dump the list of active requests, and the client statistics */
+			strbuffer_t *creport = newstrbuffer(0);
+
 			dumpsessions = 0;
 			for (connwalk = chead; (connwalk); connwalk = connwalk->next) {
-				char *ctypestr, *actionstr;
+				char *ctypestr = "", *actionstr = "";
 				char timestr[30];
 
 				switch (connwalk->ctype) {
-				  case C_CLIENT: ctypestr = "client"; break;
+				  case C_CLIENT: ctypestr = ((connwalk->session == S_NONE) ? "client" : "session"); break;
 				  case C_SERVER: ctypestr = "server"; break;
 				}
 
 				switch (connwalk->action) {
 				  case C_READING: actionstr = "reading"; break;
 				  case C_WRITING: actionstr = "writing"; break;
+				  case C_IDLE:    actionstr = "idle"; break;
 				  case C_CLEANUP: actionstr = "cleanup"; break;
 				}
 
@@ -595,96 +1301,42 @@ int main(int argc, char *argv[])
 					  connwalk->seq, ctypestr, actionstr, addrstring(&connwalk->caddr, 1),
 					  timestr, (now - connwalk->tstamp));
 			}
+
+			client_report(creport, 0);
+			errprintf("Client statistics:%s", STRBUF(creport));
+			freestrbuffer(creport);
 		}
 
 		now = gettimer();
+		if (reportcolumn && (now >= nextreport)) {
+			send_report(now - nextreport + reportinterval);
+			nextreport = now + reportinterval;
+		}
+
 		if (now >= whentoqueue) {
 			/* Scan host-tree for clients we need to contact */
 			for (handle = xtreeFirst(clients); (handle != xtreeEnd(clients)); handle = xtreeNext(clients, handle)) {
 				clients_t *clientwalk;
-				char msgline[100];
-				strbuffer_t *request;
-				char *pullstr, *ip;
-				int port;
 
 				clientwalk = (clients_t *)xtreeData(clients, handle);
 				if (clientwalk->busy) continue;
 				if (clientwalk->nextpoll > now) continue;
 
-				/* Deleted hosts stay in our tree - but should disappear from the known hosts */
-				hostwalk = hostinfo(clientwalk->hostname); if (!hostwalk) continue;
-				pullstr = xmh_item(hostwalk, XMH_FLAG_PULLDATA); if (!pullstr) continue;
-
-				ip = strchr(pullstr, '=');
-				port = atoi(xgetenv("XYMONDPORT"));
-
-				if (!ip) {
-					ip = strdup(xmh_item(hostwalk, XMH_IP));
-				}
-				else {
-					/* There is an explicit IP setting in the pulldata tag */
-					char *p;
-
-					ip++; /* Skip the '=' */
-					ip = strdup(ip);
-					p = strchr(ip, ':');
-					if (p) { *p = '\0'; port = atoi(p+1); }
-
-					if (*ip == '\0') {
-						/* No IP given, just a port number */
-						xfree(ip);
-						ip = strdup(xmh_item(hostwalk, XMH_IP));
-					}
-				}
-
-				if (strcmp(ip, "0.0.0.0") == 0) {
-					struct hostent *hent;
-
-					xfree(ip); ip = NULL;
-					hent = gethostbyname(clientwalk->hostname);
-					if (hent) {
-						struct in_addr addr;
-
-						memcpy(&addr, *(hent->h_addr_list), sizeof(addr));
-						ip = strdup(inet_ntoa(addr));
-					}
-				}
-
-				if (!ip) continue;
-
-				/* 
-				 * Build the "pullclient" request, which includes the latest
-				 * clientdata config we got from the server. Keep the clientdata
-				 * here - we send "pullclient" requests more often that we actually
-				 * contact the server, but we should provide the config data always.
-				 */
-				request = newstrbuffer(0);
-				sprintf(msgline, "pullclient %d\n", serverid);
-				addtobuffer(request, msgline);
-				if (clientwalk->clientdata) addtobuffer(request, clientwalk->clientdata);
-
-				/* Put the request on the connection queue */
-				addrequest(C_CLIENT, ip, port, request, clientwalk);
-				clientwalk->busy = 1;
-
-				xfree(ip);
+				poll_client(clientwalk, now);
 			}
 		}
 
 		/* Handle request queue */
-		FD_ZERO(&fdread);
-		FD_ZERO(&fdwrite);
-		maxfd = -1;
+		io_start();
 		for (connwalk = chead; (connwalk); connwalk = connwalk->next) {
 			switch (connwalk->action) {
-			  case C_READING: 
-				FD_SET(connwalk->sockfd, &fdread);
-				if (connwalk->sockfd > maxfd) maxfd = connwalk->sockfd;
+			  case C_READING:
+			  case C_IDLE:
+				io_want(connwalk->sockfd, IO_READ);
 				break;
 
-			  case C_WRITING: 
-				FD_SET(connwalk->sockfd, &fdwrite);
-				if (connwalk->sockfd > maxfd) maxfd = connwalk->sockfd;
+			  case C_WRITING:
+				io_want(connwalk->sockfd, IO_WRITE);
 				break;
 
 			  case C_CLEANUP:
@@ -692,10 +1344,8 @@ int main(int argc, char *argv[])
 			}
 		}
 
-		/* Do select with a 1 second timeout */
-		tmo.tv_sec = 1;
-		tmo.tv_usec = 0;
-		n = select(maxfd+1, &fdread, &fdwrite, NULL, &tmo);
+		/* Wait with a 1 second timeout */
+		n = io_wait(1000);
 
 		if (n == -1) {
 			if (errno == EINTR) continue;	/* Interrupted, e.g. a SIGHUP */
@@ -709,12 +1359,13 @@ int main(int argc, char *argv[])
 
 		for (connwalk = chead; (connwalk); connwalk = connwalk->next) {
 			switch (connwalk->action) {
-			  case C_READING: 
-				if (FD_ISSET(connwalk->sockfd, &fdread)) grabdata(connwalk);
+			  case C_READING:
+			  case C_IDLE:
+				if (io_ready(connwalk->sockfd, IO_READ)) grabdata(connwalk);
 				break;
 
-			  case C_WRITING: 
-				if (FD_ISSET(connwalk->sockfd, &fdwrite)) senddata(connwalk);
+			  case C_WRITING:
+				if (io_ready(connwalk->sockfd, IO_WRITE)) senddata(connwalk);
 				break;
 
 			  case C_CLEANUP:
@@ -726,4 +1377,3 @@ int main(int argc, char *argv[])
 
 	return 0;
 }
-
@@ -57,6 +57,8 @@ unsigned int tcp_stats_total    = 0;
 unsigned int tcp_stats_http     = 0;
 unsigned int tcp_stats_plain    = 0;
 unsigned int tcp_stats_connects = 0;
+unsigned int tcp_stats_reused   = 0;
+unsigned int tcp_stats_resumed  = 0;
 unsigned long tcp_stats_read    = 0;
 unsigned long tcp_stats_written = 0;
 unsigned int warnbytesread = 0;
@@ -64,6 +66,7 @@ unsigned int warnbytesread = 0;
 static tcptest_t *thead = NULL;
 
 int shuffletests = 0;
+int httpkeepalive = 1;
 
 static svcinfo_t svcinfo_http  = { "http", NULL, 0, NULL, 0, 0, (TCP_GET_BANNER|TCP_HTTP), 80 };
 static svcinfo_t svcinfo_https = { "https", NULL, 0, NULL, 0, 0, (TCP_GET_BANNER|TCP_HTTP|TCP_SSL), 443 };
@@ -208,6 +211,13 @@ tcptest_t *add_tcp_test(char *ip, int port, char *service, ssloptions_t *sslopt,
 	newtest->certexpires = 0;
 	newtest->sslrunning = ((newtest->svcinfo->flags & TCP_SSL) ? SSLSETUP_PENDING : 0);
 	newtest->sslagain = 0;
+	newtest->sslname = NULL;
+
+	newtest->reusekey = NULL;
+	newtest->reusable = 0;
+	newtest->reused = 0;
+	newtest->skipround = 0;
+	newtest->reuseq = NULL;
 
 	newtest->banner = NULL;
 	newtest->bannerbytes = 0;
@@ -341,6 +351,10 @@ static int socket_read(tcptest_t *item, unsigned char *inbuf, int inbufsize)
 	return n;
 }
 
+static void socket_drop(tcptest_t *item)
+{
+}
+
 static void socket_shutdown(tcptest_t *item)
 {
 	shutdown(item->fd, SHUT_RDWR);
@@ -392,6 +406,157 @@ static int cert_password_cb(char *buf, int size, int rwflag, void *userdata)
 	return strlen(buf);
 }
 
+/*
+ * The SSL contexts are shared by all tests using the same SSL options.
+ * The sessions from completed connections are saved, so the next 
+ * connection to the same server can resume the session instead of
+ * doing a full handshake.
+ */
+typedef struct sslcontext_t {
+	int sslversion;
+	char *cipherlist;
+	char *clientcert;
+	SSL_CTX *ctx;
+	struct sslcontext_t *next;
+} sslcontext_t;
+static sslcontext_t *sslcontexts = NULL;
+
+typedef struct sslsession_t {
+	char *key;			/* Context/IP:port/servername */
+	SSL_SESSION *session;
+} sslsession_t;
+static void *sslsessions = NULL;
+
+static int strsame(char *a, char *b)
+{
+	if (a && b) return (strcmp(a, b) == 0);
+	return (a == b);
+}
+
+static char *sslsession_key(tcptest_t *item)
+{
+	static char key[1024];
+
+	snprintf(key, sizeof(key), "%p/%s:%d/%s", (void *)item->sslctx,
+		 inet_ntoa(item->addr.sin_addr), ntohs(item->addr.sin_port), 
+		 (item->sslname ? item->sslname : ""));
+	return key;
+}
+
+static SSL_SESSION *find_sslsession(tcptest_t *item)
+{
+	xtreePos_t handle;
+
+	if (!sslsessions) return NULL;
+
+	handle = xtreeFind(sslsessions, sslsession_key(item));
+	if (handle == xtreeEnd(sslsessions)) return NULL;
+
+	return ((sslsession_t *)xtreeData(sslsessions, handle))->session;
+}
+
+static void save_sslsession(tcptest_t *item)
+{
+	xtreePos_t handle;
+	sslsession_t *rec;
+	SSL_SESSION *session;
+	char *key;
+
+	session = SSL_get1_session(item->ssldata);
+	if (!session) return;
+
+	if (!sslsessions) sslsessions = xtreeNew(strcmp);
+
+	key = sslsession_key(item);
+	handle = xtreeFind(sslsessions, key);
+	if (handle == xtreeEnd(sslsessions)) {
+		rec = (sslsession_t *)calloc(1, sizeof(sslsession_t));
+		rec->key = strdup(key);
+		xtreeAdd(sslsessions, rec->key, rec);
+	}
+	else {
+		rec = (sslsession_t *)xtreeData(sslsessions, handle);
+		if (rec->session) SSL_SESSION_free(rec->session);
+	}
+
+	rec->session = session;
+}
+
+static SSL_CTX *get_sslcontext(tcptest_t *item)
+{
+	sslcontext_t *walk;
+	SSL_CTX *ctx;
+
+	for (walk = sslcontexts; (walk); walk = walk->next) {
+		if ( (walk->sslversion == item->ssloptions->sslversion) &&
+		     strsame(walk->cipherlist, item->ssloptions->cipherlist) &&
+		     strsame(walk->clientcert, item->ssloptions->clientcert) ) return walk->ctx;
+	}
+
+	switch (item->ssloptions->sslversion) {
+	  case SSLVERSION_V2:
+		ctx = SSL_CTX_new(SSLv2_client_method()); break;
+	  case SSLVERSION_V3:
+		ctx = SSL_CTX_new(SSLv3_client_method()); break;
+	  case SSLVERSION_TLS1:
+		ctx = SSL_CTX_new(TLSv1_client_method()); break;
+	  default:
+		ctx = SSL_CTX_new(SSLv23_client_method()); break;
+	}
+
+	if (!ctx) {
+		char sslerrmsg[256];
+
+		ERR_error_string(ERR_get_error(), sslerrmsg);
+		errprintf("Cannot create SSL context - IP %s, service %s: %s\n", 
+			   inet_ntoa(item->addr.sin_addr), item->svcinfo->svcname, sslerrmsg);
+		return NULL;
+	}
+
+	/* Workaround SSL bugs */
+	SSL_CTX_set_options(ctx, SSL_OP_ALL);
+	SSL_CTX_set_quiet_shutdown(ctx, 1);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+
+	/* Limit set of ciphers, if user wants to */
+	if (item->ssloptions->cipherlist) 
+		SSL_CTX_set_cipher_list(ctx, item->ssloptions->cipherlist);
+
+	if (item->ssloptions->clientcert) {
+		int status;
+		char certfn[PATH_MAX];
+
+		SSL_CTX_set_default_passwd_cb(ctx, cert_password_cb);
+		SSL_CTX_set_default_passwd_cb_userdata(ctx, item);
+
+		sprintf(certfn, "%s/certs/%s", xgetenv("XYMONHOME"), item->ssloptions->clientcert);
+		status = SSL_CTX_use_certificate_chain_file(ctx, certfn);
+		if (status == 1) {
+			status = SSL_CTX_use_PrivateKey_file(ctx, certfn, SSL_FILETYPE_PEM);
+		}
+
+		if (status != 1) {
+			char sslerrmsg[256];
+
+			ERR_error_string(ERR_get_error(), sslerrmsg);
+			errprintf("Cannot load SSL client certificate/key %s: %s\n", 
+				  item->ssloptions->clientcert, sslerrmsg);
+			SSL_CTX_free(ctx);
+			return NULL;
+		}
+	}
+
+	walk = (sslcontext_t *)calloc(1, sizeof(sslcontext_t));
+	walk->sslversion = item->ssloptions->sslversion;
+	walk->cipherlist = item->ssloptions->cipherlist;
+	walk->clientcert = item->ssloptions->clientcert;
+	walk->ctx = ctx;
+	walk->next = sslcontexts;
+	sslcontexts = walk;
+
+	return ctx;
+}
+
 static char *xymon_ASN1_UTCTIME(ASN1_UTCTIME *tm)
 {
 	static char result[256];
@@ -477,60 +642,12 @@ static void setup_ssl(tcptest_t *item)
 	}
 
 	if (item->sslctx == NULL) {
-		switch (item->ssloptions->sslversion) {
-		  case SSLVERSION_V2:
-			item->sslctx = SSL_CTX_new(SSLv2_client_method()); break;
-		  case SSLVERSION_V3:
-			item->sslctx = SSL_CTX_new(SSLv3_client_method()); break;
-		  case SSLVERSION_TLS1:
-			item->sslctx = SSL_CTX_new(TLSv1_client_method()); break;
-		  default:
-			item->sslctx = SSL_CTX_new(SSLv23_client_method()); break;
-		}
-
+		item->sslctx = get_sslcontext(item);
 		if (!item->sslctx) {
-			char sslerrmsg[256];
-
-			ERR_error_string(ERR_get_error(), sslerrmsg);
-			errprintf("Cannot create SSL context - IP %s, service %s: %s\n", 
-				   inet_ntoa(item->addr.sin_addr), item->svcinfo->svcname, sslerrmsg);
 			item->sslrunning = 0;
 			item->errcode = CONTEST_ESSL;
 			return;
 		}
-
-		/* Workaround SSL bugs */
-		SSL_CTX_set_options(item->sslctx, SSL_OP_ALL);
-		SSL_CTX_set_quiet_shutdown(item->sslctx, 1);
-
-		/* Limit set of ciphers, if user wants to */
-		if (item->ssloptions->cipherlist) 
-			SSL_CTX_set_cipher_list(item->sslctx, item->ssloptions->cipherlist);
-
-		if (item->ssloptions->clientcert) {
-			int status;
-			char certfn[PATH_MAX];
-
-			SSL_CTX_set_default_passwd_cb(item->sslctx, cert_password_cb);
-			SSL_CTX_set_default_passwd_cb_userdata(item->sslctx, item);
-
-			sprintf(certfn, "%s/certs/%s", xgetenv("XYMONHOME"), item->ssloptions->clientcert);
-			status = SSL_CTX_use_certificate_chain_file(item->sslctx, certfn);
-			if (status == 1) {
-				status = SSL_CTX_use_PrivateKey_file(item->sslctx, certfn, SSL_FILETYPE_PEM);
-			}
-
-			if (status != 1) {
-				char sslerrmsg[256];
-
-				ERR_error_string(ERR_get_error(), sslerrmsg);
-				errprintf("Cannot load SSL client certificate/key %s: %s\n", 
-					  item->ssloptions->clientcert, sslerrmsg);
-				item->sslrunning = 0;
-				item->errcode = CONTEST_ESSL;
-				return;
-			}
-		}
 	}
 
 	if (item->ssldata == NULL) {
@@ -542,7 +659,6 @@ static void setup_ssl(tcptest_t *item)
 			errprintf("SSL_new failed - IP %s, service %s: %s\n", 
 				   inet_ntoa(item->addr.sin_addr), item->svcinfo->svcname, sslerrmsg);
 			item->sslrunning = 0;
-			SSL_CTX_free(item->sslctx);
 			item->errcode = CONTEST_ESSL;
 			return;
 		}
@@ -574,11 +690,21 @@ static void setup_ssl(tcptest_t *item)
 			errprintf("Could not initiate SSL on connection - IP %s, service %s: %s\n", 
 				   inet_ntoa(item->addr.sin_addr), item->svcinfo->svcname, sslerrmsg);
 			item->sslrunning = 0;
-			SSL_free(item->ssldata); 
-			SSL_CTX_free(item->sslctx);
+			SSL_free(item->ssldata); item->ssldata = NULL;
 			item->errcode = CONTEST_ESSL;
 			return;
 		}
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+		/* Tell the server which virtual host we want the certificate for */
+		if (item->sslname) SSL_set_tlsext_host_name(item->ssldata, item->sslname);
+#endif
+
+		/* Resume the session from an earlier connection to this server */
+		{
+			SSL_SESSION *session = find_sslsession(item);
+			if (session) SSL_set_session(item->ssldata, session);
+		}
 	}
 
 	sp = getservbyport(item->addr.sin_port, "tcp");
@@ -604,21 +730,21 @@ static void setup_ssl(tcptest_t *item)
 					  portinfo, inet_ntoa(item->addr.sin_addr), sslerrmsg);
 			}
 			item->errcode = CONTEST_ESSL;
-			item->sslrunning = 0; SSL_free(item->ssldata); SSL_CTX_free(item->sslctx);
+			item->sslrunning = 0; SSL_free(item->ssldata); item->ssldata = NULL;
 			break;
 		  case SSL_ERROR_SSL:
 			ERR_error_string(ERR_get_error(), sslerrmsg);
 			errprintf("Unspecified SSL error in SSL_connect to %s on host %s: %s\n",
 				  portinfo, inet_ntoa(item->addr.sin_addr), sslerrmsg);
 			item->errcode = CONTEST_ESSL;
-			item->sslrunning = 0; SSL_free(item->ssldata); SSL_CTX_free(item->sslctx);
+			item->sslrunning = 0; SSL_free(item->ssldata); item->ssldata = NULL;
 			break;
 		  default:
 			ERR_error_string(ERR_get_error(), sslerrmsg);
 			errprintf("Unknown error %d in SSL_connect to %s on host %s: %s\n",
 				  err, portinfo, inet_ntoa(item->addr.sin_addr), sslerrmsg);
 			item->errcode = CONTEST_ESSL;
-			item->sslrunning = 0; SSL_free(item->ssldata); SSL_CTX_free(item->sslctx);
+			item->sslrunning = 0; SSL_free(item->ssldata); item->ssldata = NULL;
 			break;
 		}
 
@@ -626,12 +752,13 @@ static void setup_ssl(tcptest_t *item)
 	}
 
 	/* If we get this far, the SSL handshake has completed. So grab the certificate */
+	if (SSL_session_reused(item->ssldata)) tcp_stats_resumed++;
 	peercert = SSL_get_peer_certificate(item->ssldata);
 	if (!peercert) {
 		errprintf("Cannot get peer certificate for %s on host %s\n",
 			  portinfo, inet_ntoa(item->addr.sin_addr));
 		item->errcode = CONTEST_ESSL;
-		item->sslrunning = 0; SSL_free(item->ssldata); SSL_CTX_free(item->sslctx);
+		item->sslrunning = 0; SSL_free(item->ssldata); item->ssldata = NULL;
 		return;
 	}
 
@@ -732,12 +859,20 @@ static int socket_read(tcptest_t *item, char *inbuf, int inbufsize)
 	return res;
 }
 
+static void socket_drop(tcptest_t *item)
+{
+	/* Forget the SSL session on a connection that has gone away */
+	if (item->ssldata) SSL_free(item->ssldata);
+	item->ssldata = NULL;
+}
+
 static void socket_shutdown(tcptest_t *item)
 {
 	if (item->sslrunning) {
+		if (item->sslrunning == 1) save_sslsession(item);
 		SSL_shutdown(item->ssldata);
 		SSL_free(item->ssldata);
-		SSL_CTX_free(item->sslctx);
+		item->ssldata = NULL;
 	}
 	shutdown(item->fd, SHUT_RDWR);
 
@@ -771,6 +906,303 @@ static void tcptest_setnext(void *a, void *newval)
 }
 
 
+static int start_connection(tcptest_t *item, int timeout)
+{
+	/*
+	 * Initiate the connection for a test, once it has a socket.
+	 * Returns 1 if the connection is being set up, 0 if it failed
+	 * right away (the test is done), and -1 if the socket cannot be 
+	 * made non-blocking.
+	 */
+	int res;
+
+	/* Set the source address */
+	if (item->srcaddr) {
+		struct sockaddr_in src;
+		int isip;
+
+		memset(&src, 0, sizeof(src));
+		src.sin_family = PF_INET;
+		src.sin_port = 0;
+		isip = (inet_aton(item->srcaddr, (struct in_addr *) &src.sin_addr.s_addr) != 0);
+
+		if (!isip) {
+			char *envaddr = getenv(item->srcaddr);
+			isip = (envaddr && (inet_aton(envaddr, (struct in_addr *) &src.sin_addr.s_addr) != 0));
+		}
+
+		if (isip) {
+			res = bind(item->fd, (struct sockaddr *)&src, sizeof(src));
+			if (res != 0) errprintf("WARNING: Could not bind to source IP %s for test %s: %s\n",
+					item->srcaddr, item->tspec, strerror(errno));
+		}
+		else {
+			errprintf("WARNING: Invalid source IP %s for test %s, using default\n",
+					item->srcaddr, item->tspec);
+		}
+	}
+
+	res = fcntl(item->fd, F_SETFL, O_NONBLOCK);
+	if (res != 0) {
+		/* Could net set to non-blocking mode! Hmmm ... */
+		errprintf("Cannot set O_NONBLOCK\n");
+		return -1;
+	}
+
+	/*
+	 * Initiate the connection attempt ... 
+	 */
+	getntimer(&item->timestart);
+	item->lastactive = item->timestart.tv_sec;
+	item->cutoff = item->timestart.tv_sec + timeout + 1;
+	res = connect(item->fd, (struct sockaddr *)&item->addr, sizeof(item->addr));
+
+	/*
+	 * Did it work ?
+	 */
+	if ((res == 0) || ((res == -1) && (errno == EINPROGRESS))) {
+		/* This is OK - EINPROGRES and res=0 pick up status in select() */
+		tcp_stats_connects++;
+		return 1;
+	}
+	else if (res == -1) {
+		/* connect() failed. Flag the item as "not open" */
+		item->connres = errno;
+		item->open = 0;
+		item->errcode = CONTEST_ENOCONN;
+		close(item->fd);
+		item->fd = -1;
+
+		switch (item->connres) {
+		   /* These may happen if connection is refused immediately */
+		   case ECONNREFUSED : break;
+		   case EHOSTUNREACH : break;
+		   case ENETUNREACH  : break;
+		   case EHOSTDOWN    : break;
+
+		   /* Not likely ... */
+		   case ETIMEDOUT    : break;
+
+		   /* These should not happen. */
+		   case EBADF        : errprintf("connect returned EBADF!\n"); break;
+		   case ENOTSOCK     : errprintf("connect returned ENOTSOCK!\n"); break;
+		   case EADDRNOTAVAIL: errprintf("connect returned EADDRNOTAVAIL!\n"); break;
+		   case EAFNOSUPPORT : errprintf("connect returned EAFNOSUPPORT!\n"); break;
+		   case EISCONN      : errprintf("connect returned EISCONN!\n"); break;
+		   case EADDRINUSE   : errprintf("connect returned EADDRINUSE!\n"); break;
+		   case EFAULT       : errprintf("connect returned EFAULT!\n"); break;
+		   case EALREADY     : errprintf("connect returned EALREADY!\n"); break;
+		   default           : errprintf("connect returned %d, errno=%d\n", res, errno);
+		}
+	}
+	else {
+		/* Should NEVER happen. connect returns 0 or -1 */
+		errprintf("Strange result from connect: %d, errno=%d\n", res, errno);
+	}
+
+	return 0;
+}
+
+static int new_connection(tcptest_t *item, int timeout)
+{
+	/* Start a test outside the normal queue. Returns 1 if the connection is being set up */
+	item->fd = socket(PF_INET, SOCK_STREAM, 0);
+	if (item->fd == -1) {
+		errprintf("Cannot get socket: %s\n", strerror(errno));
+		item->errcode = CONTEST_ENOCONN;
+		return 0;
+	}
+
+	if (start_connection(item, timeout) == 1) {
+		/* The socket may have the number of one we saw activity on in this round */
+		item->skipround = 1;
+		return 1;
+	}
+
+	if (item->fd != -1) {
+		close(item->fd);
+		item->fd = -1;
+		item->errcode = CONTEST_ENOCONN;
+	}
+	return 0;
+}
+
+static void group_reusable_tests(void)
+{
+	/*
+	 * HTTP tests going to the same server are queued behind the first 
+	 * of them, so they can use the same connection one after the other.
+	 * Only the first test of each group stays in the list of tests to 
+	 * start; the others are put back when it is their turn.
+	 */
+	void *groups = xtreeNew(strcasecmp);
+	tcptest_t *item, *previtem, *nextitem, *walk;
+	xtreePos_t handle;
+
+	for (item = thead, previtem = NULL; (item); item = nextitem) {
+		nextitem = item->next;
+
+		if (!item->reusekey) {
+			previtem = item;
+			continue;
+		}
+
+		handle = xtreeFind(groups, item->reusekey);
+		if (handle == xtreeEnd(groups)) {
+			xtreeAdd(groups, item->reusekey, item);
+			previtem = item;
+			continue;
+		}
+
+		/* Take it out of the list, and queue it behind the others in the group */
+		if (previtem) previtem->next = nextitem; else thead = nextitem;
+		item->next = NULL;
+
+		walk = (tcptest_t *)xtreeData(groups, handle);
+		while (walk->reuseq) walk = walk->reuseq;
+		walk->reuseq = item;
+	}
+
+	xtreeDestroy(groups);
+}
+
+static tcptest_t *fail_queued(tcptest_t *item, int *pending)
+{
+	/*
+	 * We could not connect to the server, so the tests waiting to use 
+	 * the connection will not get through either. Put them in the list
+	 * after "item" with the same result, and return the last of them.
+	 */
+	tcptest_t *nextitem;
+
+	while ((nextitem = item->reuseq) != NULL) {
+		item->reuseq = NULL;
+		nextitem->next = item->next;
+		item->next = nextitem;
+
+		nextitem->open = 0;
+		nextitem->connres = item->connres;
+		nextitem->errcode = item->errcode;
+		if (nextitem->finalcallback) nextitem->finalcallback(nextitem->priv);
+		(*pending)--;
+
+		item = nextitem;
+	}
+
+	return item;
+}
+
+static int pass_connection(tcptest_t *item, int keepconn, struct timespec *timestamp, int timeout, int *pending)
+{
+	/*
+	 * The test in "item" is done. Start the next test waiting for a 
+	 * connection to the same server, either on the connection we have 
+	 * if the server allows it, or on a new one.
+	 * Returns the number of sockets now used by the tests that waited.
+	 */
+	tcptest_t *nextitem;
+	int started = 0;
+
+	if (!item->reuseq) return 0;
+
+	if (!item->open) {
+		fail_queued(item, pending);
+		return 0;
+	}
+
+	if (item->errcode == CONTEST_ETIMEOUT) {
+		/* The server is slow. Dont let the waiting tests time out one after the other */
+		while ((nextitem = item->reuseq) != NULL) {
+			item->reuseq = nextitem->reuseq;
+			nextitem->reuseq = NULL;
+			nextitem->next = item->next;
+			item->next = nextitem;
+
+			if (new_connection(nextitem, timeout)) started++; else (*pending)--;
+		}
+
+		return started;
+	}
+
+	while ((nextitem = item->reuseq) != NULL) {
+		item->reuseq = NULL;
+
+		/* Put it in the list of active tests, right after the one that is done */
+		nextitem->next = item->next;
+		item->next = nextitem;
+
+		if (keepconn) {
+			nextitem->fd = item->fd;
+			nextitem->open = 1;
+			nextitem->connres = 0;
+			nextitem->reused = 1;
+			nextitem->skipround = 1;
+			nextitem->sslctx = item->sslctx;
+			nextitem->ssldata = item->ssldata;
+			nextitem->sslrunning = item->sslrunning;
+			item->ssldata = NULL;
+			item->sslrunning = 0;
+
+			/* Same connection, so same certificate */
+			if (item->certinfo) nextitem->certinfo = strdup(item->certinfo);
+			if (item->certsubject) nextitem->certsubject = strdup(item->certsubject);
+			nextitem->certexpires = item->certexpires;
+			nextitem->mincipherbits = item->mincipherbits;
+
+			nextitem->timestart = *timestamp;
+			nextitem->lastactive = timestamp->tv_sec;
+			nextitem->cutoff = timestamp->tv_sec + timeout + 1;
+			nextitem->duration.tv_sec = nextitem->duration.tv_nsec = 0;
+			tcp_stats_reused++;
+			return 1;
+		}
+
+		if (new_connection(nextitem, timeout)) return 1;
+
+		/* Could not connect, so this one is done. Try the next one */
+		(*pending)--;
+		item = nextitem;
+	}
+
+	return 0;
+}
+
+static int restart_test(tcptest_t *item, int timeout)
+{
+	/*
+	 * The server closed a re-used connection before sending anything. 
+	 * It may have timed out the idle connection just as we sent our 
+	 * request, so try again on a new connection.
+	 * Returns 1 if the test was restarted.
+	 */
+	if (!item->reused || item->bytesread || item->sslagain) return 0;
+
+	dbgprintf("Re-used connection closed for %s, retrying on a new connection\n", textornull(item->tspec));
+
+	socket_drop(item);
+	close(item->fd);
+	item->fd = -1;
+
+	/* All of the data written was the request, so rewind that */
+	item->sendtxt -= item->byteswritten;
+	item->sendlen += item->byteswritten;
+	item->byteswritten = 0;
+
+	item->reused = 0;
+	item->open = 0;
+	item->connres = -1;
+	item->readpending = 0;
+	item->errcode = CONTEST_ENOERROR;
+	if (item->certinfo) { xfree(item->certinfo); }
+	if (item->certsubject) { xfree(item->certsubject); }
+	item->certexpires = 0;
+	item->mincipherbits = 0;
+	item->sslrunning = ((item->svcinfo->flags & TCP_SSL) ? SSLSETUP_PENDING : 0);
+
+	return new_connection(item, timeout);
+}
+
+
 void do_tcp_tests(int timeout, int concurrency)
 {
 	int		selres;
@@ -824,6 +1256,7 @@ void do_tcp_tests(int timeout, int concurrency)
 		pending++; 
 	}
 	if (shuffletests) thead = msort(thead, tcptest_compare, tcptest_getnext, tcptest_setnext);
+	if (httpkeepalive) group_reusable_tests();
 
 	firstactive = nextinqueue = thead;
 	dbgprintf("About to do %d TCP tests running %d in parallel, abs.max %d\n", 
@@ -857,91 +1290,17 @@ void do_tcp_tests(int timeout, int concurrency)
 			nextinqueue->fd = socket(PF_INET, SOCK_STREAM, 0);
 			sockok = (nextinqueue->fd != -1);
 			if (sockok) {
-				/* Set the source address */
-				if (nextinqueue->srcaddr) {
-					struct sockaddr_in src;
-					int isip;
-
-					memset(&src, 0, sizeof(src));
-					src.sin_family = PF_INET;
-					src.sin_port = 0;
-					isip = (inet_aton(nextinqueue->srcaddr, (struct in_addr *) &src.sin_addr.s_addr) != 0);
-
-					if (!isip) {
-						char *envaddr = getenv(nextinqueue->srcaddr);
-						isip = (envaddr && (inet_aton(envaddr, (struct in_addr *) &src.sin_addr.s_addr) != 0));
-					}
-
-					if (isip) {
-						res = bind(nextinqueue->fd, (struct sockaddr *)&src, sizeof(src));
-						if (res != 0) errprintf("WARNING: Could not bind to source IP %s for test %s: %s\n",
-								nextinqueue->srcaddr, nextinqueue->tspec, strerror(errno));
-					}
-					else {
-						errprintf("WARNING: Invalid source IP %s for test %s, using default\n",
-								nextinqueue->srcaddr, nextinqueue->tspec);
-					}
+				res = start_connection(nextinqueue, timeout);
+				if (res == 1) {
+					activesockets++;
 				}
+				else if (res == 0) {
+					pending--;
 
-				res = fcntl(nextinqueue->fd, F_SETFL, O_NONBLOCK);
-
-				if (res == 0) {
-					/*
-					 * Initiate the connection attempt ... 
-					 */
-					getntimer(&nextinqueue->timestart);
-					nextinqueue->lastactive = nextinqueue->timestart.tv_sec;
-					nextinqueue->cutoff = nextinqueue->timestart.tv_sec + timeout + 1;
-					res = connect(nextinqueue->fd, (struct sockaddr *)&nextinqueue->addr, sizeof(nextinqueue->addr));
-
-					/*
-					 * Did it work ?
-					 */
-					if ((res == 0) || ((res == -1) && (errno == EINPROGRESS))) {
-						/* This is OK - EINPROGRES and res=0 pick up status in select() */
-						activesockets++;
-						tcp_stats_connects++;
-					}
-					else if (res == -1) {
-						/* connect() failed. Flag the item as "not open" */
-						nextinqueue->connres = errno;
-						nextinqueue->open = 0;
-						nextinqueue->errcode = CONTEST_ENOCONN;
-						close(nextinqueue->fd);
-						nextinqueue->fd = -1;
-						pending--;
-
-						switch (nextinqueue->connres) {
-						   /* These may happen if connection is refused immediately */
-						   case ECONNREFUSED : break;
-						   case EHOSTUNREACH : break;
-						   case ENETUNREACH  : break;
-						   case EHOSTDOWN    : break;
-
-						   /* Not likely ... */
-						   case ETIMEDOUT    : break;
-
-						   /* These should not happen. */
-						   case EBADF        : errprintf("connect returned EBADF!\n"); break;
-						   case ENOTSOCK     : errprintf("connect returned ENOTSOCK!\n"); break;
-						   case EADDRNOTAVAIL: errprintf("connect returned EADDRNOTAVAIL!\n"); break;
-						   case EAFNOSUPPORT : errprintf("connect returned EAFNOSUPPORT!\n"); break;
-						   case EISCONN      : errprintf("connect returned EISCONN!\n"); break;
-						   case EADDRINUSE   : errprintf("connect returned EADDRINUSE!\n"); break;
-						   case EFAULT       : errprintf("connect returned EFAULT!\n"); break;
-						   case EALREADY     : errprintf("connect returned EALREADY!\n"); break;
-						   default           : errprintf("connect returned %d, errno=%d\n", res, errno);
-						}
-					}
-					else {
-						/* Should NEVER happen. connect returns 0 or -1 */
-						errprintf("Strange result from connect: %d, errno=%d\n", res, errno);
-					}
+					nextinqueue = fail_queued(nextinqueue, &pending);
 				}
 				else {
-					/* Could net set to non-blocking mode! Hmmm ... */
 					sockok = 0;
-					errprintf("Cannot set O_NONBLOCK\n");
 				}
 
 				nextinqueue=nextinqueue->next;
@@ -1053,7 +1412,11 @@ restartselect:
 
 		/* Now find out which connections had something happen to them */
 		for (item=firstactive; (item != nextinqueue); item=item->next) {
-			if (item->fd > -1) {		/* Only active sockets have this */
+			if ((item->fd > -1) && item->skipround) {
+				/* Started during this round - wait for the next select() */
+				item->skipround = 0;
+			}
+			else if (item->fd > -1) {		/* Only active sockets have this */
 				if (timestamp.tv_sec > item->cutoff) {
 					/* 
 					 * Request timed out.
@@ -1070,8 +1433,8 @@ restartselect:
 					}
 					get_totaltime(item, &timestamp);
 					close(item->fd);
+					activesockets += pass_connection(item, 0, &timestamp, timeout, &pending) - 1;
 					item->fd = -1;
-					activesockets--;
 					pending--;
 					if (item == firstactive) firstactive = item->next;
 				}
@@ -1154,7 +1517,11 @@ restartselect:
 								 */
 								res = socket_write(item, outbuf, outlen);
 								tcp_stats_written += res;
-								if (res == -1) {
+								if ((res == -1) && restart_test(item, timeout)) {
+									/* Server closed the re-used connection */
+									continue;
+								}
+								else if (res == -1) {
 									/* Write failed - this socket is done. */
 									dbgprintf("write failed\n");
 									item->readpending = 0;
@@ -1182,8 +1549,8 @@ restartselect:
 								close(item->fd);
 								get_totaltime(item, &timestamp);
 								if (item->finalcallback) item->finalcallback(item->priv);
+								activesockets += pass_connection(item, 0, &timestamp, timeout, &pending) - 1;
 								item->fd = -1;
-								activesockets--;
 								pending--;
 								if (item == firstactive) firstactive = item->next;
 							}
@@ -1262,16 +1629,27 @@ restartselect:
 							wantmoredata = 1;
 						}
 
+						if (!wantmoredata && (res <= 0) && restart_test(item, timeout)) {
+							/* Server closed the re-used connection */
+							continue;
+						}
+
 						if (!wantmoredata) {
-							if (item->open) {
-								socket_shutdown(item);
+							/* Keep the connection for the next test, if the server lets us */
+							int keepconn = (item->reuseq && item->reusable && datadone && 
+									(item->errcode == CONTEST_ENOERROR));
+
+							if (!keepconn) {
+								if (item->open) {
+									socket_shutdown(item);
+								}
+								close(item->fd);
 							}
 							item->readpending = 0;
-							close(item->fd);
 							get_totaltime(item, &timestamp);
 							if (item->finalcallback) item->finalcallback(item->priv);
+							activesockets += pass_connection(item, keepconn, &timestamp, timeout, &pending) - 1;
 							item->fd = -1;
-							activesockets--;
 							pending--;
 							if (item == firstactive) firstactive = item->next;
 						}
@@ -53,6 +53,7 @@ extern char *ciphershigh;
 extern char *ciphersmedium;
 extern unsigned int warnbytesread;
 extern int shuffletests;
+extern int httpkeepalive;
 
 #define SSLVERSION_DEFAULT 0
 #define SSLVERSION_V2      1
@@ -115,6 +116,14 @@ typedef struct tcptest_t {
 	int mincipherbits;              /* Bits in the weakest encryption supported */
 	int sslrunning;			/* Track state of an SSL session */
 	int sslagain;			/* SSL read/write needs more data */
+	char *sslname;			/* Server name sent with the SSL handshake (SNI) */
+
+	/* For re-using connections between tests */
+	char *reusekey;			/* Tests with the same key may share a connection */
+	int reusable;			/* Server will keep the connection open after this request */
+	int reused;			/* Test runs on a connection inherited from another test */
+	int skipround;			/* Connection was set up during this select() round */
+	struct tcptest_t *reuseq;	/* Tests waiting to use this connection when we are done */
 
 	/* For testing telnet services */
 	unsigned char *telnetbuf;	/* Buffer for telnet option negotiation */
@@ -139,6 +148,18 @@ typedef struct tcptest_t {
 #define HTTPVER_10  1
 #define HTTPVER_11  2
 
+/*
+ * A set of HTTP status codes, from the okstatusexpr/notokstatusexpr of a 
+ * "httpstatus" test. Matching codes 0-999 are in the bitmap, so the 
+ * regex is only used for odd codes outside that range.
+ */
+#define HTTPCODESET_MAX 1000
+typedef struct httpcodeset_t {
+	char *pattern;
+	pcre *ptn;
+	unsigned char codes[(HTTPCODESET_MAX+7)/8];
+} httpcodeset_t;
+
 #define CHUNK_NOTCHUNKED 0
 #define CHUNK_INIT       1
 #define CHUNK_GETLEN     2
@@ -171,6 +192,7 @@ typedef struct {
 	int		contentcheck;		/* 0=no content check, 1=regex check, 2=digest check */
 	void		*exp;			/* data for content match (digest, or regexp data) */
 	digestctx_t	*digestctx;		/* OpenSSL data for digest handling */
+	httpcodeset_t	*okset, *badset;	/* Compiled okcodes and badcodes for status tests */
 	char		*digest;		/* Digest of the data received from the server */
 	long		contstatus;		/* Pseudo HTTP status for content check */
 
@@ -186,6 +208,8 @@ extern unsigned int tcp_stats_total;
 extern unsigned int tcp_stats_http;
 extern unsigned int tcp_stats_plain;
 extern unsigned int tcp_stats_connects;
+extern unsigned int tcp_stats_reused;
+extern unsigned int tcp_stats_resumed;
 
 extern char *init_tcp_services(void);
 extern int default_tcp_port(char *svcname);
@@ -20,6 +20,10 @@ static char rcsid[] = "$Id: dns.c 6745 2011-09-04 06:01:06Z storner $";
 #include <arpa/nameser.h>
 #include <netdb.h>
 #include <sys/time.h>
+#include <errno.h>
+#ifdef LINUX
+#include <sys/epoll.h>
+#endif
 
 #include "libxymon.h"
 
@@ -45,7 +49,25 @@ int dns_stats_failed  = 0;
 int dns_stats_lookups = 0;
 int dnstimeout        = 30;
 
+/* Persistent DNS cache statistics */
+int dns_stats_cachehits  = 0;
+int dns_stats_refreshes  = 0;
+int dns_stats_refreshfail = 0;
+unsigned long dns_stats_latency_total = 0;	/* Milliseconds */
+unsigned long dns_stats_latency_max = 0;
+int dns_stats_latency_count = 0;
+
 FILE *dnsfaillog = NULL;
+char *dnscachefn = NULL;
+
+/*
+ * Cache entries are refreshed in the background when less than this
+ * much of their TTL remains, or less than 1/4 of their TTL.
+ */
+#define DNSCACHE_REFRESHAHEAD 300
+/* TTL for entries resolved via the system resolver, which does not tell us the real TTL */
+#define DNSCACHE_SYSTEMTTL 300
+#define DNSCACHE_MAXADDRS 16
 
 
 typedef struct dnsitem_t {
@@ -53,10 +75,48 @@ typedef struct dnsitem_t {
 	struct in_addr addr;
 	struct dnsitem_t *next;
 	int failed;
+	int pending;		/* Foreground lookup in progress */
+	int refreshing;		/* Background refresh in progress */
+	int persistent;		/* Should be saved in the on-disk cache */
+	int used;		/* Has been requested in this run */
+	int fresh;		/* Has been resolved in this run */
+	time_t expires;		/* When the DNS TTL runs out */
+	int ttl;
 	struct timespec resolvetime;
 } dnsitem_t;
 
 static void * dnscache;
+static int pending_refresh_count = 0;
+#ifdef LINUX
+static int dns_epollfd = -1;
+#endif
+
+static void dns_load_cache(void);
+#ifdef LINUX
+static void dns_sock_state_cb(void *data, int s, int readable, int writable);
+#endif
+
+static int dns_channel_init(ares_channel *channel, struct ares_options *options, int optmask)
+{
+	struct ares_options defoptions;
+
+	if (options == NULL) {
+		memset(&defoptions, 0, sizeof(defoptions));
+		options = &defoptions;
+	}
+
+#ifdef LINUX
+	/* Have ARES tell us about its sockets, so we can run them via epoll */
+	if (dns_epollfd == -1) dns_epollfd = epoll_create(64);
+	if (dns_epollfd != -1) {
+		options->sock_state_cb = dns_sock_state_cb;
+		options->sock_state_cb_data = NULL;
+		optmask |= ARES_OPT_SOCK_STATE_CB;
+	}
+#endif
+
+	return ares_init_options(channel, options, optmask);
+}
 
 static void dns_init(void)
 {
@@ -67,7 +127,7 @@ static void dns_init(void)
 	dnscache = xtreeNew(strcasecmp);
 
 	if (use_ares_lookup) {
-		int status = ares_init(&mychannel);
+		int status = dns_channel_init(&mychannel, NULL, 0);
 
 		if (status != ARES_SUCCESS) {
 			errprintf("Cannot initialize ARES resolver, using standard\n");
@@ -77,6 +137,8 @@ static void dns_init(void)
 	}
 
 	initdone = 1;
+
+	if (dnscachefn) dns_load_cache();
 }
 
 static char *find_dnscache(char *hostname)
@@ -101,14 +163,27 @@ static char *find_dnscache(char *hostname)
 }
 
 
-static void dns_simple_callback(void *arg, int status, int timeout, struct hostent *hent)
+static void dns_record_latency(dnsitem_t *dnsc)
 {
-	struct dnsitem_t *dnsc = (dnsitem_t *)arg;
 	struct timespec etime;
+	unsigned long msecs;
 
 	getntimer(&etime);
 	tvdiff(&dnsc->resolvetime, &etime, &dnsc->resolvetime);
+
+	msecs = dnsc->resolvetime.tv_sec*1000 + dnsc->resolvetime.tv_nsec/1000000;
+	dns_stats_latency_total += msecs;
+	dns_stats_latency_count++;
+	if (msecs > dns_stats_latency_max) dns_stats_latency_max = msecs;
+}
+
+static void dns_simple_callback(void *arg, int status, int timeout, struct hostent *hent)
+{
+	struct dnsitem_t *dnsc = (dnsitem_t *)arg;
+
+	dns_record_latency(dnsc);
 	pending_dns_count--;
+	dnsc->pending = 0;
 
 	if (status == ARES_SUCCESS) {
 		memcpy(&dnsc->addr, *(hent->h_addr_list), sizeof(dnsc->addr));
@@ -129,30 +204,131 @@ static void dns_simple_callback(void *arg, int status, int timeout, struct hoste
 }
 
 
+static int dns_parse_ttl_reply(int status, unsigned char *abuf, int alen, struct in_addr *addr, int *ttl)
+{
+	struct ares_addrttl addrttls[DNSCACHE_MAXADDRS];
+	int naddrttls = DNSCACHE_MAXADDRS;
+
+	if (status != ARES_SUCCESS) return status;
+
+	status = ares_parse_a_reply(abuf, alen, NULL, addrttls, &naddrttls);
+	if (status != ARES_SUCCESS) return status;
+	if (naddrttls == 0) return ARES_ENODATA;
+
+	memcpy(addr, &addrttls[0].ipaddr, sizeof(*addr));
+	*ttl = ((addrttls[0].ttl > 0) ? addrttls[0].ttl : 0);
 
-static void dns_ares_queue_run(ares_channel channel)
+	return ARES_SUCCESS;
+}
+
+static void dns_ttl_callback(void *arg, int status, int timeout, unsigned char *abuf, int alen)
+{
+	/* Foreground lookup via DNS, where we also pick up the TTL for the cache */
+	struct dnsitem_t *dnsc = (dnsitem_t *)arg;
+	struct in_addr addr;
+	int ttl;
+
+	status = dns_parse_ttl_reply(status, abuf, alen, &addr, &ttl);
+
+	dns_record_latency(dnsc);
+	pending_dns_count--;
+	dnsc->pending = 0;
+
+	if (status == ARES_SUCCESS) {
+		memcpy(&dnsc->addr, &addr, sizeof(dnsc->addr));
+		dnsc->ttl = ttl;
+		dnsc->expires = getcurrenttime(NULL) + ttl;
+		dnsc->persistent = 1;
+		dbgprintf("Got DNS result for host %s : %s (TTL %d)\n", dnsc->name, inet_ntoa(dnsc->addr), ttl);
+		dns_stats_success++;
+	}
+	else {
+		memset(&dnsc->addr, 0, sizeof(dnsc->addr));
+		dbgprintf("DNS lookup failed for %s - status %s (%d)\n", dnsc->name, ares_strerror(status), status);
+		dnsc->failed = 1;
+		dnsc->persistent = 0;
+		dns_stats_failed++;
+
+		if (dnsfaillog) {
+			fprintf(dnsfaillog, "DNS lookup failed for %s - status %s (%d)\n", 
+				dnsc->name, ares_strerror(status), status);
+		}
+	}
+}
+
+static void dns_refresh_callback(void *arg, int status, int timeout, unsigned char *abuf, int alen)
+{
+	/* Background refresh of a cached entry. On failure we keep the old (still valid) address. */
+	struct dnsitem_t *dnsc = (dnsitem_t *)arg;
+	struct in_addr addr;
+	int ttl;
+
+	pending_refresh_count--;
+	dnsc->refreshing = 0;
+
+	status = dns_parse_ttl_reply(status, abuf, alen, &addr, &ttl);
+	if (status == ARES_SUCCESS) {
+		memcpy(&dnsc->addr, &addr, sizeof(dnsc->addr));
+		dnsc->ttl = ttl;
+		dnsc->expires = getcurrenttime(NULL) + ttl;
+		dbgprintf("Refreshed DNS cache for host %s : %s (TTL %d)\n", dnsc->name, inet_ntoa(dnsc->addr), ttl);
+	}
+	else {
+		dbgprintf("DNS refresh failed for %s - status %s (%d)\n", dnsc->name, ares_strerror(status), status);
+		dns_stats_refreshfail++;
+	}
+}
+
+
+#ifdef LINUX
+static void dns_sock_state_cb(void *data, int s, int readable, int writable)
+{
+	struct epoll_event ev;
+
+	if (dns_epollfd == -1) return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = s;
+	ev.events = (readable ? EPOLLIN : 0) | (writable ? EPOLLOUT : 0);
+
+	if (ev.events == 0) {
+		epoll_ctl(dns_epollfd, EPOLL_CTL_DEL, s, &ev);
+	}
+	else if (epoll_ctl(dns_epollfd, EPOLL_CTL_MOD, s, &ev) == -1) {
+		if ((errno != ENOENT) || (epoll_ctl(dns_epollfd, EPOLL_CTL_ADD, s, &ev) == -1)) {
+			errprintf("Cannot add DNS socket to epoll set: %s\n", strerror(errno));
+		}
+	}
+}
+#endif
+
+
+static int dns_queue_done(ares_channel channel, int *waitcount)
+{
+	struct timeval tv;
+
+	if (waitcount) return (*waitcount <= 0);
+
+	/* No counter - wait until ARES has no queries outstanding */
+	return (ares_timeout(channel, NULL, &tv) == NULL);
+}
+
+static void dns_ares_queue_run(ares_channel channel, int *waitcount)
 {
-	int nfds, selres;
-	fd_set read_fds, write_fds;
 	struct timeval *tvp, tv;
 	int loops = 0;
 
-	if ((channel == mychannel) && (!pending_dns_count)) return;
+	if (dns_queue_done(channel, waitcount)) return;
 
-	dbgprintf("Processing %d DNS lookups with ARES\n", pending_dns_count);
+	dbgprintf("Processing %d DNS lookups with ARES\n", (waitcount ? *waitcount : -1));
 
-	while (1) {	/* Loop continues until all requests handled (or time out) */
+	while (!dns_queue_done(channel, waitcount)) {	/* Loop continues until all requests handled (or time out) */
 		loops++;
-		FD_ZERO(&read_fds);
-		FD_ZERO(&write_fds);
-		nfds = ares_fds(channel, &read_fds, &write_fds);
-		if (nfds == 0) {
-			dbgprintf("Finished ARES queue after loop %d\n", loops);
-			break;	/* No pending requests */
-		}
+
+		if (ares_timeout(channel, NULL, &tv) == NULL) break;	/* No pending requests */
 
 		/* 
-		 * Determine how long select() waits before processing timeouts.
+		 * Determine how long we wait before processing timeouts.
 		 * "dnstimeout" is the user configurable option which is
 		 * the absolute maximum timeout value. However, ARES also
 		 * has built in timeouts - these are defined at ares_init()
@@ -162,11 +338,51 @@ static void dns_ares_queue_run(ares_channel channel)
 		tv.tv_sec = dnstimeout; tv.tv_usec = 0;
 		tvp = ares_timeout(channel, &tv, &tv);
 
-		selres = select(nfds, &read_fds, &write_fds, NULL, tvp);
-		ares_process(channel, &read_fds, &write_fds);
+#ifdef LINUX
+		if (dns_epollfd != -1) {
+			struct epoll_event events[64];
+			int i, n;
+
+			n = epoll_wait(dns_epollfd, events, 64, (tvp->tv_sec*1000 + (tvp->tv_usec+999)/1000));
+			if ((n == -1) && (errno != EINTR)) {
+				errprintf("epoll_wait failed: %s\n", strerror(errno));
+				break;
+			}
+
+			for (i = 0; (i < n); i++) {
+				int rfd = ((events[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)) ? events[i].data.fd : ARES_SOCKET_BAD);
+				int wfd = ((events[i].events & EPOLLOUT) ? events[i].data.fd : ARES_SOCKET_BAD);
+
+				/*
+				 * All channels share the epoll set, so background refreshes on
+				 * the main channel also progress while e.g. DNS tests run.
+				 */
+				ares_process_fd(channel, rfd, wfd);
+				if ((channel != mychannel) && use_ares_lookup) ares_process_fd(mychannel, rfd, wfd);
+			}
+
+			/* Handle timeouts */
+			if (n <= 0) ares_process_fd(channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+		}
+		else
+#endif
+		{
+			int nfds;
+			fd_set read_fds, write_fds;
+
+			FD_ZERO(&read_fds);
+			FD_ZERO(&write_fds);
+			nfds = ares_fds(channel, &read_fds, &write_fds);
+			if (nfds == 0) break;	/* No pending requests */
+
+			select(nfds, &read_fds, &write_fds, NULL, tvp);
+			ares_process(channel, &read_fds, &write_fds);
+		}
 	}
 
-	if (pending_dns_count > 0) {
+	dbgprintf("Finished ARES queue after loop %d\n", loops);
+
+	if ((channel == mychannel) && (pending_dns_count > 0)) {
 		errprintf("Odd ... pending_dns_count=%d after a queue run\n", 
 				pending_dns_count);
 		pending_dns_count = 0;
@@ -174,32 +390,173 @@ static void dns_ares_queue_run(ares_channel channel)
 }
 
 
+static void dns_load_cache(void)
+{
+	FILE *fd;
+	char l[1024];
+	time_t now = getcurrenttime(NULL);
+	int count = 0;
+
+	fd = fopen(dnscachefn, "r");
+	if (fd == NULL) {
+		dbgprintf("No DNS cache file %s\n", dnscachefn);
+		return;
+	}
+
+	/* File format: hostname|IP|expiretime|ttl */
+	while (fgets(l, sizeof(l), fd)) {
+		char *name, *ip, *expstr, *ttlstr;
+		dnsitem_t *dnsc;
+
+		name = strtok(l, "|\n");
+		ip = (name ? strtok(NULL, "|\n") : NULL);
+		expstr = (ip ? strtok(NULL, "|\n") : NULL);
+		ttlstr = (expstr ? strtok(NULL, "|\n") : NULL);
+		if (!ttlstr) continue;
+
+		/* Drop expired entries */
+		if (atol(expstr) <= now) continue;
+		if (xtreeFind(dnscache, name) != xtreeEnd(dnscache)) continue;
+
+		dnsc = (dnsitem_t *)calloc(1, sizeof(dnsitem_t));
+		if (inet_aton(ip, &dnsc->addr) == 0) {
+			xfree(dnsc);
+			continue;
+		}
+		dnsc->name = strdup(name);
+		dnsc->expires = atol(expstr);
+		dnsc->ttl = atoi(ttlstr);
+		dnsc->persistent = 1;
+		xtreeAdd(dnscache, dnsc->name, dnsc);
+		count++;
+	}
+
+	fclose(fd);
+	dbgprintf("Loaded %d entries from DNS cache %s\n", count, dnscachefn);
+}
+
+void dns_save_cache(void)
+{
+	FILE *fd;
+	char *tmpfn;
+	xtreePos_t handle;
+	time_t now;
+
+	if (!dnscachefn) return;
+
+	dns_init();
+
+	/* Let the background refreshes finish, so the next run has up-to-date data */
+	if (use_ares_lookup) dns_ares_queue_run(mychannel, &pending_refresh_count);
+
+	tmpfn = (char *)malloc(strlen(dnscachefn) + 5);
+	sprintf(tmpfn, "%s.tmp", dnscachefn);
+	fd = fopen(tmpfn, "w");
+	if (fd == NULL) {
+		errprintf("Cannot write DNS cache file %s: %s\n", tmpfn, strerror(errno));
+		xfree(tmpfn);
+		return;
+	}
+
+	now = getcurrenttime(NULL);
+	for (handle = xtreeFirst(dnscache); (handle != xtreeEnd(dnscache)); handle = xtreeNext(dnscache, handle)) {
+		dnsitem_t *dnsc = (dnsitem_t *)xtreeData(dnscache, handle);
+
+		if (!dnsc->persistent || dnsc->failed || (dnsc->expires <= now)) continue;
+		fprintf(fd, "%s|%s|%ld|%d\n", dnsc->name, inet_ntoa(dnsc->addr), (long)dnsc->expires, dnsc->ttl);
+	}
+
+	if (fclose(fd) != 0) {
+		errprintf("Error writing DNS cache file %s: %s\n", tmpfn, strerror(errno));
+		unlink(tmpfn);
+	}
+	else if (rename(tmpfn, dnscachefn) == -1) {
+		errprintf("Cannot rename %s to %s: %s\n", tmpfn, dnscachefn, strerror(errno));
+	}
+
+	xfree(tmpfn);
+}
+
+
 void add_host_to_dns_queue(char *hostname)
 {
 	dnsitem_t *dnsc;
 
+	struct in_addr inp;
+	xtreePos_t handle;
+	time_t now;
+
 	dns_init();
 	dns_stats_total++;
 
-	if (find_dnscache(hostname)) return; 	/* Already resolved */
+	if (inet_aton(hostname, &inp) != 0) return;	/* It is an IP */
+
+	handle = xtreeFind(dnscache, hostname);
+	if (handle != xtreeEnd(dnscache)) {
+		dnsc = (dnsitem_t *)xtreeData(dnscache, handle);
+
+		/* Already resolved or being resolved in this run */
+		if (dnsc->pending || dnsc->failed || !dnsc->persistent) return;
+
+		now = getcurrenttime(NULL);
+		if (dnsc->expires > now) {
+			/* Valid entry from the on-disk cache */
+			if (!dnsc->used) dns_stats_cachehits++;
+			dnsc->used = 1;
+
+			if (use_ares_lookup && !dnsc->refreshing && !dnsc->fresh &&
+			    (((dnsc->expires - now) < DNSCACHE_REFRESHAHEAD) || ((dnsc->expires - now) < (dnsc->ttl / 4)))) {
+				/* About to expire - refresh it in the background for the next run */
+				dbgprintf("Refreshing cached DNS entry for '%s' in the background\n", hostname);
+				dnsc->refreshing = 1;
+				pending_refresh_count++;
+				dns_stats_refreshes++;
+				ares_search(mychannel, hostname, C_IN, T_A, dns_refresh_callback, dnsc);
+			}
+			return;
+		}
+
+		if (dnsc->used) return;		/* Expired during this run - keep using it */
+
+		/* Expired cache entry - do a new lookup */
+		dbgprintf("Cached DNS entry for '%s' has expired\n", hostname);
+	}
+	else {
+		/* New hostname */
+		dnsc = (dnsitem_t *)calloc(1, sizeof(dnsitem_t));
+		dnsc->name = strdup(hostname);
+		xtreeAdd(dnscache, dnsc->name, dnsc);
+	}
 
 	if (max_dns_per_run && (pending_dns_count >= max_dns_per_run)) {
 		/* Limit the number of requests we do per run */
-		dns_ares_queue_run(mychannel);
+		dns_ares_queue_run(mychannel, &pending_dns_count);
 	}
 
-	/* New hostname */
-	dnsc = (dnsitem_t *)calloc(1, sizeof(dnsitem_t));
-
 	dbgprintf("Adding hostname '%s' to resolver queue\n", hostname);
 	pending_dns_count++;
 
-	dnsc->name = strdup(hostname);
+	dnsc->pending = 1;
+	dnsc->used = 1;
+	dnsc->fresh = 1;
+	dnsc->persistent = 0;
 	getntimer(&dnsc->resolvetime);
-	xtreeAdd(dnscache, dnsc->name, dnsc);
 
 	if (use_ares_lookup) {
-		ares_gethostbyname(mychannel, hostname, AF_INET, dns_simple_callback, dnsc);
+		struct hostent *hent = NULL;
+
+		if (!dnscachefn) {
+			ares_gethostbyname(mychannel, hostname, AF_INET, dns_simple_callback, dnsc);
+		}
+		else if (ares_gethostbyname_file(mychannel, hostname, AF_INET, &hent) == ARES_SUCCESS) {
+			/* Found in the local hosts file - no need to cache that */
+			dns_simple_callback(dnsc, ARES_SUCCESS, 0, hent);
+			ares_free_hostent(hent);
+		}
+		else {
+			/* DNS lookup, which gives us the TTL needed for the on-disk cache */
+			ares_search(mychannel, hostname, C_IN, T_A, dns_ttl_callback, dnsc);
+		}
 	}
 	else {
 		/*
@@ -227,6 +584,11 @@ void add_host_to_dns_queue(char *hostname)
 
 		/* Send the result to our normal callback function */
 		dns_simple_callback(dnsc, status, 0, hent);
+		if ((status == ARES_SUCCESS) && dnscachefn) {
+			dnsc->ttl = DNSCACHE_SYSTEMTTL;
+			dnsc->expires = getcurrenttime(NULL) + DNSCACHE_SYSTEMTTL;
+			dnsc->persistent = 1;
+		}
 	}
 }
 
@@ -252,7 +614,7 @@ void add_url_to_dns_queue(char *url)
 void flush_dnsqueue(void)
 {
 	dns_init();
-	dns_ares_queue_run(mychannel);
+	if (use_ares_lookup) dns_ares_queue_run(mychannel, &pending_dns_count);
 }
 
 char *dnsresolve(char *hostname)
@@ -297,12 +659,13 @@ int dns_test_server(char *serverip, char *hostname, strbuffer_t *banner)
 		return 1;
 	}
 
+	memset(&options, 0, sizeof(options));
 	options.flags = ARES_FLAG_NOCHECKRESP;
 	options.servers = &serveraddr;
 	options.nservers = 1;
 	options.timeout = dnstimeout;
 
-	status = ares_init_options(&channel, &options, (ARES_OPT_FLAGS | ARES_OPT_SERVERS | ARES_OPT_TIMEOUT));
+	status = dns_channel_init(&channel, &options, (ARES_OPT_FLAGS | ARES_OPT_SERVERS | ARES_OPT_TIMEOUT));
 	if (status != ARES_SUCCESS) {
 		errprintf("Could not initialize ares channel: %s\n", ares_strerror(status));
 		return 1;
@@ -330,7 +693,7 @@ int dns_test_server(char *serverip, char *hostname, strbuffer_t *banner)
 		tst = strtok(NULL, ",");
 	} while (tst);
 
-	dns_ares_queue_run(channel);
+	dns_ares_queue_run(channel, NULL);
 
 	getntimer(&endtime);
 	tspent = tvdiff(&starttime, &endtime, NULL);
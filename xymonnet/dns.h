@@ -26,12 +26,20 @@ extern int dns_stats_total;
 extern int dns_stats_success;
 extern int dns_stats_failed;
 extern int dns_stats_lookups;
+extern int dns_stats_cachehits;
+extern int dns_stats_refreshes;
+extern int dns_stats_refreshfail;
+extern unsigned long dns_stats_latency_total;
+extern unsigned long dns_stats_latency_max;
+extern int dns_stats_latency_count;
 
 extern FILE *dnsfaillog;
+extern char *dnscachefn;
 
 extern void add_host_to_dns_queue(char *hostname);
 extern void add_url_to_dns_queue(char *hostname);
 extern void flush_dnsqueue(void);
+extern void dns_save_cache(void);
 extern char *dnsresolve(char *hostname);
 extern int dns_test_server(char *serverip, char *hostname, strbuffer_t *banner);
 
@@ -25,6 +25,7 @@ static char rcsid[] = "$Id: httpresult.c 6712 2011-07-31 21:01:52Z storner $";
 #include "xymonnet.h"
 #include "contest.h"
 #include "httpcookies.h"
+#include "httptest.h"
 #include "httpresult.h"
 
 static int statuscolor(testedhost_t *h, long status)
@@ -68,33 +69,28 @@ static int statuscolor(testedhost_t *h, long status)
 }
 
 
-static int statuscolor_by_set(testedhost_t *h, long status, char *okcodes, char *badcodes)
+static int statuscolor_by_set(testedhost_t *h, long status, httpcodeset_t *okset, httpcodeset_t *badset)
 {
 	int result = -1;
-	char codestr[10];
-	pcre *ptn;
+	long code;
 
 	/* Use code 999 to indicate we could not fetch the URL */
-	sprintf(codestr, "%ld", (status ? status : 999));
+	code = (status ? status : 999);
 
-	if (okcodes) {
-		ptn = compileregex(okcodes);
-		if (matchregex(codestr, ptn)) result = COL_GREEN; else result = COL_RED;
-		freeregex(ptn);
+	if (okset) {
+		if (httpcodeset_match(okset, code)) result = COL_GREEN; else result = COL_RED;
 	}
 
-	if (badcodes) {
-		ptn = compileregex(badcodes);
-		if (matchregex(codestr, ptn)) result = COL_RED; else result = COL_GREEN;
-		freeregex(ptn);
+	if (badset) {
+		if (httpcodeset_match(badset, code)) result = COL_RED; else result = COL_GREEN;
 	}
 
 	if (result == -1) result = statuscolor(h, status);
 
-	dbgprintf("Host %s status %s [%s:%s] -> color %s\n", 
-		  h->hostname, codestr, 
-		  (okcodes ? okcodes : "<null>"),
-		  (badcodes ? badcodes : "<null>"),
+	dbgprintf("Host %s status %ld [%s:%s] -> color %s\n", 
+		  h->hostname, code, 
+		  (okset ? okset->pattern : "<null>"),
+		  (badset ? badset->pattern : "<null>"),
 		  colorname(result));
 
 	return result;
@@ -137,7 +133,7 @@ void send_http_results(service_t *httptest, testedhost_t *host, testitem_t *firs
 
 		totalreports++;
 		if (req->weburl.okcodes || req->weburl.badcodes) {
-			req->httpcolor = statuscolor_by_set(host, req->httpstatus, req->weburl.okcodes, req->weburl.badcodes);
+			req->httpcolor = statuscolor_by_set(host, req->httpstatus, req->okset, req->badset);
 		}
 		else {
 			req->httpcolor = statuscolor(host, req->httpstatus);
@@ -450,7 +446,6 @@ void send_content_results(service_t *httptest, testedhost_t *host,
 						regmatch_t foo[1];
 
 						status = regexec((regex_t *) req->exp, req->output, 0, foo, 0);
-						regfree((regex_t *) req->exp);
 					}
 					else {
 						/* output may be null if we only got a redirect */
@@ -463,7 +458,6 @@ void send_content_results(service_t *httptest, testedhost_t *host,
 						regmatch_t foo[1];
 
 						status = (!regexec((regex_t *) req->exp, req->output, 0, foo, 0));
-						regfree((regex_t *) req->exp);
 					}
 					else {
 						/* output may be null if we only got a redirect */
@@ -31,6 +31,70 @@ static char rcsid[] = "$Id: httptest.c 6712 2011-07-31 21:01:52Z storner $";
 #include "dns.h"
 
 
+/*
+ * The same status code sets and content patterns are often used in many 
+ * tests, so they are compiled only once and shared by the tests.
+ */
+static void *codesettree = NULL;
+static void *contentregextree = NULL;
+
+static httpcodeset_t *httpcodeset(char *pattern)
+{
+	httpcodeset_t *result;
+	xtreePos_t handle;
+	char codestr[10];
+	int i;
+
+	if (!pattern) return NULL;
+
+	if (!codesettree) codesettree = xtreeNew(strcmp);
+	handle = xtreeFind(codesettree, pattern);
+	if (handle != xtreeEnd(codesettree)) return (httpcodeset_t *)xtreeData(codesettree, handle);
+
+	result = (httpcodeset_t *)calloc(1, sizeof(httpcodeset_t));
+	result->pattern = strdup(pattern);
+	result->ptn = compileregex(pattern);
+	for (i = 0; (i < HTTPCODESET_MAX); i++) {
+		sprintf(codestr, "%d", i);
+		if (matchregex(codestr, result->ptn)) result->codes[i / 8] |= (1 << (i % 8));
+	}
+
+	xtreeAdd(codesettree, result->pattern, result);
+	return result;
+}
+
+int httpcodeset_match(httpcodeset_t *set, long status)
+{
+	char codestr[30];
+
+	if ((status >= 0) && (status < HTTPCODESET_MAX)) return ((set->codes[status / 8] & (1 << (status % 8))) != 0);
+
+	sprintf(codestr, "%ld", status);
+	return matchregex(codestr, set->ptn);
+}
+
+static regex_t *contentregex(char *pattern, char *url)
+{
+	regex_t *result;
+	xtreePos_t handle;
+
+	if (!contentregextree) contentregextree = xtreeNew(strcmp);
+	handle = xtreeFind(contentregextree, pattern);
+	if (handle != xtreeEnd(contentregextree)) return (regex_t *)xtreeData(contentregextree, handle);
+
+	result = (regex_t *) malloc(sizeof(regex_t));
+	if (regcomp(result, pattern, REG_EXTENDED|REG_NOSUB) != 0) {
+		errprintf("Failed to compile regexp '%s' for URL %s\n", pattern, url);
+		xfree(result);
+		result = NULL;
+	}
+
+	/* Failures are remembered also, so we only complain once */
+	xtreeAdd(contentregextree, strdup(pattern), result);
+	return result;
+}
+
+
 int tcp_http_data_callback(unsigned char *buf, unsigned int len, void *priv)
 {
 	/*
@@ -204,7 +268,7 @@ check_for_endofheaders:
 		if (p) {
 			int http1subver, httpstatus;
 			unsigned int bytesindata;
-			char *p1, *xferencoding;
+			char *p1, *xferencoding, *connhdr;
 			int contlen;
 
 			/* We have an end-of-header delimiter, but it could be just a "100 Continue" response */
@@ -239,7 +303,7 @@ check_for_endofheaders:
 			if (*(p-2) == '\r') { *(p-2) = '\0'; } /* NULL-terminate the headers. */
 
 			/* See if the transfer uses chunks */
-			p1 = item->headers; xferencoding = NULL; contlen = 0;
+			p1 = item->headers; xferencoding = connhdr = NULL; contlen = -1;
 			do {
 				if (strncasecmp(p1, "Transfer-encoding:", 18) == 0) {
 					p1 += 18; while (isspace((int)*p1)) p1++;
@@ -249,6 +313,10 @@ check_for_endofheaders:
 					p1 += 15; while (isspace((int)*p1)) p1++;
 					contlen = atoi(p1);
 				}
+				else if (strncasecmp(p1, "Connection:", 11) == 0) {
+					p1 += 11; while (isspace((int)*p1)) p1++;
+					connhdr = p1;
+				}
 				else {
 					p1 = strchr(p1, '\n'); if (p1) p1++;
 				}
@@ -257,7 +325,20 @@ check_for_endofheaders:
 			if (xferencoding && (strncasecmp(xferencoding, "chunked", 7) == 0)) {
 				item->chunkstate = CHUNK_INIT;
 			}
-			item->contlen = (contlen ? contlen : -1);
+
+			/* These responses never have any content */
+			if ((httpstatus == 204) || (httpstatus == 304)) contlen = 0;
+			item->contlen = contlen;
+
+			/* 
+			 * Can the connection be used for another request ? Only if the server
+			 * says so, and we can tell where this response ends.
+			 */
+			if (http1subver >= 1)
+				item->tcptest->reusable = !(connhdr && (strncasecmp(connhdr, "close", 5) == 0));
+			else
+				item->tcptest->reusable = (connhdr && (strncasecmp(connhdr, "keep-alive", 10) == 0));
+			if ((item->chunkstate == CHUNK_NOTCHUNKED) && (contlen == -1)) item->tcptest->reusable = 0;
 
 			bytesindata = item->hdrlen - (p - item->headers);
 			item->hdrlen = strlen(item->headers);
@@ -461,15 +542,10 @@ void add_http_test(testitem_t *t)
 
 	  case CONTENTCHECK_REGEX:
 	  case CONTENTCHECK_NOREGEX:
-		{
-			int status;
-
-			httptest->exp = (void *) malloc(sizeof(regex_t));
-			status = regcomp((regex_t *)httptest->exp, httptest->weburl.expdata, REG_EXTENDED|REG_NOSUB);
-			if (status) {
-				errprintf("Failed to compile regexp '%s' for URL %s\n", httptest->weburl.expdata, httptest->url);
-				httptest->contstatus = STATUS_CONTENTMATCH_BADREGEX;
-			}
+		if (httptest->weburl.expdata == NULL) break;	/* No content file - contstatus is set already */
+		httptest->exp = (void *) contentregex(httptest->weburl.expdata, httptest->url);
+		if (httptest->exp == NULL) {
+			httptest->contstatus = STATUS_CONTENTMATCH_BADREGEX;
 		}
 		break;
 
@@ -478,6 +554,10 @@ void add_http_test(testitem_t *t)
 		break;
 	}
 
+	/* And the status codes for "httpstatus" tests */
+	httptest->okset = httpcodeset(httptest->weburl.okcodes);
+	httptest->badset = httpcodeset(httptest->weburl.badcodes);
+
 	if (httptest->weburl.desturl->schemeopts) {
 		if      (strstr(httptest->weburl.desturl->schemeopts, "3"))      sslopt_version = SSLVERSION_V3;
 		else if (strstr(httptest->weburl.desturl->schemeopts, "2"))      sslopt_version = SSLVERSION_V2;
@@ -508,7 +588,8 @@ void add_http_test(testitem_t *t)
 			 */
 			addtobuffer(httprequest, (httptest->weburl.proxyurl ? httptest->url : httptest->weburl.desturl->relurl));
 			addtobuffer(httprequest, " HTTP/1.1\r\n"); 
-			addtobuffer(httprequest, "Connection: close\r\n"); 
+			/* Persistent connections are the default with HTTP/1.1 */
+			if (!httpkeepalive) addtobuffer(httprequest, "Connection: close\r\n"); 
 			break;
 	}
 
@@ -664,5 +745,28 @@ void add_http_test(testitem_t *t)
 						 t->testspec, t->silenttest, grabstrbuffer(httprequest), 
 						 httptest, tcp_http_data_callback, tcp_http_final_callback);
 	}
+
+	if (httptest->tcptest) {
+		tcptest_t *tcptest = httptest->tcptest;
+		struct in_addr addr;
+
+		/* Send the hostname with the SSL handshake, so we get the right certificate for virtual hosts */
+		if ((tcptest->svcinfo->flags & TCP_SSL) && (httptest->weburl.proxyurl == NULL) && 
+		    (inet_aton(httptest->weburl.desturl->host, &addr) == 0)) {
+			tcptest->sslname = strdup(httptest->weburl.desturl->host);
+		}
+
+		/* HTTP/1.1 requests to the same server with the same options can share a connection */
+		if (httpkeepalive && (httpversion == HTTPVER_11)) {
+			char key[1024];
+
+			snprintf(key, sizeof(key), "%s:%d/%s/%s/%s/%d/%s/%s",
+				 inet_ntoa(tcptest->addr.sin_addr), ntohs(tcptest->addr.sin_port),
+				 tcptest->svcinfo->svcname, textornull(tcptest->sslname), textornull(t->srcip),
+				 tcptest->ssloptions->sslversion, textornull(tcptest->ssloptions->cipherlist), 
+				 textornull(tcptest->ssloptions->clientcert));
+			tcptest->reusekey = strdup(key);
+		}
+	}
 }
 
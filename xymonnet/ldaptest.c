@@ -19,7 +19,8 @@ static char rcsid[] = "$Id: ldaptest.c 6712 2011-07-31 21:01:52Z storner $";
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
-#include <signal.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "libxymon.h"
 
@@ -35,8 +36,6 @@ static char rcsid[] = "$Id: ldaptest.c 6712 2011-07-31 21:01:52Z storner $";
 
 char *ldap_library_version = NULL;
 
-static volatile int connect_timeout = 0;
-
 int init_ldap_library(void)
 {
 #ifdef XYMON_LDAP
@@ -121,250 +120,366 @@ int add_ldap_test(testitem_t *t)
 }
 
 
-static void ldap_alarmhandler(int signum)
-{
-	signal(signum, SIG_DFL);
-	connect_timeout = 1;
-}
-
-void run_ldap_tests(service_t *ldaptest, int sslcertcheck, int querytimeout)
-{
 #ifdef XYMON_LDAP
-	ldap_data_t *req;
-	testitem_t *t;
-	struct timespec starttime;
-	struct timespec endtime;
-
-	/* Pick a sensible default for the timeout setting */
-	if (querytimeout == 0) querytimeout = 30;
-
-	for (t = ldaptest->items; (t); t = t->next) {
-		LDAPURLDesc	*ludp;
-		LDAP		*ld;
-		int		rc, finished;
-		int		msgID = -1;
-		struct timeval	ldaptimeout;
-		struct timeval	openldaptimeout;
-		LDAPMessage	*result;
-		LDAPMessage	*e;
-		strbuffer_t	*response;
-		char		buf[MAX_LINE_LEN];
+static void ldap_finish(ldap_data_t *req, int status, char *output)
+{
+	/* Test is done - with an error if "status" is non-zero */
+	LDAP *ld = (LDAP *)req->ld;
 
-		req = (ldap_data_t *) t->privdata;
-		if (req->skiptest) continue;
+	if (status != XYMON_LDAP_OK) {
+		req->ldapstatus = status;
+		req->output = output;
+	}
 
-		ludp = (LDAPURLDesc *) req->ldapdesc;
+	if (ld) {
+		if ((req->msgid != -1) && (status != XYMON_LDAP_OK)) ldap_abandon_ext(ld, req->msgid, NULL, NULL);
+		ldap_unbind(ld);
+	}
+	req->ld = NULL;
+	req->msgid = -1;
+	req->ldapstate = LDAPSTATE_DONE;
 
-		getntimer(&starttime);
+	if (req->ldapdesc) ldap_free_urldesc((LDAPURLDesc *)req->ldapdesc);
+	req->ldapdesc = NULL;
+}
 
-		/* Initiate session with the LDAP server */
-		dbgprintf("Initiating LDAP session for host %s port %d\n",
-			ludp->lud_host, ludp->lud_port);
+static void ldap_setdeadline(ldap_data_t *req, int querytimeout)
+{
+	getntimer(&req->deadline);
+	req->deadline.tv_sec += querytimeout;
+}
 
-		if( (ld = ldap_init(ludp->lud_host, ludp->lud_port)) == NULL ) {
-			dbgprintf("ldap_init failed\n");
-			req->ldapstatus = XYMON_LDAP_INITFAIL;
-			continue;
-		}
+static int ldap_start(testitem_t *t, int querytimeout)
+{
+	/*
+	 * Setup the LDAP session, and send the BIND request. We dont wait for the
+	 * response, that is picked up later when the socket becomes readable.
+	 * Returns 1 if the test is in progress, 0 if it failed right away.
+	 */
+	ldap_data_t *req = (ldap_data_t *) t->privdata;
+	LDAPURLDesc *ludp = (LDAPURLDesc *) req->ldapdesc;
+	LDAP *ld;
+	int rc;
+	struct timeval openldaptimeout;
+
+	getntimer(&req->starttime);
+	req->msgid = -1;
+
+	/* Initiate session with the LDAP server */
+	dbgprintf("Initiating LDAP session for host %s port %d\n",
+		ludp->lud_host, ludp->lud_port);
+
+	if( (ld = ldap_init(ludp->lud_host, ludp->lud_port)) == NULL ) {
+		dbgprintf("ldap_init failed\n");
+		ldap_finish(req, XYMON_LDAP_INITFAIL, NULL);
+		return 0;
+	}
+	req->ld = (void *)ld;
 
-		/* 
-		 * There is apparently no standard way of defining a network
-		 * timeout for the initial connection setup. 
-		 */
+	/* 
+	 * There is apparently no standard way of defining a network
+	 * timeout for the initial connection setup. OpenLDAP has an 
+	 * undocumented ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, &tv).
+	 * The connect happens inside ldap_simple_bind(), but the TCP
+	 * tests have already found the port open, so it normally
+	 * completes right away.
+	 */
 #if (LDAP_VENDOR == OpenLDAP) && defined(LDAP_OPT_NETWORK_TIMEOUT)
-		/* 
-		 * OpenLDAP has an undocumented ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, &tv)
-		 */
-		openldaptimeout.tv_sec = querytimeout;
-		openldaptimeout.tv_usec = 0;
-		ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, &openldaptimeout);
-#else
-		/*
-		 * So using an alarm() to interrupt any pending operations
-		 * seems to be the least insane way of doing this.
-		 *
-		 * Note that we must do this right after ldap_init(), as
-		 * any operation on the session handle (ld) may trigger the
-		 * network connection to be established.
-		 */
-		connect_timeout = 0;
-		signal(SIGALRM, ldap_alarmhandler);
-		alarm(querytimeout);
+	openldaptimeout.tv_sec = querytimeout;
+	openldaptimeout.tv_usec = 0;
+	ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, &openldaptimeout);
 #endif
 
-		/*
-		 * This is completely undocumented in the OpenLDAP docs.
-		 * But apparently it is documented in 
-		 * http://www.ietf.org/proceedings/99jul/I-D/draft-ietf-ldapext-ldap-c-api-03.txt
-		 *
-		 * Both of these routines appear in the <ldap.h> file 
-		 * from OpenLDAP 2.1.22. Their use to enable TLS has
-		 * been deciphered from the ldapsearch() utility
-		 * sourcecode.
-		 *
-		 * According to Manon Goo <manon@manon.de>, recent (Jan. 2005)
-		 * OpenLDAP implementations refuse to talk LDAPv2.
-		 */
+	/*
+	 * This is completely undocumented in the OpenLDAP docs.
+	 * But apparently it is documented in 
+	 * http://www.ietf.org/proceedings/99jul/I-D/draft-ietf-ldapext-ldap-c-api-03.txt
+	 *
+	 * Both of these routines appear in the <ldap.h> file 
+	 * from OpenLDAP 2.1.22. Their use to enable TLS has
+	 * been deciphered from the ldapsearch() utility
+	 * sourcecode.
+	 *
+	 * According to Manon Goo <manon@manon.de>, recent (Jan. 2005)
+	 * OpenLDAP implementations refuse to talk LDAPv2.
+	 */
 #ifdef LDAP_OPT_PROTOCOL_VERSION 
-		{
-			int protocol = LDAP_VERSION3;
+	{
+		int protocol = LDAP_VERSION3;
 
-			dbgprintf("Attempting to select LDAPv3\n");
+		dbgprintf("Attempting to select LDAPv3\n");
+		if ((rc = ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &protocol)) != LDAP_SUCCESS) {
+			dbgprintf("Failed to select LDAPv3, trying LDAPv2\n");
+			protocol = LDAP_VERSION2;
 			if ((rc = ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &protocol)) != LDAP_SUCCESS) {
-				dbgprintf("Failed to select LDAPv3, trying LDAPv2\n");
-				protocol = LDAP_VERSION2;
-				if ((rc = ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &protocol)) != LDAP_SUCCESS) {
-					req->output = strdup(ldap_err2string(rc));
-					req->ldapstatus = XYMON_LDAP_TLSFAIL;
-				}
-				continue;
+				ldap_finish(req, XYMON_LDAP_TLSFAIL, strdup(ldap_err2string(rc)));
+				return 0;
 			}
 		}
+	}
 #endif
 
 #ifdef XYMON_LDAP_USESTARTTLS
-		if (req->usetls) {
-			dbgprintf("Trying to enable TLS for session\n");
-			if ((rc = ldap_start_tls_s(ld, NULL, NULL)) != LDAP_SUCCESS) {
-				dbgprintf("ldap_start_tls failed\n");
-				req->output = strdup(ldap_err2string(rc));
-				req->ldapstatus = XYMON_LDAP_TLSFAIL;
-				continue;
-			}
+	if (req->usetls) {
+		/* Synchronous, but bounded by the network timeout */
+		dbgprintf("Trying to enable TLS for session\n");
+		if ((rc = ldap_start_tls_s(ld, NULL, NULL)) != LDAP_SUCCESS) {
+			dbgprintf("ldap_start_tls failed\n");
+			ldap_finish(req, XYMON_LDAP_TLSFAIL, strdup(ldap_err2string(rc)));
+			return 0;
 		}
+	}
 #endif
 
-		if (!connect_timeout) {
-			msgID = ldap_simple_bind(ld, (t->host->ldapuser ? t->host->ldapuser : ""), 
-					 (t->host->ldappasswd ? t->host->ldappasswd : ""));
-		}
+	req->msgid = ldap_simple_bind(ld, (t->host->ldapuser ? t->host->ldapuser : ""), 
+				 (t->host->ldappasswd ? t->host->ldappasswd : ""));
+	if (req->msgid == -1) {
+		ldap_finish(req, XYMON_LDAP_BINDFAIL, "Cannot connect to server");
+		return 0;
+	}
 
-		/* Cancel any pending alarms */
-		alarm(0);
-		signal(SIGALRM, SIG_DFL);
+	req->ldapstate = LDAPSTATE_BINDING;
+	ldap_setdeadline(req, querytimeout);
+	return 1;
+}
 
-		/* Did we connect? */
-		if (connect_timeout || (msgID == -1)) {
-			req->ldapstatus = XYMON_LDAP_BINDFAIL;
-			req->output = "Cannot connect to server";
-			continue;
-		}
+static void ldap_searchresult(testitem_t *t, LDAPMessage *result)
+{
+	ldap_data_t *req = (ldap_data_t *) t->privdata;
+	LDAP *ld = (LDAP *)req->ld;
+	struct timespec endtime;
+	LDAPMessage *e;
+	strbuffer_t *response;
+	char buf[MAX_LINE_LEN];
 
-		/* Wait for bind to complete */
-		rc = 0; finished = 0; 
-		ldaptimeout.tv_sec = querytimeout;
-		ldaptimeout.tv_usec = 0L;
-		while( ! finished ) {
-			int rc2;
-
-			rc = ldap_result(ld, msgID, LDAP_MSG_ONE, &ldaptimeout, &result);
-			dbgprintf("ldap_result returned %d for ldap_simple_bind()\n", rc);
-			if(rc == -1) {
-				finished = 1;
-				req->ldapstatus = XYMON_LDAP_BINDFAIL;
-
-				if (result == NULL) {
-					errprintf("LDAP library problem - NULL result returned\n");
-					req->output = strdup("LDAP BIND failed\n");
-				}
-				else {
-					rc2 = ldap_result2error(ld, result, 1);
-					req->output = strdup(ldap_err2string(rc2));
+	getntimer(&endtime);
+
+	response = newstrbuffer(0);
+	sprintf(buf, "Searching LDAP for %s yields %d results:\n\n", 
+		t->testspec, ldap_count_entries(ld, result));
+	addtobuffer(response, buf);
+
+	for(e = ldap_first_entry(ld, result); (e != NULL); e = ldap_next_entry(ld, e) ) {
+		char 		*dn;
+		BerElement	*ber;
+		char		*attribute;
+		char		**vals;
+
+		dn = ldap_get_dn(ld, e);
+		sprintf(buf, "DN: %s\n", dn); 
+		addtobuffer(response, buf);
+
+		/* Addtributes and values */
+		for (attribute = ldap_first_attribute(ld, e, &ber); (attribute != NULL); attribute = ldap_next_attribute(ld, e, ber) ) {
+			if ((vals = ldap_get_values(ld, e, attribute)) != NULL) {
+				int i;
+
+				for(i = 0; (vals[i] != NULL); i++) {
+					sprintf(buf, "\t%s: %s\n", attribute, vals[i]);
+					addtobuffer(response, buf);
 				}
-				ldap_unbind(ld);
 			}
-			else if (rc == 0) {
-				finished = 1;
-				req->ldapstatus = XYMON_LDAP_BINDFAIL;
-				req->output = strdup("Connection timeout");
-				ldap_unbind(ld);
+			/* Free memory used to store values */
+			ldap_value_free(vals);
+		}
+
+		/* Free memory used to store attribute */
+		ldap_memfree(attribute);
+		ldap_memfree(dn);
+		if (ber != NULL) ber_free(ber, 0);
+
+		addtobuffer(response, "\n");
+	}
+	req->ldapstatus = XYMON_LDAP_OK;
+	req->output = grabstrbuffer(response);
+	tvdiff(&req->starttime, &endtime, &req->duration);
+}
+
+static void ldap_progress(testitem_t *t, int querytimeout)
+{
+	/* Pick up a response for this test, if it is there */
+	ldap_data_t *req = (ldap_data_t *) t->privdata;
+	LDAP *ld = (LDAP *)req->ld;
+	LDAPURLDesc *ludp = (LDAPURLDesc *) req->ldapdesc;
+	LDAPMessage *result = NULL;
+	struct timeval polltimeout;
+	int rc, rc2;
+
+	/* Dont block - we know there is data, or we just want to check */
+	polltimeout.tv_sec = polltimeout.tv_usec = 0;
+	rc = ldap_result(ld, req->msgid, LDAP_MSG_ALL, &polltimeout, &result);
+	if (rc == 0) return;	/* Not complete yet */
+
+	switch (req->ldapstate) {
+	  case LDAPSTATE_BINDING:
+		dbgprintf("ldap_result returned %d for ldap_simple_bind()\n", rc);
+		if (rc == -1) {
+			if (result == NULL) {
+				errprintf("LDAP library problem - NULL result returned\n");
+				ldap_finish(req, XYMON_LDAP_BINDFAIL, strdup("LDAP BIND failed\n"));
 			}
-			else if( rc > 0 ) {
-				finished = 1;
-				if (result == NULL) {
-					errprintf("LDAP library problem - got a NULL resultcode for status %d\n", rc);
-					req->ldapstatus = XYMON_LDAP_BINDFAIL;
-					req->output = strdup("LDAP library problem: ldap_result2error returned a NULL result for status %d\n");
-					ldap_unbind(ld);
-				}
-				else {
-					rc2 = ldap_result2error(ld, result, 1);
-					if(rc2 != LDAP_SUCCESS) {
-						req->ldapstatus = XYMON_LDAP_BINDFAIL;
-						req->output = strdup(ldap_err2string(rc));
-						ldap_unbind(ld);
-					}
-				}
+			else {
+				rc2 = ldap_result2error(ld, result, 1);
+				ldap_finish(req, XYMON_LDAP_BINDFAIL, strdup(ldap_err2string(rc2)));
 			}
-		} /* ... while() */
+			return;
+		}
+		else if (result == NULL) {
+			errprintf("LDAP library problem - got a NULL resultcode for status %d\n", rc);
+			ldap_finish(req, XYMON_LDAP_BINDFAIL, strdup("LDAP library problem: ldap_result2error returned a NULL result"));
+			return;
+		}
+
+		rc2 = ldap_result2error(ld, result, 1);
+		if (rc2 != LDAP_SUCCESS) {
+			ldap_finish(req, XYMON_LDAP_BINDFAIL, strdup(ldap_err2string(rc2)));
+			return;
+		}
 
-		/* We're done connecting. If something went wrong, go to next query. */
-		if (req->ldapstatus != 0) continue;
+		/* Bound OK, now do the search. With a timeout */
+		polltimeout.tv_sec = querytimeout;
+		polltimeout.tv_usec = 0L;
+		rc = ldap_search_ext(ld, ludp->lud_dn, ludp->lud_scope, ludp->lud_filter, ludp->lud_attrs, 0, 
+				     NULL, NULL, &polltimeout, LDAP_NO_LIMIT, &req->msgid);
+		if (rc != LDAP_SUCCESS) {
+			req->msgid = -1;
+			ldap_finish(req, XYMON_LDAP_SEARCHFAILED, strdup(ldap_err2string(rc)));
+			return;
+		}
 
-		/* Now do the search. With a timeout */
-		ldaptimeout.tv_sec = querytimeout;
-		ldaptimeout.tv_usec = 0L;
-		rc = ldap_search_st(ld, ludp->lud_dn, ludp->lud_scope, ludp->lud_filter, ludp->lud_attrs, 0, &ldaptimeout, &result);
+		req->ldapstate = LDAPSTATE_SEARCHING;
+		ldap_setdeadline(req, querytimeout);
+		break;
+
+	  case LDAPSTATE_SEARCHING:
+		if ((rc == -1) || (result == NULL)) {
+			rc2 = ldap_get_option(ld, LDAP_OPT_RESULT_CODE, &rc);
+			if (rc2 != LDAP_OPT_SUCCESS) rc = LDAP_OTHER;
+			if (result) ldap_msgfree(result);
+			ldap_finish(req, XYMON_LDAP_SEARCHFAILED, strdup(ldap_err2string(rc)));
+			return;
+		}
 
-		if(rc == LDAP_TIMEOUT) {
-			req->ldapstatus = XYMON_LDAP_TIMEOUT;
-			req->output = strdup(ldap_err2string(rc));
-	  		ldap_unbind(ld);
-			continue;
+		rc = ldap_result2error(ld, result, 0);
+		if (rc == LDAP_TIMELIMIT_EXCEEDED) {
+			ldap_msgfree(result);
+			ldap_finish(req, XYMON_LDAP_TIMEOUT, strdup(ldap_err2string(LDAP_TIMEOUT)));
+		}
+		else if (rc != LDAP_SUCCESS) {
+			ldap_msgfree(result);
+			ldap_finish(req, XYMON_LDAP_SEARCHFAILED, strdup(ldap_err2string(rc)));
 		}
-		if( rc != LDAP_SUCCESS ) {
-			req->ldapstatus = XYMON_LDAP_SEARCHFAILED;
-			req->output = strdup(ldap_err2string(rc));
-	  		ldap_unbind(ld);
-			continue;
+		else {
+			req->msgid = -1;
+			ldap_searchresult(t, result);
+			ldap_msgfree(result);
+			ldap_finish(req, XYMON_LDAP_OK, NULL);
 		}
+		break;
 
-		getntimer(&endtime);
+	  default:
+		if (result) ldap_msgfree(result);
+		break;
+	}
+}
+#endif
 
-		response = newstrbuffer(0);
-		sprintf(buf, "Searching LDAP for %s yields %d results:\n\n", 
-			t->testspec, ldap_count_entries(ld, result));
-		addtobuffer(response, buf);
+void run_ldap_tests(service_t *ldaptest, int sslcertcheck, int querytimeout, int concurrency)
+{
+#ifdef XYMON_LDAP
+	/*
+	 * Run the LDAP tests in parallel. Up to "concurrency" tests are
+	 * active at any time; we poll() the LDAP sockets and pick up the
+	 * BIND and search results as they arrive. So a few hung servers
+	 * delay the LDAP tests by at most one timeout, not one timeout each.
+	 */
+	testitem_t *nexttest, *t;
+	struct pollfd *pfds;
+	testitem_t **pfdtests;
+	int activecount = 0;
 
-		for(e = ldap_first_entry(ld, result); (e != NULL); e = ldap_next_entry(ld, e) ) {
-			char 		*dn;
-			BerElement	*ber;
-			char		*attribute;
-			char		**vals;
-
-			dn = ldap_get_dn(ld, e);
-			sprintf(buf, "DN: %s\n", dn); 
-			addtobuffer(response, buf);
-
-			/* Addtributes and values */
-			for (attribute = ldap_first_attribute(ld, e, &ber); (attribute != NULL); attribute = ldap_next_attribute(ld, e, ber) ) {
-				if ((vals = ldap_get_values(ld, e, attribute)) != NULL) {
-					int i;
-
-					for(i = 0; (vals[i] != NULL); i++) {
-						sprintf(buf, "\t%s: %s\n", attribute, vals[i]);
-						addtobuffer(response, buf);
-					}
-				}
-				/* Free memory used to store values */
-				ldap_value_free(vals);
+	/* Pick a sensible default for the timeout and concurrency settings */
+	if (querytimeout == 0) querytimeout = 30;
+	if (concurrency == 0) concurrency = (FD_SETSIZE / 4);
+
+	pfds = (struct pollfd *)calloc(concurrency, sizeof(struct pollfd));
+	pfdtests = (testitem_t **)calloc(concurrency, sizeof(testitem_t *));
+
+	nexttest = ldaptest->items;
+	do {
+		struct timespec now;
+		int i, n, pfdcount, waitms;
+
+		/* Start some more tests */
+		while (nexttest && (activecount < concurrency)) {
+			t = nexttest; nexttest = nexttest->next;
+			if (((ldap_data_t *)t->privdata)->skiptest) continue;
+			if (ldap_start(t, querytimeout)) activecount++;
+		}
+
+		/* Find the sockets of the active tests, and how long we can wait */
+		getntimer(&now);
+		waitms = querytimeout * 1000;
+		pfdcount = 0;
+		for (t = ldaptest->items; (t); t = t->next) {
+			ldap_data_t *req = (ldap_data_t *)t->privdata;
+			int fd = -1;
+			long msleft;
+
+			if (req->skiptest || !req->ld || (req->ldapstate == LDAPSTATE_DONE)) continue;
+
+			msleft = (req->deadline.tv_sec - now.tv_sec) * 1000 + (req->deadline.tv_nsec - now.tv_nsec) / 1000000;
+			if (msleft <= 0) {
+				/* Timed out */
+				if (req->ldapstate == LDAPSTATE_BINDING)
+					ldap_finish(req, XYMON_LDAP_BINDFAIL, strdup("Connection timeout"));
+				else
+					ldap_finish(req, XYMON_LDAP_TIMEOUT, strdup(ldap_err2string(LDAP_TIMEOUT)));
+				activecount--;
+				continue;
 			}
+			if (msleft < waitms) waitms = msleft;
 
-			/* Free memory used to store attribute */
-			ldap_memfree(attribute);
-			ldap_memfree(dn);
-			if (ber != NULL) ber_free(ber, 0);
+			if ((ldap_get_option((LDAP *)req->ld, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS) || (fd < 0)) {
+				/* No socket to wait on - the deadline will catch it */
+				continue;
+			}
 
-			addtobuffer(response, "\n");
+			pfds[pfdcount].fd = fd;
+			pfds[pfdcount].events = POLLIN;
+			pfds[pfdcount].revents = 0;
+			pfdtests[pfdcount] = t;
+			pfdcount++;
 		}
-		req->ldapstatus = XYMON_LDAP_OK;
-		req->output = grabstrbuffer(response);
-		tvdiff(&starttime, &endtime, &req->duration);
 
-		ldap_msgfree(result);
-		ldap_unbind(ld);
-		ldap_free_urldesc(ludp);
+		if (activecount == 0) continue;
+
+		n = poll(pfds, pfdcount, waitms);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			errprintf("poll() failed while running LDAP tests: %s\n", strerror(errno));
+			break;
+		}
+
+		for (i = 0; (i < pfdcount); i++) {
+			ldap_data_t *req = (ldap_data_t *)pfdtests[i]->privdata;
+
+			if (pfds[i].revents == 0) continue;
+
+			ldap_progress(pfdtests[i], querytimeout);
+			if (req->ldapstate == LDAPSTATE_DONE) activecount--;
+		}
+	} while (nexttest || (activecount > 0));
+
+	/* Anything left over (after a poll() failure) is failed */
+	for (t = ldaptest->items; (t); t = t->next) {
+		ldap_data_t *req = (ldap_data_t *)t->privdata;
+
+		if (req->ld) ldap_finish(req, XYMON_LDAP_TIMEOUT, strdup(ldap_err2string(LDAP_TIMEOUT)));
 	}
+
+	xfree(pfds);
+	xfree(pfdtests);
 #endif
 }
 
@@ -571,7 +686,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (add_ldap_test(&item) == 0) {
-		run_ldap_tests(&ldapservice, 0, 10);
+		run_ldap_tests(&ldapservice, 0, 10, 0);
 		combo_start();
 		send_ldap_results(&ldapservice, &host, "", 0);
 		combo_end();
@@ -26,6 +26,10 @@
 
 #endif
 
+#define LDAPSTATE_BINDING	1
+#define LDAPSTATE_SEARCHING	2
+#define LDAPSTATE_DONE		3
+
 typedef struct {
 	void   *ldapdesc;		/* Result from ldap_url_parse() */
 	int    usetls;
@@ -41,6 +45,12 @@ typedef struct {
 	char   *certinfo;               /* Data about SSL certificate */
 	time_t certexpires;             /* Expiry time for SSL cert */
 	int    mincipherbits;
+
+	void   *ld;			/* LDAP session while the test runs */
+	int    ldapstate;		/* LDAPSTATE_* */
+	int    msgid;			/* Pending BIND or search request */
+	struct timespec starttime;
+	struct timespec deadline;	/* When the pending request times out */
 } ldap_data_t;
 
 extern char *ldap_library_version;
@@ -48,7 +58,7 @@ extern int  init_ldap_library(void);
 extern void shutdown_ldap_library(void);
 
 extern int  add_ldap_test(testitem_t *t);
-extern void run_ldap_tests(service_t *ldaptest, int sslcertcheck, int timeout);
+extern void run_ldap_tests(service_t *ldaptest, int sslcertcheck, int timeout, int concurrency);
 extern void show_ldap_test_results(service_t *ldaptest);
 extern void send_ldap_results(service_t *ldaptest, testedhost_t *host, char *nonetpage, int failgoesclear);
 
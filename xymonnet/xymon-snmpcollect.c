@@ -18,9 +18,16 @@ static char rcsid[] = "$Id: xymon-snmpcollect.c 6712 2011-07-31 21:01:52Z storne
 #include <net-snmp/net-snmp-includes.h>
 
 #include <limits.h>
+#include <sys/resource.h>
 
 #include "libxymon.h"
 
+#if defined(LINUX) && defined(NETSNMP_LARGE_FD_SET)
+/* Net-SNMP 5.5 or later, so we can hand it more sockets than select() handles */
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 /* -----------------  struct's used for the host/requests we need to do ---------------- */
 /* List of the OID's we will request */
 typedef struct oid_t {
@@ -60,16 +67,43 @@ typedef struct req_t {
 	struct snmp_session *sess;		/* SNMP session data */
 
 	keyrecord_t *keyrecords, *currentkey;	/* For keyed requests: Key records */
+	oid walkoid[MAX_OID_LEN];		/* Where the current table walk request starts */
+	size_t walkoidlen;
+	int maxrep;				/* Max-repetitions for GETBULK walks - adjusted as we go */
 
 	oid_t *oidhead, *oidtail;		/* List of the OID's we will fetch */
 	oid_t *curr_oid, *next_oid;		/* Current- and next-OID pointers while fetching data */
+	int curr_varcount;			/* Number of variables in the current GET request */
+	int maxvars;				/* Max. number of variables in one GET request */
+
+	struct snmp_pdu *delayedpdu;		/* Request waiting to be sent, when pacing a slow agent */
+	struct timespec sendtime;		/* When the delayed request can go */
+	struct timespec lastsend;		/* When we last sent a request to this agent */
+	long rtt;				/* Smoothed response time of the agent, in microseconds */
+	struct req_t *nextdelayed;
+
+	struct timespec walkstart;		/* Per-host statistics */
+	long walktime;				/* Milliseconds spent collecting data from the host */
+	int pdus, timeouts;
+
 	struct req_t *next;
 } req_t;
 
+/* Sessions we are done with. They cannot be closed inside a Net-SNMP callback */
+typedef struct closesess_t {
+	struct snmp_session *sess;
+	struct closesess_t *next;
+} closesess_t;
+
 
 /* Global variables */
 req_t *reqhead = NULL;				/* Holds the list of requests */
 int active_requests = 0;			/* Number of active SNMP requests in flight */
+req_t *delayedhead = NULL;			/* Hosts with a request waiting to be sent */
+closesess_t *closehead = NULL;			/* Sessions waiting to be closed */
+#ifdef USE_EPOLL
+int epollfd = -1;
+#endif
 
 /* dataoperation tracks what we are currently doing */
 enum { 
@@ -81,6 +115,12 @@ enum {
 int max_pending_requests = 30;
 int retries = 0;	/* Number of retries before timeout. 0 = Net-SNMP default (5). */
 long timeout = 0;	/* Number of uS until first timeout, then exponential backoff. 0 = Net-SNMP default (1 second). */
+int max_repetitions = 50;	/* Upper limit for the GETBULK max-repetitions */
+int max_getvars = 40;		/* Upper limit for the number of variables in one GET request */
+long agent_interval = 0;	/* Minimum time between two requests to the same agent, in uS */
+
+#define START_REPETITIONS 10	/* GETBULK max-repetitions for the first request to an agent */
+#define SLOW_AGENT 500000	/* Agents taking longer than this (uS) to respond get a pause between requests */
 
 /* Statistics */
 char *reportcolumn = NULL;
@@ -90,6 +130,7 @@ int okcount = 0;
 int toobigcount = 0;
 int timeoutcount = 0;
 int errorcount = 0;
+int bulkcount = 0;
 struct timeval starttv, endtv;
 
 
@@ -99,8 +140,27 @@ void startonehost(struct req_t *r, int ipchange);
 void starthosts(int resetstart);
 
 
+static int setsize(oid_t *owalk)
+{
+	int currentset = owalk->setnumber;
+	int result = 0;
+
+	while (owalk && (currentset == owalk->setnumber)) {
+		result++;
+		owalk = owalk->next;
+	}
+
+	return result;
+}
+
 struct snmp_pdu *generate_datarequest(req_t *item)
 {
+	/*
+	 * Build a GET request for the next set of OID's. SNMPv2c and v3
+	 * agents report missing OID's individually, so for those we pack
+	 * as many sets as we can into one request. With SNMPv1 a missing
+	 * OID fails the whole request, so we do one set at a time.
+	 */
 	struct snmp_pdu *req;
 	int currentset;
 
@@ -109,16 +169,160 @@ struct snmp_pdu *generate_datarequest(req_t *item)
 	req = snmp_pdu_create(SNMP_MSG_GET);
 	pducount++;
 	item->curr_oid = item->next_oid;
-	currentset = item->next_oid->setnumber;
-	while (item->next_oid && (currentset == item->next_oid->setnumber)) {
-		varcount++;
-		snmp_add_null_var(req, item->next_oid->Oid, item->next_oid->OidLen);
-		item->next_oid = item->next_oid->next;
+	item->curr_varcount = 0;
+	do {
+		currentset = item->next_oid->setnumber;
+		while (item->next_oid && (currentset == item->next_oid->setnumber)) {
+			varcount++;
+			item->curr_varcount++;
+			snmp_add_null_var(req, item->next_oid->Oid, item->next_oid->OidLen);
+			item->next_oid = item->next_oid->next;
+		}
+	} while ((item->version != SNMP_VERSION_1) && item->next_oid && 
+		 ((item->curr_varcount + setsize(item->next_oid)) <= item->maxvars));
+
+	return req;
+}
+
+struct snmp_pdu *generate_walkrequest(req_t *item, oid *name, size_t namelen)
+{
+	/* Get the next row(s) of a table. GETBULK if the agent can do it, GETNEXT for SNMPv1 */
+	struct snmp_pdu *req;
+
+	memmove(item->walkoid, name, namelen * sizeof(oid));
+	item->walkoidlen = namelen;
+
+	if (item->version == SNMP_VERSION_1) {
+		req = snmp_pdu_create(SNMP_MSG_GETNEXT);
 	}
+	else {
+		req = snmp_pdu_create(SNMP_MSG_GETBULK);
+		req->non_repeaters = 0;
+		req->max_repetitions = item->maxrep;
+		bulkcount++;
+	}
+	pducount++;
+	varcount++;
+	snmp_add_null_var(req, item->walkoid, item->walkoidlen);
 
 	return req;
 }
 
+static int inkeytable(req_t *req, struct variable_list *vp)
+{
+	/* Is this variable part of the key table we are walking ? */
+	if ((vp->type == SNMP_ENDOFMIBVIEW) || (vp->type == SNMP_NOSUCHOBJECT) || (vp->type == SNMP_NOSUCHINSTANCE)) return 0;
+
+	return ((vp->name_length >= req->currentkey->indexmethod->rootoidlen) && 
+		(memcmp(req->currentkey->indexmethod->rootoid, vp->name, req->currentkey->indexmethod->rootoidlen * sizeof(oid)) == 0));
+}
+
+static long usecsince(struct timespec *tstart)
+{
+	struct timespec now, diff;
+
+	getntimer(&now);
+	tvdiff(tstart, &now, &diff);
+	return (diff.tv_sec * 1000000 + diff.tv_nsec / 1000);
+}
+
+static int send_now(req_t *req, struct snmp_pdu *snmpreq)
+{
+	if (snmp_send(req->sess, snmpreq)) {
+		getntimer(&req->lastsend);
+		req->pdus++;
+		return 1;
+	}
+
+	snmp_sess_perror("snmp_send", req->sess);
+	snmp_free_pdu(snmpreq);
+	return 0;
+}
+
+int send_request(req_t *req, struct snmp_pdu *snmpreq)
+{
+	/*
+	 * Send a request, unless the agent needs a break. Slow agents get
+	 * a pause as long as their response time between requests, so
+	 * we never keep them busy more than half of the time.
+	 */
+	long pause = agent_interval;
+
+	if (req->rtt > SLOW_AGENT) pause = ((req->rtt > pause) ? req->rtt : pause);
+
+	if ((pause > 0) && (req->lastsend.tv_sec || req->lastsend.tv_nsec) && (usecsince(&req->lastsend) < pause)) {
+		req->sendtime.tv_sec = req->lastsend.tv_sec + (pause / 1000000);
+		req->sendtime.tv_nsec = req->lastsend.tv_nsec + (pause % 1000000) * 1000;
+		if (req->sendtime.tv_nsec >= 1000000000) {
+			req->sendtime.tv_sec++;
+			req->sendtime.tv_nsec -= 1000000000;
+		}
+
+		req->delayedpdu = snmpreq;
+		req->nextdelayed = delayedhead;
+		delayedhead = req;
+		return 1;
+	}
+
+	return send_now(req, snmpreq);
+}
+
+long send_delayed(void)
+{
+	/* Send the delayed requests that are due. Returns how many uS until the next one is due */
+	req_t *rwalk, *rprev, *rnext;
+	struct timespec now;
+	long nextdue = LONG_MAX;
+
+	getntimer(&now);
+
+	rwalk = delayedhead; rprev = NULL;
+	while (rwalk) {
+		long waittime = (rwalk->sendtime.tv_sec - now.tv_sec) * 1000000 + (rwalk->sendtime.tv_nsec - now.tv_nsec) / 1000;
+
+		rnext = rwalk->nextdelayed;
+		if (waittime <= 0) {
+			if (rprev) rprev->nextdelayed = rnext; else delayedhead = rnext;
+
+			if (!send_now(rwalk, rwalk->delayedpdu)) {
+				dbgprintf("Finished host %s\n", rwalk->hostname);
+				active_requests--;
+			}
+			rwalk->delayedpdu = NULL;
+		}
+		else {
+			if (waittime < nextdue) nextdue = waittime;
+			rprev = rwalk;
+		}
+
+		rwalk = rnext;
+	}
+
+	return nextdue;
+}
+
+void close_session(struct snmp_session *sess)
+{
+	closesess_t *newitem = (closesess_t *)malloc(sizeof(closesess_t));
+
+	newitem->sess = sess;
+	newitem->next = closehead;
+	closehead = newitem;
+}
+
+void close_sessions(void)
+{
+	/* Close the sessions of the hosts we are done with. This also removes the socket from the epoll set */
+	closesess_t *tmp;
+
+	while (closehead) {
+		tmp = closehead;
+		closehead = closehead->next;
+		snmp_close(tmp->sess);
+		xfree(tmp);
+	}
+}
+
 
 /*
  * Store data received in response PDU
@@ -147,71 +351,76 @@ int print_result (int status, req_t *req, struct snmp_pdu *pdu)
 				 * look through the unresolved keys to see if we have a match.
 				 * If we do, determine the index for data retrieval.
 				 */
-				vp = pdu->variables;
-				len = 0; sprint_realloc_value(&valstr, &valsz, &len, 1, vp->name, vp->name_length, vp);
-				len = 0; sprint_realloc_objid(&oidstr, &oidsz, &len, 1, vp->name, vp->name_length);
-				dbgprintf("Got key-oid '%s' = '%s'\n", oidstr, valstr);
-				for (kwalk = req->currentkey, done = 0; (kwalk && !done); kwalk = kwalk->next) {
-					/* Skip records where we have the result already, or that are not keyed */
-					if (kwalk->indexoid || (kwalk->indexmethod != req->currentkey->indexmethod)) {
-						continue;
-					}
-
-					keyoidlen = strlen(req->currentkey->indexmethod->keyoid);
-
-					switch (kwalk->indexmethod->idxtype) {
-					  case MIB_INDEX_IN_OID:
-						/* Does the key match the value we just got? */
-						if (*kwalk->key == '*') {
-							/* Match all. Add an extra key-record at the end. */
-							keyrecord_t *newkey;
-
-							newkey = (keyrecord_t *)calloc(1, sizeof(keyrecord_t));
-							memcpy(newkey, kwalk, sizeof(keyrecord_t));
-							newkey->indexoid = strdup(oidstr + keyoidlen + 1);
-							newkey->key = valstr; valstr = NULL;
-							newkey->next = kwalk->next;
-							kwalk->next = newkey;
-							done = 1;
-						}
-						else if (strcmp(valstr, kwalk->key) == 0) {
-							/* Grab the index part of the OID */
-							kwalk->indexoid = strdup(oidstr + keyoidlen + 1);
-							done = 1;
-						}
-						break;
-
-					  case MIB_INDEX_IN_VALUE:
-						/* Does the key match the index-part of the result OID? */
-						if (*kwalk->key == '*') {
-							/* Match all. Add an extra key-record at the end. */
-							keyrecord_t *newkey;
-
-							newkey = (keyrecord_t *)calloc(1, sizeof(keyrecord_t));
-							memcpy(newkey, kwalk, sizeof(keyrecord_t));
-							newkey->indexoid = valstr; valstr = NULL;
-							newkey->key = strdup(oidstr + keyoidlen + 1);
-							newkey->next = kwalk->next;
-							kwalk->next = newkey;
-							done = 1;
+				for (vp = pdu->variables; (vp && inkeytable(req, vp)); vp = vp->next_variable) {
+					len = 0; sprint_realloc_value(&valstr, &valsz, &len, 1, vp->name, vp->name_length, vp);
+					len = 0; sprint_realloc_objid(&oidstr, &oidsz, &len, 1, vp->name, vp->name_length);
+					dbgprintf("Got key-oid '%s' = '%s'\n", oidstr, valstr);
+					for (kwalk = req->currentkey, done = 0; (kwalk && !done); kwalk = kwalk->next) {
+						/* Skip records where we have the result already, or that are not keyed */
+						if (kwalk->indexoid || (kwalk->indexmethod != req->currentkey->indexmethod)) {
+							continue;
 						}
-						else if ((*(oidstr+keyoidlen) == '.') && (strcmp(oidstr+keyoidlen+1, kwalk->key)) == 0) {
-							/* 
-							 * Grab the index which is the value. 
-							 * Avoid a strdup by grabbing the valstr pointer.
-							 */
-							kwalk->indexoid = valstr; valstr = NULL; valsz = 0;
-							done = 1;
+
+						keyoidlen = strlen(req->currentkey->indexmethod->keyoid);
+
+						switch (kwalk->indexmethod->idxtype) {
+						  case MIB_INDEX_IN_OID:
+							/* Does the key match the value we just got? */
+							if (*kwalk->key == '*') {
+								/* Match all. Add an extra key-record at the end. */
+								keyrecord_t *newkey;
+
+								newkey = (keyrecord_t *)calloc(1, sizeof(keyrecord_t));
+								memcpy(newkey, kwalk, sizeof(keyrecord_t));
+								newkey->indexoid = strdup(oidstr + keyoidlen + 1);
+								newkey->key = valstr; valstr = NULL;
+								newkey->next = kwalk->next;
+								kwalk->next = newkey;
+								done = 1;
+							}
+							else if (strcmp(valstr, kwalk->key) == 0) {
+								/* Grab the index part of the OID */
+								kwalk->indexoid = strdup(oidstr + keyoidlen + 1);
+								done = 1;
+							}
+							break;
+
+						  case MIB_INDEX_IN_VALUE:
+							/* Does the key match the index-part of the result OID? */
+							if (*kwalk->key == '*') {
+								/* Match all. Add an extra key-record at the end. */
+								keyrecord_t *newkey;
+
+								newkey = (keyrecord_t *)calloc(1, sizeof(keyrecord_t));
+								memcpy(newkey, kwalk, sizeof(keyrecord_t));
+								newkey->indexoid = valstr; valstr = NULL;
+								newkey->key = strdup(oidstr + keyoidlen + 1);
+								newkey->next = kwalk->next;
+								kwalk->next = newkey;
+								done = 1;
+							}
+							else if ((*(oidstr+keyoidlen) == '.') && (strcmp(oidstr+keyoidlen+1, kwalk->key)) == 0) {
+								/* 
+								 * Grab the index which is the value. 
+								 * Avoid a strdup by grabbing the valstr pointer.
+								 */
+								kwalk->indexoid = valstr; valstr = NULL; valsz = 0;
+								done = 1;
+							}
+							break;
 						}
-						break;
 					}
+
+					/* valstr may have been grabbed by a key record */
+					if (valstr) xfree(valstr);
+					valstr = NULL; valsz = 0;
 				}
 				break;
 
 			  case GET_DATA:
 				owalk = req->curr_oid;
 				vp = pdu->variables;
-				while (vp) {
+				while (vp && owalk) {
 					valsz = len = 0;
 					sprint_realloc_value((unsigned char **)&owalk->result, &valsz, &len, 1, 
 							     vp->name, vp->name_length, vp);
@@ -257,24 +466,17 @@ int asynch_response(int operation, struct snmp_session *sp, int reqid, struct sn
 
 	if (operation == NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE) {
 		struct snmp_pdu *snmpreq = NULL;
-		int okoid = 1;
+		int retrywalk = 0;
+		long rtt;
 
-		if (dataoperation == GET_KEYS) {
-			/* 
-			 * We're doing GETNEXT's when retrieving keys, so we will get a response
-			 * which has nothing really to do with the data we're looking for. In that
-			 * case, we should NOT process data from this response.
-			 */
-			struct variable_list *vp = pdu->variables;
-
-			okoid = ((vp->name_length >= req->currentkey->indexmethod->rootoidlen) && 
-			         (memcmp(req->currentkey->indexmethod->rootoid, vp->name, req->currentkey->indexmethod->rootoidlen * sizeof(oid)) == 0));
-		}
+		/* Track how quickly the agent responds */
+		rtt = usecsince(&req->lastsend);
+		req->rtt = (req->rtt ? ((7 * req->rtt + rtt) / 8) : rtt);
 
 		switch (pdu->errstat) {
 		  case SNMP_ERR_NOERROR:
-			/* Pick up the results, but only if the OID is valid */
-			if (okoid) print_result(STAT_SUCCESS, req, pdu);
+			/* Pick up the results. Only OID's in the key table are used while walking it */
+			print_result(STAT_SUCCESS, req, pdu);
 			break;
 
 		  case SNMP_ERR_NOSUCHNAME:
@@ -287,7 +489,21 @@ int asynch_response(int operation, struct snmp_session *sp, int reqid, struct sn
 
 		  case SNMP_ERR_TOOBIG:
 			toobigcount++;
-			errprintf("Host %s item %s: Response too big\n", req->hostname, req->curr_oid->devname);
+			if ((dataoperation == GET_KEYS) && (req->version != SNMP_VERSION_1) && (req->maxrep > 1)) {
+				/* Ask for fewer rows at a time */
+				req->maxrep /= 2;
+				retrywalk = 1;
+				dbgprintf("Host %s: Response too big, max-repetitions now %d\n", req->hostname, req->maxrep);
+			}
+			else if ((dataoperation == GET_DATA) && (req->curr_varcount > setsize(req->curr_oid))) {
+				/* Ask for fewer variables at a time */
+				req->maxvars = (req->curr_varcount / 2);
+				req->next_oid = req->curr_oid;
+				dbgprintf("Host %s: Response too big, max. variables now %d\n", req->hostname, req->maxvars);
+			}
+			else {
+				errprintf("Host %s item %s: Response too big\n", req->hostname, req->curr_oid->devname);
+			}
 			break;
 
 		  default:
@@ -305,19 +521,24 @@ int asynch_response(int operation, struct snmp_session *sp, int reqid, struct sn
 			 * FIXME: Could optimize so we dont fetch the whole table, but only those rows we need.
 			 */
 			if (pdu->errstat == SNMP_ERR_NOERROR) {
-				struct variable_list *vp = pdu->variables;
-
-				if ( (vp->name_length >= req->currentkey->indexmethod->rootoidlen) && 
-				     (memcmp(req->currentkey->indexmethod->rootoid, vp->name, req->currentkey->indexmethod->rootoidlen * sizeof(oid)) == 0) ) {
-					/* Still more data in the current key table, get the next row */
-					snmpreq = snmp_pdu_create(SNMP_MSG_GETNEXT);
-					pducount++;
-					/* Probably only one variable to fetch, but never mind ... */
-					while (vp) {
-						varcount++;
-						snmp_add_null_var(snmpreq, vp->name, vp->name_length);
-						vp = vp->next_variable;
+				struct variable_list *vp, *lastvp = NULL;
+				int rowcount = 0;
+
+				for (vp = pdu->variables; (vp && inkeytable(req, vp)); vp = vp->next_variable) {
+					lastvp = vp;
+					rowcount++;
+				}
+
+				if (lastvp && !vp) {
+					/* Still more data in the current key table, get the next rows */
+					if (req->version != SNMP_VERSION_1) {
+						/* Adjust the number of rows we ask for to how well the agent copes */
+						if ((rtt > SLOW_AGENT) && (req->maxrep > 1)) 
+							req->maxrep /= 2;
+						else if ((rowcount >= req->maxrep) && (rtt < (SLOW_AGENT / 2)) && (req->maxrep < max_repetitions)) 
+							req->maxrep = ((2*req->maxrep > max_repetitions) ? max_repetitions : 2*req->maxrep);
 					}
+					snmpreq = generate_walkrequest(req, lastvp->name, lastvp->name_length);
 				}
 				else {
 					/* End of current key table. If more keys to be found, start the next table. */
@@ -326,14 +547,16 @@ int asynch_response(int operation, struct snmp_session *sp, int reqid, struct sn
 					} while (req->currentkey && req->currentkey->indexoid);
 
 					if (req->currentkey) {
-						snmpreq = snmp_pdu_create(SNMP_MSG_GETNEXT);
-						pducount++;
-						snmp_add_null_var(snmpreq, 
+						snmpreq = generate_walkrequest(req, 
 								  req->currentkey->indexmethod->rootoid, 
 								  req->currentkey->indexmethod->rootoidlen);
 					}
 				}
 			}
+			else if (retrywalk) {
+				/* Retry with the smaller max-repetitions */
+				snmpreq = generate_walkrequest(req, req->walkoid, req->walkoidlen);
+			}
 			break;
 
 		  case GET_DATA:
@@ -348,17 +571,11 @@ int asynch_response(int operation, struct snmp_session *sp, int reqid, struct sn
 		}
 
 		/* Send the request we just made */
-		if (snmpreq) {
-			if (snmp_send(req->sess, snmpreq))
-				goto finish;
-			else {
-				snmp_sess_perror("snmp_send", req->sess);
-				snmp_free_pdu(snmpreq);
-			}
-		}
+		if (snmpreq && send_request(req, snmpreq)) goto finish;
 	}
 	else {
 		dbgprintf("operation not succesful: %d\n", operation);
+		req->timeouts++;
 		print_result(STAT_TIMEOUT, req, pdu);
 	}
 
@@ -368,6 +585,11 @@ int asynch_response(int operation, struct snmp_session *sp, int reqid, struct sn
 	 */
 	dbgprintf("Finished host %s\n", req->hostname);
 	active_requests--;
+	req->walktime += (usecsince(&req->walkstart) / 1000);
+	if (req->sess == sp) {
+		close_session(req->sess);
+		req->sess = NULL;
+	}
 
 finish:
 	/* Start some more hosts */
@@ -386,15 +608,17 @@ void startonehost(struct req_t *req, int ipchange)
 
 	/* Are we retrying a cluster with a new IP? Then drop the current session */
 	if (req->sess && ipchange) {
-		/*
-		 * Apparently, we cannot close a session while in a callback.
-		 * So leave this for now - it will leak some memory, but
-		 * this is not a problem as long as we only run once.
-		 */
-		/* snmp_close(req->sess); */
+		/* We cannot close a session while in a callback, so this happens later */
+		close_session(req->sess);
 		req->sess = NULL;
 	}
 
+	if (!ipchange) {
+		getntimer(&req->walkstart);
+		if (req->maxrep == 0) req->maxrep = ((START_REPETITIONS < max_repetitions) ? START_REPETITIONS : max_repetitions);
+		if (req->maxvars == 0) req->maxvars = max_getvars;
+	}
+
 	/* Setup the SNMP session */
 	if (!req->sess) {
 		snmp_sess_init(&s);
@@ -465,13 +689,25 @@ void startonehost(struct req_t *req, int ipchange)
 			snmp_sess_perror("snmp_open", &s);
 			return;
 		}
+
+#ifdef USE_EPOLL
+		{
+			netsnmp_transport *transport = snmp_sess_transport(snmp_sess_pointer(req->sess));
+			struct epoll_event ev;
+
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.fd = transport->sock;
+			if (epoll_ctl(epollfd, EPOLL_CTL_ADD, transport->sock, &ev) == -1) {
+				errprintf("Cannot add SNMP socket for %s to epoll set: %s\n", req->hostname, strerror(errno));
+			}
+		}
+#endif
 	}
 
 	switch (dataoperation) {
 	  case GET_KEYS:
-		snmpreq = snmp_pdu_create(SNMP_MSG_GETNEXT);
-		pducount++;
-		snmp_add_null_var(snmpreq, req->currentkey->indexmethod->rootoid, req->currentkey->indexmethod->rootoidlen);
+		snmpreq = generate_walkrequest(req, req->currentkey->indexmethod->rootoid, req->currentkey->indexmethod->rootoidlen);
 		break;
 
 	  case GET_DATA:
@@ -482,13 +718,10 @@ void startonehost(struct req_t *req, int ipchange)
 
 	if (!snmpreq) return;
 
-	if (snmp_send(req->sess, snmpreq))
+	if (send_request(req, snmpreq))
 		active_requests++;
-	else {
+	else
 		errorcount++;
-		snmp_sess_perror("snmp_send", req->sess);
-		snmp_free_pdu(snmpreq);
-	}
 }
 
 
@@ -527,9 +760,11 @@ void stophosts(void)
 {
 	struct req_t *rwalk;
 
+	close_sessions();
 	for (rwalk = reqhead; (rwalk); rwalk = rwalk->next) {
 		if (rwalk->sess) {
 			snmp_close(rwalk->sess);
+			rwalk->sess = NULL;
 		}
 	}
 }
@@ -823,6 +1058,55 @@ void readconfig(char *cfgfn, int verbose)
 }
 
 
+#ifdef USE_EPOLL
+void communicate(void)
+{
+	/*
+	 * Each host has its own session (and socket), so with many hosts in flight
+	 * we may go beyond what select() can handle. Wait for the sockets via epoll,
+	 * and let Net-SNMP handle timeouts and retransmissions every 100 ms.
+	 */
+	struct epoll_event events[256];
+	netsnmp_large_fd_set readset;
+	struct rlimit lim;
+	struct timespec lasttimeout;
+
+	getrlimit(RLIMIT_NOFILE, &lim);
+	netsnmp_large_fd_set_init(&readset, ((lim.rlim_cur == RLIM_INFINITY) || (lim.rlim_cur > 65536)) ? 65536 : lim.rlim_cur);
+	getntimer(&lasttimeout);
+
+	/* loop while any active requests */
+	while (active_requests) {
+		int i, n, waitms = 100;
+		long nextdue;
+
+		nextdue = send_delayed();
+		if (nextdue < (waitms * 1000)) waitms = ((nextdue + 999) / 1000);
+
+		n = epoll_wait(epollfd, events, (sizeof(events) / sizeof(events[0])), waitms);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait failed");
+			exit(1);
+		}
+
+		if (n > 0) {
+			NETSNMP_LARGE_FD_ZERO(&readset);
+			for (i = 0; (i < n); i++) NETSNMP_LARGE_FD_SET(events[i].data.fd, &readset);
+			snmp_read2(&readset);
+		}
+
+		if (usecsince(&lasttimeout) >= 100000) {
+			snmp_timeout();
+			getntimer(&lasttimeout);
+		}
+
+		close_sessions();
+	}
+
+	netsnmp_large_fd_set_cleanup(&readset);
+}
+#else
 void communicate(void)
 {
 	/* loop while any active requests */
@@ -830,9 +1114,18 @@ void communicate(void)
 		int fds = 0, block = 1;
 		fd_set fdset;
 		struct timeval timeout;
+		long nextdue;
+
+		nextdue = send_delayed();
 
 		FD_ZERO(&fdset);
 		snmp_select_info(&fds, &fdset, &timeout, &block);
+		if ((nextdue != LONG_MAX) && (block || (nextdue < (timeout.tv_sec * 1000000 + timeout.tv_usec)))) {
+			/* Wake up when the next delayed request is due */
+			block = 0;
+			timeout.tv_sec = nextdue / 1000000;
+			timeout.tv_usec = nextdue % 1000000;
+		}
 		fds = select(fds, &fdset, NULL, NULL, block ? NULL : &timeout);
 		if (fds < 0) {
 			perror("select failed");
@@ -842,8 +1135,11 @@ void communicate(void)
 			snmp_read(&fdset);
 		else
 			snmp_timeout();
+
+		close_sessions();
 	}
 }
+#endif
 
 
 void resolvekeys(void)
@@ -997,6 +1293,45 @@ void sendresult(void)
 	freestrbuffer(clientmsg);
 }
 
+static int walktime_compare(const void *v1, const void *v2)
+{
+	req_t **r1 = (req_t **)v1;
+	req_t **r2 = (req_t **)v2;
+
+	if ((*r1)->walktime > (*r2)->walktime) return -1;
+	if ((*r1)->walktime < (*r2)->walktime) return 1;
+	return 0;
+}
+
+void hosttiming(void)
+{
+	/* Show the slowest hosts, and those that had timeouts */
+	char msgline[1024];
+	req_t **hosts, *rwalk;
+	int hostcount = 0, i, shown = 0;
+
+	for (rwalk = reqhead; (rwalk); rwalk = rwalk->next) hostcount++;
+	if (hostcount == 0) return;
+
+	hosts = (req_t **)malloc(hostcount * sizeof(req_t *));
+	for (rwalk = reqhead, i = 0; (rwalk); rwalk = rwalk->next) hosts[i++] = rwalk;
+	qsort(hosts, hostcount, sizeof(req_t *), walktime_compare);
+
+	addtostatus("\nSlowest hosts, and hosts with timeouts:\n");
+	sprintf(msgline, "%-40s %10s %6s %8s %8s\n", "Host", "Time (ms)", "PDUs", "Timeouts", "RTT (ms)");
+	addtostatus(msgline);
+	for (i = 0; ((i < hostcount) && (shown < 100)); i++) {
+		if ((i >= 20) && (hosts[i]->timeouts == 0)) continue;
+
+		snprintf(msgline, sizeof(msgline), "%-40s %10ld %6d %8d %8ld\n",
+			 hosts[i]->hostname, hosts[i]->walktime, hosts[i]->pdus, hosts[i]->timeouts, (hosts[i]->rtt / 1000));
+		addtostatus(msgline);
+		shown++;
+	}
+
+	xfree(hosts);
+}
+
 void egoresult(int color, char *egocolumn)
 {
 	char msgline[1024];
@@ -1022,6 +1357,8 @@ void egoresult(int color, char *egocolumn)
 	addtostatus(msgline);
 	sprintf(msgline, "Errors     : %d\n", errorcount);
 	addtostatus(msgline);
+	sprintf(msgline, "Bulk PDUs  : %d\n", bulkcount);
+	addtostatus(msgline);
 
 	show_timestamps(&timestamps);
 	if (timestamps) {
@@ -1029,6 +1366,8 @@ void egoresult(int color, char *egocolumn)
 		xfree(timestamps);
 	}
 
+	hosttiming();
+
 	finish_status();
 	combo_end();
 
@@ -1067,6 +1406,20 @@ int main (int argc, char **argv)
 			char *p = strchr(argv[argi], '=');
 			max_pending_requests = atoi(p+1);
 		}
+		else if (argnmatch(argv[argi], "--max-repetitions=")) {
+			char *p = strchr(argv[argi], '=');
+			max_repetitions = atoi(p+1);
+			if (max_repetitions < 1) max_repetitions = 1;
+		}
+		else if (argnmatch(argv[argi], "--max-getvars=")) {
+			char *p = strchr(argv[argi], '=');
+			max_getvars = atoi(p+1);
+			if (max_getvars < 1) max_getvars = 1;
+		}
+		else if (argnmatch(argv[argi], "--agent-interval=")) {
+			char *p = strchr(argv[argi], '=');
+			agent_interval = 1000*atol(p+1);
+		}
 		else if (argnmatch(argv[argi], "--report=")) {
 			char *p = strchr(argv[argi], '=');
 			reportcolumn = strdup(p+1);
@@ -1079,6 +1432,36 @@ int main (int argc, char **argv)
 
 	add_timestamp("xymon-snmpcollect startup");
 
+	{
+		/* Each active host has a socket open. Make sure we are allowed enough of them */
+		struct rlimit lim;
+
+		getrlimit(RLIMIT_NOFILE, &lim);
+		if ((lim.rlim_cur != RLIM_INFINITY) && (lim.rlim_cur < (max_pending_requests + 64))) {
+			lim.rlim_cur = max_pending_requests + 64;
+			if ((lim.rlim_max != RLIM_INFINITY) && (lim.rlim_cur > lim.rlim_max)) lim.rlim_cur = lim.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &lim);
+		}
+
+		if ((lim.rlim_cur != RLIM_INFINITY) && (max_pending_requests > (lim.rlim_cur - 64))) {
+			max_pending_requests = lim.rlim_cur - 64;
+			errprintf("Concurrency limited to %d by the max. number of open files\n", max_pending_requests);
+		}
+#ifdef USE_EPOLL
+		epollfd = epoll_create(max_pending_requests + 1);
+		if (epollfd == -1) {
+			errprintf("Cannot create epoll set: %s\n", strerror(errno));
+			return 1;
+		}
+#else
+		if (max_pending_requests > (FD_SETSIZE - 64)) {
+			max_pending_requests = FD_SETSIZE - 64;
+			errprintf("Concurrency limited to %d by select()\n", max_pending_requests);
+		}
+#endif
+		if (max_pending_requests < 1) max_pending_requests = 1;
+	}
+
 	netsnmp_register_loghandler(NETSNMP_LOGHANDLER_STDERR, 7);
 	init_snmp("xymon-snmpcollect");
 	snmp_mib_toggle_options("e");	/* Like -Pe: Dont show MIB parsing errors */
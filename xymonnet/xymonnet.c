@@ -23,6 +23,9 @@ static char rcsid[] = "$Id: xymonnet.c 6752 2011-09-09 08:12:02Z storner $";
 #include <rpc/rpc.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/file.h>
 
 #include "libxymon.h"
 
@@ -89,6 +92,7 @@ int		hostcount = 0;
 int		testcount = 0;
 int		notesthostcount = 0;
 char		**selectedhosts;
+char		**selectedtests = NULL;		/* Scheduler children: Tests to run for each selected host, NULL = all */
 int		selectedcount = 0;
 int		testuntagged = 0;
 time_t		frequenttestlimit = 1800;	/* Interval (seconds) when failing hosts are retried frequently */
@@ -105,6 +109,12 @@ int		extcmdtimeout = 30;
 int		bigfailure = 0;
 char		*defaultsourceip = NULL;
 int		loadhostsfromxymond = 0;
+int		schedinterval = 0;		/* --scheduler: Run continuously, spreading the tests over this interval */
+int		schedchildren = 4;		/* Max. number of scheduler children running tests at the same time */
+int		schedretest = 60;		/* Interval (seconds) for retesting failing hosts in scheduler mode */
+int		schedchild = 0;			/* Set in the scheduler children */
+int		schedfd = -1;			/* Pipe from a scheduler child back to the scheduler */
+int		statuslockfd = -1;
 
 void dump_hostlist(void)
 {
@@ -385,6 +395,38 @@ int wanted_host(void *host, char *netstring)
 	return 0;
 }
 
+static int sched_hastest(char *tests, char *testname)
+{
+	/* Scheduler test lists are " test1 test2 ... " */
+	char *p;
+	int n = strlen(testname);
+
+	for (p = strstr(tests, testname); (p); p = strstr(p+1, testname)) {
+		if ((*(p-1) == ' ') && (*(p+n) == ' ')) return 1;
+	}
+
+	return 0;
+}
+
+int wanted_test(char *hostname, char *testname)
+{
+	/*
+	 * A scheduler child may only retest some of the tests for a host.
+	 * With testname NULL, check if all of the tests for the host are run.
+	 */
+	int i;
+
+	if (selectedtests == NULL) return 1;
+
+	for (i=0; (i < selectedcount); i++) {
+		if (strcmp(selectedhosts[i], hostname) != 0) continue;
+		if (selectedtests[i] == NULL) return 1;
+		if (testname && sched_hastest(selectedtests[i], testname)) return 1;
+	}
+
+	return 0;
+}
+
 
 void load_tests(void)
 {
@@ -701,6 +743,9 @@ void load_tests(void)
 					if (option) *(option-1) = ':';
 				}
 
+				/* Scheduler retests only run the tests that failed */
+				if (s && !wanted_test(h->hostname, s->testname)) s = NULL;
+
 				if (s) {
 					testitem_t *newtest;
 
@@ -739,7 +784,7 @@ void load_tests(void)
 			testspec = xmh_item_walk(NULL);
 		}
 
-		if (pingtest && !h->noconn) {
+		if (pingtest && !h->noconn && wanted_test(h->hostname, pingtest->testname)) {
 			/* Add the ping check */
 			testitem_t *newtest;
 
@@ -915,15 +960,94 @@ void load_ping_status(void)
 	fclose(statusfd);
 }
 
+void lock_statusfiles(void)
+{
+	/* Scheduler children run in parallel, so they take turns updating the state files */
+	char fn[PATH_MAX];
+
+	sprintf(fn, "%s/xymonnet.%s.lock", xgetenv("XYMONTMP"), location);
+	statuslockfd = open(fn, O_RDWR|O_CREAT, 0664);
+	if (statuslockfd == -1) return;
+
+	while ((flock(statuslockfd, LOCK_EX) == -1) && (errno == EINTR)) ;
+}
+
+void unlock_statusfiles(void)
+{
+	if (statuslockfd != -1) {
+		close(statuslockfd);
+		statuslockfd = -1;
+	}
+}
+
+static int tested_now(service_t *service, char *hostname)
+{
+	/* Does this run have the status of this test for the host ? */
+	testitem_t *t;
+
+	if ((xtreeFind(testhosttree, hostname) != xtreeEnd(testhosttree)) && wanted_test(hostname, NULL)) return 1;
+
+	for (t = service->items; (t); t = t->next) {
+		if (strcmp(t->host->hostname, hostname) == 0) return 1;
+	}
+
+	return 0;
+}
+
+FILE *open_statusfile(service_t *service, char *statusfn, char *tmpfn, int *didany)
+{
+	FILE *statusfd, *oldfd;
+	char l[MAX_LINE_LEN];
+	char host[MAX_LINE_LEN];
+
+	if (!schedchild) return fopen(statusfn, "w");
+
+	/* A scheduler child only runs some of the tests, so keep the saved status of the others */
+	sprintf(tmpfn, "%s.%d", statusfn, (int)getpid());
+	statusfd = fopen(tmpfn, "w");
+	if (statusfd == NULL) return NULL;
+
+	oldfd = fopen(statusfn, "r");
+	if (oldfd) {
+		while (fgets(l, sizeof(l), oldfd)) {
+			if ((sscanf(l, "%s", host) == 1) && !tested_now(service, host)) {
+				fputs(l, statusfd);
+				*didany = 1;
+			}
+		}
+		fclose(oldfd);
+	}
+
+	return statusfd;
+}
+
+void close_statusfile(FILE *statusfd, char *statusfn, char *tmpfn, int didany)
+{
+	fclose(statusfd);
+
+	if (schedchild) {
+		if (didany) {
+			if (rename(tmpfn, statusfn) == -1) {
+				errprintf("Cannot rename %s to %s: %s\n", tmpfn, statusfn, strerror(errno));
+				unlink(tmpfn);
+			}
+			return;
+		}
+		unlink(tmpfn);
+	}
+
+	if (!didany) unlink(statusfn);
+}
+
 void save_ping_status(void)
 {
 	FILE *statusfd;
-	char statusfn[PATH_MAX];
+	char statusfn[PATH_MAX], tmpfn[PATH_MAX];
 	testitem_t *t;
 	int didany = 0;
 
 	sprintf(statusfn, "%s/ping.%s.status", xgetenv("XYMONTMP"), location);
-	statusfd = fopen(statusfn, "w");
+	statusfd = open_statusfile(pingtest, statusfn, tmpfn, &didany);
 	if (statusfd == NULL) return;
 
 	for (t=pingtest->items; (t); t = t->next) {
@@ -934,8 +1058,7 @@ void save_ping_status(void)
 		}
 	}
 
-	fclose(statusfd);
-	if (!didany) unlink(statusfn);
+	close_statusfile(statusfd, statusfn, tmpfn, didany);
 }
 
 void load_test_status(service_t *test)
@@ -979,12 +1102,12 @@ void load_test_status(service_t *test)
 void save_test_status(service_t *test)
 {
 	FILE *statusfd;
-	char statusfn[PATH_MAX];
+	char statusfn[PATH_MAX], tmpfn[PATH_MAX];
 	testitem_t *t;
 	int didany = 0;
 
 	sprintf(statusfn, "%s/%s.%s.status", xgetenv("XYMONTMP"), test->testname, location);
-	statusfd = fopen(statusfn, "w");
+	statusfd = open_statusfile(test, statusfn, tmpfn, &didany);
 	if (statusfd == NULL) return;
 
 	for (t=test->items; (t); t = t->next) {
@@ -995,8 +1118,7 @@ void save_test_status(service_t *test)
 		}
 	}
 
-	fclose(statusfd);
-	if (!didany) unlink(statusfn);
+	close_statusfile(statusfd, statusfn, tmpfn, didany);
 }
 
 
@@ -1927,6 +2049,555 @@ void send_sslcert_status(testedhost_t *host)
 	freestrbuffer(sslmsg);
 }
 
+/*
+ * Scheduler mode.
+ *
+ * Instead of testing all hosts in one burst, xymonnet keeps running and
+ * spreads the tests over the interval: Each host is tested at a fixed
+ * offset within the interval, derived from a hash of the hostname. Every
+ * few seconds a child process is forked to test the hosts that are due;
+ * the child runs the normal test engine with only those hosts selected.
+ *
+ * The schedule is keyed by host and interval. The full run of a host keeps
+ * all of its tests together, since the conn test decides how the other
+ * tests are reported and the sslcert column collects the certificates from
+ * all of them. Tests that are failing get a second schedule entry for the
+ * host, at the retest interval and with an offset of its own, which runs
+ * only those tests - like the xymonnet-again script does for normal runs.
+ */
+typedef struct schedhost_t {
+	char *key;			/* "hostname/interval" */
+	char *hostname;
+	char *tests;			/* Tests to run, NULL = all tests for the host */
+	unsigned int offset;		/* Hashed offset within the interval */
+	int interval;
+	time_t nextrun, laststart;
+	int generation;			/* Last hosts.cfg load that had this host */
+	int running;
+	char *failed;			/* Failing tests reported by the last run */
+	struct schedhost_t *peer;	/* The other entry for this host: Full run <-> retest */
+} schedhost_t;
+
+typedef struct schedchild_t {
+	pid_t pid;
+	int fd;
+	int hostcount;
+	schedhost_t **hosts;
+	strbuffer_t *output;
+	struct schedchild_t *next;
+} schedchild_t;
+
+static volatile int schedrunning = 1;
+static volatile int schedreload = 0;
+
+static void sched_sighandler(int signum)
+{
+	switch (signum) {
+	  case SIGTERM:
+	  case SIGINT:
+		schedrunning = 0;
+		break;
+	  case SIGHUP:
+		schedreload = 1;
+		break;
+	}
+}
+
+static unsigned int sched_hash(char *key)
+{
+	unsigned int h = 5381;
+	unsigned char *p;
+
+	for (p = (unsigned char *)key; (*p); p++) h = ((h << 5) + h) + *p;
+	return h;
+}
+
+static time_t sched_nextrun(schedhost_t *h, time_t after)
+{
+	/* The next time slot for this entry, at its offset in the interval */
+	time_t t;
+
+	t = after - (after % h->interval) + (h->offset % h->interval);
+	if (t <= after) t += h->interval;
+
+	return t;
+}
+
+static char *sched_key(char *hostname, int interval)
+{
+	static char *key = NULL;
+
+	if (key) xfree(key);
+	key = (char *)malloc(strlen(hostname) + 20);
+	sprintf(key, "%s/%d", hostname, interval);
+
+	return key;
+}
+
+static void sched_addtest(char **tests, char *testname)
+{
+	if (*tests == NULL) {
+		*tests = (char *)malloc(strlen(testname) + 3);
+		sprintf(*tests, " %s ", testname);
+	}
+	else if (!sched_hastest(*tests, testname)) {
+		*tests = (char *)realloc(*tests, strlen(*tests) + strlen(testname) + 2);
+		strcat(*tests, testname);
+		strcat(*tests, " ");
+	}
+}
+
+static schedhost_t *sched_newentry(void *schedtree, char *hostname, int interval, time_t now)
+{
+	schedhost_t *h;
+
+	h = (schedhost_t *)calloc(1, sizeof(schedhost_t));
+	h->key = strdup(sched_key(hostname, interval));
+	h->hostname = strdup(hostname);
+	h->offset = sched_hash(h->key);
+	h->interval = interval;
+	h->nextrun = sched_nextrun(h, now);
+	xtreeAdd(schedtree, h->key, h);
+
+	return h;
+}
+
+static void sched_freeentry(void *schedtree, schedhost_t *h)
+{
+	xtreeDelete(schedtree, h->key);
+	if (h->peer) h->peer->peer = NULL;
+	xfree(h->key);
+	xfree(h->hostname);
+	if (h->tests) xfree(h->tests);
+	if (h->failed) xfree(h->failed);
+	xfree(h);
+}
+
+static void sched_load_hosts(void *schedtree, int generation, time_t now)
+{
+	void *hwalk;
+	xtreePos_t handle;
+	schedhost_t *h, **stale = NULL;
+	int res, stalecount = 0, i;
+
+	if (loadhostsfromxymond) 
+		res = load_hostnames("@", NULL, fqdn);
+	else
+		res = load_hostnames(xgetenv("HOSTSCFG"), "netinclude", fqdn);
+	if (res != 0) {
+		errprintf("Cannot load host configuration, keeping the current schedule\n");
+		for (handle = xtreeFirst(schedtree); (handle != xtreeEnd(schedtree)); handle = xtreeNext(schedtree, handle)) {
+			h = (schedhost_t *)xtreeData(schedtree, handle);
+			h->generation = generation;
+		}
+		return;
+	}
+
+	for (hwalk = first_host(); (hwalk); hwalk = next_host(hwalk, 0)) {
+		char *hostname;
+
+		if (!wanted_host(hwalk, location)) continue;
+
+		hostname = xmh_item(hwalk, XMH_HOSTNAME);
+		handle = xtreeFind(schedtree, sched_key(hostname, schedinterval));
+		if (handle != xtreeEnd(schedtree)) {
+			h = (schedhost_t *)xtreeData(schedtree, handle);
+		}
+		else {
+			h = sched_newentry(schedtree, hostname, schedinterval, now);
+		}
+		h->generation = generation;
+		if (h->peer) h->peer->generation = generation;
+	}
+
+	/* Drop the hosts that have been removed from hosts.cfg, once their tests have finished */
+	for (handle = xtreeFirst(schedtree); (handle != xtreeEnd(schedtree)); handle = xtreeNext(schedtree, handle)) {
+		h = (schedhost_t *)xtreeData(schedtree, handle);
+		if ((h->generation == generation) || h->running || (h->peer && h->peer->running)) continue;
+
+		stale = (schedhost_t **)realloc(stale, (stalecount+1) * sizeof(schedhost_t *));
+		stale[stalecount++] = h;
+	}
+
+	for (i=0; (i < stalecount); i++) {
+		dbgprintf("Removing %s from the schedule\n", stale[i]->key);
+		sched_freeentry(schedtree, stale[i]);
+	}
+	if (stale) xfree(stale);
+}
+
+static schedchild_t *sched_start_child(schedhost_t **hosts, int hostcount)
+{
+	schedchild_t *newchild;
+	int pfd[2];
+	pid_t pid;
+	int i;
+
+	if (pipe(pfd) == -1) {
+		errprintf("Cannot create pipe: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		errprintf("Cannot fork test process: %s\n", strerror(errno));
+		close(pfd[0]); close(pfd[1]);
+		return NULL;
+	}
+	else if (pid == 0) {
+		/* Child: Test these hosts only */
+		close(pfd[0]);
+		schedfd = pfd[1];
+		schedchild = 1;
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGHUP, SIG_DFL);
+
+		selectedhosts = (char **)malloc(hostcount * sizeof(char *));
+		selectedtests = (char **)malloc(hostcount * sizeof(char *));
+		for (i=0; (i < hostcount); i++) {
+			selectedhosts[i] = hosts[i]->hostname;
+			selectedtests[i] = hosts[i]->tests;
+		}
+		selectedcount = hostcount;
+
+		return NULL;
+	}
+
+	close(pfd[1]);
+	fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+
+	newchild = (schedchild_t *)calloc(1, sizeof(schedchild_t));
+	newchild->pid = pid;
+	newchild->fd = pfd[0];
+	newchild->hostcount = hostcount;
+	newchild->hosts = (schedhost_t **)malloc(hostcount * sizeof(schedhost_t *));
+	memcpy(newchild->hosts, hosts, hostcount * sizeof(schedhost_t *));
+	newchild->output = newstrbuffer(0);
+
+	return newchild;
+}
+
+static int sched_child_done(schedchild_t *child, void *schedtree, int *retests)
+{
+	/*
+	 * The child reports the number of tests it ran, and the tests that
+	 * failed and should be retested soon. The full run of a host and its
+	 * retests never run at the same time, so the failing tests reported
+	 * are all of the failing tests for the host. Then the hosts are
+	 * scheduled for their next run.
+	 */
+	char *bol, *eol;
+	int tests = 0, i, j;
+	schedhost_t **fullrun;
+	int fullcount = 0;
+	time_t now = getcurrenttime(NULL);
+
+	for (i=0; (i < child->hostcount); i++) {
+		schedhost_t *h = child->hosts[i];
+
+		h->running = 0;
+		h->nextrun = sched_nextrun(h, h->laststart);
+		if (h->nextrun < now) h->nextrun = sched_nextrun(h, now);
+	}
+
+	bol = STRBUF(child->output);
+	while (bol && *bol) {
+		eol = strchr(bol, '\n'); if (eol) *eol = '\0';
+
+		if (strncmp(bol, "tests ", 6) == 0) {
+			tests = atoi(bol+6);
+		}
+		else if (strncmp(bol, "retest ", 7) == 0) {
+			char *hostname = bol+7;
+			char *testname = strchr(hostname, ' ');
+			xtreePos_t handle;
+
+			if (testname) {
+				*testname = '\0'; testname++;
+				handle = xtreeFind(schedtree, sched_key(hostname, schedinterval));
+				if (handle != xtreeEnd(schedtree)) {
+					schedhost_t *h = (schedhost_t *)xtreeData(schedtree, handle);
+					sched_addtest(&h->failed, testname);
+				}
+			}
+		}
+
+		bol = (eol ? eol+1 : NULL);
+	}
+
+	/* Update the retest entries of the hosts */
+	fullrun = (schedhost_t **)malloc(child->hostcount * sizeof(schedhost_t *));
+	for (i=0; (i < child->hostcount); i++) {
+		schedhost_t *h = (child->hosts[i]->tests ? child->hosts[i]->peer : child->hosts[i]);
+
+		if (h == NULL) continue;
+		for (j=0; ((j < fullcount) && (fullrun[j] != h)); j++) ;
+		if (j == fullcount) fullrun[fullcount++] = h;
+	}
+
+	for (i=0; (i < fullcount); i++) {
+		schedhost_t *h = fullrun[i];
+
+		if (h->failed && (schedretest < schedinterval)) {
+			if (h->peer == NULL) {
+				h->peer = sched_newentry(schedtree, h->hostname, schedretest, now);
+				h->peer->peer = h;
+			}
+			if (h->peer->tests) xfree(h->peer->tests);
+			h->peer->tests = h->failed;
+			h->peer->generation = h->generation;
+			h->failed = NULL;
+			(*retests)++;
+		}
+		else if (h->peer) {
+			sched_freeentry(schedtree, h->peer);
+		}
+
+		if (h->failed) xfree(h->failed);
+	}
+	xfree(fullrun);
+
+	return tests;
+}
+
+static void sched_report(char *egocolumn, time_t elapsed, int hosttotal, int runs, int hostruns, int tests, int retests,
+			 int deferred, time_t jittersum, time_t jittermax, int jittercount)
+{
+	char msgline[4096];
+	int color;
+
+	color = (errbuf ? COL_YELLOW : COL_GREEN);
+	if (deferred) color = COL_YELLOW;
+
+	combo_start();
+	init_status(color);
+	sprintf(msgline, "status+%d %s.%s %s %s\n\n", validity, xgetenv("MACHINE"), egocolumn, colorname(color), timestamp);
+	addtostatus(msgline);
+
+	sprintf(msgline, "xymonnet version %s, scheduler mode\n", VERSION);
+	addtostatus(msgline);
+
+	sprintf(msgline, "\nScheduler statistics for the last %d seconds:\n Interval (seconds)    : %8d\n Retest interval       : %8d\n Hosts scheduled       : %8d\n Test processes run    : %8d\n Host test runs        : %8d\n Hosts retested        : %8d\n Total test count      : %8d\n Tests per second      : %8.2f\n Start delay avg (sec) : %8.2f\n Start delay max (sec) : %8d\n Slots with all busy   : %8d\n",
+		(int)elapsed, schedinterval, schedretest, hosttotal, runs, hostruns, retests, tests,
+		(elapsed ? ((double)tests / elapsed) : 0.0),
+		(jittercount ? ((double)jittersum / jittercount) : 0.0), (int)jittermax, deferred);
+	addtostatus(msgline);
+
+	if (deferred) {
+		addtostatus("\n&yellow All test processes were busy when tests were due. Consider raising --scheduler-children\n");
+	}
+
+	if (errbuf) {
+		addtostatus("\n\nError output:\n");
+		addtostatus(errbuf);
+		flush_errbuf();
+	}
+
+	finish_status();
+	combo_end();
+}
+
+int run_scheduler(char *egocolumn)
+{
+	void *schedtree;
+	xtreePos_t handle;
+	schedhost_t **duehosts = NULL;
+	int duesize = 0;
+	schedchild_t *childhead = NULL, *cwalk, *cprev;
+	int childcount = 0, generation = 0;
+	int slice;
+	time_t now, lastload = 0, reportstart;
+	int hosttotal = 0, runs = 0, hostruns = 0, tests = 0, retests = 0, deferred = 0, jittercount = 0;
+	time_t jittersum = 0, jittermax = 0;
+	struct sigaction sa;
+
+	/* Start a test process every few seconds; about 60 slots per interval */
+	slice = schedinterval / 60;
+	if (slice < 1) slice = 1; else if (slice > 10) slice = 10;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sched_sighandler;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	schedtree = xtreeNew(strcasecmp);
+	reportstart = getcurrenttime(NULL);
+	dbgprintf("xymonnet scheduler started, interval %d seconds\n", schedinterval);
+
+	while (schedrunning) {
+		struct pollfd *pfds;
+		int duecount = 0, i, n, waitms;
+
+		now = getcurrenttime(NULL);
+
+		if (schedreload || (now >= (lastload + 60))) {
+			sched_load_hosts(schedtree, ++generation, now);
+			schedreload = 0;
+			lastload = now;
+		}
+
+		/* Pick up the hosts that are due */
+		hosttotal = 0;
+		for (handle = xtreeFirst(schedtree); (handle != xtreeEnd(schedtree)); handle = xtreeNext(schedtree, handle)) {
+			schedhost_t *h = (schedhost_t *)xtreeData(schedtree, handle);
+
+			if (h->generation != generation) continue;
+			if (h->tests == NULL) hosttotal++;
+			if (h->running || (h->peer && h->peer->running) || (h->nextrun > now)) continue;
+
+			if (duecount == duesize) {
+				duesize += 128;
+				duehosts = (schedhost_t **)realloc(duehosts, duesize * sizeof(schedhost_t *));
+			}
+			duehosts[duecount++] = h;
+		}
+
+		if (duecount && (childcount >= schedchildren)) {
+			dbgprintf("%d hosts due, but all test processes are busy\n", duecount);
+			deferred++;
+		}
+		else if (duecount) {
+			schedchild_t *newchild = sched_start_child(duehosts, duecount);
+
+			if (schedchild) {
+				/* In the child process: Go run the tests */
+				xtreeDestroy(schedtree);
+				return 0;
+			}
+
+			if (newchild) {
+				for (i=0; (i < duecount); i++) {
+					time_t delay = now - duehosts[i]->nextrun;
+
+					duehosts[i]->running = 1;
+					duehosts[i]->laststart = now;
+					jittersum += delay;
+					if (delay > jittermax) jittermax = delay;
+					jittercount++;
+				}
+				newchild->next = childhead;
+				childhead = newchild;
+				childcount++;
+				runs++;
+				hostruns += duecount;
+				dbgprintf("Started test process %d for %d hosts\n", (int)newchild->pid, duecount);
+			}
+		}
+
+		/* Collect results from the running tests until the next slot */
+		pfds = (childcount ? (struct pollfd *)calloc(childcount, sizeof(struct pollfd)) : NULL);
+		for (cwalk = childhead, n = 0; (cwalk); cwalk = cwalk->next) {
+			if (cwalk->fd == -1) continue;
+			pfds[n].fd = cwalk->fd;
+			pfds[n].events = POLLIN;
+			n++;
+		}
+
+		do {
+			waitms = (slice - (getcurrenttime(NULL) - now)) * 1000;
+			if (waitms < 0) waitms = 0;
+			i = poll(pfds, n, waitms);
+		} while ((i == -1) && (errno == EINTR) && schedrunning && !schedreload);
+
+		for (cwalk = childhead; (cwalk); cwalk = cwalk->next) {
+			char buf[4096];
+
+			while (cwalk->fd != -1) {
+				n = read(cwalk->fd, buf, sizeof(buf)-1);
+				if (n > 0) {
+					buf[n] = '\0';
+					addtobuffer(cwalk->output, buf);
+				}
+				else if ((n == 0) || (errno != EAGAIN)) {
+					close(cwalk->fd);
+					cwalk->fd = -1;
+				}
+				else break;
+			}
+		}
+		if (pfds) xfree(pfds);
+
+		/* Reap the children that have finished */
+		cwalk = childhead; cprev = NULL;
+		while (cwalk) {
+			schedchild_t *zombie;
+			int status;
+
+			if ((cwalk->fd != -1) || (waitpid(cwalk->pid, &status, WNOHANG) != cwalk->pid)) {
+				cprev = cwalk;
+				cwalk = cwalk->next;
+				continue;
+			}
+
+			if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+				errprintf("Test process %d for %d hosts failed\n", (int)cwalk->pid, cwalk->hostcount);
+			}
+			tests += sched_child_done(cwalk, schedtree, &retests);
+
+			zombie = cwalk;
+			cwalk = cwalk->next;
+			if (cprev) cprev->next = cwalk; else childhead = cwalk;
+			childcount--;
+
+			xfree(zombie->hosts);
+			freestrbuffer(zombie->output);
+			xfree(zombie);
+		}
+
+		/* Report how we are doing once per interval */
+		now = getcurrenttime(NULL);
+		if (now >= (reportstart + schedinterval)) {
+			if (egocolumn) {
+				sched_report(egocolumn, (now - reportstart), hosttotal, runs, hostruns, tests, retests,
+					     deferred, jittersum, jittermax, jittercount);
+			}
+			else {
+				dbgprintf("Scheduler: %d hosts, %d tests, %d test processes\n", hosttotal, tests, runs);
+			}
+
+			reportstart = now;
+			runs = hostruns = tests = retests = deferred = jittercount = 0;
+			jittersum = jittermax = 0;
+		}
+	}
+
+	errprintf("xymonnet scheduler stopping, waiting for %d test processes\n", childcount);
+	while (childcount && (wait(NULL) > 0)) childcount--;
+
+	return 1;
+}
+
+void report_to_scheduler(void)
+{
+	/* Tell the scheduler how many tests we ran, and which tests must be retested soon */
+	xtreePos_t handle;
+	service_t *s;
+	testitem_t *t;
+	FILE *fd;
+	time_t now = getcurrenttime(NULL);
+
+	fd = fdopen(schedfd, "w");
+	if (fd == NULL) return;
+
+	fprintf(fd, "tests %d\n", testcount);
+	for (handle = xtreeFirst(svctree); handle != xtreeEnd(svctree); handle = xtreeNext(svctree, handle)) {
+		s = (service_t *)xtreeData(svctree, handle);
+
+		for (t = s->items; (t); t = t->next) {
+			int downcount = ((s == pingtest) ? t->host->downcount : t->downcount);
+			time_t downstart = ((s == pingtest) ? t->host->downstart : t->downstart);
+
+			if (t->internal || (downcount == 0)) continue;
+			if ((now - downstart) < frequenttestlimit) fprintf(fd, "retest %s %s\n", t->host->hostname, s->testname);
+		}
+	}
+
+	fclose(fd);
+	schedfd = -1;
+}
+
 int main(int argc, char *argv[])
 {
 	xtreePos_t handle;
@@ -1993,6 +2664,10 @@ int main(int argc, char *argv[])
 			char *fn = strchr(argv[argi], '=');
 			dnsfaillog = fopen(fn+1, "w");
 		}
+		else if (argnmatch(argv[argi], "--dns-cache=") || (strcmp(argv[argi], "--dns-cache") == 0)) {
+			char *fn = strchr(argv[argi], '=');
+			dnscachefn = strdup(fn ? fn+1 : "");
+		}
 		else if (argnmatch(argv[argi], "--report=") || (strcmp(argv[argi], "--report") == 0)) {
 			char *p = strchr(argv[argi], '=');
 			if (p) {
@@ -2019,6 +2694,19 @@ int main(int argc, char *argv[])
 		else if (strcmp(argv[argi], "--loadhostsfromxymond") == 0) {
 			loadhostsfromxymond = 1;
 		}
+		else if (argnmatch(argv[argi], "--scheduler-children=")) {
+			char *p = strchr(argv[argi], '=');
+			p++; schedchildren = atoi(p);
+			if (schedchildren < 1) schedchildren = 1;
+		}
+		else if (argnmatch(argv[argi], "--scheduler-retest=")) {
+			char *p = strchr(argv[argi], '=');
+			p++; schedretest = atoi(p);
+		}
+		else if (argnmatch(argv[argi], "--scheduler=") || (strcmp(argv[argi], "--scheduler") == 0)) {
+			char *p = strchr(argv[argi], '=');
+			schedinterval = (p ? atoi(p+1) : runtimewarn);
+		}
 
 		/* Options for TCP tests */
 		else if (strcmp(argv[argi], "--checkresponse") == 0) {
@@ -2073,6 +2761,9 @@ int main(int argc, char *argv[])
 		}
 
 		/* Options for HTTP tests */
+		else if (strcmp(argv[argi], "--no-keepalive") == 0) {
+			httpkeepalive = 0;
+		}
 		else if (argnmatch(argv[argi], "--content=")) {
 			char *p = strchr(argv[argi], '=');
 			contenttestname = strdup(p+1);
@@ -2151,10 +2842,14 @@ int main(int argc, char *argv[])
 			printf("    --dns=[only|ip|standard]    : How IP's are decided\n");
 			printf("    --no-ares                   : Use the system resolver library for hostname lookups\n");
 			printf("    --dnslog=FILENAME           : Log failed hostname lookups to file FILENAME\n");
+			printf("    --dns-cache[=FILENAME]      : Keep resolved hostnames in a persistent cache between runs\n");
 			printf("    --report[=COLUMNNAME]       : Send a status report about the running of xymonnet\n");
 			printf("    --test-untagged             : Include hosts without a NET: tag in the test\n");
 			printf("    --frequenttestlimit=N       : Seconds after detecting failures in which we poll frequently\n");
 			printf("    --timelimit=N               : Warns if the complete test run takes longer than N seconds [TASKSLEEP]\n");
+			printf("    --scheduler[=N]             : Run continuously, spreading the tests over N seconds [TASKSLEEP]\n");
+			printf("    --scheduler-children=N      : Max. number of test processes running at once in scheduler mode [4]\n");
+			printf("    --scheduler-retest=N        : Retest failing hosts every N seconds in scheduler mode [60]\n");
 			printf("\nOptions for simple TCP service tests:\n");
 			printf("    --checkresponse             : Check response from known services\n");
 			printf("    --no-flags                  : Dont send extra xymonnet test flags\n");
@@ -2166,6 +2861,7 @@ int main(int argc, char *argv[])
 			printf("    --ping-tasks=N              : Run N ping tasks in parallel (default N=1)\n");
 			printf("\nOptions for HTTP/HTTPS (Web) tests:\n");
 			printf("    --content=COLUMNNAME        : Define default columnname for CONTENT checks (content)\n");
+			printf("    --no-keepalive              : Use a new connection for each HTTP request\n");
 			printf("\nOptions for SSL certificate tests:\n");
 			printf("    --ssl=COLUMNNAME            : Define columnname for SSL certificate checks (sslcert)\n");
 			printf("    --no-ssl                    : Disable SSL certificate check\n");
@@ -2201,6 +2897,12 @@ int main(int argc, char *argv[])
 	envcheck(reqenv);
 	fqdn = get_fqdn();
 
+	if (dnscachefn && (*dnscachefn == '\0')) {
+		xfree(dnscachefn);
+		dnscachefn = (char *)malloc(strlen(xgetenv("XYMONTMP")) + strlen("/xymonnet.dnscache") + 1);
+		sprintf(dnscachefn, "%s/xymonnet.dnscache", xgetenv("XYMONTMP"));
+	}
+
 	/* Setup SEGV handler */
 	setup_signalhandler(egocolumn ? egocolumn : "xymonnet");
 
@@ -2226,6 +2928,17 @@ int main(int argc, char *argv[])
 		printf("\n");
 	}
 
+	if (schedinterval > 0) {
+		if (schedretest <= 0) schedretest = schedinterval;
+
+		/* The scheduler only returns in the child processes, which then run the tests */
+		if (run_scheduler(egocolumn) != 0) return 0;
+
+		egocolumn = NULL;
+		timing = 0;
+		init_timestamp();
+	}
+
 	add_timestamp("xymonnet startup");
 
 	load_services();
@@ -2252,6 +2965,7 @@ int main(int argc, char *argv[])
 
 	/* Ping checks first */
 	if (pingtest && pingtest->items) pingrunning = (start_ping_service(pingtest) == 0);
+	if (schedchild && !pingrunning) load_ping_status();	/* Retests without a ping check use the saved status */
 
 	/* Load current status files */
 	for (handle = xtreeFirst(svctree); handle != xtreeEnd(svctree); handle = xtreeNext(svctree, handle)) {
@@ -2291,7 +3005,11 @@ int main(int argc, char *argv[])
 		add_timestamp(msg);
 		combo_start();
 		send_results(pingtest, failgoesclear);
-		if (selectedhosts == 0) save_ping_status();
+		if ((selectedhosts == 0) || schedchild) {
+			if (schedchild) lock_statusfiles();
+			save_ping_status();
+			unlock_statusfiles();
+		}
 		combo_end();
 		add_timestamp("PING test results sent");
 	}
@@ -2346,7 +3064,7 @@ int main(int argc, char *argv[])
 	for (t = ldaptest->items; (t); t = t->next) add_ldap_test(t);
 	add_timestamp("LDAP test engine setup completed");
 
-	run_ldap_tests(ldaptest, (ssltestname != NULL), timeout);
+	run_ldap_tests(ldaptest, (ssltestname != NULL), timeout, concurrency);
 	add_timestamp("LDAP tests executed");
 
 	if (debug) show_ldap_test_results(ldaptest);
@@ -2411,7 +3129,7 @@ int main(int argc, char *argv[])
 		send_http_results(httptest, h, h->firsthttp, nonetpage, failgoesclear);
 		send_content_results(httptest, h, nonetpage, contenttestname, failgoesclear);
 		send_ldap_results(ldaptest, h, nonetpage, failgoesclear);
-		if (ssltestname && !h->nosslcert) send_sslcert_status(h);
+		if (ssltestname && !h->nosslcert && wanted_test(h->hostname, NULL)) send_sslcert_status(h);
 	}
 
 	combo_end();
@@ -2431,20 +3149,29 @@ int main(int argc, char *argv[])
 	 * too much.
 	 *
 	 * So for now update the list only if we ran with no host-parameters.
+	 *
+	 * In scheduler mode the children each update the status of their
+	 * own hosts, and tell the scheduler which hosts to retest soon.
 	 */
-	if (selectedcount == 0) {
+	if (schedchild) lock_statusfiles();
+	if ((selectedcount == 0) || schedchild) {
 		/* Save current status files */
 		for (handle = xtreeFirst(svctree); handle != xtreeEnd(svctree); handle = xtreeNext(svctree, handle)) {
 			s = (service_t *)xtreeData(svctree, handle);
 			if (s != pingtest) save_test_status(s);
 		}
 		/* Save frequent-test list */
-		save_frequenttestlist(argc, argv);
+		if (schedchild) report_to_scheduler(); else save_frequenttestlist(argc, argv);
 	}
 
 	/* Save session cookies - every time */
 	save_session_cookies();
 
+	/* Save the DNS cache, after any background refreshes have completed */
+	dns_save_cache();
+	if (dnscachefn) add_timestamp("DNS cache saved");
+	unlock_statusfiles();
+
 	shutdown_ldap_library();
 	add_timestamp("xymonnet completed");
 
@@ -2485,9 +3212,22 @@ int main(int argc, char *argv[])
 		sprintf(msgline, "\nDNS statistics:\n # hostnames resolved  : %8d\n # succesful           : %8d\n # failed              : %8d\n # calls to dnsresolve : %8d\n",
 			dns_stats_total, dns_stats_success, dns_stats_failed, dns_stats_lookups);
 		addtostatus(msgline);
-		sprintf(msgline, "\nTCP test statistics:\n # TCP tests total     : %8d\n # HTTP tests          : %8d\n # Simple TCP tests    : %8d\n # Connection attempts : %8d\n # bytes written       : %8ld\n # bytes read          : %8ld\n",
+		if (dns_stats_latency_count > 0) {
+			sprintf(msgline, " Resolve time avg (ms) : %8lu\n Resolve time max (ms) : %8lu\n",
+				dns_stats_latency_total / dns_stats_latency_count, dns_stats_latency_max);
+			addtostatus(msgline);
+		}
+		if (dnscachefn) {
+			int cachelookups = dns_stats_cachehits + dns_stats_latency_count;
+
+			sprintf(msgline, " # cache hits          : %8d\n Cache hit ratio (%%)   : %8d\n # background refresh  : %8d\n # failed refreshes    : %8d\n",
+				dns_stats_cachehits, (cachelookups ? (100*dns_stats_cachehits / cachelookups) : 0),
+				dns_stats_refreshes, dns_stats_refreshfail);
+			addtostatus(msgline);
+		}
+		sprintf(msgline, "\nTCP test statistics:\n # TCP tests total     : %8d\n # HTTP tests          : %8d\n # Simple TCP tests    : %8d\n # Connection attempts : %8d\n # Connections re-used : %8d\n # SSL sessions resumed: %8d\n # bytes written       : %8ld\n # bytes read          : %8ld\n",
 			tcp_stats_total, tcp_stats_http, tcp_stats_plain, tcp_stats_connects, 
-			tcp_stats_written, tcp_stats_read);
+			tcp_stats_reused, tcp_stats_resumed, tcp_stats_written, tcp_stats_read);
 		addtostatus(msgline);
 
 		if (errbuf) {
@@ -12,12 +12,17 @@
 
 static char rcsid[] = "$Id: xymonping.c 6712 2011-07-31 21:01:52Z storner $";
 
+#ifdef LINUX
+#define _GNU_SOURCE	/* For sendmmsg() and recvmmsg() */
+#endif
+
 #include "config.h"
 
 #include <sys/types.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
@@ -32,6 +37,7 @@ static char rcsid[] = "$Id: xymonping.c 6712 2011-07-31 21:01:52Z storner $";
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
@@ -41,13 +47,63 @@ static char rcsid[] = "$Id: xymonping.c 6712 2011-07-31 21:01:52Z storner $";
 
 #define PING_PACKET_SIZE 64
 #define PING_MINIMUM_SIZE ICMP_MINLEN
-#define SENDLIMIT 100
+#define PING_BATCHSIZE 64	/* Max. number of packets handled by one sendmmsg/recvmmsg call */
+#define PING_RECVSIZE 512	/* Size of each receive buffer - replies are no larger than what we send */
+#define PING_SOCKBUFSZ (1024*1024)
+
+#if defined(MSG_WAITFORONE)
+/* Linux 2.6.33+ / glibc 2.14+ have sendmmsg() and recvmmsg() */
+#define HAVE_MMSG 1
+#else
+/* Emulate the batched socket calls with one sendmsg/recvmsg call per packet */
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+
+static int sendmmsg(int sock, struct mmsghdr *msgs, unsigned int count, int flags)
+{
+	unsigned int i;
+	ssize_t n;
+
+	for (i = 0; (i < count); i++) {
+		n = sendmsg(sock, &msgs[i].msg_hdr, flags);
+		if (n < 0) return ((i == 0) ? -1 : i);
+		msgs[i].msg_len = n;
+	}
+
+	return count;
+}
+
+static int recvmmsg(int sock, struct mmsghdr *msgs, unsigned int count, int flags, struct timespec *tmo)
+{
+	unsigned int i;
+	ssize_t n;
+
+	for (i = 0; (i < count); i++) {
+		n = recvmsg(sock, &msgs[i].msg_hdr, flags);
+		if (n < 0) return ((i == 0) ? -1 : i);
+		msgs[i].msg_len = n;
+	}
+
+	return count;
+}
+#endif
 
 typedef struct hostdata_t {
 	int id;
-	struct sockaddr_in addr;	/* Address of host to ping */
+	char ip[INET6_ADDRSTRLEN];	/* IP of the host, as text */
+	int family;			/* AF_INET or AF_INET6 */
+	union {
+		struct sockaddr sa;
+		struct sockaddr_in sin;
+		struct sockaddr_in6 sin6;
+	} addr;				/* Address of host to ping */
+	socklen_t addrlen;
+	int pendingpos;			/* Index in the pendinglist, or -1 if not pending */
 	int received;			/* how many ICMP_ECHO replies we've got */
-	struct timespec rtt_total;
+	unsigned long rtt_min, rtt_max, rtt_last;	/* Round-trip times in microseconds */
+	unsigned long long rtt_total, jitter_total;
 	struct hostdata_t *next;
 } hostdata_t;
 
@@ -55,7 +111,29 @@ hostdata_t *hosthead = NULL;
 int hostcount = 0;
 hostdata_t **hosts = NULL;	/* Array of pointers to the hostdata records, for fast acces via ID */
 int myicmpid;
-int senddelay = (1000000 / 50);	/* Delay between sending packets, in microseconds */
+int maxpps = 50;		/* Max. packets per second we send. 0 means no limit */
+int rttstats = 0;		/* Show min/avg/max/jitter round-trip times */
+
+/*
+ * The pending-list holds the ID's of the hosts we still need a response from
+ * in the current round. Entries [0..sentcount) have been sent a packet,
+ * entries [sentcount..pendingcount) are still waiting to be sent one.
+ * Hosts are removed in O(1) when they have responded, so we never have
+ * to scan the full host table while pinging.
+ */
+int *pendinglist = NULL;
+int pendingcount = 0;
+int sentcount = 0;
+
+/* Token-bucket used to pace the outgoing packets */
+double tokens = 0.0;
+double tokenburst = 1.0;
+struct timespec lastrefill;
+
+/* With kernel receive-timestamps, we must use the same clock for the send-timestamps */
+int kerneltimestamps = 0;
+
+unsigned long pktssent = 0, pktsrcvd = 0;
 
 /* This routine more or less taken from the "fping" source. Apparently by W. Stevens (public domain) */
 int calc_icmp_checksum(unsigned short *pkt, int pktlen)
@@ -82,6 +160,28 @@ int calc_icmp_checksum(unsigned short *pkt, int pktlen)
 }
 
 
+static void pingclock(struct timespec *tp)
+{
+#ifdef SO_TIMESTAMPNS
+	if (kerneltimestamps) {
+		clock_gettime(CLOCK_REALTIME, tp);
+		return;
+	}
+#endif
+
+	getntimer(tp);
+}
+
+
+static int isipaddr(char *s)
+{
+	struct in_addr in4;
+	struct in6_addr in6;
+
+	return ((inet_pton(AF_INET, s, &in4) == 1) || (inet_pton(AF_INET6, s, &in6) == 1));
+}
+
+
 char *nextip(int argc, char *argv[], FILE *fd)
 {
 	static int argi = 0;
@@ -90,9 +190,7 @@ char *nextip(int argc, char *argv[], FILE *fd)
 
 	if (argi == 0) {
 		/* Check if there are any command-line IP's */
-		struct sockaddr_in ina;
-
-		for (argi=1; ((argi < argc) && (inet_aton(argv[argi], &ina.sin_addr) == 0)); argi++) ;
+		for (argi=1; ((argi < argc) && !isipaddr(argv[argi])); argi++) ;
 		cmdmode = (argi < argc);
 	}
 
@@ -115,13 +213,15 @@ char *nextip(int argc, char *argv[], FILE *fd)
 	return NULL;
 }
 
-void load_ips(int argc, char *argv[], FILE *fd)
+void load_ips(int argc, char *argv[], FILE *fd, int *v4count, int *v6count)
 {
 	char *l;
 	hostdata_t *tail = NULL;
 	hostdata_t *walk;
 	int i;
 
+	*v4count = *v6count = 0;
+
 	while ((l = nextip(argc, argv, fd)) != NULL) {
 		hostdata_t *newitem;
 
@@ -129,14 +229,27 @@ void load_ips(int argc, char *argv[], FILE *fd)
 
 		newitem = (hostdata_t *)calloc(1, sizeof(hostdata_t));
 
-		newitem->addr.sin_family = AF_INET;
-		newitem->addr.sin_port = 0;
-		if (inet_aton(l, &newitem->addr.sin_addr) == 0) {
+		if (inet_pton(AF_INET, l, &newitem->addr.sin.sin_addr) == 1) {
+			newitem->family = newitem->addr.sin.sin_family = AF_INET;
+			newitem->addrlen = sizeof(struct sockaddr_in);
+			inet_ntop(AF_INET, &newitem->addr.sin.sin_addr, newitem->ip, sizeof(newitem->ip));
+			(*v4count)++;
+		}
+		else if (inet_pton(AF_INET6, l, &newitem->addr.sin6.sin6_addr) == 1) {
+			newitem->family = newitem->addr.sin6.sin6_family = AF_INET6;
+			newitem->addrlen = sizeof(struct sockaddr_in6);
+			inet_ntop(AF_INET6, &newitem->addr.sin6.sin6_addr, newitem->ip, sizeof(newitem->ip));
+			(*v6count)++;
+		}
+		else {
 			errprintf("Dropping %s - not an IP\n", l);
-			free(newitem); 
+			free(newitem);
 			continue;
 		}
 
+		newitem->id = hostcount;
+		newitem->pendingpos = -1;
+
 		if (tail) {
 			tail->next = newitem;
 		}
@@ -151,6 +264,99 @@ void load_ips(int argc, char *argv[], FILE *fd)
 	hosts = (hostdata_t **)malloc((hostcount+1) * sizeof(hostdata_t *));
 	for (i=0, walk=hosthead; (walk); walk=walk->next, i++) hosts[i] = walk;
 	hosts[hostcount] = NULL;
+
+	pendinglist = (int *)malloc((hostcount+1) * sizeof(int));
+}
+
+
+void build_pending(int minresponses)
+{
+	int idx;
+
+	/* Setup the pending-list for a new round of pings */
+	pendingcount = sentcount = 0;
+	for (idx = 0; (idx < hostcount); idx++) {
+		if (hosts[idx]->received < minresponses) {
+			hosts[idx]->pendingpos = pendingcount;
+			pendinglist[pendingcount++] = idx;
+		}
+		else {
+			hosts[idx]->pendingpos = -1;
+		}
+	}
+}
+
+static void pending_swap(int pos1, int pos2)
+{
+	int tmp;
+
+	if (pos1 == pos2) return;
+
+	tmp = pendinglist[pos1];
+	pendinglist[pos1] = pendinglist[pos2];
+	pendinglist[pos2] = tmp;
+	hosts[pendinglist[pos1]]->pendingpos = pos1;
+	hosts[pendinglist[pos2]]->pendingpos = pos2;
+}
+
+void drop_pending(hostdata_t *host)
+{
+	int pos = host->pendingpos;
+
+	if (pos < 0) return;
+
+	/*
+	 * Remove a host from the pending list, keeping the sent/unsent
+	 * partitioning of the list intact.
+	 */
+	if (pos < sentcount) {
+		pending_swap(pos, sentcount-1);
+		pos = sentcount-1;
+		sentcount--;
+	}
+	pending_swap(pos, pendingcount-1);
+	pendingcount--;
+	host->pendingpos = -1;
+}
+
+
+/* Token-bucket pacing of the packets we send */
+static void init_tokens(void)
+{
+	/* Allow bursts of up to 1/20th of a second worth of packets */
+	tokenburst = (maxpps / 20);
+	if (tokenburst < 1.0) tokenburst = 1.0;
+	if (tokenburst > PING_BATCHSIZE) tokenburst = PING_BATCHSIZE;
+
+	tokens = tokenburst;
+	getntimer(&lastrefill);
+}
+
+static int available_tokens(void)
+{
+	struct timespec now;
+
+	if (maxpps <= 0) return PING_BATCHSIZE;
+
+	getntimer(&now);
+	tokens += ((now.tv_sec - lastrefill.tv_sec) + (now.tv_nsec - lastrefill.tv_nsec) / 1000000000.0) * maxpps;
+	if (tokens > tokenburst) tokens = tokenburst;
+	lastrefill = now;
+
+	return (int)tokens;
+}
+
+static void use_tokens(int count)
+{
+	if (maxpps > 0) tokens -= count;
+}
+
+static long token_wait(void)
+{
+	/* How many microseconds until we can send the next packet */
+	if ((maxpps <= 0) || (tokens >= 1.0)) return 0;
+
+	return (long)(((1.0 - tokens) * 1000000.0) / maxpps) + 1;
 }
 
 
@@ -161,86 +367,158 @@ typedef struct pingdata_t {
 } pingdata_t;
 
 
-int send_ping(int sock, int startidx, int minresponses)
+static int build_packet(unsigned char *buffer, hostdata_t *host)
+{
+	pingdata_t pingdata;
+	int hdrlen;
+
+	memset(buffer, 0, PING_PACKET_SIZE);
+
+	pingdata.id = host->id;
+	pingclock(&pingdata.timesent);
+
+	if (host->family == AF_INET) {
+		struct icmp *icmphdr = (struct icmp *)buffer;
+
+		hdrlen = sizeof(struct icmp);
+		icmphdr->icmp_type = ICMP_ECHO;
+		icmphdr->icmp_code = 0;
+		icmphdr->icmp_cksum = 0;
+		icmphdr->icmp_seq = htons(host->id & 0xFFFF);	/* So we can map response to our hosts */
+		icmphdr->icmp_id = htons(myicmpid);
+		memcpy(buffer + hdrlen, &pingdata, sizeof(pingdata));
+		icmphdr->icmp_cksum = calc_icmp_checksum((unsigned short *)buffer, PING_PACKET_SIZE);
+	}
+	else {
+		struct icmp6_hdr *icmphdr = (struct icmp6_hdr *)buffer;
+
+		/* The kernel calculates the checksum for ICMPv6 raw sockets */
+		hdrlen = sizeof(struct icmp6_hdr);
+		icmphdr->icmp6_type = ICMP6_ECHO_REQUEST;
+		icmphdr->icmp6_code = 0;
+		icmphdr->icmp6_seq = htons(host->id & 0xFFFF);
+		icmphdr->icmp6_id = htons(myicmpid);
+		memcpy(buffer + hdrlen, &pingdata, sizeof(pingdata));
+	}
+
+	return PING_PACKET_SIZE;
+}
+
+
+int send_pings(int sock4, int sock6, int maxcount, int *blocked)
 {
-	static unsigned char buffer[PING_PACKET_SIZE];
-	struct icmp *icmphdr;
-	struct pingdata_t *pingdata;
-	struct timezone tz;
-	int sentbytes;
-	int idx = startidx;
+	static unsigned char buffers[PING_BATCHSIZE][PING_PACKET_SIZE];
+	static struct iovec iov[PING_BATCHSIZE];
+	static struct mmsghdr msgs[PING_BATCHSIZE];
+	int family, batchcount, n, i, total = 0;
 
 	/*
-	 * Sends one ICMP "echo-request" packet.
-	 *
-	 * Note: A first attempt at this kept sending packets until
-	 * we got an EWOULDBLOCK or a send error. This causes incoming
-	 * responses to be dropped.
+	 * Send ICMP "echo-request" packets to the next hosts on the
+	 * pending list. Packets go out in batches of hosts with the same
+	 * address family, so each batch is a single sendmmsg() call.
 	 */
+	*blocked = 0;
+	if (maxcount > PING_BATCHSIZE) maxcount = PING_BATCHSIZE;
+
+	while ((total < maxcount) && (sentcount < pendingcount)) {
+		family = hosts[pendinglist[sentcount]]->family;
+
+		memset(msgs, 0, sizeof(msgs));
+		for (batchcount = 0;
+		     ((total+batchcount < maxcount) && (sentcount+batchcount < pendingcount) &&
+		      (hosts[pendinglist[sentcount+batchcount]]->family == family));
+		     batchcount++) {
+			hostdata_t *host = hosts[pendinglist[sentcount+batchcount]];
+
+			iov[batchcount].iov_base = buffers[batchcount];
+			iov[batchcount].iov_len = build_packet(buffers[batchcount], host);
+			msgs[batchcount].msg_hdr.msg_name = &host->addr.sa;
+			msgs[batchcount].msg_hdr.msg_namelen = host->addrlen;
+			msgs[batchcount].msg_hdr.msg_iov = &iov[batchcount];
+			msgs[batchcount].msg_hdr.msg_iovlen = 1;
+		}
 
-	/* Skip the hosts that have already delivered a ping response */
-	while ((idx < hostcount) && (hosts[idx]->received >= minresponses)) idx++;
-	if (idx >= hostcount) return hostcount;
+		n = sendmmsg(((family == AF_INET) ? sock4 : sock6), msgs, batchcount, 0);
 
-	/* 
-	 * Dont flood the net.
-	 * By enforcing a brief sleep here, we force a delay
-	 * between sending packets. It is easiest to do before sending
-	 * a packet, because if done after the send completes, then
-	 * it affects the RTT measurements.
-	 */
-	if (senddelay) usleep(senddelay);
+		if (n < 0) {
+			if ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == ENOBUFS)) {
+				*blocked = 1;
+				break;
+			}
 
-	/* Build the packet and send it */
-	memset(buffer, 0, PING_PACKET_SIZE);
+			errprintf("Failed to send ICMP packet to %s: %s\n",
+				  hosts[pendinglist[sentcount]]->ip, strerror(errno));
+			n = 1; /* To avoid looping indefinitely trying to send to this host */
+		}
+		else if (debug) {
+			for (i = 0; (i < n); i++) {
+				dbgprintf("Sent a ping to %s: index=%d, id=%d\n",
+					hosts[pendinglist[sentcount+i]]->ip, pendinglist[sentcount+i], myicmpid);
+			}
+		}
 
-	icmphdr = (struct icmp *)buffer;
-	icmphdr->icmp_type = ICMP_ECHO;
-	icmphdr->icmp_code = 0;
-	icmphdr->icmp_cksum = 0;
-	icmphdr->icmp_seq = htons(idx+1);	/* So we can map response to our hosts */
-	icmphdr->icmp_id = htons(myicmpid);
+		sentcount += n;
+		total += n;
+		pktssent += n;
 
-	pingdata = (struct pingdata_t *)(buffer + sizeof(struct icmp));
-	pingdata->id = idx;
-	getntimer(&pingdata->timesent);
+		/* Partial send means the socket buffer is full */
+		if (n < batchcount) {
+			*blocked = 1;
+			break;
+		}
+	}
+
+	return total;
+}
 
-	icmphdr->icmp_cksum = calc_icmp_checksum((unsigned short *)buffer, PING_PACKET_SIZE);
 
-	sentbytes = sendto(sock, buffer, PING_PACKET_SIZE, 0, 
-			   (struct sockaddr *) &hosts[idx]->addr, sizeof(struct sockaddr_in));
+static void record_response(hostdata_t *host, struct timespec *sent, struct timespec *rcvd, int minresponses)
+{
+	long long rtt_usecs;
 
-	if (sentbytes == -1) {
-		if (errno != EWOULDBLOCK) {
-			errprintf("Failed to send ICMP packet: %s\n", strerror(errno));
-			idx++; /* To avoid looping indefinitely trying to send to this host */
-		}
+	/* Calculate the round-trip time. */
+	rtt_usecs = ((long long)rcvd->tv_sec - sent->tv_sec)*1000000 + (rcvd->tv_nsec - sent->tv_nsec)/1000;
+	if (rtt_usecs < 0) rtt_usecs = 0;	/* Clock was stepped */
+
+	if (host->received == 0) {
+		host->rtt_min = host->rtt_max = rtt_usecs;
 	}
-	else if (sentbytes == PING_PACKET_SIZE) {
-		/* We managed to send a ping! */
-		if (debug) {
-			dbgprintf("Sent a ping to %s: index=%d, id=%d\n",
-				inet_ntoa(hosts[idx]->addr.sin_addr), idx, myicmpid);
-		}
-		idx++;
+	else {
+		if (rtt_usecs < host->rtt_min) host->rtt_min = rtt_usecs;
+		if (rtt_usecs > host->rtt_max) host->rtt_max = rtt_usecs;
+
+		/* Jitter is the mean difference between consecutive round-trip times */
+		host->jitter_total += ((rtt_usecs > host->rtt_last) ? (rtt_usecs - host->rtt_last) : (host->rtt_last - rtt_usecs));
 	}
 
-	return idx;
+	host->rtt_last = rtt_usecs;
+	host->rtt_total += rtt_usecs;
+	host->received += 1;
+
+	if (host->received >= minresponses) drop_pending(host);
 }
 
 
-int get_response(int sock)
+static int match_sender(hostdata_t *host, struct sockaddr_storage *addr)
 {
-	static unsigned char buffer[4096];
-	struct sockaddr_in addr;
-	int n, pktcount;
-	unsigned int addrlen;
-	struct ip *iphdr;
-	int iphdrlen;
-	struct icmp *icmphdr;
-	struct pingdata_t *pingdata;
-	int hostidx;
-	struct timespec rtt;
+	if (host->family == AF_INET) {
+		return (((struct sockaddr_in *)addr)->sin_addr.s_addr == host->addr.sin.sin_addr.s_addr);
+	}
+	else {
+		return (memcmp(&((struct sockaddr_in6 *)addr)->sin6_addr, &host->addr.sin6.sin6_addr, sizeof(struct in6_addr)) == 0);
+	}
+}
+
+
+int get_responses(int sock, int family, int minresponses)
+{
+	static unsigned char buffers[PING_BATCHSIZE][PING_RECVSIZE];
+	static unsigned char cbufs[PING_BATCHSIZE][256];
+	static struct sockaddr_storage addrs[PING_BATCHSIZE];
+	static struct iovec iov[PING_BATCHSIZE];
+	static struct mmsghdr msgs[PING_BATCHSIZE];
+	int n, i, pktcount;
+	struct timespec now;
 
 	/*
 	 * Read responses from the network.
@@ -249,134 +527,240 @@ int get_response(int sock)
 	 */
 	pktcount = 0;
 	do {
-		addrlen = sizeof(addr);
-		n = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&addr, &addrlen);
-		if (n < 0) {
-			if (errno != EWOULDBLOCK) errprintf("Failed to receive packet: %s\n", strerror(errno));
-			continue;
+		for (i = 0; (i < PING_BATCHSIZE); i++) {
+			iov[i].iov_base = buffers[i];
+			iov[i].iov_len = PING_RECVSIZE;
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = cbufs[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(cbufs[i]);
 		}
 
-		getntimer(&rtt);
-
-		/* Check the IP header - we need to have at least enough bytes for an ICMP header. */
-		iphdr = (struct ip *)buffer;
-		iphdrlen = (iphdr->ip_hl << 2);	/* IP header always aligned on 4-byte boundary */
-		if (n < (iphdrlen + PING_MINIMUM_SIZE)) {
-			errprintf("Short packet ignored\n");
-			continue;
-		}
-
-		/*
-		 * Get the ICMP header, and our host index which is the sequence number.
-		 * Thanks to "fping" for this neat way of matching requests and responses.
-		 */
-		icmphdr = (struct icmp *)(buffer + iphdrlen);
-		hostidx = ntohs(icmphdr->icmp_seq)-1;
-
-		if (debug) {
-			dbgprintf("Got packet from %s: type=%d, index=%d, id=%d\n",
-				inet_ntoa(addr.sin_addr), icmphdr->icmp_type, icmphdr->icmp_id, hostidx);
+		n = recvmmsg(sock, msgs, PING_BATCHSIZE, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if ((errno != EWOULDBLOCK) && (errno != EAGAIN) && (errno != EINTR))
+				errprintf("Failed to receive packet: %s\n", strerror(errno));
+			break;
 		}
 
-		switch (icmphdr->icmp_type) {
-		  case ICMP_ECHOREPLY:
-			if (ntohs(icmphdr->icmp_id) != myicmpid) {
-				/* Not one of our packets. Happens if someone else does ping simultaneously. */
-				break;
+		pingclock(&now);
+
+		for (i = 0; (i < n); i++) {
+			unsigned char *pkt = buffers[i];
+			int pktlen = msgs[i].msg_len;
+			struct timespec rcvd = now;
+			pingdata_t pingdata;
+			int icmptype, icmpid, icmpseq, hdrlen;
+			hostdata_t *host;
+#ifdef SO_TIMESTAMPNS
+			struct cmsghdr *cmsg;
+
+			for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); (cmsg); cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+				if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS)) {
+					memcpy(&rcvd, CMSG_DATA(cmsg), sizeof(rcvd));
+				}
 			}
+#endif
 
-			if ((hostidx >= 0) && (hostidx < hostcount)) {
-				/* Looks like one of our packets succeeded. */
-				pktcount++;
-				hosts[hostidx]->received += 1;
+			if (family == AF_INET) {
+				/* Check the IP header - we need to have at least enough bytes for an ICMP header. */
+				struct ip *iphdr = (struct ip *)pkt;
+				int iphdrlen = (iphdr->ip_hl << 2);	/* IP header always aligned on 4-byte boundary */
+				struct icmp *icmphdr;
 
-				pingdata = (struct pingdata_t *)(buffer + iphdrlen + sizeof(struct icmp));
+				if (pktlen < (iphdrlen + PING_MINIMUM_SIZE)) {
+					errprintf("Short packet ignored\n");
+					continue;
+				}
 
-				/* Calculate the round-trip time. */
-				rtt.tv_sec -= pingdata->timesent.tv_sec;
-				rtt.tv_nsec -= pingdata->timesent.tv_nsec;
-				if (rtt.tv_nsec < 0) {
-					rtt.tv_sec--;
-					rtt.tv_nsec += 1000000000;
+				icmphdr = (struct icmp *)(pkt + iphdrlen);
+				icmptype = icmphdr->icmp_type;
+				icmpid = ntohs(icmphdr->icmp_id);
+				icmpseq = ntohs(icmphdr->icmp_seq);
+				pkt += iphdrlen; pktlen -= iphdrlen;
+				hdrlen = sizeof(struct icmp);
+
+				if (icmptype != ICMP_ECHOREPLY) {
+					/*
+					 * ICMP_ECHO: Sometimes we see our own packets going out (if we ping ourselves)
+					 * ICMP_UNREACH: Ignored. Hosts get retried until we succeed, then reported as down.
+					 * ICMP_REDIRECT: Ignored - the IP stack handles this.
+					 */
+					if ((icmptype != ICMP_ECHO) && (icmptype != ICMP_UNREACH) && (icmptype != ICMP_REDIRECT)) {
+						errprintf("Got a packet that wasnt a reply - type %d\n", icmptype);
+					}
+					continue;
 				}
+			}
+			else {
+				/* ICMPv6 raw sockets do not deliver the IP header */
+				struct icmp6_hdr *icmphdr = (struct icmp6_hdr *)pkt;
 
-				/* Add RTT to the total time */
-				hosts[hostidx]->rtt_total.tv_sec += rtt.tv_sec;
-				hosts[hostidx]->rtt_total.tv_nsec += rtt.tv_nsec;
-				if (hosts[hostidx]->rtt_total.tv_nsec >= 1000000000) {
-					hosts[hostidx]->rtt_total.tv_sec++;
-					hosts[hostidx]->rtt_total.tv_nsec -= 1000000000;
+				if (pktlen < sizeof(struct icmp6_hdr)) {
+					errprintf("Short packet ignored\n");
+					continue;
 				}
+
+				icmptype = icmphdr->icmp6_type;
+				icmpid = ntohs(icmphdr->icmp6_id);
+				icmpseq = ntohs(icmphdr->icmp6_seq);
+				hdrlen = sizeof(struct icmp6_hdr);
+
+				if (icmptype != ICMP6_ECHO_REPLY) continue;
 			}
-			break;
 
-		  case ICMP_ECHO:
-			/* Sometimes, we see our own packets going out (if we ping ourselves) */
-			break;
+			if (icmpid != myicmpid) {
+				/* Not one of our packets. Happens if someone else does ping simultaneously. */
+				continue;
+			}
 
-		  case ICMP_UNREACH:
-			/* We simply ignore these. Hosts get retried until we succeed, then reported as down. */
-			break;
+			if (pktlen < (hdrlen + sizeof(pingdata))) {
+				errprintf("Short packet ignored\n");
+				continue;
+			}
 
-		  case ICMP_REDIRECT:
-			/* Ignored - the IP stack handles this. */
-			break;
+			/*
+			 * The host ID is in our payload, and its low 16 bits are the
+			 * sequence number. Thanks to "fping" for this neat way of matching
+			 * requests and responses.
+			 */
+			memcpy(&pingdata, pkt + hdrlen, sizeof(pingdata));
+			if ((pingdata.id < 0) || (pingdata.id >= hostcount) || ((pingdata.id & 0xFFFF) != icmpseq)) continue;
+			host = hosts[pingdata.id];
+			if ((host->family != family) || !match_sender(host, &addrs[i])) continue;
+
+			if (debug) {
+				dbgprintf("Got packet from %s: type=%d, index=%d, id=%d\n",
+					host->ip, icmptype, pingdata.id, icmpid);
+			}
 
-		  default:
-			/* Shouldn't happen */
-			errprintf("Got a packet that wasnt a reply - type %d\n", icmphdr->icmp_type);
-			break;
+			/* Looks like one of our packets succeeded. */
+			pktcount++;
+			record_response(host, &pingdata.timesent, &rcvd, minresponses);
 		}
-	} while (n > 0);
+	} while (n == PING_BATCHSIZE);
 
+	pktsrcvd += pktcount;
 	return pktcount;
 }
 
-int count_pending(int minresponses)
+
+static char *msecstr(unsigned long usecs)
 {
-	int result = 0;
-	int idx;
+	static char result[4][30];
+	static int idx = 0;
 
-	/* Counts how many hosts we haven't seen a reply from yet. */
-	for (idx = 0; (idx < hostcount); idx++)
-		if (hosts[idx]->received < minresponses) result++;
+	idx = ((idx + 1) % 4);
+	if (usecs >= 1000)
+		sprintf(result[idx], "%lu", usecs / 1000);
+	else
+		sprintf(result[idx], "0.%02lu", (usecs / 10));
 
-	return result;
+	return result[idx];
 }
 
 void show_results(void)
 {
 	int idx;
-	unsigned long rtt_usecs; /* Big enough for 2147 seconds - larger than we will ever see */
+	hostdata_t *host;
+	unsigned long rtt_usecs, jitter_usecs;
 
 	/*
 	 * Print out the results. Format is identical to "fping -Ae" so we can use
 	 * it directly in Xymon without changing the xymonnet code.
 	 */
 	for (idx = 0; (idx < hostcount); idx++) {
-		if (hosts[idx]->received > 0) {
-			printf("%s is alive", inet_ntoa(hosts[idx]->addr.sin_addr));
-			rtt_usecs = (hosts[idx]->rtt_total.tv_sec*1000000 + (hosts[idx]->rtt_total.tv_nsec / 1000)) / hosts[idx]->received;
-			if (rtt_usecs >= 1000) {
-				printf(" (%lu ms)\n", rtt_usecs / 1000);
-			}
-			else {
-				printf(" (0.%02lu ms)\n", (rtt_usecs / 10));
+		host = hosts[idx];
+
+		if (host->received > 0) {
+			rtt_usecs = host->rtt_total / host->received;
+			printf("%s is alive (%s ms)", host->ip, msecstr(rtt_usecs));
+
+			if (rttstats) {
+				jitter_usecs = ((host->received > 1) ? (host->jitter_total / (host->received - 1)) : 0);
+				printf(" min/avg/max/jitter = %s/%s/%s/%s ms",
+					msecstr(host->rtt_min), msecstr(rtt_usecs), msecstr(host->rtt_max), msecstr(jitter_usecs));
 			}
+			printf("\n");
 		}
 		else {
-			printf("%s is unreachable\n", inet_ntoa(hosts[idx]->addr.sin_addr));
+			printf("%s is unreachable\n", host->ip);
+		}
+	}
+}
+
+static int setup_socket(int family, int protonumber, char *srcip, int *binderr)
+{
+	int sock;
+
+	*binderr = 0;
+	sock = socket(family, SOCK_RAW, protonumber);
+	if (sock == -1) return -1;
+
+	if (srcip != NULL) {
+		/* Bind to a specific source address */
+		struct sockaddr_storage src_addr;
+		socklen_t src_len;
+
+		memset(&src_addr, 0, sizeof(src_addr));
+		if ((family == AF_INET) && (inet_pton(AF_INET, srcip, &((struct sockaddr_in *)&src_addr)->sin_addr) == 1)) {
+			src_addr.ss_family = AF_INET;
+			src_len = sizeof(struct sockaddr_in);
+			if (bind(sock, (struct sockaddr *) &src_addr, src_len) == -1) *binderr = errno;
+		}
+		else if ((family == AF_INET6) && (inet_pton(AF_INET6, srcip, &((struct sockaddr_in6 *)&src_addr)->sin6_addr) == 1)) {
+			src_addr.ss_family = AF_INET6;
+			src_len = sizeof(struct sockaddr_in6);
+			if (bind(sock, (struct sockaddr *) &src_addr, src_len) == -1) *binderr = errno;
 		}
 	}
+
+	return sock;
+}
+
+static void tune_socket(int sock, int family)
+{
+	int bufsz = PING_SOCKBUFSZ;
+#ifdef SO_TIMESTAMPNS
+	int on = 1;
+#endif
+
+	/* Set the socket non-blocking - we use select() exclusively */
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+
+	/* Large socket buffers, so bursts of replies are not dropped */
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(bufsz));
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsz, sizeof(bufsz));
+
+#ifdef SO_TIMESTAMPNS
+	/* Let the kernel timestamp the replies, so RTT's do not depend on how fast we process them */
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0) kerneltimestamps = 1;
+#endif
+
+#ifdef ICMP6_FILTER
+	if (family == AF_INET6) {
+		/* Only pass echo-replies to us */
+		struct icmp6_filter filter;
+
+		ICMP6_FILTER_SETBLOCKALL(&filter);
+		ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+		setsockopt(sock, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter));
+	}
+#endif
 }
 
 int main(int argc, char *argv[])
 {
 	struct protoent *proto;
-	int protonumber, pingsocket = -1, sockerr = 0, binderr = 0;
-	int argi, sendidx, pending, minresponses = 1, tries = 3, timeout = 5;
+	int protonumber, ping4socket = -1, ping6socket = -1;
+	int sock4err = 0, sock6err = 0, bind4err = 0, bind6err = 0;
+	int argi, minresponses = 1, tries = 3, timeout = 5;
+	int v4count, v6count, maxfd;
 	char *srcip = NULL;
-	struct sockaddr_in src_addr;
+	struct timespec starttime, endtime;
 
 	/* Immediately drop all root privileges. */
 	drop_root();
@@ -400,7 +784,10 @@ int main(int argc, char *argv[])
 		}
 		else if (strncmp(argv[argi], "--max-pps=", 10) == 0) {
 			char *delim = strchr(argv[argi], '=');
-			senddelay = (1000000 / atoi(delim+1));
+			maxpps = atoi(delim+1);
+		}
+		else if (strcmp(argv[argi], "--rtt-stats") == 0) {
+			rttstats = 1;
 		}
 		else if (strncmp(argv[argi], "--debug", 7) == 0) {
 			char *delim = strchr(argv[argi], '=');
@@ -408,15 +795,15 @@ int main(int argc, char *argv[])
 			if (delim) set_debugfile(delim+1, 0);
 		}
 		else if (strcmp(argv[argi], "--help") == 0) {
-			if (pingsocket >= 0) close(pingsocket);
-			fprintf(stderr, "%s [--retries=N] [--timeout=N] [--responses=N] [--max-pps=N] [--source=IP]\n", argv[0]);
+			fprintf(stderr, "%s [--retries=N] [--timeout=N] [--responses=N] [--max-pps=N] [--source=IP] [--rtt-stats]\n", argv[0]);
 			return 0;
 		}
 
 		/* fping compatibility options */
 		else if (strncmp(argv[argi], "-i", 2) == 0) {
+			/* Delay between packets, in microseconds */
 			char *val = argv[argi] + 2;
-			if (isdigit((int) *val)) senddelay = atoi(val);
+			if (isdigit((int) *val)) maxpps = ((atoi(val) > 0) ? (1000000 / atoi(val)) : 0);
 		}
 		else if (strncmp(argv[argi], "-r", 2) == 0) {
 			char *val = argv[argi] + 2;
@@ -431,111 +818,127 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	proto = getprotobyname("icmp");
-	protonumber = (proto ? proto->p_proto : 1);
-	if (srcip != NULL) {
-		/* Setup the source address */
-		src_addr.sin_family = AF_INET;
-		src_addr.sin_addr.s_addr = inet_addr(srcip);
-		src_addr.sin_port = htons(0);
-	}
+	if (minresponses < 1) minresponses = 1;
+
+	load_ips(argc, argv, stdin, &v4count, &v6count);
 
-	/* Get a raw socket. Requires root privs. */
+	/* Get the raw sockets. Requires root privs. */
 	get_root();
-	pingsocket = socket(AF_INET, SOCK_RAW, protonumber); sockerr = errno;
-	if ((pingsocket != -1) && (srcip != NULL)) {
-		/* Bind to a specific source address */
-		if (bind(pingsocket, (struct sockaddr *) &src_addr, sizeof(src_addr)) == -1) binderr = errno;
+	if (v4count > 0) {
+		proto = getprotobyname("icmp");
+		protonumber = (proto ? proto->p_proto : IPPROTO_ICMP);
+		ping4socket = setup_socket(AF_INET, protonumber, srcip, &bind4err); sock4err = errno;
+	}
+	if (v6count > 0) {
+		proto = getprotobyname("ipv6-icmp");
+		protonumber = (proto ? proto->p_proto : IPPROTO_ICMPV6);
+		ping6socket = setup_socket(AF_INET6, protonumber, srcip, &bind6err); sock6err = errno;
 	}
 	drop_root();
 
-	if (pingsocket == -1) {
-		errprintf("Cannot get RAW socket: %s\n", strerror(sockerr));
-		if (sockerr == EPERM) errprintf("This program must be installed suid-root\n");
+	if ((v4count > 0) && (ping4socket == -1)) {
+		errprintf("Cannot get RAW socket: %s\n", strerror(sock4err));
+		if (sock4err == EPERM) errprintf("This program must be installed suid-root\n");
+		return 3;
+	}
+	if ((v6count > 0) && (ping6socket == -1)) {
+		errprintf("Cannot get RAW IPv6 socket: %s\n", strerror(sock6err));
+		if (sock6err == EPERM) errprintf("This program must be installed suid-root\n");
 		return 3;
 	}
 
-	if ((srcip != NULL) && (binderr != 0)) {
+	if ((srcip != NULL) && ((bind4err != 0) || (bind6err != 0))) {
 		errprintf("Cannot bind to source address %s: %s\nUsing default address\n",
-			  srcip, strerror(binderr));
+			  srcip, strerror(bind4err ? bind4err : bind6err));
 	}
 
+	maxfd = -1;
+	if (ping4socket >= 0) { tune_socket(ping4socket, AF_INET); maxfd = ping4socket; }
+	if (ping6socket >= 0) { tune_socket(ping6socket, AF_INET6); if (ping6socket > maxfd) maxfd = ping6socket; }
 
-	/* Set the socket non-blocking - we use select() exclusively */
-	fcntl(pingsocket, F_SETFL, O_NONBLOCK);
-
-	load_ips(argc, argv, stdin);
-	pending = count_pending(minresponses);
+	init_tokens();
+	getntimer(&starttime);
+	build_pending(minresponses);
 
-	while (tries) {
-		int sendnow = SENDLIMIT;
+	while (tries && (pendingcount > 0)) {
+		int blocked = 0;
 		time_t cutoff = getcurrenttime(NULL) + timeout + 1;
-		sendidx = 0;
 
 		/* Change this on each iteration, so we dont mix packets from each round of pings */
 		myicmpid = ((getpid()+tries) & 0x7FFF);
 
 		/* Do one loop over the hosts we havent had responses from yet. */
-		while (pending > 0) {
+		while (pendingcount > 0) {
 			fd_set readfds, writefds;
 			struct timeval selecttmo;
+			long waitusecs = 100000;
 			int n;
 
+			if ((sentcount < pendingcount) && !blocked) {
+				int sendcount = available_tokens();
+
+				if (sendcount > 0) {
+					sendcount = send_pings(ping4socket, ping6socket, sendcount, &blocked);
+					use_tokens(sendcount);
+
+					/* Adjust the cutoff time, so we wait TIMEOUT seconds for a response */
+					cutoff = getcurrenttime(NULL) + timeout + 1;
+				}
+
+				if ((sentcount < pendingcount) && !blocked) {
+					long tokenwait = token_wait();
+					if (tokenwait < waitusecs) waitusecs = tokenwait;
+				}
+			}
+
 			FD_ZERO(&readfds);
 			FD_ZERO(&writefds);
-			FD_SET(pingsocket, &readfds);
-
-			if (sendnow && (sendidx < hostcount)) FD_SET(pingsocket, &writefds);
+			if (ping4socket >= 0) FD_SET(ping4socket, &readfds);
+			if (ping6socket >= 0) FD_SET(ping6socket, &readfds);
+			if (blocked) {
+				if (ping4socket >= 0) FD_SET(ping4socket, &writefds);
+				if (ping6socket >= 0) FD_SET(ping6socket, &writefds);
+			}
 
 			selecttmo.tv_sec = 0;
-			selecttmo.tv_usec = 100000;
-			n = select(pingsocket+1, &readfds, &writefds, NULL, &selecttmo);
+			selecttmo.tv_usec = waitusecs;
+			n = select(maxfd+1, &readfds, &writefds, NULL, &selecttmo);
 
 			if (n < 0) {
 				if (errno == EINTR) continue;
 				errprintf("select failed: %s\n", strerror(errno));
 				return 4;
 			}
-			else if (n == 0) {
-				/* Time out */
-				sendnow = SENDLIMIT;
-			}
-			else {
-				if (sendnow && FD_ISSET(pingsocket, &writefds)) {
-					/* OK to send */
-					sendidx = send_ping(pingsocket, sendidx, minresponses);
-					sendnow--;
+			else if (n > 0) {
+				if ((ping4socket >= 0) && FD_ISSET(ping4socket, &writefds)) blocked = 0;
+				if ((ping6socket >= 0) && FD_ISSET(ping6socket, &writefds)) blocked = 0;
 
-					/* Adjust the cutoff time, so we wait TIMEOUT seconds for a response */
-					cutoff = getcurrenttime(NULL) + timeout + 1;
-				}
-
-				if (FD_ISSET(pingsocket, &readfds)) {
-					/* Grab the replies */
-					int count = get_response(pingsocket);
-					pending -= count;
-					sendnow += count; if (sendnow > SENDLIMIT) sendnow = SENDLIMIT;
-				}
+				/* Grab the replies */
+				if ((ping4socket >= 0) && FD_ISSET(ping4socket, &readfds)) get_responses(ping4socket, AF_INET, minresponses);
+				if ((ping6socket >= 0) && FD_ISSET(ping6socket, &readfds)) get_responses(ping6socket, AF_INET6, minresponses);
 			}
 
 			/* See if we have hit the timeout */
-			if ((getcurrenttime(NULL) >= cutoff) && (sendidx >= hostcount)) {
-				pending = 0;
-			}
+			if ((getcurrenttime(NULL) >= cutoff) && (sentcount >= pendingcount)) break;
 		}
 
 		tries--;
-		pending = count_pending(minresponses);
-		if (pending == 0) {
-			/* Have got responses for all hosts - we're done */
-			tries = 0;
-		}
+		build_pending(minresponses);
 	}
 
-	close(pingsocket);
+	if (ping4socket >= 0) close(ping4socket);
+	if (ping6socket >= 0) close(ping6socket);
+
+	if (debug) {
+		struct timespec elapsed;
+
+		getntimer(&endtime);
+		tvdiff(&starttime, &endtime, &elapsed);
+		dbgprintf("Sent %lu packets, received %lu replies in %u.%03u seconds\n",
+			  pktssent, pktsrcvd, (unsigned int)elapsed.tv_sec, (unsigned int)(elapsed.tv_nsec / 1000000));
+	}
 
 	show_results();
 
 	return 0;
 }
-
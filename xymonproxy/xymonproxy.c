@@ -32,6 +32,11 @@ static char rcsid[] = "$Id: xymonproxy.c 6712 2011-07-31 21:01:52Z storner $";
 #include <ctype.h>
 #include <signal.h>
 #include <time.h>
+#ifdef LINUX
+/* epoll has no limit on the number of sockets, and does not need the full set passed for each wait */
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include "version.h"
 #include "libxymon.h"
@@ -76,11 +81,13 @@ typedef struct conn_t {
 	struct sockaddr_in caddr;
 	struct in_addr *clientip, *serverip;
 	int snum;
+	int sidx;		/* Index of the server we are connected to */
 	int ssocket;
 	int conntries, sendtries;
 	int connectpending;
 	time_t conntime;
 	int madetocombo;
+	int combofull;
 	struct timespec arrival;
 	struct timespec timelimit;
 	unsigned char *buf, *bufp, *bufpsave;
@@ -94,10 +101,9 @@ typedef struct conn_t {
 #define SEND_TRIES 2		/* How many times to try sending a message */
 #define BUFSZ_READ 2048		/* Minimum #bytes that must be free when read'ing into a buffer */
 #define BUFSZ_INC  8192		/* How much to grow the buffer when it is too small */
-#define MAX_OPEN_SOCKS 256
-#define MINIMUM_FOR_COMBO 2048	/* To start merging messages, at least have 2 KB free */
-#define MAXIMUM_FOR_COMBO 32768 /* Max. size of a combined message */
-#define COMBO_DELAY 250000000	/* Delay before sending a combo message (in nanoseconds) */
+#define COMBO_DELAY 250	/* Default delay before sending a combo message (in milliseconds) */
+#define COMBO_MAXSIZE 524288	/* Default max. size of a combined message */
+#define SERVER_CONNS 32		/* Default max. number of simultaneous connections to each server */
 
 int keeprunning = 1;
 time_t laststatus = 0;
@@ -105,6 +111,196 @@ char *logfile = NULL;
 int logdetails = 0;
 unsigned long msgs_timeout_from[P_CLEANUP+1] = { 0, };
 
+int combodelay = COMBO_DELAY;
+int combomaxsize = COMBO_MAXSIZE;
+int maxserverconns = SERVER_CONNS;
+int serverconns[MAX_SERVERS] = { 0, };
+int serverfreed = 0;
+int maxsockets = 0;
+int sockcount = 0;
+
+#define IO_READ  1
+#define IO_WRITE 2
+
+#ifdef USE_EPOLL
+/*
+ * The sockets stay in the epoll set between calls to io_wait(). Each time
+ * around the main loop we collect which sockets we want to wait for in
+ * fdwant[], and only tell the kernel about those that changed since the
+ * last time (fdwatch[]). fdready[] holds the result of the wait.
+ */
+static int epollfd = -1;
+static unsigned char *fdwant = NULL, *fdwatch = NULL, *fdready = NULL;
+static int fdtabsz = 0;
+#else
+static fd_set fdread, fdwrite;
+#endif
+static int fdmax = -1;
+
+static void io_init(void)
+{
+#ifdef USE_EPOLL
+	struct rlimit lim;
+
+	epollfd = epoll_create(1024);
+	if (epollfd == -1) {
+		errprintf("Cannot create epoll set: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	/* We want as many sockets as we can get */
+	if ((getrlimit(RLIMIT_NOFILE, &lim) == 0) && (lim.rlim_cur < lim.rlim_max)) {
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+#else
+	/* select() cannot handle file descriptors above FD_SETSIZE */
+	if ((maxsockets == 0) || (maxsockets > (FD_SETSIZE - 10))) maxsockets = FD_SETSIZE - 10;
+#endif
+}
+
+static void io_start(void)
+{
+#ifndef USE_EPOLL
+	FD_ZERO(&fdread);
+	FD_ZERO(&fdwrite);
+	fdmax = -1;
+#endif
+}
+
+static void io_want(int fd, int events)
+{
+	if (fd < 0) return;
+
+#ifdef USE_EPOLL
+	if (fd >= fdtabsz) {
+		int newsz = fd + 1024;
+
+		fdwant = (unsigned char *)realloc(fdwant, newsz);
+		fdwatch = (unsigned char *)realloc(fdwatch, newsz);
+		fdready = (unsigned char *)realloc(fdready, newsz);
+		memset(fdwant+fdtabsz, 0, newsz-fdtabsz);
+		memset(fdwatch+fdtabsz, 0, newsz-fdtabsz);
+		memset(fdready+fdtabsz, 0, newsz-fdtabsz);
+		fdtabsz = newsz;
+	}
+	fdwant[fd] |= events;
+#else
+	if (events & IO_READ) FD_SET(fd, &fdread);
+	if (events & IO_WRITE) FD_SET(fd, &fdwrite);
+#endif
+
+	if (fd > fdmax) fdmax = fd;
+}
+
+static int io_ready(int fd, int events)
+{
+	if (fd < 0) return 0;
+
+#ifdef USE_EPOLL
+	return ((fd < fdtabsz) && (fdready[fd] & events));
+#else
+	return (((events & IO_READ) && FD_ISSET(fd, &fdread)) || ((events & IO_WRITE) && FD_ISSET(fd, &fdwrite)));
+#endif
+}
+
+static int io_wait(int waitms)
+{
+#ifdef USE_EPOLL
+	struct epoll_event events[256];
+	int fd, i, n, newmax = -1;
+
+	for (fd = 0; (fd <= fdmax); fd++) {
+		fdready[fd] = 0;
+
+		if (fdwant[fd] != fdwatch[fd]) {
+			struct epoll_event ev;
+
+			memset(&ev, 0, sizeof(ev));
+			ev.events = ((fdwant[fd] & IO_READ) ? EPOLLIN : 0) | ((fdwant[fd] & IO_WRITE) ? EPOLLOUT : 0);
+			ev.data.fd = fd;
+
+			if (fdwant[fd] == 0) {
+				epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, &ev);
+			}
+			else if (fdwatch[fd] == 0) {
+				if ((epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) && 
+				    ((errno != EEXIST) || (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev) == -1))) {
+					errprintf("Cannot add socket to epoll set: %s\n", strerror(errno));
+				}
+			}
+			else {
+				if ((epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev) == -1) && 
+				    ((errno != ENOENT) || (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1))) {
+					errprintf("Cannot update socket in epoll set: %s\n", strerror(errno));
+				}
+			}
+
+			fdwatch[fd] = fdwant[fd];
+		}
+
+		fdwant[fd] = 0;
+		if (fdwatch[fd]) newmax = fd;
+	}
+	fdmax = newmax;
+
+	n = epoll_wait(epollfd, events, (sizeof(events) / sizeof(events[0])), waitms);
+	for (i = 0; (i < n); i++) {
+		fd = events[i].data.fd;
+		if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) fdready[fd] |= IO_READ;
+		if (events[i].events & (EPOLLOUT|EPOLLHUP|EPOLLERR)) fdready[fd] |= IO_WRITE;
+	}
+
+	return n;
+#else
+	struct timeval selecttmo;
+
+	selecttmo.tv_sec = waitms / 1000;
+	selecttmo.tv_usec = (waitms % 1000) * 1000;
+	return select(fdmax+1, &fdread, &fdwrite, NULL, &selecttmo);
+#endif
+}
+
+static void io_close(int fd)
+{
+	close(fd);
+	sockcount--;
+
+#ifdef USE_EPOLL
+	/* close() removes it from the epoll set */
+	if (fd < fdtabsz) fdwant[fd] = fdwatch[fd] = fdready[fd] = 0;
+#endif
+}
+
+static void close_client(conn_t *conn)
+{
+	if (conn->csocket >= 0) {
+		io_close(conn->csocket);
+		conn->csocket = -1;
+	}
+}
+
+static void close_server(conn_t *conn)
+{
+	if (conn->ssocket >= 0) {
+		io_close(conn->ssocket);
+		conn->ssocket = -1;
+		serverconns[conn->sidx]--;
+		serverfreed = 1;
+	}
+}
+
+static void settimelimit(struct timespec *limit, int msecs)
+{
+	getntimer(limit);
+	limit->tv_sec += msecs / 1000;
+	limit->tv_nsec += (msecs % 1000) * 1000000;
+	if (limit->tv_nsec >= 1000000000) {
+		limit->tv_sec++;
+		limit->tv_nsec -= 1000000000;
+	}
+}
+
 
 void sigmisc_handler(int signum)
 {
@@ -219,7 +415,6 @@ int main(int argc, char *argv[])
 	char *proxyname = NULL;
 	char *proxynamesvc = "xymonproxy";
 
-	int sockcount = 0;
 	int lsocket;
 	struct sockaddr_in laddr;
 	struct sockaddr_in xymonserveraddr[MAX_SERVERS];
@@ -227,6 +422,7 @@ int main(int argc, char *argv[])
 	int opt;
 	conn_t *chead = NULL;
 	struct sigaction sa;
+	char *msgtype;
 
 	/* Statistics info */
 	time_t startuptime = gettimer();
@@ -238,6 +434,7 @@ int main(int argc, char *argv[])
 	unsigned long msgs_status = 0;
 	unsigned long msgs_combo = 0;
 	unsigned long msgs_other = 0;
+	unsigned long msgs_compressed = 0;
 	unsigned long msgs_recovered = 0;
 	struct timespec timeinqueue = { 0, 0 };
 
@@ -300,6 +497,23 @@ int main(int argc, char *argv[])
 			char *p = strchr(argv[opt], '=');
 			listenq = atoi(p+1);
 		}
+		else if (argnmatch(argv[opt], "--max-sockets=")) {
+			char *p = strchr(argv[opt], '=');
+			maxsockets = atoi(p+1);
+		}
+		else if (argnmatch(argv[opt], "--server-connections=")) {
+			char *p = strchr(argv[opt], '=');
+			maxserverconns = atoi(p+1);
+		}
+		else if (argnmatch(argv[opt], "--combo-delay=")) {
+			char *p = strchr(argv[opt], '=');
+			combodelay = atoi(p+1);
+		}
+		else if (argnmatch(argv[opt], "--combo-size=")) {
+			char *p = strchr(argv[opt], '=');
+			combomaxsize = 1024*atoi(p+1);
+			if (combomaxsize < BUFSZ_INC) combomaxsize = BUFSZ_INC;
+		}
 		else if (strcmp(argv[opt], "--daemon") == 0) {
 			daemonize = 1;
 		}
@@ -352,6 +566,10 @@ int main(int argc, char *argv[])
 			printf("\t--report=[HOST.]SERVICE     : Sends a status message about proxy activity\n");
 			printf("\t--timeout=N                 : Communications timeout (seconds)\n");
 			printf("\t--lqueue=N                  : Listen-queue size\n");
+			printf("\t--max-sockets=N             : Max. number of open sockets (default: no limit)\n");
+			printf("\t--server-connections=N      : Max. simultaneous connections to each Xymon server\n");
+			printf("\t--combo-delay=N             : Max. time (ms) to hold status messages for combining\n");
+			printf("\t--combo-size=N              : Max. size (kB) of a combined message\n");
 			printf("\t--daemon                    : Run as a daemon\n");
 			printf("\t--no-daemon                 : Do not run as a daemon\n");
 			printf("\t--pidfile=FILENAME          : Save proces-ID of daemon to FILENAME\n");
@@ -437,16 +655,17 @@ int main(int argc, char *argv[])
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SIGUSR1, &sa, NULL);
 
+	io_init();
+
 	do {
-		fd_set fdread, fdwrite;
-		int maxfd;
 		struct timespec tmo;
-		struct timeval selecttmo;
-		int n, idx;
+		int n, idx, waitms;
 		conn_t *cwalk, *ctmp;
 		time_t ctime;
 		time_t now;
-		int combining = 0;
+		int combining = 0, slotwait = 0;
+		static time_t lasttimeoutcheck = 0;
+		static time_t acceptpause = 0;
 
 		/* See if it is time for a status report */
 		if (proxyname && ((now = gettimer()) >= (laststatus+300))) {
@@ -491,14 +710,20 @@ int main(int argc, char *argv[])
 			}
 
 			p = stentry->buf;
-			p += sprintf(p, "combo\nstatus %s green %s Proxy up %s\n\nxymonproxy for Xymon version %s\n\nProxy statistics\n\nIncoming messages        : %10lu (%lu msgs/second)\nOutbound messages        : %10lu\n\nIncoming message distribution\n- Combo messages         : %10lu\n- Status messages        : %10lu\n  Messages merged        : %10lu\n  Resulting combos       : %10lu\n- Other messages         : %10lu\n\nProxy ressources\n- Connection table size  : %10d\n- Buffer space           : %10lu kByte\n",
+			p += sprintf(p, "combo\nstatus %s green %s Proxy up %s\n\nxymonproxy for Xymon version %s\n\nProxy statistics\n\nIncoming messages        : %10lu (%lu msgs/second)\nOutbound messages        : %10lu\n\nIncoming message distribution\n- Combo messages         : %10lu\n- Status messages        : %10lu\n  Messages merged        : %10lu\n  Resulting combos       : %10lu\n- Other messages         : %10lu\n- Compressed (passed on) : %10lu\n\nProxy ressources\n- Connection table size  : %10d\n- Buffer space           : %10lu kByte\n- Open sockets           : %10d\n",
 				proxyname, timestamp, runtime_s, VERSION,
 				msgs_total, (msgs_total - msgs_total_last) / (now - laststatus),
 				msgs_delivered,
 				msgs_combo, 
 				msgs_status, msgs_merged, msgs_combined, 
-				msgs_other,
-				ccount, bufspace / 1024);
+				msgs_other, msgs_compressed,
+				ccount, bufspace / 1024, sockcount);
+			for (idx = 0; (idx < xymonservercount); idx++) {
+				char srvlabel[30];
+
+				sprintf(srvlabel, "Server %s", inet_ntoa(xymonserveraddr[idx].sin_addr));
+				p += sprintf(p, "- %-22s : %10d connections\n", srvlabel, serverconns[idx]);
+			}
 			p += sprintf(p, "\nTimeout/failure details\n");
 			p += sprintf(p, "- %-22s : %10lu\n", statename[P_REQ_READING], msgs_timeout_from[P_REQ_READING]);
 			p += sprintf(p, "- %-22s : %10lu\n", statename[P_REQ_CONNECTING], msgs_timeout_from[P_REQ_CONNECTING]);
@@ -519,19 +744,18 @@ int main(int argc, char *argv[])
 			stentry->state = P_REQ_READY;
 		}
 
-		FD_ZERO(&fdread);
-		FD_ZERO(&fdwrite);
-		maxfd = -1;
+		io_start();
 		combining = 0;
+		waitms = 1000;
+		serverfreed = 0;
 
 		for (cwalk = chead, idx=0; (cwalk); cwalk = cwalk->next, idx++) {
 			dbgprintf("state %d: %s\n", idx, statename[cwalk->state]);
 
-			/* First, handle any state transitions and setup the FD sets for select() */
+			/* First, handle any state transitions and tell which sockets we wait for */
 			switch (cwalk->state) {
 			  case P_REQ_READING:
-				FD_SET(cwalk->csocket, &fdread); 
-				if (cwalk->csocket > maxfd) maxfd = cwalk->csocket; 
+				io_want(cwalk->csocket, IO_READ);
 				break;
 
 			  case P_REQ_READY:
@@ -558,8 +782,19 @@ int main(int argc, char *argv[])
 				 * Note that since we started out as optimists and put a "combo\n"
 				 * at the front of the buffer, we need to skip that when looking at
 				 * what type of message it is. Hence the "cwalk->buf+6".
+				 *
+				 * Compressed messages are passed on as-is; the header tells us
+				 * what kind of message is inside. They are never merged into
+				 * combos, but any text we add after the compressed data is
+				 * appended to the message when xymond uncompresses it.
 				 */
-				if (strncmp(cwalk->buf+6, "client", 6) == 0) {
+				msgtype = cwalk->buf+6;
+				if (iscompressed(msgtype)) {
+					msgs_compressed++;
+					msgtype = compressed_type(cwalk->buf+6);
+				}
+
+				if (strncmp(msgtype, "client", 6) == 0) {
 					/*
 					 * "client" messages go to all Xymon servers, but
 					 * we will only pass back the response from one of them
@@ -577,10 +812,10 @@ int main(int argc, char *argv[])
 						cwalk->buflen += n;
 					}
 				}
-				else if ((strncmp(cwalk->buf+6, "query", 5) == 0)  ||
-				         (strncmp(cwalk->buf+6, "config", 6) == 0) ||
-				         (strncmp(cwalk->buf+6, "ping", 4) == 0) ||
-				         (strncmp(cwalk->buf+6, "download", 8) == 0)) {
+				else if ((strncmp(msgtype, "query", 5) == 0)  ||
+				         (strncmp(msgtype, "config", 6) == 0) ||
+				         (strncmp(msgtype, "ping", 4) == 0) ||
+				         (strncmp(msgtype, "download", 8) == 0)) {
 					/* 
 					 * These requests get a response back, but send no data.
 					 * Send these to the last of the Xymon servers only.
@@ -593,19 +828,26 @@ int main(int argc, char *argv[])
 					/* It's a request that doesn't take a response. */
 					if (cwalk->csocket >= 0) {
 						shutdown(cwalk->csocket, SHUT_RDWR);
-						close(cwalk->csocket); sockcount--;
-						cwalk->csocket = -1;
+						close_client(cwalk);
 					}
 					cwalk->snum = xymonservercount;
 
-					if (strncmp(cwalk->buf+6, "status", 6) == 0) {
-						msgs_status++;
-						getntimer(&cwalk->timelimit);
-						cwalk->timelimit.tv_nsec += COMBO_DELAY;
-						if (cwalk->timelimit.tv_nsec >= 1000000000) {
-							cwalk->timelimit.tv_sec++;
-							cwalk->timelimit.tv_nsec -= 1000000000;
+					if (iscompressed(cwalk->buf+6)) {
+						if ((strncmp(msgtype, "status", 6) == 0) && ((cwalk->buflen + 50 ) < cwalk->bufsize)) {
+							int n = sprintf(cwalk->bufp, 
+									"\nStatus message received from %s\n", 
+									inet_ntoa(*cwalk->clientip));
+							cwalk->bufp += n;
+							cwalk->buflen += n;
+						}
+						else if (strncmp(msgtype, "page", 4) == 0) {
+							cwalk->state = P_CLEANUP;
+							break;
 						}
+					}
+					else if (strncmp(cwalk->buf+6, "status", 6) == 0) {
+						msgs_status++;
+						settimelimit(&cwalk->timelimit, combodelay);
 
 						/*
 						 * Some clients (bbnt) send a trailing \0, so we cannot
@@ -637,12 +879,7 @@ int main(int argc, char *argv[])
 						cwalk->buflen = strlen(cwalk->buf);
 						cwalk->bufp = cwalk->buf + cwalk->buflen;
 
-						getntimer(&cwalk->timelimit);
-						cwalk->timelimit.tv_nsec += COMBO_DELAY;
-						if (cwalk->timelimit.tv_nsec >= 1000000000) {
-							cwalk->timelimit.tv_sec++;
-							cwalk->timelimit.tv_nsec -= 1000000000;
-						}
+						settimelimit(&cwalk->timelimit, combodelay);
 
 						currmsg = cwalk->buf+12; /* Skip pre-def. "combo\n" and message "combo\n" */
 						do {
@@ -701,6 +938,14 @@ int main(int argc, char *argv[])
 					break;
 				}
 
+				/* Wait for a free connection to this server */
+				cwalk->sidx = (xymonservercount - cwalk->snum);
+				if (maxserverconns && (serverconns[cwalk->sidx] >= maxserverconns)) {
+					dbgprintf("All connections to server busy, waiting\n");
+					slotwait = 1;
+					break;
+				}
+
 				cwalk->conntries--;
 				cwalk->conntime = ctime;
 				if (cwalk->conntries < 0) {
@@ -716,14 +961,12 @@ int main(int argc, char *argv[])
 					break; /* Retry the next time around */
 				}
 				sockcount++;
+				serverconns[cwalk->sidx]++;
 				fcntl(cwalk->ssocket, F_SETFL, O_NONBLOCK);
 
-				{
-					int idx = (xymonservercount - cwalk->snum);
-					n = connect(cwalk->ssocket, (struct sockaddr *)&xymonserveraddr[idx], sizeof(xymonserveraddr[idx]));
-					cwalk->serverip = &xymonserveraddr[idx].sin_addr;
-					dbgprintf("Connecting to Xymon server at %s\n", inet_ntoa(*cwalk->serverip));
-				}
+				n = connect(cwalk->ssocket, (struct sockaddr *)&xymonserveraddr[cwalk->sidx], sizeof(xymonserveraddr[cwalk->sidx]));
+				cwalk->serverip = &xymonserveraddr[cwalk->sidx].sin_addr;
+				dbgprintf("Connecting to Xymon server at %s\n", inet_ntoa(*cwalk->serverip));
 
 				if ((n == 0) || ((n == -1) && (errno == EINPROGRESS))) {
 					cwalk->state = P_REQ_SENDING;
@@ -735,15 +978,13 @@ int main(int argc, char *argv[])
 				else {
 					/* Could not connect! Invoke retries */
 					dbgprintf("Connect to server failed: %s\n", strerror(errno));
-					close(cwalk->ssocket); sockcount--;
-					cwalk->ssocket = -1;
+					close_server(cwalk);
 					break;
 				}
 				/* No "break" here! */
 			  
 			  case P_REQ_SENDING:
-				FD_SET(cwalk->ssocket, &fdwrite); 
-				if (cwalk->ssocket > maxfd) maxfd = cwalk->ssocket;
+				io_want(cwalk->ssocket, IO_WRITE);
 				break;
 
 			  case P_REQ_DONE:
@@ -752,7 +993,7 @@ int main(int argc, char *argv[])
 				cwalk->snum--;
 				if (cwalk->snum) {
 					/* More servers to do */
-					close(cwalk->ssocket); cwalk->ssocket = -1; sockcount--;
+					close_server(cwalk);
 					cwalk->conntries = CONNECT_TRIES;
 					cwalk->sendtries = SEND_TRIES;
 					cwalk->conntime = 0;
@@ -762,7 +1003,7 @@ int main(int argc, char *argv[])
 				else {
 					/* Have sent to all servers, grab the response from the last one. */
 					cwalk->bufp = cwalk->buf; cwalk->buflen = 0;
-					memset(cwalk->buf, 0, cwalk->bufsize);
+					*cwalk->buf = '\0';
 				}
 
 				msgs_delivered++;
@@ -807,14 +1048,12 @@ int main(int argc, char *argv[])
 				/* Fallthrough */
 
 			  case P_RESP_READING:
-				FD_SET(cwalk->ssocket, &fdread); 
-				if (cwalk->ssocket > maxfd) maxfd = cwalk->ssocket;
+				io_want(cwalk->ssocket, IO_READ);
 				break;
 
 			  case P_RESP_READY:
 				shutdown(cwalk->ssocket, SHUT_RD);
-				close(cwalk->ssocket); sockcount--;
-				cwalk->ssocket = -1;
+				close_server(cwalk);
 				cwalk->bufp = cwalk->buf;
 				cwalk->state = P_RESP_SENDING;
 				getntimer(&cwalk->timelimit);
@@ -823,8 +1062,7 @@ int main(int argc, char *argv[])
 
 			  case P_RESP_SENDING:
 				if (cwalk->buflen && (cwalk->csocket >= 0)) {
-					FD_SET(cwalk->csocket, &fdwrite);
-					if (cwalk->csocket > maxfd) maxfd = cwalk->csocket;
+					io_want(cwalk->csocket, IO_WRITE);
 					break;
 				}
 				else {
@@ -835,27 +1073,26 @@ int main(int argc, char *argv[])
 			  case P_RESP_DONE:
 				if (cwalk->csocket >= 0) {
 					shutdown(cwalk->csocket, SHUT_WR);
-					close(cwalk->csocket); sockcount--;
+					close_client(cwalk);
 				}
-				cwalk->csocket = -1;
 				cwalk->state = P_CLEANUP;
 				/* Fall through */
 
 			  case P_CLEANUP:
-				if (cwalk->csocket >= 0) {
-					close(cwalk->csocket); sockcount--;
-					cwalk->csocket = -1;
-				}
-				if (cwalk->ssocket >= 0) {
-					close(cwalk->ssocket); sockcount--;
-					cwalk->ssocket = -1;
-				}
+				close_client(cwalk);
+				close_server(cwalk);
 				cwalk->arrival.tv_sec = cwalk->arrival.tv_nsec = 0;
-				cwalk->bufp = cwalk->bufp; 
+				if (cwalk->bufsize > 4*BUFSZ_INC) {
+					/* Dont keep a large combo buffer around */
+					cwalk->bufsize = BUFSZ_INC;
+					cwalk->buf = realloc(cwalk->buf, cwalk->bufsize);
+				}
+				cwalk->bufp = cwalk->buf; 
 				cwalk->buflen = 0;
-				memset(cwalk->buf, 0, cwalk->bufsize);
+				*cwalk->buf = '\0';
 				memset(&cwalk->caddr, 0, sizeof(cwalk->caddr));
 				cwalk->madetocombo = 0;
+				cwalk->combofull = 0;
 				cwalk->state = P_IDLE;
 				break;
 
@@ -863,56 +1100,61 @@ int main(int argc, char *argv[])
 				break;
 
 			  case P_REQ_COMBINING:
-				/* See if we can combine some "status" messages into a "combo" */
+				/*
+				 * See if we can combine some "status" messages into a "combo".
+				 * We keep merging until the combo is as large as we allow, or
+				 * this - the oldest - message has waited for combodelay ms.
+				 */
 				combining++;
 				getntimer(&tmo);
-				if ((cwalk->buflen < MINIMUM_FOR_COMBO) && !overdue(&tmo, &cwalk->timelimit)) {
+				if (!cwalk->combofull && !overdue(&tmo, &cwalk->timelimit)) {
 					conn_t *cextra;
 
-					/* Are there any other messages in P_COMBINING state ? */
-					cextra = cwalk->next;
-					while (cextra && (cextra->state != P_REQ_COMBINING)) cextra = cextra->next;
+					for (cextra = cwalk->next; (cextra && !cwalk->combofull); cextra = cextra->next) {
+						int newsize;
+
+						if (cextra->state != P_REQ_COMBINING) continue;
+						if (strncmp(cextra->buf+6, "status", 6) != 0) continue;
 
-					if (cextra) {
 						/*
-						 * Yep. It might be worthwhile to go for a combo.
+						 * Size of the new message - if the cextra one
+						 * is merged - is the cwalk buffer, plus the
+						 * two newlines separating messages in combo's,
+						 * plus the cextra buffer except the leading
+						 * "combo\n" of 6 bytes.
 						 */
-						while (cextra && (cwalk->buflen < (MAXIMUM_FOR_COMBO-20))) {
-							if (strncmp(cextra->buf+6, "status", 6) == 0) {
-								int newsize;
-
-								/*
-								 * Size of the new message - if the cextra one
-								 * is merged - is the cwalk buffer, plus the
-								 * two newlines separating messages in combo's,
-								 * plus the cextra buffer except the leading
-								 * "combo\n" of 6 bytes.
-								 */
-								newsize = cwalk->buflen + 2 + (cextra->buflen - 6);
-
-								if ((newsize < cwalk->bufsize) && (newsize < MAXIMUM_FOR_COMBO)) {
-									/*
-									 * There's room for it. Add it to the
-									 * cwalk buffer, but without the leading
-									 * "combo\n" (we already have one of those).
-									 */
-									cwalk->madetocombo++;
-									strcat(cwalk->buf, "\n\n");
-									strcat(cwalk->buf, cextra->buf+6);
-									cwalk->buflen = newsize;
-									cextra->state = P_CLEANUP;
-									dbgprintf("Merged combo\n");
-									msgs_merged++;
-								}
-							}
+						newsize = cwalk->buflen + 2 + (cextra->buflen - 6);
+						if (newsize >= combomaxsize) {
+							/* No more room, send what we have */
+							cwalk->combofull = 1;
+							break;
+						}
 
-							/* Go to the next connection in the right state */
-							do {
-								cextra = cextra->next;
-							} while (cextra && (cextra->state != P_REQ_COMBINING));
+						if (newsize >= cwalk->bufsize) {
+							while (newsize >= cwalk->bufsize) cwalk->bufsize *= 2;
+							cwalk->buf = realloc(cwalk->buf, cwalk->bufsize);
 						}
+
+						/*
+						 * Add it to the cwalk buffer, but without the leading
+						 * "combo\n" (we already have one of those).
+						 */
+						cwalk->madetocombo += (1 + cextra->madetocombo);
+						memcpy(cwalk->buf + cwalk->buflen, "\n\n", 2);
+						memcpy(cwalk->buf + cwalk->buflen + 2, cextra->buf+6, (cextra->buflen - 6));
+						cwalk->buflen = newsize;
+						*(cwalk->buf + cwalk->buflen) = '\0';
+						cextra->state = P_CLEANUP;
+						dbgprintf("Merged combo\n");
+						msgs_merged++;
 					}
 				}
+
+				if (!cwalk->combofull && !overdue(&tmo, &cwalk->timelimit)) {
+					/* Keep it for a while - wake up when it is due */
+					int duems = (cwalk->timelimit.tv_sec - tmo.tv_sec)*1000 + (cwalk->timelimit.tv_nsec - tmo.tv_nsec)/1000000 + 1;
+					if (duems < waitms) waitms = duems;
+				}
 				else {
 					combining--;
 					cwalk->state = P_REQ_CONNECTING;
@@ -948,27 +1190,27 @@ int main(int argc, char *argv[])
 			}
 		}
 
-		/* Add the listen-socket to the select() list, but only if we have room */
-		if (sockcount < MAX_OPEN_SOCKS) {
-			FD_SET(lsocket, &fdread); 
-			if (lsocket > maxfd) maxfd = lsocket;
+		/* Wait for new connections, but only if we have room */
+		now = gettimer();
+		if (((maxsockets == 0) || (sockcount < maxsockets)) && (now >= acceptpause)) {
+			io_want(lsocket, IO_READ);
 		}
 		else {
 			static time_t lastlog = 0;
-			if ((now = gettimer()) < (lastlog+30)) {
+			if (now >= (lastlog+30)) {
 				lastlog = now;
 				errprintf("Squelching incoming connections, sockcount=%d\n", sockcount);
 			}
 		}
 
-		if (combining) {
-			selecttmo.tv_sec = 0; selecttmo.tv_usec = COMBO_DELAY;
-		}
-		else {
-			selecttmo.tv_sec = 1; selecttmo.tv_usec = 0;
-		}
-		n = select(maxfd+1, &fdread, &fdwrite, NULL, &selecttmo);
-		if (n <= 0) {
+		/* If a server connection was freed while others were waiting for one, go again right away */
+		if (slotwait && serverfreed) waitms = 0;
+		if (waitms < 0) waitms = 0;
+		n = io_wait(waitms);
+
+		if ((n <= 0) || (gettimer() != lasttimeoutcheck)) {
+			/* Check for timeouts when idle, and at least once a second when busy */
+			lasttimeoutcheck = gettimer();
 			getntimer(&tmo);
 			for (cwalk = chead; (cwalk); cwalk = cwalk->next) {
 				switch (cwalk->state) {
@@ -977,8 +1219,8 @@ int main(int argc, char *argv[])
 				  case P_RESP_READING:
 				  case P_RESP_SENDING:
 					if (overdue(&tmo, &cwalk->timelimit)) {
-						cwalk->state = P_CLEANUP;
 						msgs_timeout_from[cwalk->state]++;
+						cwalk->state = P_CLEANUP;
 					}
 					break;
 
@@ -987,17 +1229,18 @@ int main(int argc, char *argv[])
 				}
 			}
 		}
-		else {
+
+		if (n > 0) {
 			for (cwalk = chead; (cwalk); cwalk = cwalk->next) {
 				switch (cwalk->state) {
 				  case P_REQ_READING:
-					if (FD_ISSET(cwalk->csocket, &fdread)) {
+					if (io_ready(cwalk->csocket, IO_READ)) {
 						do_read(cwalk->csocket, cwalk->clientip, cwalk, P_REQ_READY);
 					}
 					break;
 
 				  case P_REQ_SENDING:
-					if (FD_ISSET(cwalk->ssocket, &fdwrite)) {
+					if (io_ready(cwalk->ssocket, IO_WRITE)) {
 						if (cwalk->connectpending) {
 							int connres, connressize;
 
@@ -1009,8 +1252,7 @@ int main(int argc, char *argv[])
 								/* Connect failed! Invoke retries. */
 								dbgprintf("Connect to server failed: %s - retrying\n", 
 									strerror(errno));
-								close(cwalk->ssocket); sockcount--;
-								cwalk->ssocket = -1;
+								close_server(cwalk);
 								cwalk->state = P_REQ_CONNECTING;
 								break;
 							}
@@ -1023,7 +1265,7 @@ int main(int argc, char *argv[])
 							 * Try saving the situation by retrying the send later.
 							 */
 							dbgprintf("Attempting recovery from write error\n");
-							close(cwalk->ssocket); sockcount--; cwalk->ssocket = -1;
+							close_server(cwalk);
 							cwalk->sendtries--;
 							cwalk->state = P_REQ_CONNECTING;
 							cwalk->conntries = CONNECT_TRIES;
@@ -1033,13 +1275,13 @@ int main(int argc, char *argv[])
 					break;
 
 				  case P_RESP_READING:
-					if (FD_ISSET(cwalk->ssocket, &fdread)) {
+					if (io_ready(cwalk->ssocket, IO_READ)) {
 						do_read(cwalk->ssocket, cwalk->serverip, cwalk, P_RESP_READY);
 					}
 					break;
 
 				  case P_RESP_SENDING:
-					if (FD_ISSET(cwalk->csocket, &fdwrite)) {
+					if (io_ready(cwalk->csocket, IO_WRITE)) {
 						do_write(cwalk->csocket, cwalk->clientip, cwalk, P_RESP_DONE);
 					}
 					break;
@@ -1049,52 +1291,66 @@ int main(int argc, char *argv[])
 				}
 			}
 
-			if (FD_ISSET(lsocket, &fdread)) {
-				/* New incoming connection */
-				conn_t *newconn;
-				int caddrsize;
+			if (io_ready(lsocket, IO_READ)) {
+				/* New incoming connections. Pick up a batch of them while we are here */
+				int acceptcount;
 
-				dbgprintf("New connection\n");
-				for (cwalk = chead; (cwalk && (cwalk->state != P_IDLE)); cwalk = cwalk->next);
-				if (cwalk) {
-					newconn = cwalk;
-				}
-				else {
-					newconn = malloc(sizeof(conn_t));
-					newconn->next = chead;
-					chead = newconn;
-					newconn->bufsize = BUFSZ_INC;
-					newconn->buf = newconn->bufp = malloc(newconn->bufsize);
-				}
+				for (acceptcount = 0; ((acceptcount < 64) && ((maxsockets == 0) || (sockcount < maxsockets))); acceptcount++) {
+					conn_t *newconn;
+					int caddrsize;
 
-				newconn->connectpending = 0;
-				newconn->madetocombo = 0;
-				newconn->snum = 0;
-				newconn->ssocket = -1;
-				newconn->serverip = NULL;
-				newconn->conntries = 0;
-				newconn->sendtries = 0;
-				newconn->timelimit.tv_sec = newconn->timelimit.tv_nsec = 0;
+					for (cwalk = chead; (cwalk && (cwalk->state != P_IDLE)); cwalk = cwalk->next);
+					if (cwalk) {
+						newconn = cwalk;
+					}
+					else {
+						newconn = malloc(sizeof(conn_t));
+						newconn->next = chead;
+						chead = newconn;
+						newconn->bufsize = BUFSZ_INC;
+						newconn->buf = newconn->bufp = malloc(newconn->bufsize);
+					}
 
-				/*
-				 * Why this ? Because we like to merge small status messages
-				 * into larger combo messages. So put a "combo\n" at the start 
-				 * of the buffer, and then don't send it if we decide it won't
-				 * be a combo-message after all.
-				 */
-				strcpy(newconn->buf, "combo\n");
-				newconn->buflen = 6;
-				newconn->bufp = newconn->buf+6;
-
-				caddrsize = sizeof(newconn->caddr);
-				newconn->csocket = accept(lsocket, (struct sockaddr *)&newconn->caddr, &caddrsize);
-				if (newconn->csocket == -1) {
-					/* accept() failure. Yes, it does happen! */
-					dbgprintf("accept failure, ignoring connection (%s), sockcount=%d\n", 
-						strerror(errno), sockcount);
-					newconn->state = P_IDLE;
-				}
-				else {
+					newconn->connectpending = 0;
+					newconn->madetocombo = 0;
+					newconn->combofull = 0;
+					newconn->snum = 0;
+					newconn->sidx = 0;
+					newconn->ssocket = -1;
+					newconn->serverip = NULL;
+					newconn->conntries = 0;
+					newconn->sendtries = 0;
+					newconn->timelimit.tv_sec = newconn->timelimit.tv_nsec = 0;
+
+					/*
+					 * Why this ? Because we like to merge small status messages
+					 * into larger combo messages. So put a "combo\n" at the start 
+					 * of the buffer, and then don't send it if we decide it won't
+					 * be a combo-message after all.
+					 */
+					strcpy(newconn->buf, "combo\n");
+					newconn->buflen = 6;
+					newconn->bufp = newconn->buf+6;
+
+					caddrsize = sizeof(newconn->caddr);
+					newconn->csocket = accept(lsocket, (struct sockaddr *)&newconn->caddr, &caddrsize);
+					if (newconn->csocket == -1) {
+						newconn->state = P_IDLE;
+
+						if ((errno == EMFILE) || (errno == ENFILE)) {
+							/* Out of file descriptors - hold new connections for a moment */
+							errprintf("Out of sockets, sockcount=%d\n", sockcount);
+							acceptpause = gettimer() + 1;
+						}
+						else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+							/* accept() failure. Yes, it does happen! */
+							dbgprintf("accept failure, ignoring connection (%s), sockcount=%d\n", 
+								strerror(errno), sockcount);
+						}
+						break;
+					}
+
+					dbgprintf("New connection\n");
 					msgs_total++;
 					newconn->clientip = &newconn->caddr.sin_addr;
 					sockcount++;